@@ -45,6 +45,14 @@
 #define PATH_SEP '/'
 #endif
 
+/** 文件属性 */
+typedef struct FileStatRec_ {
+	int64_t size;		/**< 文件大小 */
+	int64_t mtime;		/**< 修改时间 */
+	int64_t ctime;		/**< 创建时间，某些平台上为状态变更时间 */
+	uint64_t inode;		/**< 索引节点号，不支持的平台上为 0 */
+} FileStatRec, *FileStat;
+
 void EncodeSHA1( char *hash_out, const char *str, int len );
 
 void WEncodeSHA1( wchar_t *hash_out, const wchar_t *wstr, int len );
@@ -55,12 +63,46 @@ const wchar_t *wgetfilename( const wchar_t *path );
 
 int wgetfilectime( const wchar_t *path );
 
+/** 获取文件或目录的修改时间，获取失败时返回 0 */
+int64_t wgetfilemtime( const wchar_t *path );
+
 int64_t wgetfilesize( const wchar_t *path );
 
+/**
+ * 获取文件的属性
+ * 只根据路径查询，不需要打开文件，获取失败时返回 -1
+ */
+int wgetfilestat( const wchar_t *path, FileStat st );
+
+/** 获取文件所在设备的编号，用于判断多个文件是否位于同一设备上 */
+int wgetfiledev( const wchar_t *path, uint64_t *dev );
+
+/**
+ * 判断文件是否位于网络文件系统中，例如 SMB 共享文件夹和 NFS 挂载点
+ * 这类文件系统上的每次元数据查询都要经过一次网络往返
+ */
+LCUI_BOOL wisremotepath( const wchar_t *path );
+
+/** 以只读方式将整个文件映射到内存中，失败时返回 NULL */
+void *wmapfile( const wchar_t *path, size_t *size );
+
+/** 解除文件映射 */
+void wunmapfile( void *data, size_t size );
+
+/**
+ * 将当前线程设为后台线程
+ * 降低线程的 CPU 和 I/O 优先级，只在系统空闲时才会占用磁盘。降低后的优先级
+ * 不一定能恢复，只应在专用的工作线程中调用。
+ */
+int setthreadbackground( void );
+
 int pathjoin( char *path, const char *path1, const char *path2 );
 
 int wpathjoin( wchar_t *path, const wchar_t *path1, const wchar_t *path2 );
 
+/** 新建目录，上级目录需已存在，目录已存在时也返回 0 */
+int wmkdir( const wchar_t *path );
+
 /** 获取程序当前所在目录 */
 void wgetcurdir( wchar_t *path, int max_len );
 
@@ -0,0 +1,102 @@
+﻿/* ***************************************************************************
+* dir_reader.h -- batched directory reader.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* dir_reader.h -- 批量目录读取器。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_DIR_READER_H
+#define LCFINDER_DIR_READER_H
+
+/** 目录读取方式 */
+typedef enum DirReaderType_ {
+	DIR_READER_PORTABLE,	/**< 用 LCUI 的目录接口逐项读取，再逐个获取属性 */
+	DIR_READER_GETDENTS,	/**< 用 getdents64 批量读取目录项，statx 获取属性 */
+	DIR_READER_IO_URING	/**< 与上一种相同，但 statx 通过 io_uring 批量提交 */
+} DirReaderType;
+
+#ifdef LCUI_BUILD_IN_LINUX
+#define DIR_READER_DEFAULT DIR_READER_GETDENTS
+#else
+#define DIR_READER_DEFAULT DIR_READER_PORTABLE
+#endif
+
+/** 目录项类型 */
+enum DirEntryType {
+	DIR_ENTRY_OTHER,
+	DIR_ENTRY_FILE,
+	DIR_ENTRY_DIR
+};
+
+typedef struct DirReaderEntryRec_ {
+	const wchar_t *name;	/**< 名称 */
+	int type;		/**< 类型，见 DirEntryType */
+	LCUI_BOOL has_stat;	/**< 是否已获取到属性 */
+	FileStatRec stat;	/**< 文件属性 */
+} DirReaderEntryRec, *DirReaderEntry;
+
+/** 判断是否需要获取文件的属性 */
+typedef LCUI_BOOL( *DirReaderFilter )(const wchar_t*);
+
+/**
+ * 目录读取器
+ * 读取器内部的缓冲区会在多次读取之间重复使用，不能同时在多个线程中使用。
+ */
+typedef struct DirReaderRec_ *DirReader;
+
+/** 
+ * 新建目录读取器
+ * 当前平台或系统不支持指定的读取方式时，会改用次一级的方式
+ */
+DirReader DirReader_New( DirReaderType type );
+
+/** 删除目录读取器 */
+void DirReader_Delete( DirReader *rptr );
+
+/** 获取读取器实际使用的读取方式 */
+DirReaderType DirReader_GetType( DirReader r );
+
+/** 根据名称获取读取方式，名称无效时返回 DIR_READER_DEFAULT */
+DirReaderType DirReader_GetTypeByName( const char *name );
+
+/**
+ * 读取目录中的所有目录项，. 和 .. 除外
+ * 只有被 filter 选中的普通文件才会获取属性，filter 为 NULL 时都不获取
+ * @returns 目录项的数量，读取失败时返回 -1
+ */
+int DirReader_Read( DirReader r, const wchar_t *dirpath, 
+		    DirReaderFilter filter );
+
+/** 获取上次读取到的第 i 个目录项 */
+DirReaderEntry DirReader_GetEntry( DirReader r, int i );
+
+#endif
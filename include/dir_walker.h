@@ -0,0 +1,77 @@
+﻿/* ***************************************************************************
+* dir_walker.h -- multi-threaded directory walker.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* dir_walker.h -- 多线程目录遍历器。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_DIR_WALKER_H
+#define LCFINDER_DIR_WALKER_H
+
+typedef struct DirWalkerRec_ *DirWalker;
+
+/**
+ * 目录处理函数，由工作线程调用
+ * 参数依次为：遍历器、当前工作线程的编号、目录路径、附加数据
+ */
+typedef void( *DirWalkerHandler )(DirWalker, int, const wchar_t*, void*);
+
+/**
+ * 新建目录遍历器
+ * 每个工作线程都有自己的目录队列，空闲的工作线程会从其它队列中窃取目录，
+ * 当工作线程数量为 1 时，所有目录都在调用 DirWalker_Run() 的线程中处理。
+ */
+DirWalker DirWalker_New( int n_workers, DirWalkerHandler handler, void *data );
+
+/** 删除目录遍历器 */
+void DirWalker_Delete( DirWalker *wptr );
+
+/** 将目录添加至指定工作线程的队列中，通常在目录处理函数中调用 */
+void DirWalker_Push( DirWalker w, int worker, const wchar_t *dirpath );
+
+/**
+ * 从指定目录开始遍历，在所有目录处理完后返回已处理的目录数量
+ * dirpath 为 NULL 时，只遍历之前用 DirWalker_Push() 添加到 0 号队列中的目录
+ */
+int DirWalker_Run( DirWalker w, const wchar_t *dirpath );
+
+/**
+ * 设置工作线程是否以后台优先级运行
+ * 只对 DirWalker_Run() 新建的工作线程有效，0 号工作线程即调用者所在的线程，
+ * 它的优先级需要由调用者自己设置。
+ */
+void DirWalker_SetBackground( DirWalker w, LCUI_BOOL background );
+
+/** 终止遍历，尚未处理的目录将被丢弃 */
+void DirWalker_Stop( DirWalker w );
+
+#endif
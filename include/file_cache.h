@@ -48,40 +48,119 @@ typedef enum {
 typedef struct SyncTaskRec_ {
 	wchar_t *file;				/**< 数据文件 */
 	wchar_t *tmpfile;			/**< 临时数据文件 */
+	wchar_t *ckptfile;			/**< 检查点文件 */
 	wchar_t *scan_dir;			/**< 需扫描的目录 */
 	wchar_t *data_dir;			/**< 数据存放目录 */
 	SyncTaskState state;			/**< 任务状态 */
+	int workers;				/**< 扫描时使用的线程数量 */
+	int reader;				/**< 目录读取方式，见 DirReaderType */
+	LCUI_BOOL background;			/**< 扫描线程是否以后台优先级运行 */
+	LCUI_BOOL skip_unchanged;		/**< 是否沿用修改时间未变的目录的记录 */
+	LCUI_BOOL remote;			/**< 是否使用网络文件系统的远程扫描模式 */
 	unsigned long int total_files;		/**< 当前缓存的总文件数量 */
 	unsigned long int added_files;		/**< 当前缓存的新增的文件数量 */
 	unsigned long int deleted_files;	/**< 当前缓存的删除的文件数量 */
+	unsigned long int modified_files;	/**< 当前缓存的修改过的文件数量 */
 } SyncTaskRec, *SyncTask;
 
-typedef void(*FileHanlder)(void*, const wchar_t*);
+/**
+ * 文件处理函数
+ * 参数依次为：附加数据、文件路径、文件属性，已删除的文件的属性是之前缓存的，
+ * 旧版本的缓存中没有文件属性，此时属性值都为 0
+ */
+typedef void(*FileHanlder)(void*, const wchar_t*, const FileStatRec*);
+
+/**
+ * 扫描限速函数
+ * 每读取完一个目录就会在扫描线程中调用它，参数依次为：附加数据、本次读取的
+ * 目录项数量，函数可以通过阻塞扫描线程来降低扫描速度。
+ */
+typedef void(*ScanThrottle)(void*, int);
 
 SyncTask SyncTask_New( const char *data_dir, const char *scan_dir );
 
 /** 新建同步任务 */
 SyncTask SyncTask_NewW( const wchar_t *data_dir, const wchar_t *scan_dir );
 
+/**
+ * 标记需要重新读取的目录
+ * 标记过目录的任务只读取这些目录及其中新增的子目录，其余目录沿用缓存中的
+ * 记录，适用于已知哪些目录有变化的场合。
+ */
+void SyncTask_AddDirtyDir( SyncTask t, const wchar_t *dirpath );
+
+/**
+ * 标记需要重新读取的目录树
+ * 与 SyncTask_AddDirtyDir() 不同，这个目录下所有已缓存的子目录也都会重新
+ * 读取，适用于只刷新源文件夹中的某个目录的场合。
+ */
+void SyncTask_AddDirtyTree( SyncTask t, const wchar_t *dirpath );
+
 /** 清除缓存数据 */
 void SyncTask_ClearCache( SyncTask t );
 
 /** 删除同步任务 */
 void SyncTask_Delete( SyncTask *tptr );
 
-/** 遍历每个新增的文件 */
+/**
+ * 设置文件变更的处理函数
+ * 设置后，每个目录扫描完就会在扫描线程中调用这些函数处理它变更的文件，不用
+ * 等到扫描结束后再调用 SyncTask_InAddedFiles() 等函数。处理函数会被多个扫描
+ * 线程同时调用，扫描被终止时已处理的变更不会撤销，下次同步可能会再次处理。
+ */
+void SyncTask_SetHandlers( SyncTask t, FileHanlder on_added,
+			   FileHanlder on_deleted, FileHanlder on_modified,
+			   void *func_data );
+
+/**
+ * 设置路径过滤器
+ * 被排除的目录在扫描时不会被读取，被排除的文件不会记录到缓存中。过滤规则与
+ * 上次扫描时不同时，本次会重新读取所有目录，之前缓存的、现在被排除的文件会
+ * 被视为已删除。过滤器归任务所有，任务删除时会一并删除。
+ */
+void SyncTask_SetFilter( SyncTask t, PathFilter filter );
+
+/**
+ * 设置扫描的分片
+ * 扫描目录下的子目录按名称的哈希值分到 count 个分片中，只扫描属于第 index
+ * 个分片的子目录，扫描目录下的文件都属于 0 号分片。分片设置与过滤规则一样
+ * 会记录到缓存中，设置有变化时会重新读取所有目录。
+ */
+void SyncTask_SetShard( SyncTask t, int index, int count );
+
+/** 获取名称所属的分片，与 SyncTask_SetShard() 的分片方式一致 */
+int SyncTask_GetShard( const wchar_t *name, int count );
+
+/** 设置扫描限速函数，为 NULL 时不限速 */
+void SyncTask_SetThrottle( SyncTask t, ScanThrottle func, void *func_data );
+
+/**
+ * 遍历每个新增的文件
+ * 需在 SyncTask_Start() 之后、SyncTask_Commit() 之前调用
+ */
 int SyncTask_InAddedFiles( SyncTask t, FileHanlder func, void *func_data );
 
 /** 遍历每个已删除的文件 */
 int SyncTask_InDeletedFiles( SyncTask t, FileHanlder func, void *func_data );
 
-/** 开始同步文件列表 */
+/**
+ * 遍历每个修改过的文件
+ * 文件大小、修改时间或索引节点号与缓存中的不同时，即视为修改过
+ */
+int SyncTask_InModifiedFiles( SyncTask t, FileHanlder func, void *func_data );
+
+/**
+ * 开始同步文件列表
+ * 扫描整个目录树时会定期保存检查点，如果上次同步在扫描中途被终止，本次会
+ * 沿用上次已扫描完且未变化的目录。
+ * @returns 文件总数，扫描被终止时返回 -1
+ */
 int SyncTask_Start( SyncTask t );
 
-/** 提交文件列表的变更 */
+/** 提交文件列表的变更，扫描未完成时不做任何处理 */
 void SyncTask_Commit( SyncTask t );
 
-/** 终止同步文件列表 */
+/** 终止同步文件列表，SyncTask_Start() 会保存检查点后返回 */
 void LCFinder_StopSync( SyncTask t );
 
 #endif
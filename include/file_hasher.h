@@ -0,0 +1,94 @@
+﻿/* ***************************************************************************
+* file_hasher.h -- file content hashing in background threads.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* file_hasher.h -- 在后台线程中计算文件内容的哈希值。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_FILE_HASHER_H
+#define LCFINDER_FILE_HASHER_H
+
+/** 文件内容哈希值的长度 */
+#define FILE_HASH_SIZE 16
+
+/**
+ * 读取限速函数
+ * 每读取一块数据就会调用它，参数依次为：附加数据、本次读取的字节数，函数可以
+ * 通过阻塞来降低读取速度，返回非 0 值时中止计算。
+ */
+typedef int( *FileReadThrottle )(void*, size_t);
+
+/**
+ * 哈希值计算完成后的处理函数
+ * 参数依次为：附加数据、文件标识号、计算时的文件属性、哈希值，由工作线程调用
+ */
+typedef void( *FileHashHandler )(void*, int, const FileStatRec*,
+				 const unsigned char*);
+
+/**
+ * 文件哈希计算器
+ * 工作线程以空闲 I/O 优先级读取文件，只在磁盘空闲时才会占用它。
+ */
+typedef struct FileHasherRec_ *FileHasher;
+
+/**
+ * 计算文件内容的哈希值
+ * 计算前后会各获取一次文件属性，两次不一致说明文件在计算期间被修改过，此时
+ * 返回 -1，需要稍后重新计算。
+ */
+int FileHasher_HashFile( const wchar_t *path, FileStat st,
+			 unsigned char *hash );
+
+/** 计算文件内容的哈希值，读取时按 throttle 限速，throttle 为 NULL 时不限速 */
+int FileHasher_HashFileEx( const wchar_t *path, FileStat st,
+			   unsigned char *hash, FileReadThrottle throttle,
+			   void *throttle_data );
+
+/** 新建文件哈希计算器 */
+FileHasher FileHasher_New( int workers, FileHashHandler func, void *data );
+
+/**
+ * 添加需要计算哈希值的文件
+ * 队列已满时会等待工作线程，计算器已停止时返回 -1
+ */
+int FileHasher_Add( FileHasher h, int id, const wchar_t *path );
+
+/** 等待队列中的文件都计算完 */
+void FileHasher_Wait( FileHasher h );
+
+/** 停止计算，丢弃队列中剩余的文件，正在计算的文件会计算完 */
+void FileHasher_Stop( FileHasher h );
+
+/** 停止计算并删除计算器 */
+void FileHasher_Delete( FileHasher *hptr );
+
+#endif
@@ -52,6 +52,7 @@ typedef struct DB_TagRec_ {
 typedef struct DB_DirRec_ {
 	int id;			/**< 文件夹标识号 */
 	char *path;		/**< 文件夹路径 */
+	char *rules;		/**< 扫描时的过滤规则，以换行符分隔，没有时为 NULL */
 } DB_DirRec, *DB_Dir;
 
 typedef struct DB_FileRec_ {
@@ -62,6 +63,25 @@ typedef struct DB_FileRec_ {
 	unsigned int create_time;	/**< 创建时间 */
 } DB_FileRec, *DB_File;
 
+/** 内容相同的一组文件 */
+typedef struct DB_FileGroupRec_ {
+	DB_File *files;			/**< 文件列表，以 NULL 结尾 */
+	int n_files;			/**< 文件数量 */
+	int64_t size;			/**< 文件大小 */
+} DB_FileGroupRec, *DB_FileGroup;
+
+/** 文件内容哈希值的最大长度 */
+#define DB_HASH_MAX_LEN 64
+
+/** 文件的内容哈希值记录 */
+typedef struct DB_FileHashRec_ {
+	DB_File file;			/**< 文件记录 */
+	int64_t size;			/**< 计算时的文件大小 */
+	int64_t mtime;			/**< 计算时的文件修改时间 */
+	int hash_len;			/**< 哈希值的长度 */
+	unsigned char hash[DB_HASH_MAX_LEN];
+} DB_FileHashRec, *DB_FileHash;
+
 typedef struct DB_QueryTermsRec_ {
 	DB_Dir *dirs;			/**< 源文件夹列表 */
 	DB_Tag *tags;			/**< 标签列表 */
@@ -79,7 +99,17 @@ typedef struct DB_QueryRec_ {
 	char *sql_terms;
 	char *sql_tables;
 	char *sql_options;
-	sqlite3_stmt *stmt;
+	char *dirpath;			/**< 按目录筛选时的目录路径 */
+	int folder_id;			/**< 按目录筛选时的目录标识号 */
+	int *ids;			/**< 源文件夹和标签的标识号 */
+	int n_ids;			/**< 标识号的数量 */
+	int limit;			/**< 不分页时的数据记录的最大数量 */
+	int offset;			/**< 不分页时从何处开始取数据记录 */
+	sqlite3_stmt *stmt;		/**< 从缓存中取出的查询语句 */
+	int page_size;			/**< 游标每页的文件数量，为 0 时不分页 */
+	int page_count;			/**< 当前页已取出的文件数量 */
+	int64_t keys[3];		/**< 上一个文件的创建时间、评分和标识号 */
+	char *last_name;		/**< 按文件名分页时，上一个文件的文件名 */
 } DB_QueryRec, *DB_Query;
 #else
 typedef void* DB_Query;
@@ -88,28 +118,97 @@ typedef void* DB_Query;
 /** 初始化数据库模块 */
 int DB_Init( void );
 
+/**
+ * 以指定的数据库文件初始化数据库模块
+ * 用于分片索引的工作进程，它们各自写入自己的分片目录
+ */
+int DB_InitFile( const char *path );
+
 /** 添加一个文件夹 */
 DB_Dir DB_AddDir( const char *dirpath );
 
 /** 删除一个文件夹 */
 void DB_DeleteDir( DB_Dir dir );
 
+/** 设置文件夹的过滤规则，rules 为 NULL 或空字符串时表示不过滤 */
+void DB_SetDirRules( DB_Dir dir, const char *rules );
+
 /** 获取所有文件夹 */
 int DB_GetDirs( DB_Dir **outlist );
 
 /** 添加一个标签 */
 DB_Tag DB_AddTag( const char *tagname );
 
-/** 添加一个文件记录 */
+/** 添加一个文件记录，文件已存在时不做任何处理 */
 void DB_AddFile( DB_Dir dir, const char *filepath, int create_time );
 
 /** 删除一个文件记录 */
 void DB_DeleteFile( DB_Dir dir, const char *filepath );
 
+/**
+ * 移动一个文件记录
+ * 只修改记录中的源文件夹和路径，文件的评分和标签都会保留
+ */
+void DB_MoveFile( DB_Dir dir, const char *filepath,
+		  DB_Dir new_dir, const char *new_filepath );
+
+/**
+ * 获取还没有计算过内容哈希值的文件
+ * 结果按文件标识号升序排列，只取标识号大于 min_id 的文件，方便分批获取
+ */
+int DB_GetUnhashedFiles( int min_id, int limit, DB_File **outlist );
+
+/** 保存文件的内容哈希值，以及计算时的文件大小和修改时间 */
+void DB_SetFileHash( int fid, int64_t size, int64_t mtime,
+		     const unsigned char *hash, int hash_len );
+
+/** 删除文件的内容哈希值，在文件内容有变化时调用 */
+void DB_DeleteFileHash( DB_Dir dir, const char *filepath );
+
+/**
+ * 获取已计算过内容哈希值的文件
+ * 结果按文件标识号升序排列，只取标识号大于 min_id 的文件，方便分批获取
+ */
+int DB_GetHashedFiles( int min_id, int limit, DB_FileHash **outlist );
+
+/**
+ * 记录内容已损坏的文件
+ * hash 为校验时算出的、与保存的哈希值不一致的哈希值，check_time 为校验时间。
+ * 文件的哈希值被删除时，它的损坏记录也会一起删除。
+ */
+void DB_SetFileCorrupt( int fid, const unsigned char *hash, int hash_len,
+			int64_t check_time );
+
+/** 清除文件的损坏记录，在文件校验通过时调用 */
+void DB_ClearFileCorrupt( int fid );
+
+/** 获取内容已损坏的文件，按校验时间降序排列，列表以 NULL 结尾 */
+int DB_GetCorruptFiles( DB_File **outlist );
+
+/**
+ * 获取文件校验的进度
+ * last_fid 为当前这一轮已校验到的文件标识号，为 0 时表示没有未完成的校验，
+ * finish_time 为上一轮校验完成的时间。从未校验过时都为 0。
+ */
+void DB_GetScrubState( int *last_fid, int64_t *finish_time );
+
+/** 保存文件校验的进度 */
+void DB_SetScrubState( int last_fid, int64_t finish_time );
+
+/**
+ * 获取内容重复的文件
+ * 大小和内容哈希值都相同的文件为一组，列表以 NULL 结尾，返回组数
+ */
+int DB_GetDuplicateFiles( DB_FileGroup **outlist );
+
 /** 获取全部标签记录 */
 int DB_GetTags( DB_Tag **outlist );
 
-/** 移除一个标签记录 */
+/**
+ * 移除一个标签记录
+ * 评分和标签的变更都会先记录在延迟写入队列中，等到 DB_Flush() 或
+ * DB_Commit() 时再一次性写入数据库。
+ */
 void DBTag_Remove( DB_Tag tag );
 
 /** 为文件移除一个标签 */
@@ -130,13 +229,51 @@ DB_File DBQuery_FetchFile( DB_Query query );
 /** 新建一个查询实例 */
 DB_Query DB_NewQuery( const DB_QueryTerms terms );
 
+/**
+ * 新建一个分页查询游标
+ * 查询结果按 terms 中的排序规则和文件标识号排序，只按目录筛选而不排序时按
+ * 文件名排序。每页最多 terms->limit 个文件，terms->offset 不起作用。
+ * DBQuery_FetchFile() 取完一页后会从上一个文件的排序字段值之后开始取下一页，
+ * 不需要跳过已取过的记录，取完全部文件的总耗时与文件数量成正比。游标同样用
+ * DB_DeleteQuery() 删除。
+ */
+DB_Query DB_NewQueryCursor( const DB_QueryTerms terms );
+
 /** 删除一个查询实例 */
 void DB_DeleteQuery( DB_Query query );
 
-/** 事物开始 */
+/**
+ * 将分片目录合并到当前数据库中
+ * 文件夹按路径、文件按所在文件夹和路径、标签按名称对应，分片中的标识号都会
+ * 重新映射成当前数据库中的标识号，已存在的文件会保留它的评分和标签。
+ * @returns 分片中的文件数量，失败时返回 -1
+ */
+int DB_MergeCatalog( const char *path );
+
+/**
+ * 结束分片目录的合并
+ * dir 不为 NULL 时，删除该文件夹中没有出现在任何一个已合并的分片中的文件，
+ * 只应在所有分片都合并成功后这样做。
+ * @returns 删除的文件数量
+ */
+int DB_EndMerge( DB_Dir dir );
+
+/**
+ * 事务开始
+ * 持有事务锁直到 DB_Commit()，其它线程的 DB_Begin() 会等待。同步线程以外的
+ * 线程读写数据库时也需要这样做，避免和同步线程同时使用同一条预编译语句。
+ */
 int DB_Begin( void );
 
-/** 提交事务 */
+/** 提交事务，延迟写入队列中的操作会在同一事务中写入 */
 int DB_Commit( void );
 
+/**
+ * 将延迟写入队列中的操作写入数据库
+ * 其它线程正在进行事务时直接返回，由该事务提交时写入，因此可以在界面线程的
+ * 定时器中调用。
+ * @returns 实际执行的操作数量
+ */
+int DB_Flush( void );
+
 #endif
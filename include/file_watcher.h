@@ -0,0 +1,70 @@
+﻿/* ***************************************************************************
+* file_watcher.h -- file watcher
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* file_watcher.h -- 文件监视器
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_FILE_WATCHER_H
+#define LCFINDER_FILE_WATCHER_H
+
+typedef struct FileWatcherRec_ *FileWatcher;
+
+/**
+ * 文件变更处理函数，由监视线程调用
+ * 参数依次为：附加数据、被监视的根目录、有变更的目录列表
+ * 目录列表为 NULL 时表示事件队列已溢出，丢失了部分事件，需要重新扫描根目录
+ */
+typedef void( *FileWatcherHandler )(void*, const wchar_t*, LinkedList*);
+
+/**
+ * 新建文件监视器
+ * 监视器会合并一段时间内的文件变更事件，在 delay 毫秒内没有新事件时，
+ * 再将有变更的目录一并交给处理函数。当前只支持 Linux，其它平台返回 NULL。
+ */
+FileWatcher FileWatcher_New( int delay, FileWatcherHandler handler, 
+			     void *data );
+
+/** 删除文件监视器 */
+void FileWatcher_Delete( FileWatcher *wptr );
+
+/**
+ * 监视目录及其所有子目录
+ * 子目录由监视线程在稍后遍历并监视，有子目录无法监视时，会像丢失了事件一样
+ * 以 NULL 目录列表调用处理函数。
+ */
+int FileWatcher_Watch( FileWatcher w, const wchar_t *dirpath );
+
+/** 取消监视目录 */
+void FileWatcher_Unwatch( FileWatcher w, const wchar_t *dirpath );
+
+#endif
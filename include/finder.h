@@ -41,8 +41,16 @@
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
 #include "common.h"
+#include "path_filter.h"
 #include "file_cache.h"
+#include "dir_reader.h"
+#include "remote_mount.h"
+#include "source_monitor.h"
 #include "file_search.h"
+#include "file_watcher.h"
+#include "file_hasher.h"
+#include "hash_service.h"
+#include "scrub_service.h"
 #include "thumb_db.h" 
 #include "thumb_cache.h" 
 
@@ -55,6 +63,34 @@ enum LCFinderEventType {
 	EVENT_THUMBDB_DEL_DONE
 };
 
+/**
+ * 文件同步方式
+ * 后台同步由同步调度器在用户空闲时或定期发起，扫描时会降低优先级并限速。
+ */
+enum SyncMode {
+	SYNC_MANUAL,
+	SYNC_BACKGROUND
+};
+
+/** 远程扫描模式，用于掩盖网络文件系统的元数据查询延迟 */
+enum RemoteScanMode {
+	REMOTE_SCAN_AUTO,	/**< 只用于网络文件系统上的源文件夹 */
+	REMOTE_SCAN_ON,		/**< 用于所有源文件夹 */
+	REMOTE_SCAN_OFF		/**< 不使用 */
+};
+
+/**
+ * 文件同步范围，作为 EVENT_SYNC 事件的附加数据
+ * 附加数据为 NULL 时，以手动方式同步所有源文件夹。范围之外的源文件夹不会被
+ * 扫描，它们的文件列表缓存也不会被改动。
+ */
+typedef struct SyncScopeRec_ {
+	int mode;		/**< 同步方式，见 SyncMode */
+	DB_Dir *dirs;		/**< 需要同步的源文件夹，已删除的会被忽略 */
+	int n_dirs;		/**< 源文件夹数量，为 0 时同步所有源文件夹 */
+	char *path;		/**< 只同步这个目录树，为 NULL 时不限，设置后忽略 dirs */
+} SyncScopeRec, *SyncScope;
+
 /** LCFinder 的主要数据记录 */
 typedef struct Finder_ {
 	DB_Dir *dirs;			/** 源文件夹列表 */
@@ -67,6 +103,13 @@ typedef struct Finder_ {
 	wchar_t **thumb_paths;		/**< 缩略图数据库路径列表 */
 	Dict *thumb_dbs;		/**< 缩略图数据库记录，以源文件夹路径作为索引 */
 	LCUI_EventTrigger trigger;	/**< 事件触发器 */
+	FileWatcher watcher;		/**< 文件监视器，当前平台不支持时为 NULL */
+	int dir_reader;			/**< 扫描文件时使用的目录读取方式 */
+	int sync_per_device;		/**< 同一设备上可同时扫描的源文件夹数量 */
+	int remote_scan;		/**< 远程扫描模式，见 RemoteScanMode */
+	SourceMonitor sources;		/**< 源文件夹状态监视器 */
+	FileHashService hash_service;	/**< 文件哈希服务 */
+	ScrubService scrub_service;	/**< 文件校验服务 */
 } Finder;
 
 typedef void( *EventHandler )(void*, void*);
@@ -76,10 +119,13 @@ typedef struct FileSyncStatusRec_ {
 	int state;		/**< 当前状态 */
 	int added_files;	/**< 增加的文件数量 */
 	int deleted_files;	/**< 删除的文件数量 */
+	int modified_files;	/**< 修改过的文件数量 */
 	int scaned_files;	/**< 已扫描的文件数量 */
 	int synced_files;	/**< 已同步的文件数量 */
-	SyncTask task;		/**< 当前正执行的任务 */
-	SyncTask *tasks;	/**< 所有任务 */
+	SyncTask task;		/**< 当前正保存的任务，扫描阶段为 NULL */
+	SyncTask *tasks;	/**< 所有任务，扫描阶段会有多个任务同时执行 */
+	int n_tasks;		/**< 任务数量 */
+	LCUI_BOOL is_background;	/**< 是否为后台同步，同步中途可改为 FALSE */
 } FileSyncStatusRec, *FileSyncStatus;
 
 extern Finder finder;
@@ -95,14 +141,50 @@ int LCFinder_TriggerEvent( int event_id, void *data );
 /** 获取指定文件路径所处的源文件夹 */
 DB_Dir LCFinder_GetSourceDir( const char *filepath );
 
+/**
+ * 判断源文件夹是否在线
+ * 只返回上次检测的结果，不会阻塞。离线的源文件夹的文件仍可从文件数据库和
+ * 缩略图数据库中浏览，但不应再访问它的文件。
+ */
+LCUI_BOOL LCFinder_IsSourceOnline( DB_Dir dir );
+
 /** 获取缩略图数据库总大小 */
 int64_t LCFinder_GetThumbDBTotalSize( void );
 
 /** 清除缩略图数据库 */
 void LCFinder_ClearThumbDB( void );
 
-/** 同步文件 */
-int LCFinder_SyncFiles( FileSyncStatus s );
+/** 新建同步范围，新的范围包括所有源文件夹 */
+SyncScope SyncScope_New( int mode );
+
+/** 复制同步范围，scope 为 NULL 时复制的是手动同步所有源文件夹的范围 */
+SyncScope SyncScope_Duplicate( SyncScope scope );
+
+/** 删除同步范围 */
+void SyncScope_Delete( SyncScope *scope );
+
+/** 判断 scope 是否包括了 other 中的所有源文件夹和目录 */
+LCUI_BOOL SyncScope_Covers( SyncScope scope, SyncScope other );
+
+/**
+ * 将 other 合并到 scope 中
+ * 合并后的范围包括两者中的所有源文件夹，只要有一个是手动同步，合并后就是手动
+ * 同步。两者限定的目录不同时，改为同步这些目录所在的整个源文件夹。
+ */
+void SyncScope_Merge( SyncScope scope, SyncScope other );
+
+/**
+ * 同步文件
+ * @param[in] scope 同步范围，为 NULL 时以手动方式同步所有源文件夹
+ */
+int LCFinder_SyncFiles( FileSyncStatus s, SyncScope scope );
+
+/**
+ * 获取已扫描的文件数量，包括正在扫描的源文件夹中已扫描到的文件
+ * 同步线程会随时删除已完成的任务，所以界面线程不能直接访问 s->tasks，需要
+ * 通过这个函数获取。
+ */
+int LCFinder_GetScannedFiles( FileSyncStatus s );
 
 DB_Dir LCFinder_GetDir( const char *dirpath );
 
@@ -110,4 +192,16 @@ DB_Dir LCFinder_AddDir( const char *dirpath );
 
 void LCFinder_DeleteDir( DB_Dir dir );
 
+/**
+ * 设置源文件夹的过滤规则，规则的写法见 PathFilter
+ * 设置后会重新同步文件，现在被排除的文件会从数据库中删除
+ */
+void LCFinder_SetDirRules( DB_Dir dir, const char *rules );
+
+/**
+ * 增减等待载入的缩略图数量
+ * 有缩略图等待载入时，后台同步会降低扫描速度，把磁盘让给界面
+ */
+void LCFinder_AddPendingThumbs( int n );
+
 #endif
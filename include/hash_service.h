@@ -0,0 +1,69 @@
+﻿/* ***************************************************************************
+* hash_service.h -- background file hash service
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* hash_service.h -- 后台文件哈希服务
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_HASH_SERVICE_H
+#define LCFINDER_HASH_SERVICE_H
+
+/**
+ * 判断文件能否读取的函数
+ * 参数依次为：附加数据、文件路径，返回 FALSE 时跳过该文件，例如它所在的源文件夹
+ * 已离线，跳过的文件留到下一轮再处理。
+ */
+typedef LCUI_BOOL( *FileReadableFunc )(void*, const char*);
+
+/**
+ * 文件哈希服务
+ * 在后台为数据库中的文件计算内容哈希值，用于查找重复的文件。读写数据库时都
+ * 通过 DB_Begin() 和 DB_Commit() 持有事务锁，不会和同步线程同时使用同一条
+ * 预编译语句。
+ */
+typedef struct FileHashServiceRec_ *FileHashService;
+
+/**
+ * 新建并启动文件哈希服务，启动后会立即检查一次是否有文件需要计算
+ * @param[in] workers 计算哈希值的工作线程数量
+ * @param[in] readable 判断文件能否读取的函数，为 NULL 时不跳过任何文件
+ */
+FileHashService FileHashService_New( int workers, FileReadableFunc readable,
+				     void *data );
+
+/** 通知服务可能有新的文件需要计算，例如文件同步完成后 */
+void FileHashService_Notify( FileHashService s );
+
+/** 停止并删除文件哈希服务，正在计算的文件会计算完 */
+void FileHashService_Delete( FileHashService *sptr );
+
+#endif
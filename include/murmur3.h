@@ -0,0 +1,23 @@
+#ifndef MURMUR3_H
+#define MURMUR3_H
+
+/*
+MurmurHash3_x64_128
+By Austin Appleby
+100% Public Domain
+
+This version can be fed in pieces, and yields the same digest as the
+one-shot MurmurHash3_x64_128() of the concatenated input.
+*/
+
+typedef struct {
+	uint64_t h1, h2;
+	uint64_t length;
+	unsigned char buffer[16];
+} MURMUR3_CTX;
+
+void Murmur3Init( MURMUR3_CTX *context, uint32_t seed );
+void Murmur3Update( MURMUR3_CTX *context, const unsigned char *data, size_t len );
+void Murmur3Final( unsigned char digest[16], MURMUR3_CTX *context );
+
+#endif /* MURMUR3_H */
@@ -0,0 +1,91 @@
+﻿/* ***************************************************************************
+* path_filter.h -- path exclusion rules compiled to a DFA.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* path_filter.h -- 编译为确定有限状态自动机的路径排除规则。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_PATH_FILTER_H
+#define LCFINDER_PATH_FILTER_H
+
+/**
+ * 路径过滤器
+ * 规则的写法与 .gitignore 相同：
+ * - 空行和以 # 开头的行会被忽略
+ * - 以 ! 开头的规则表示重新包含之前的规则所排除的路径
+ * - 以 / 结尾的规则只匹配目录
+ * - 开头或中间含有 / 的规则相对于源文件夹匹配，否则匹配任意层级中的名称
+ * - * 和 ? 不匹配 /，** 可匹配任意层级的目录，[a-z] 匹配字符集合
+ * \ 与 / 同样视为路径分隔符，不能用作转义符。Windows 中匹配时忽略大小写。
+ * 多条规则都匹配时以最后一条为准。目录被排除后不会再被读取，因此其中的文件
+ * 无法被重新包含。
+ * 所有规则会被编译成一个确定有限状态自动机，匹配一个路径只需逐个字符查表。
+ */
+typedef struct PathFilterRec_ *PathFilter;
+
+PathFilter PathFilter_New( void );
+
+void PathFilter_Delete( PathFilter *fptr );
+
+/** 添加一条规则，返回添加的规则数量，空行和注释不算在内 */
+int PathFilter_AddRule( PathFilter f, const wchar_t *rule );
+
+/** 添加多条规则，规则之间以换行符分隔，返回添加的规则数量 */
+int PathFilter_AddRules( PathFilter f, const wchar_t *rules );
+
+/** 获取规则总数 */
+int PathFilter_GetRuleCount( PathFilter f );
+
+/**
+ * 获取规则的摘要
+ * 规则相同的过滤器的摘要相同，可用于判断规则是否有变化，没有规则时为 0
+ */
+uint32_t PathFilter_GetDigest( PathFilter f );
+
+/**
+ * 编译规则
+ * 需在添加完规则后、开始匹配前调用。自动机的状态数量超出上限时返回 -1，
+ * 此时改为逐个位置模拟匹配，结果相同，但速度较慢
+ */
+int PathFilter_Compile( PathFilter f );
+
+/** 判断相对于源文件夹的路径是否被排除 */
+LCUI_BOOL PathFilter_IsExcluded( PathFilter f, const wchar_t *path,
+				 LCUI_BOOL is_dir );
+
+/**
+ * 判断相对于源文件夹的目录，或者它的任意一个上级目录是否被排除
+ * 适用于没有经过逐层遍历就直接得到的目录
+ */
+LCUI_BOOL PathFilter_IsExcludedTree( PathFilter f, const wchar_t *dirpath );
+
+#endif
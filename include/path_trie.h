@@ -0,0 +1,86 @@
+﻿/* ***************************************************************************
+* path_trie.h -- compact path store
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* path_trie.h -- 紧凑的路径存储
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_PATH_TRIE_H
+#define LCFINDER_PATH_TRIE_H
+
+/** 无效的编号 */
+#define PATH_TRIE_NONE 0xffffffff
+
+/**
+ * 路径树
+ * 目录按层级拆分后只存储一次，每个目录和文件都只记录上级目录的编号和自身
+ * 名称在名称池中的位置，用 32 位编号来引用，适合存储大量有共同前缀的路径。
+ */
+typedef struct PathTrieRec_ *PathTrie;
+
+PathTrie PathTrie_New( void );
+
+void PathTrie_Delete( PathTrie *trieptr );
+
+/** 添加目录，路径末尾可以带路径分隔符，返回目录的编号 */
+uint32_t PathTrie_AddDir( PathTrie trie, const wchar_t *dirpath );
+
+/** 查找目录，找不到时返回 PATH_TRIE_NONE */
+uint32_t PathTrie_FindDir( PathTrie trie, const wchar_t *dirpath );
+
+/** 在目录中添加文件，返回文件的编号 */
+uint32_t PathTrie_AddFile( PathTrie trie, uint32_t dir, const wchar_t *name );
+
+/** 获取目录总数，目录编号从 0 开始连续分配 */
+uint32_t PathTrie_GetDirCount( PathTrie trie );
+
+/** 获取文件总数，文件编号从 0 开始连续分配 */
+uint32_t PathTrie_GetFileCount( PathTrie trie );
+
+/** 获取目录的完整路径，路径末尾带有路径分隔符，返回路径长度 */
+int PathTrie_GetDirPath( PathTrie trie, uint32_t dir, 
+			 wchar_t *buf, int max_len );
+
+/** 获取文件的完整路径，返回路径长度 */
+int PathTrie_GetFilePath( PathTrie trie, uint32_t file,
+			  wchar_t *buf, int max_len );
+
+/** 获取文件名称 */
+const wchar_t *PathTrie_GetFileName( PathTrie trie, uint32_t file );
+
+/** 获取目录中的第一个文件，没有文件时返回 PATH_TRIE_NONE */
+uint32_t PathTrie_GetFirstFile( PathTrie trie, uint32_t dir );
+
+/** 获取同一目录中的下一个文件 */
+uint32_t PathTrie_GetNextFile( PathTrie trie, uint32_t file );
+
+#endif
@@ -0,0 +1,103 @@
+﻿/* ***************************************************************************
+* remote_mount.h -- metadata access to network filesystems
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* remote_mount.h -- 网络文件系统的元数据访问
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#ifndef LCFINDER_REMOTE_MOUNT_H
+#define LCFINDER_REMOTE_MOUNT_H
+
+/** 并发窗口的默认大小 */
+#define REMOTE_WINDOW_DEFAULT	32
+/** 并发窗口的上限 */
+#define REMOTE_WINDOW_MAX	256
+/** 元数据缓存的默认有效期（秒） */
+#define REMOTE_TTL_DEFAULT	30
+
+/**
+ * 远程挂载点
+ * 网络文件系统上的每次目录读取和属性查询都是一次网络往返，逐个执行时扫描
+ * 速度取决于往返延迟而不是带宽。挂载点会同时发出多个查询来掩盖延迟，并用
+ * 并发窗口限制同时进行的查询数量，以免压垮服务器。同一设备上的源文件夹共用
+ * 一个挂载点，也就共用一个并发窗口。
+ * 查询到的属性会在有效期内缓存，有效期内重复扫描时无需再次查询。
+ */
+typedef struct RemoteMountRec_ *RemoteMount;
+
+/**
+ * 初始化远程挂载点模块
+ * @param[in] window 并发窗口的大小，即每个挂载点同时进行的查询数量上限
+ * @param[in] ttl 元数据缓存的有效期（秒），为 0 时不缓存
+ */
+void RemoteMount_Init( int window, int ttl );
+
+/** 退出远程挂载点模块，释放所有挂载点，需在所有挂载点关闭后调用 */
+void RemoteMount_Exit( void );
+
+/** 打开路径所在的挂载点，会启动挂载点的查询线程 */
+RemoteMount RemoteMount_Open( const wchar_t *path );
+
+/** 关闭挂载点，缓存会保留到下次打开 */
+void RemoteMount_Close( RemoteMount *mptr );
+
+/** 获取挂载点的并发窗口的大小 */
+int RemoteMount_GetWindow( RemoteMount m );
+
+/**
+ * 占用并发窗口中的一个位置，窗口已满时等待
+ * 用于挂载点之外的查询，例如读取目录，与 RemoteMount_Leave() 成对调用
+ */
+void RemoteMount_Enter( RemoteMount m );
+
+/** 释放占用的位置 */
+void RemoteMount_Leave( RemoteMount m );
+
+/**
+ * 获取文件或目录的属性
+ * @param[in] cached 是否可以使用缓存中尚未过期的属性
+ * @returns 获取失败时返回 -1
+ */
+int RemoteMount_GetStat( RemoteMount m, const wchar_t *path, 
+			 FileStat st, LCUI_BOOL cached );
+
+/**
+ * 同时获取目录中多个文件的属性
+ * 查询由挂载点的查询线程和当前线程一起执行，全部完成后返回。获取成功的
+ * 目录项的 has_stat 会被设为 TRUE。
+ */
+void RemoteMount_StatEntries( RemoteMount m, const wchar_t *dirpath,
+			      DirReaderEntry *entries, int n, 
+			      LCUI_BOOL cached );
+
+#endif
@@ -0,0 +1,76 @@
+﻿/* ***************************************************************************
+* scrub_service.h -- background file scrub service
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* scrub_service.h -- 后台文件校验服务
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#ifndef LCFINDER_SCRUB_SERVICE_H
+#define LCFINDER_SCRUB_SERVICE_H
+
+/**
+ * 判断是否需要暂停读取的函数
+ * 参数为附加数据，返回 TRUE 时校验线程会等一会再检查，例如有缩略图等待载入
+ */
+typedef LCUI_BOOL( *ScrubBusyFunc )(void*);
+
+/**
+ * 文件校验服务
+ * 定期按速度上限重新读取已计算过哈希值的文件，与保存的哈希值比较，找出内容
+ * 已损坏的文件。校验进度保存在数据库中，程序重启后从中断的位置继续。
+ * 服务同时负责设备读取调度：同步线程在扫描设备前后标记设备，校验线程在读取
+ * 每一块数据前都会检查文件所在的设备，设备正在同步时就等同步结束再读取。
+ */
+typedef struct ScrubServiceRec_ *ScrubService;
+
+/**
+ * 新建文件校验服务
+ * @param[in] rate 每秒最多读取的字节数，为 0 时不校验，但仍需用于设备读取调度
+ * @param[in] interval 每两轮校验之间的间隔时间（秒）
+ * @param[in] readable 判断文件能否读取的函数，不能读取的文件留到下一轮再校验
+ * @param[in] busy 判断是否需要暂停读取的函数，为 NULL 时不暂停
+ * @param[in] data 传给 readable 和 busy 的附加数据
+ */
+ScrubService ScrubService_New( int64_t rate, int64_t interval,
+			       FileReadableFunc readable, ScrubBusyFunc busy,
+			       void *data );
+
+/** 标记设备开始同步，校验服务会暂停读取该设备上的文件 */
+void ScrubService_BeginSync( ScrubService s, uint64_t dev );
+
+/** 标记设备结束同步 */
+void ScrubService_EndSync( ScrubService s, uint64_t dev );
+
+/** 停止并删除文件校验服务，正在校验的文件会中止，进度停留在上一批 */
+void ScrubService_Delete( ScrubService *sptr );
+
+#endif
@@ -0,0 +1,79 @@
+﻿/* ***************************************************************************
+* shard_index.h -- sharded indexing of very large source folders
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* shard_index.h -- 大型源文件夹的分片索引
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#ifndef LCFINDER_SHARD_INDEX_H
+#define LCFINDER_SHARD_INDEX_H
+
+/** 分片索引的命令行参数：--index <源文件夹> [分片数量] */
+#define SHARD_INDEX_ARG "--index"
+/** 默认的分片数量 */
+#define SHARD_INDEX_DEFAULT 4
+/** 工作进程的命令行参数：--index-shard <分片序号> <分片数量> <源文件夹> [过滤规则] */
+#define SHARD_INDEX_WORKER_ARG "--index-shard"
+/** 分片数量上限 */
+#define SHARD_INDEX_MAX 64
+
+/**
+ * 分片索引
+ * 源文件夹中的文件多到单个进程处理不过来时，可将它的子目录按名称分到多个
+ * 工作进程中同时扫描，每个进程都写入自己的分片目录，各自只有一个数据库写入
+ * 者，全部完成后再将分片目录合并到主数据库中。分片目录和分片的文件列表缓存
+ * 都会保留，再次索引时各个分片只需处理有变化的文件。
+ * 分片的划分方式见 SyncTask_SetShard()。
+ */
+
+/**
+ * 运行分片索引的工作进程
+ * 数据库模块会被初始化为该分片的分片目录，调用前不能初始化数据库模块
+ * @param[in] data_dir 数据文件夹，分片目录存放在其中的 shards 文件夹中
+ * @param[in] rules 源文件夹的过滤规则，没有时为 NULL
+ * @returns 分片中的文件数量，失败时返回 -1
+ */
+int ShardIndex_RunWorker( const wchar_t *data_dir, const char *dirpath,
+			  const char *rules, int index, int count );
+
+/**
+ * 为源文件夹建立分片索引
+ * 启动 count 个工作进程，等它们都结束后将分片目录依次合并到当前数据库中。
+ * 所有分片都成功时，还会删除源文件夹中已不存在的文件的记录。
+ * @param[in] exe 程序路径，工作进程以 SHARD_INDEX_WORKER_ARG 参数启动
+ * @returns 合并的文件数量，有分片失败时返回 -1
+ */
+int ShardIndex_Run( const char *exe, const wchar_t *data_dir,
+		    DB_Dir dir, int count );
+
+#endif
@@ -0,0 +1,94 @@
+﻿/* ***************************************************************************
+* source_monitor.h -- source folder health monitor
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* source_monitor.h -- 源文件夹状态监视器
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#ifndef LCFINDER_SOURCE_MONITOR_H
+#define LCFINDER_SOURCE_MONITOR_H
+
+/** 源文件夹的状态 */
+enum SourceState {
+	SOURCE_UNKNOWN,		/**< 还未检测过 */
+	SOURCE_ONLINE,		/**< 可以访问 */
+	SOURCE_OFFLINE		/**< 无法访问，或者访问超时 */
+};
+
+/**
+ * 源文件夹状态变更的处理函数
+ * 在检测线程或调用 SourceMonitor_Check() 的线程中调用，参数依次为：附加数据、
+ * 源文件夹路径、新的状态
+ */
+typedef void( *SourceStateHandler )(void*, const char*, int);
+
+/**
+ * 源文件夹状态监视器
+ * 位于已拔出的移动硬盘或已断开的共享文件夹中的源文件夹，访问时可能会在系统
+ * 调用里阻塞很久。监视器为每个源文件夹分配一个检测线程，定期查询源文件夹的
+ * 属性，查询超时的源文件夹被视为离线，卡住的只是它自己的检测线程。
+ */
+typedef struct SourceMonitorRec_ *SourceMonitor;
+
+/**
+ * 新建监视器
+ * @param[in] timeout 检测的超时时间（毫秒）
+ * @param[in] interval 定期检测的间隔时间（毫秒）
+ * @param[in] handler 状态变更的处理函数，首次检测出的状态不会通知
+ */
+SourceMonitor SourceMonitor_New( int timeout, int interval,
+				 SourceStateHandler handler, void *data );
+
+/**
+ * 删除监视器
+ * 检测线程卡在系统调用中时不会等待它，它会在调用返回后自行退出
+ */
+void SourceMonitor_Delete( SourceMonitor *mptr );
+
+/** 添加需要监视的源文件夹，添加后会立即开始检测 */
+void SourceMonitor_Add( SourceMonitor m, const char *path );
+
+/** 移除源文件夹 */
+void SourceMonitor_Remove( SourceMonitor m, const char *path );
+
+/** 获取源文件夹上次检测出的状态，不会阻塞 */
+int SourceMonitor_GetState( SourceMonitor m, const char *path );
+
+/**
+ * 立即检测源文件夹的状态
+ * 最多阻塞到超时时间，超时后源文件夹会被标记为离线，之后检测线程完成检测时
+ * 会再次更新状态。已知离线而且检测仍未完成的源文件夹会直接返回离线状态。
+ */
+int SourceMonitor_Check( SourceMonitor m, const char *path );
+
+#endif
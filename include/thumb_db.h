@@ -61,4 +61,14 @@ int ThumbDB_Load( ThumbDB db, const char *filepath, ThumbData data );
 /** 将缩略图数据保存至缓存中 */
 int ThumbDB_Save( ThumbDB db, const char *filepath, ThumbData data );
 
+/** 删除指定文件路径的缩略图数据 */
+int ThumbDB_Delete( ThumbDB db, const char *filepath );
+
+/**
+ * 移动缩略图数据
+ * 缩略图数据原样转存到新的路径下，不需要重新生成，两个数据库可以是同一个
+ */
+int ThumbDB_Move( ThumbDB db, const char *filepath,
+		  ThumbDB new_db, const char *new_filepath );
+
 #endif
@@ -59,6 +59,9 @@ void UI_ExitFolderView( void );
 /** 初始化文件同步时的提示框 */
 void UI_InitFileSyncTip( void );
 
+/** 丢弃排队中的同步，不再接受新的同步，并等待文件同步线程结束 */
+void UI_ExitFileSyncTip( void );
+
 /** 初始化首页集锦视图 */
 void UI_InitHomeView( void );
 
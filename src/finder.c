@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#include <time.h>
 #include <locale.h>
 #ifdef _WIN32
 #include <io.h>
@@ -46,21 +47,176 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <direct.h>
+#include <Windows.h>
+#include <shellapi.h>
 #define mkdir(PATH) _wmkdir(PATH)
 #endif
 #include "finder.h"
 #include "ui.h"
+#include "shard_index.h"
 #include <LCUI/font/charset.h>
+#include <LCUI/timer.h>
 
 #define EncodeUTF8(STR, WSTR, LEN) LCUI_EncodeString( STR, WSTR, LEN, ENCODING_UTF8 )
+#define DecodeUTF8(WSTR, STR, LEN) LCUI_DecodeString( WSTR, STR, LEN, ENCODING_UTF8 )
+/** 合并文件变更事件的等待时间（毫秒） */
+#define WATCHER_DELAY 1000
+/** 指定目录读取方式的环境变量，可选值有：portable、getdents、io_uring */
+#define DIR_READER_ENV "LCFINDER_DIR_READER"
+/** 指定同一设备上可同时扫描的源文件夹数量的环境变量 */
+#define SYNC_PER_DEVICE_ENV "LCFINDER_SYNC_PER_DEVICE"
+/** 同一设备上默认只同时扫描一个源文件夹，避免机械硬盘来回寻道 */
+#define SYNC_PER_DEVICE 1
+/**
+ * 指定远程扫描模式的环境变量，可选值有：auto、on、off
+ * 默认为 auto，只对网络文件系统上的源文件夹使用远程扫描模式
+ */
+#define REMOTE_SCAN_ENV "LCFINDER_REMOTE_SCAN"
+/** 指定每个网络挂载点同时进行的元数据查询数量的环境变量 */
+#define REMOTE_WINDOW_ENV "LCFINDER_REMOTE_WINDOW"
+/** 指定网络文件系统的元数据缓存有效期（秒）的环境变量 */
+#define REMOTE_TTL_ENV "LCFINDER_REMOTE_TTL"
+/** 检测源文件夹是否在线的超时时间（毫秒） */
+#define SOURCE_PROBE_TIMEOUT 3000
+/** 定期检测源文件夹是否在线的间隔时间（毫秒） */
+#define SOURCE_PROBE_INTERVAL 15000
+/** 文件变更队列的容量 */
+#define SYNC_QUEUE_SIZE 4096
+/** 写入线程每次从队列中取出的变更数量上限，这些变更在同一个事务中写入 */
+#define SYNC_BATCH_SIZE 256
+/** 每个事务最长的执行时间（毫秒），超出后先提交，让界面的查询能插进来 */
+#define SYNC_COMMIT_TIME 50
+/** 同步期间通知界面刷新的最短间隔时间（毫秒） */
+#define SYNC_NOTIFY_INTERVAL 2000
+/** 配对移动过的文件时使用的索引的最大长度 */
+#define FILE_MOVER_KEY_LEN 64
+/**
+ * 暂存的已添加文件和已删除文件各自的数量上限
+ * 首次同步时全是新增的文件，删除整个目录树时全是已删除的文件，不限制的话会
+ * 占用大量内存。超出上限后新增的文件只能和之前暂存的已删除文件配对，而最早
+ * 暂存的已删除文件会被直接删除，腾出位置给后面的文件。
+ */
+#define FILE_MOVER_MAX_ADDED 131072
+/** 计算文件内容哈希值的工作线程数量 */
+#define FILE_HASHER_WORKERS 2
+/** 指定定期同步的间隔时间（分钟）的环境变量，为 0 时不定期同步 */
+#define SYNC_INTERVAL_ENV "LCFINDER_SYNC_INTERVAL"
+/** 默认每隔 60 分钟在后台同步一次 */
+#define SYNC_INTERVAL 60
+/** 用户空闲时，距离上次同步至少要隔这么久（毫秒）才会再次同步 */
+#define SYNC_IDLE_INTERVAL (10 * 60 * 1000)
+/** 用户多久（毫秒）没有操作就算空闲 */
+#define SYNC_IDLE_TIME (2 * 60 * 1000)
+/** 同步调度器检查是否需要同步的间隔时间（毫秒） */
+#define SYNC_CHECK_INTERVAL (30 * 1000)
+/** 后台同步时每秒最多读取的目录项数量 */
+#define SYNC_MAX_RATE 5000
+/** 有缩略图等待载入时，后台同步的速度最低降到每秒读取这么多目录项 */
+#define SYNC_MIN_RATE 50
+/** 没有缩略图等待载入时，每次调整速度增加的目录项数量 */
+#define SYNC_RATE_STEP 500
+/** 调整后台同步速度的间隔时间（毫秒） */
+#define SYNC_RATE_INTERVAL 200
+/** 扫描线程每次限速时最多等待的时间（毫秒） */
+#define SYNC_MAX_WAIT 500
+/** 指定后台校验文件内容的速度上限（MB/s）的环境变量，为 0 时不校验 */
+#define SCRUB_RATE_ENV "LCFINDER_SCRUB_RATE"
+/** 后台校验时默认每秒最多读取 16 MB */
+#define SCRUB_RATE 16
+/** 指定每两轮文件校验之间的间隔时间（天）的环境变量 */
+#define SCRUB_INTERVAL_ENV "LCFINDER_SCRUB_INTERVAL"
+/** 默认每隔 30 天校验一轮 */
+#define SCRUB_INTERVAL 30
+/** 将评分和标签的变更写入数据库的间隔时间（毫秒） */
+#define DB_FLUSH_INTERVAL 500
 
 Finder finder;
 
+/** 同步锁，避免文件监视器和手动同步同时修改文件列表缓存和数据库 */
+static LCUI_Mutex sync_mutex;
+/** 定期写入评分和标签变更的定时器 */
+static int db_flush_timer;
+/** 正在进行的文件同步的状态 */
+static FileSyncStatus sync_status = NULL;
+/** 用于保护 sync_status 及其任务列表和统计数据的互斥锁 */
+static LCUI_Mutex sync_status_mutex;
+/** 程序退出时置为 TRUE，之后不再开始新的同步，受 sync_status_mutex 保护 */
+static LCUI_BOOL sync_closed = FALSE;
+
+/** 同一设备上的源文件夹扫描队列 */
+typedef struct SyncDeviceRec_ {
+	uint64_t dev;			/**< 设备编号 */
+	int *tasks;			/**< 任务在 FileSyncStatus.tasks 中的下标 */
+	int n_tasks;			/**< 任务数量 */
+	int next;			/**< 下一个待扫描的任务 */
+	FileSyncStatus status;		/**< 所属的文件同步状态 */
+} SyncDeviceRec, *SyncDevice;
+
 typedef struct DirStatusDataPackRec_ {
 	FileSyncStatus status;
 	DB_Dir dir;
 } DirStatusDataPackRec, *DirStatusDataPack;
 
+/** 文件变更类型 */
+enum FileChangeType {
+	FILE_CHANGE_ADDED,
+	FILE_CHANGE_DELETED,
+	FILE_CHANGE_MODIFIED
+};
+
+/** 文件变更记录，由扫描线程产生，交给写入线程保存到数据库 */
+typedef struct FileChangeRec_ {
+	int type;			/**< 变更类型 */
+	DB_Dir dir;			/**< 所属的源文件夹 */
+	char *path;			/**< 文件路径 */
+	FileStatRec stat;		/**< 文件属性 */
+	LinkedListNode node;		/**< 在暂存列表中的结点 */
+} FileChangeRec, *FileChange;
+
+/** 移动过的文件的检测记录，以文件属性生成的字符串作为索引 */
+static struct FileMoverRec_ {
+	Dict *deleted;			/**< 暂存的、尚未删除的文件 */
+	LinkedList deleted_list;	/**< 暂存的已删除文件，按暂存的先后排列 */
+	Dict *added;			/**< 已添加的文件 */
+	Dict *ambiguous;		/**< 属性相同的文件不止一个的索引 */
+} file_mover;
+
+/**
+ * 文件变更队列
+ * 扫描线程一边扫描一边将变更的文件放入队列，写入线程分批取出并写入数据库，
+ * 队列满时扫描线程需要等待写入线程。
+ */
+static struct SyncQueueRec_ {
+	FileChangeRec *items;		/**< 循环队列 */
+	int head;			/**< 队首位置 */
+	int length;			/**< 队列长度 */
+	LCUI_BOOL closed;		/**< 是否已关闭，关闭后不会再有新的变更 */
+	FileSyncStatus status;		/**< 所属的文件同步状态 */
+	LCUI_Thread thread;		/**< 写入线程 */
+	LCUI_Mutex mutex;
+	LCUI_Cond not_empty;
+	LCUI_Cond not_full;
+} sync_queue;
+
+/**
+ * 同步调度器
+ * 在用户空闲时或定期发起后台同步。后台同步按速度上限扫描目录，有缩略图等待
+ * 载入时速度减半，没有时再逐步恢复，所有扫描线程共用同一个速度上限。
+ */
+static struct SyncSchedulerRec_ {
+	LCUI_BOOL is_running;		/**< 是否正在运行 */
+	int interval;			/**< 定期同步的间隔时间，为 0 时不定期同步 */
+	int64_t sync_time;		/**< 上次同步完成的时间 */
+	int64_t active_time;		/**< 用户上次操作本程序的时间 */
+	int pending_thumbs;		/**< 等待载入的缩略图数量 */
+	int rate;			/**< 当前每秒最多读取的目录项数量 */
+	int64_t rate_time;		/**< 上次调整速度的时间 */
+	int64_t next_time;		/**< 下一个目录项可以读取的时间（微秒） */
+	LCUI_Thread thread;		/**< 调度线程 */
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;
+} sync_scheduler;
+
 typedef struct EventPackRec_ {
 	EventHandler handler;
 	void *data;
@@ -116,6 +272,25 @@ static wchar_t *LCFinder_CreateThumbDB( const char *dirpath )
 	return wpath;
 }
 
+/** 开始或停止监视源文件夹 */
+static void LCFinder_WatchDir( DB_Dir dir, LCUI_BOOL watch )
+{
+	int len;
+	wchar_t *wpath;
+	if( !finder.watcher ) {
+		return;
+	}
+	len = strlen( dir->path ) + 1;
+	wpath = NEW( wchar_t, len );
+	LCUI_DecodeString( wpath, dir->path, len, ENCODING_UTF8 );
+	if( watch ) {
+		FileWatcher_Watch( finder.watcher, wpath );
+	} else {
+		FileWatcher_Unwatch( finder.watcher, wpath );
+	}
+	free( wpath );
+}
+
 DB_Dir LCFinder_AddDir( const char *dirpath )
 {
 	int i, len;
@@ -158,6 +333,10 @@ DB_Dir LCFinder_AddDir( const char *dirpath )
 	paths[i] = LCFinder_CreateThumbDB( dir->path );
 	finder.dirs = dirs;
 	finder.thumb_paths = paths;
+	LCFinder_WatchDir( dir, TRUE );
+	if( finder.sources ) {
+		SourceMonitor_Add( finder.sources, dir->path );
+	}
 	return dir;
 }
 
@@ -176,6 +355,10 @@ void LCFinder_DeleteDir( DB_Dir dir )
 		return;
 	}
 	finder.dirs[i] = NULL;
+	LCFinder_WatchDir( dir, FALSE );
+	if( finder.sources ) {
+		SourceMonitor_Remove( finder.sources, dir->path );
+	}
 	len = strlen( dir->path ) + 1;
 	wpath = NEW( wchar_t, len );
 	LCUI_DecodeString( wpath, dir->path, len, ENCODING_UTF8 );
@@ -195,29 +378,494 @@ void LCFinder_DeleteDir( DB_Dir dir )
 	}
 	/* 删除数据库中的源文件夹记录 */
 	DB_DeleteDir( dir );
+	if( dir->rules ) {
+		free( dir->rules );
+	}
 	free( dir->path );
 	free( dir );
 }
 
-static void SyncAddedFile( void *data, const wchar_t *wpath )
+/** 根据源文件夹的过滤规则创建路径过滤器，没有规则时返回 NULL */
+static PathFilter LCFinder_CreateFilter( DB_Dir dir )
 {
-	static char path[PATH_LEN];
-	DirStatusDataPack pack = data;
-	int ctime = wgetfilectime( wpath );
-	pack->status->synced_files += 1;
-	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
-	DB_AddFile( pack->dir, path, ctime );
-	//wprintf(L"sync: add file: %s, ctime: %d\n", wpath, ctime);
+	int len;
+	wchar_t *rules;
+	PathFilter filter;
+	if( !dir->rules ) {
+		return NULL;
+	}
+	len = strlen( dir->rules ) + 1;
+	rules = NEW( wchar_t, len );
+	DecodeUTF8( rules, dir->rules, len );
+	filter = PathFilter_New();
+	PathFilter_AddRules( filter, rules );
+	free( rules );
+	return filter;
+}
+
+void LCFinder_SetDirRules( DB_Dir dir, const char *rules )
+{
+	SyncScopeRec scope = { SYNC_MANUAL, NULL, 1, NULL };
+	/* 等待正在进行的同步结束，避免扫描线程读取到一半的规则 */
+	LCUIMutex_Lock( &sync_mutex );
+	DB_SetDirRules( dir, rules );
+	LCUIMutex_Unlock( &sync_mutex );
+	scope.dirs = &dir;
+	LCFinder_TriggerEvent( EVENT_SYNC, &scope );
+}
+
+/** 获取文件在缩略图数据库中的路径，即相对于源文件夹的路径 */
+static const char *LCFinder_GetThumbPath( DB_Dir dir, const char *path )
+{
+	const char *name = path + strlen( dir->path );
+	if( name[0] == PATH_SEP ) {
+		++name;
+	}
+	return name;
+}
+
+/** 删除文件的缩略图 */
+static void LCFinder_DeleteThumb( DB_Dir dir, const char *path )
+{
+	ThumbDB db = Dict_FetchValue( finder.thumb_dbs, dir->path );
+	if( db ) {
+		ThumbDB_Delete( db, LCFinder_GetThumbPath( dir, path ) );
+	}
+}
+
+/** 移动文件记录及其缩略图 */
+static void LCFinder_MoveFile( FileChange src, FileChange dst )
+{
+	ThumbDB db, new_db;
+	DB_MoveFile( src->dir, src->path, dst->dir, dst->path );
+	db = Dict_FetchValue( finder.thumb_dbs, src->dir->path );
+	new_db = Dict_FetchValue( finder.thumb_dbs, dst->dir->path );
+	if( db && new_db ) {
+		ThumbDB_Move( db, LCFinder_GetThumbPath( src->dir, src->path ),
+			      new_db, LCFinder_GetThumbPath( dst->dir, 
+							     dst->path ) );
+	}
+}
+
+static void FileChange_Release( void *privdata, void *val )
+{
+	FileChange change = val;
+	free( change->path );
+	free( change );
+}
+
+static void FileMover_ReleaseDeleted( void *privdata, void *val )
+{
+	FileChange change = val;
+	LinkedList_Unlink( &file_mover.deleted_list, &change->node );
+	FileChange_Release( privdata, val );
+}
+
+/** 生成用于配对移动过的文件的索引，没有文件属性时返回 FALSE */
+static LCUI_BOOL FileMover_GetKey( const FileStatRec *st, char *key )
+{
+	if( st->size == 0 && st->mtime == 0 && st->inode == 0 ) {
+		return FALSE;
+	}
+	sprintf( key, "%lld:%lld:%llu", (long long)st->size,
+		 (long long)st->mtime, (unsigned long long)st->inode );
+	return TRUE;
+}
+
+/** 开始检测移动过的文件 */
+static void FileMover_Begin( void )
+{
+	file_mover.deleted = StrDict_Create( NULL, FileMover_ReleaseDeleted );
+	LinkedList_Init( &file_mover.deleted_list );
+	file_mover.added = StrDict_Create( NULL, FileChange_Release );
+	file_mover.ambiguous = StrDict_Create( NULL, NULL );
+}
+
+/**
+ * 暂存文件变更
+ * 属性相同的文件不止一个时无法确定谁和谁配对，这些文件都按普通的新增和删除
+ * 处理，此时返回 FALSE
+ */
+static LCUI_BOOL FileMover_Keep( Dict *changes, const char *key,
+				 FileChange change )
+{
+	FileChange other;
+	char other_key[FILE_MOVER_KEY_LEN];
+	other = Dict_FetchValue( changes, key );
+	if( other ) {
+		if( other->type == FILE_CHANGE_DELETED ) {
+			DB_DeleteFile( other->dir, other->path );
+		}
+		Dict_Delete( changes, key );
+		Dict_Add( file_mover.ambiguous, (void*)key, (void*)1 );
+		return FALSE;
+	}
+	if( changes == file_mover.added &&
+	    Dict_Size( changes ) >= FILE_MOVER_MAX_ADDED ) {
+		return FALSE;
+	}
+	/* 已删除文件暂存满了，最早暂存的那个已经不太可能配对，直接删除它 */
+	if( changes == file_mover.deleted &&
+	    Dict_Size( changes ) >= FILE_MOVER_MAX_ADDED ) {
+		other = file_mover.deleted_list.head.next->data;
+		DB_DeleteFile( other->dir, other->path );
+		FileMover_GetKey( &other->stat, other_key );
+		Dict_Delete( changes, other_key );
+	}
+	other = NEW( FileChangeRec, 1 );
+	*other = *change;
+	other->path = strdup( change->path );
+	if( changes == file_mover.deleted ) {
+		other->node.data = other;
+		LinkedList_AppendNode( &file_mover.deleted_list, 
+				       &other->node );
+	}
+	Dict_Add( changes, (void*)key, other );
+	return TRUE;
+}
+
+/**
+ * 将文件变更写入数据库
+ * 移动文件后，文件列表的变更中会出现一个已删除的文件和一个新增的文件，它们的
+ * 大小、修改时间和索引节点号都相同。已删除的文件先暂存起来，遇到与它配对的
+ * 新增文件时只需修改文件记录，评分、标签和缩略图都得以保留；新增的文件先出现
+ * 时，它的记录已经添加，会在修改时被替换掉。暂存的已删除文件在调用
+ * FileMover_End() 时才从数据库中删除。
+ */
+static void FileMover_Save( FileChange change )
+{
+	FileChange other;
+	char key[FILE_MOVER_KEY_LEN];
+	LCUI_BOOL has_key = FileMover_GetKey( &change->stat, key );
+	if( has_key && Dict_FetchValue( file_mover.ambiguous, key ) ) {
+		has_key = FALSE;
+	}
+	switch( change->type ) {
+	case FILE_CHANGE_ADDED:
+		other = has_key ? Dict_FetchValue( file_mover.deleted, key ) : NULL;
+		if( other ) {
+			LCFinder_MoveFile( other, change );
+			Dict_Delete( file_mover.deleted, key );
+			break;
+		}
+		DB_AddFile( change->dir, change->path, (int)change->stat.ctime );
+		if( has_key ) {
+			FileMover_Keep( file_mover.added, key, change );
+		}
+		break;
+	case FILE_CHANGE_DELETED:
+		other = has_key ? Dict_FetchValue( file_mover.added, key ) : NULL;
+		if( other ) {
+			LCFinder_MoveFile( change, other );
+			Dict_Delete( file_mover.added, key );
+			break;
+		}
+		if( !has_key || !FileMover_Keep( file_mover.deleted, key, 
+						 change ) ) {
+			DB_DeleteFile( change->dir, change->path );
+		}
+		break;
+	case FILE_CHANGE_MODIFIED:
+		LCFinder_DeleteThumb( change->dir, change->path );
+		DB_DeleteFileHash( change->dir, change->path );
+		break;
+	default: break;
+	}
+}
+
+/** 结束检测移动过的文件，未能配对的已删除文件都从数据库中删除 */
+static void FileMover_End( void )
+{
+	FileChange change;
+	DictEntry *entry;
+	DictIterator *iter;
+	iter = Dict_GetIterator( file_mover.deleted );
+	entry = Dict_Next( iter );
+	while( entry ) {
+		change = DictEntry_GetVal( entry );
+		DB_DeleteFile( change->dir, change->path );
+		entry = Dict_Next( iter );
+	}
+	Dict_ReleaseIterator( iter );
+	StrDict_Release( file_mover.deleted );
+	StrDict_Release( file_mover.added );
+	StrDict_Release( file_mover.ambiguous );
+	file_mover.deleted = NULL;
+	file_mover.added = NULL;
+	file_mover.ambiguous = NULL;
 }
 
-static void SyncDeletedFile( void *data, const wchar_t *wpath )
+/** 处理文件监视器发现的变更，参数同 FileHanlder */
+static void SaveFileChange( DirStatusDataPack pack, int type,
+			    const wchar_t *wpath, const FileStatRec *st )
 {
-	static char path[PATH_LEN];
-	DirStatusDataPack pack = data;
+	FileChangeRec change;
+	char path[PATH_LEN];
+	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
+	change.type = type;
+	change.dir = pack->dir;
+	change.path = path;
+	change.stat = *st;
+	FileMover_Save( &change );
 	pack->status->synced_files += 1;
+}
+
+static void SyncAddedFile( void *data, const wchar_t *wpath,
+			   const FileStatRec *st )
+{
+	SaveFileChange( data, FILE_CHANGE_ADDED, wpath, st );
+}
+
+static void SyncDeletedFile( void *data, const wchar_t *wpath,
+			     const FileStatRec *st )
+{
+	SaveFileChange( data, FILE_CHANGE_DELETED, wpath, st );
+}
+
+/** 修改过的文件的缩略图已经过时，需要删除掉，下次显示时再重新生成 */
+static void SyncModifiedFile( void *data, const wchar_t *wpath,
+			      const FileStatRec *st )
+{
+	SaveFileChange( data, FILE_CHANGE_MODIFIED, wpath, st );
+}
+
+/** 将变更的文件放入队列，由扫描线程调用 */
+static void SyncQueue_Push( DirStatusDataPack pack, int type,
+			    const wchar_t *wpath, const FileStatRec *st )
+{
+	FileChange change;
+	char path[PATH_LEN];
 	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
-	DB_DeleteFile( pack->dir, path );
-	//wprintf(L"sync: delete file: %s\n", wpath);
+	LCUIMutex_Lock( &sync_queue.mutex );
+	while( sync_queue.length >= SYNC_QUEUE_SIZE ) {
+		LCUICond_Wait( &sync_queue.not_full, &sync_queue.mutex );
+	}
+	change = &sync_queue.items[(sync_queue.head + sync_queue.length) %
+				   SYNC_QUEUE_SIZE];
+	change->type = type;
+	change->dir = pack->dir;
+	change->path = strdup( path );
+	change->stat = *st;
+	sync_queue.length += 1;
+	LCUICond_Signal( &sync_queue.not_empty );
+	LCUIMutex_Unlock( &sync_queue.mutex );
+}
+
+static void QueueAddedFile( void *data, const wchar_t *wpath,
+			    const FileStatRec *st )
+{
+	SyncQueue_Push( data, FILE_CHANGE_ADDED, wpath, st );
+}
+
+static void QueueDeletedFile( void *data, const wchar_t *wpath,
+			      const FileStatRec *st )
+{
+	SyncQueue_Push( data, FILE_CHANGE_DELETED, wpath, st );
+}
+
+static void QueueModifiedFile( void *data, const wchar_t *wpath,
+			       const FileStatRec *st )
+{
+	SyncQueue_Push( data, FILE_CHANGE_MODIFIED, wpath, st );
+}
+
+/**
+ * 将一批变更写入数据库
+ * 写入时间超过 SYNC_COMMIT_TIME 就先提交事务，避免长时间占用数据库的写锁
+ */
+static void SyncQueue_Save( FileChange changes, int n )
+{
+	int i;
+	int64_t start_time;
+	FileSyncStatus s = sync_queue.status;
+	DB_Begin();
+	start_time = LCUI_GetTickCount();
+	for( i = 0; i < n; ++i ) {
+		FileMover_Save( &changes[i] );
+		free( changes[i].path );
+		s->synced_files += 1;
+		if( LCUI_GetTimeDelta( start_time ) >= SYNC_COMMIT_TIME ) {
+			DB_Commit();
+			DB_Begin();
+			start_time = LCUI_GetTickCount();
+		}
+	}
+	DB_Commit();
+}
+
+/** 写入线程，不断地从队列中取出变更并写入数据库，直到队列关闭且为空 */
+static void SyncQueue_Thread( void *arg )
+{
+	int i, n;
+	int64_t notify_time;
+	FileChangeRec changes[SYNC_BATCH_SIZE];
+	notify_time = LCUI_GetTickCount();
+	FileMover_Begin();
+	while( 1 ) {
+		LCUIMutex_Lock( &sync_queue.mutex );
+		while( sync_queue.length == 0 && !sync_queue.closed ) {
+			LCUICond_Wait( &sync_queue.not_empty, 
+				       &sync_queue.mutex );
+		}
+		n = sync_queue.length;
+		if( n == 0 ) {
+			LCUIMutex_Unlock( &sync_queue.mutex );
+			break;
+		}
+		if( n > SYNC_BATCH_SIZE ) {
+			n = SYNC_BATCH_SIZE;
+		}
+		for( i = 0; i < n; ++i ) {
+			changes[i] = sync_queue.items[sync_queue.head];
+			sync_queue.head = (sync_queue.head + 1) % SYNC_QUEUE_SIZE;
+		}
+		sync_queue.length -= n;
+		LCUICond_Broadcast( &sync_queue.not_full );
+		LCUIMutex_Unlock( &sync_queue.mutex );
+		SyncQueue_Save( changes, n );
+		/* 让界面定期刷新，新找到的图片不用等到同步完成后才显示 */
+		if( LCUI_GetTimeDelta( notify_time ) >= SYNC_NOTIFY_INTERVAL ) {
+			LCFinder_TriggerEvent( EVENT_SYNC_DONE, NULL );
+			notify_time = LCUI_GetTickCount();
+		}
+	}
+	DB_Begin();
+	FileMover_End();
+	DB_Commit();
+	LCUIThread_Exit( NULL );
+}
+
+/** 打开文件变更队列，并创建写入线程 */
+static void SyncQueue_Open( FileSyncStatus s )
+{
+	sync_queue.head = 0;
+	sync_queue.length = 0;
+	sync_queue.closed = FALSE;
+	sync_queue.status = s;
+	sync_queue.items = NEW( FileChangeRec, SYNC_QUEUE_SIZE );
+	LCUIThread_Create( &sync_queue.thread, SyncQueue_Thread, NULL );
+}
+
+/** 关闭文件变更队列，并等待写入线程处理完剩余的变更 */
+static void SyncQueue_Close( void )
+{
+	LCUIMutex_Lock( &sync_queue.mutex );
+	sync_queue.closed = TRUE;
+	LCUICond_Signal( &sync_queue.not_empty );
+	LCUIMutex_Unlock( &sync_queue.mutex );
+	LCUIThread_Join( sync_queue.thread, NULL );
+	free( sync_queue.items );
+	sync_queue.items = NULL;
+	sync_queue.status = NULL;
+}
+
+/** 判断是否需要以远程扫描模式扫描源文件夹 */
+static LCUI_BOOL LCFinder_IsRemoteDir( const wchar_t *dirpath )
+{
+	switch( finder.remote_scan ) {
+	case REMOTE_SCAN_ON: return TRUE;
+	case REMOTE_SCAN_OFF: return FALSE;
+	default: break;
+	}
+	return wisremotepath( dirpath );
+}
+
+/** 初始化远程扫描模式 */
+static void LCFinder_InitRemoteScan( void )
+{
+	char *str;
+	int window = REMOTE_WINDOW_DEFAULT, ttl = REMOTE_TTL_DEFAULT;
+	finder.remote_scan = REMOTE_SCAN_AUTO;
+	str = getenv( REMOTE_SCAN_ENV );
+	if( str && strcmp( str, "on" ) == 0 ) {
+		finder.remote_scan = REMOTE_SCAN_ON;
+	} else if( str && strcmp( str, "off" ) == 0 ) {
+		finder.remote_scan = REMOTE_SCAN_OFF;
+	}
+	str = getenv( REMOTE_WINDOW_ENV );
+	if( str && atoi( str ) > 0 ) {
+		window = atoi( str );
+	}
+	str = getenv( REMOTE_TTL_ENV );
+	if( str && atoi( str ) >= 0 ) {
+		ttl = atoi( str );
+	}
+	RemoteMount_Init( window, ttl );
+}
+
+/** 处理文件监视器报告的变更，只重新读取有变更的目录 */
+static void OnFilesChanged( void *privdata, const wchar_t *dirpath, 
+			    LinkedList *dirs )
+{
+	SyncTask t;
+	LinkedListNode *node;
+	char path[PATH_LEN];
+	FileSyncStatusRec status;
+	DirStatusDataPackRec pack;
+	SyncScopeRec scope = { SYNC_BACKGROUND, NULL, 1, NULL };
+	EncodeUTF8( path, dirpath, PATH_LEN );
+	pack.dir = LCFinder_GetDir( path );
+	if( !pack.dir ) {
+		return;
+	}
+	/* 丢失了部分事件，只能在后台重新同步整个源文件夹 */
+	if( !dirs ) {
+		scope.dirs = &pack.dir;
+		LCFinder_TriggerEvent( EVENT_SYNC, &scope );
+		return;
+	}
+	memset( &status, 0, sizeof( status ) );
+	pack.status = &status;
+	LCUIMutex_Lock( &sync_mutex );
+	LCUIMutex_Lock( &sync_status_mutex );
+	if( sync_closed ) {
+		LCUIMutex_Unlock( &sync_status_mutex );
+		LCUIMutex_Unlock( &sync_mutex );
+		return;
+	}
+	LCUIMutex_Unlock( &sync_status_mutex );
+	t = SyncTask_NewW( finder.fileset_dir, dirpath );
+	t->reader = finder.dir_reader;
+	t->remote = LCFinder_IsRemoteDir( dirpath );
+	SyncTask_SetFilter( t, LCFinder_CreateFilter( pack.dir ) );
+	LinkedList_ForEach( node, dirs ) {
+		SyncTask_AddDirtyDir( t, node->data );
+	}
+	SyncTask_Start( t );
+	if( t->added_files > 0 || t->deleted_files > 0 ||
+	    t->modified_files > 0 ) {
+		/* 先处理已删除的文件，新增的文件才能和它们配对 */
+		DB_Begin();
+		FileMover_Begin();
+		SyncTask_InDeletedFiles( t, SyncDeletedFile, &pack );
+		SyncTask_InAddedFiles( t, SyncAddedFile, &pack );
+		SyncTask_InModifiedFiles( t, SyncModifiedFile, &pack );
+		FileMover_End();
+		DB_Commit();
+	}
+	SyncTask_Commit( t );
+	SyncTask_Delete( &t );
+	LCUIMutex_Unlock( &sync_mutex );
+	if( status.synced_files > 0 ) {
+		LCFinder_TriggerEvent( EVENT_SYNC_DONE, NULL );
+	}
+}
+
+int LCFinder_GetScannedFiles( FileSyncStatus s )
+{
+	int i, count;
+	SyncTask t;
+	LCUIMutex_Lock( &sync_status_mutex );
+	/* 已扫描完的任务的文件数已计入 scaned_files，再加上正在扫描的 */
+	count = s->scaned_files;
+	for( i = 0; i < s->n_tasks; ++i ) {
+		t = s->tasks[i];
+		if( t && t->state == STATE_STARTED ) {
+			count += t->total_files;
+		}
+	}
+	LCUIMutex_Unlock( &sync_status_mutex );
+	return count;
 }
 
 DB_Dir LCFinder_GetSourceDir( const char *filepath )
@@ -233,6 +881,57 @@ DB_Dir LCFinder_GetSourceDir( const char *filepath )
 	return NULL;
 }
 
+LCUI_BOOL LCFinder_IsSourceOnline( DB_Dir dir )
+{
+	if( !finder.sources ) {
+		return TRUE;
+	}
+	return SourceMonitor_GetState( finder.sources, 
+				       dir->path ) != SOURCE_OFFLINE;
+}
+
+/** 立即检测源文件夹是否在线，最多阻塞 SOURCE_PROBE_TIMEOUT 毫秒 */
+static LCUI_BOOL LCFinder_CheckSource( DB_Dir dir )
+{
+	if( !finder.sources ) {
+		return TRUE;
+	}
+	return SourceMonitor_Check( finder.sources, 
+				    dir->path ) != SOURCE_OFFLINE;
+}
+
+/** 源文件夹恢复在线后，在后台同步它在离线期间的变更 */
+static void OnSourceStateChanged( void *data, const char *path, int state )
+{
+	DB_Dir dir;
+	SyncScopeRec scope = { SYNC_BACKGROUND, NULL, 1, NULL };
+	if( state != SOURCE_ONLINE ) {
+		printf( "[source] offline: %s\n", path );
+		return;
+	}
+	printf( "[source] online: %s\n", path );
+	dir = LCFinder_GetDir( path );
+	if( dir ) {
+		scope.dirs = &dir;
+		LCFinder_TriggerEvent( EVENT_SYNC, &scope );
+	}
+}
+
+/** 初始化源文件夹状态监视器 */
+static void LCFinder_InitSourceMonitor( void )
+{
+	int i;
+	finder.sources = SourceMonitor_New( SOURCE_PROBE_TIMEOUT,
+					    SOURCE_PROBE_INTERVAL,
+					    OnSourceStateChanged, NULL );
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		if( finder.dirs[i] ) {
+			SourceMonitor_Add( finder.sources, 
+					   finder.dirs[i]->path );
+		}
+	}
+}
+
 int64_t LCFinder_GetThumbDBTotalSize( void )
 {
 	int i;
@@ -245,58 +944,445 @@ int64_t LCFinder_GetThumbDBTotalSize( void )
 	return sum_size;
 }
 
-int LCFinder_SyncFiles( FileSyncStatus s )
+SyncScope SyncScope_New( int mode )
 {
-	int i, len;
+	SyncScope scope = NEW( SyncScopeRec, 1 );
+	scope->mode = mode;
+	scope->dirs = NULL;
+	scope->n_dirs = 0;
+	scope->path = NULL;
+	return scope;
+}
+
+SyncScope SyncScope_Duplicate( SyncScope scope )
+{
+	SyncScope copy;
+	if( !scope ) {
+		return SyncScope_New( SYNC_MANUAL );
+	}
+	copy = SyncScope_New( scope->mode );
+	if( scope->n_dirs > 0 ) {
+		copy->n_dirs = scope->n_dirs;
+		copy->dirs = NEW( DB_Dir, scope->n_dirs );
+		memcpy( copy->dirs, scope->dirs, sizeof( DB_Dir )*scope->n_dirs );
+	}
+	if( scope->path ) {
+		copy->path = malloc( strlen( scope->path ) + 1 );
+		strcpy( copy->path, scope->path );
+	}
+	return copy;
+}
+
+void SyncScope_Delete( SyncScope *scope )
+{
+	if( (*scope)->dirs ) {
+		free( (*scope)->dirs );
+	}
+	if( (*scope)->path ) {
+		free( (*scope)->path );
+	}
+	free( *scope );
+	*scope = NULL;
+}
+
+/** 判断同步范围是否包括所有源文件夹 */
+static LCUI_BOOL SyncScope_IsFull( SyncScope scope )
+{
+	return !scope || (!scope->path && scope->n_dirs == 0);
+}
+
+/** 判断源文件夹是否需要完整同步 */
+static LCUI_BOOL SyncScope_HasDir( SyncScope scope, DB_Dir dir )
+{
+	int i;
+	if( SyncScope_IsFull( scope ) ) {
+		return TRUE;
+	}
+	if( scope->path ) {
+		return FALSE;
+	}
+	for( i = 0; i < scope->n_dirs; ++i ) {
+		if( scope->dirs[i] == dir ) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/** 判断源文件夹是否在同步范围内，包括只同步其中某个目录的情况 */
+static LCUI_BOOL SyncScope_InScope( SyncScope scope, DB_Dir dir )
+{
+	if( scope && scope->path ) {
+		return LCFinder_GetSourceDir( scope->path ) == dir;
+	}
+	return SyncScope_HasDir( scope, dir );
+}
+
+/** 将源文件夹添加到同步范围中 */
+static void SyncScope_AddDir( SyncScope scope, DB_Dir dir )
+{
+	DB_Dir *dirs;
+	if( !dir || SyncScope_HasDir( scope, dir ) ) {
+		return;
+	}
+	dirs = realloc( scope->dirs, sizeof( DB_Dir )*(scope->n_dirs + 1) );
+	if( !dirs ) {
+		return;
+	}
+	dirs[scope->n_dirs++] = dir;
+	scope->dirs = dirs;
+}
+
+/** 将限定的目录改为它所在的整个源文件夹 */
+static void SyncScope_ExpandPath( SyncScope scope )
+{
+	DB_Dir dir;
+	if( !scope->path ) {
+		return;
+	}
+	dir = LCFinder_GetSourceDir( scope->path );
+	free( scope->path );
+	scope->path = NULL;
+	SyncScope_AddDir( scope, dir );
+}
+
+LCUI_BOOL SyncScope_Covers( SyncScope scope, SyncScope other )
+{
+	int i;
+	DB_Dir dir;
+	if( SyncScope_IsFull( scope ) ) {
+		return TRUE;
+	}
+	if( SyncScope_IsFull( other ) ) {
+		return FALSE;
+	}
+	if( other->path ) {
+		if( scope->path ) {
+			return strcmp( scope->path, other->path ) == 0;
+		}
+		dir = LCFinder_GetSourceDir( other->path );
+		return dir && SyncScope_HasDir( scope, dir );
+	}
+	if( scope->path ) {
+		return FALSE;
+	}
+	for( i = 0; i < other->n_dirs; ++i ) {
+		if( !SyncScope_HasDir( scope, other->dirs[i] ) ) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+void SyncScope_Merge( SyncScope scope, SyncScope other )
+{
+	int i;
+	if( !other || other->mode == SYNC_MANUAL ) {
+		scope->mode = SYNC_MANUAL;
+	}
+	if( SyncScope_Covers( scope, other ) ) {
+		return;
+	}
+	if( SyncScope_IsFull( other ) ) {
+		free( scope->dirs );
+		free( scope->path );
+		scope->dirs = NULL;
+		scope->path = NULL;
+		scope->n_dirs = 0;
+		return;
+	}
+	SyncScope_ExpandPath( scope );
+	if( other->path ) {
+		SyncScope_AddDir( scope, LCFinder_GetSourceDir( other->path ) );
+		return;
+	}
+	for( i = 0; i < other->n_dirs; ++i ) {
+		SyncScope_AddDir( scope, other->dirs[i] );
+	}
+}
+
+/**
+ * 后台同步的扫描限速函数，由扫描线程调用
+ * 按当前速度算出这些目录项占用的时间，排在其它扫描线程之后，等到时间再返回
+ */
+static void SyncScheduler_Throttle( void *data, int n )
+{
+	int64_t now, wait;
+	FileSyncStatus s = data;
+	if( !s->is_background ) {
+		return;
+	}
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	now = LCUI_GetTickCount();
+	if( now - sync_scheduler.rate_time >= SYNC_RATE_INTERVAL ) {
+		if( sync_scheduler.pending_thumbs > 0 ) {
+			sync_scheduler.rate /= 2;
+		} else {
+			sync_scheduler.rate += SYNC_RATE_STEP;
+		}
+		if( sync_scheduler.rate < SYNC_MIN_RATE ) {
+			sync_scheduler.rate = SYNC_MIN_RATE;
+		} else if( sync_scheduler.rate > SYNC_MAX_RATE ) {
+			sync_scheduler.rate = SYNC_MAX_RATE;
+		}
+		sync_scheduler.rate_time = now;
+	}
+	now *= 1000;
+	if( sync_scheduler.next_time < now ) {
+		sync_scheduler.next_time = now;
+	}
+	sync_scheduler.next_time += (int64_t)n * 1000000 / sync_scheduler.rate;
+	/* 一次读取了很多目录项时不用补足全部时间，免得扫描线程长时间停住 */
+	if( sync_scheduler.next_time - now > SYNC_MAX_WAIT * 1000 ) {
+		sync_scheduler.next_time = now + SYNC_MAX_WAIT * 1000;
+	}
+	wait = (sync_scheduler.next_time - now) / 1000;
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+	if( wait > 0 ) {
+		LCUI_MSleep( (unsigned int)wait );
+	}
+}
+
+/** 扫描线程，依次扫描同一设备上还未扫描的源文件夹 */
+static void SyncDevice_Thread( void *arg )
+{
+	SyncTask t;
+	SyncDevice dev = arg;
+	FileSyncStatus s = dev->status;
+	/* 扫描线程在同步结束后就会退出，降低的优先级不会影响到其它工作 */
+	if( s->is_background ) {
+		setthreadbackground();
+	}
+	ScrubService_BeginSync( finder.scrub_service, dev->dev );
+	while( 1 ) {
+		LCUIMutex_Lock( &sync_status_mutex );
+		if( s->state != STATE_STARTED || dev->next >= dev->n_tasks ) {
+			LCUIMutex_Unlock( &sync_status_mutex );
+			break;
+		}
+		t = s->tasks[dev->tasks[dev->next++]];
+		LCUIMutex_Unlock( &sync_status_mutex );
+		SyncTask_Start( t );
+		LCUIMutex_Lock( &sync_status_mutex );
+		s->added_files += t->added_files;
+		s->scaned_files += t->total_files;
+		s->deleted_files += t->deleted_files;
+		s->modified_files += t->modified_files;
+		LCUIMutex_Unlock( &sync_status_mutex );
+	}
+	ScrubService_EndSync( finder.scrub_service, dev->dev );
+	LCUIThread_Exit( NULL );
+}
+
+/**
+ * 检测同步范围内的源文件夹是否在线
+ * 每个离线的源文件夹最多会阻塞 SOURCE_PROBE_TIMEOUT 毫秒，所以需要在持有
+ * 同步相关的锁之前调用，否则等待这些锁的界面线程也会被卡住。
+ * @param[out] outlist 在线的源文件夹列表
+ * @returns 在线的源文件夹数量
+ */
+static int LCFinder_CheckSources( SyncScope scope, DB_Dir **outlist )
+{
+	int i, n = 0;
+	DB_Dir dir, *dirs;
+	dirs = NEW( DB_Dir, finder.n_dirs + 1 );
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		dir = finder.dirs[i];
+		if( dir && SyncScope_InScope( scope, dir ) &&
+		    LCFinder_CheckSource( dir ) ) {
+			dirs[n++] = dir;
+		}
+	}
+	*outlist = dirs;
+	return n;
+}
+
+/**
+ * 为同步范围内的每个源文件夹创建同步任务，并按所在设备分组
+ * @param[in] online 在线的源文件夹列表，由 LCFinder_CheckSources() 获取
+ * @returns 设备数量
+ */
+static int LCFinder_CreateSyncTasks( FileSyncStatus s, SyncScope scope,
+				     DB_Dir *online, int n_online,
+				     SyncDevice devs )
+{
+	int i, j, k, len;
+	uint64_t id;
 	DB_Dir dir;
 	wchar_t *path;
+	int n_devs = 0;
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		dir = finder.dirs[i];
+		if( !dir || !SyncScope_InScope( scope, dir ) ) {
+			continue;
+		}
+		/* 离线的源文件夹不扫描，保留它的文件记录，恢复在线后会再同步 */
+		for( k = 0; k < n_online; ++k ) {
+			if( online[k] == dir ) {
+				break;
+			}
+		}
+		if( k == n_online ) {
+			continue;
+		}
+		len = strlen( dir->path ) + 1;
+		path = malloc( sizeof( wchar_t )*len );
+		len = LCUI_DecodeString( path, dir->path, len, ENCODING_UTF8 );
+		path[len] = 0;
+		s->tasks[i] = SyncTask_NewW( finder.fileset_dir, path );
+		s->tasks[i]->reader = finder.dir_reader;
+		s->tasks[i]->background = s->is_background;
+		/* 手动同步时需要检测出所有变更，不能跳过修改时间未变的目录 */
+		s->tasks[i]->skip_unchanged = s->is_background;
+		s->tasks[i]->remote = LCFinder_IsRemoteDir( path );
+		SyncTask_SetFilter( s->tasks[i], LCFinder_CreateFilter( dir ) );
+		SyncTask_SetThrottle( s->tasks[i], SyncScheduler_Throttle, s );
+		/* 只刷新某个目录时，其余目录都沿用缓存中的记录 */
+		if( scope && scope->path ) {
+			len = strlen( scope->path ) + 1;
+			path = realloc( path, sizeof( wchar_t )*len );
+			len = DecodeUTF8( path, scope->path, len );
+			path[len] = 0;
+			SyncTask_AddDirtyTree( s->tasks[i], path );
+		}
+		/* 获取不到设备编号的源文件夹（例如已断开的共享文件夹）都归为一组 */
+		id = 0;
+		wgetfiledev( path, &id );
+		free( path );
+		for( j = 0; j < n_devs; ++j ) {
+			if( devs[j].dev == id ) {
+				break;
+			}
+		}
+		if( j == n_devs ) {
+			devs[j].dev = id;
+			devs[j].status = s;
+			devs[j].tasks = NEW( int, finder.n_dirs );
+			++n_devs;
+		}
+		devs[j].tasks[devs[j].n_tasks++] = i;
+	}
+	return n_devs;
+}
+
+int LCFinder_SyncFiles( FileSyncStatus s, SyncScope scope )
+{
+	int i, j, n_devs, n_online;
+	int n_threads = 0;
+	DB_Dir *online;
+	SyncDevice devs;
+	LCUI_Thread *threads;
+	DirStatusDataPack packs;
 	s->task = NULL;
 	s->tasks = NULL;
+	s->n_tasks = 0;
 	s->added_files = 0;
 	s->synced_files = 0;
 	s->scaned_files = 0;
 	s->deleted_files = 0;
+	s->modified_files = 0;
+	s->is_background = scope && scope->mode == SYNC_BACKGROUND;
 	s->state = STATE_STARTED;
+	n_online = LCFinder_CheckSources( scope, &online );
+	LCUIMutex_Lock( &sync_mutex );
+	LCUIMutex_Lock( &sync_status_mutex );
+	/* 程序正在退出，源文件夹和远程挂载可能已经释放 */
+	if( sync_closed ) {
+		s->state = STATE_FINISHED;
+		LCUIMutex_Unlock( &sync_status_mutex );
+		LCUIMutex_Unlock( &sync_mutex );
+		free( online );
+		return 0;
+	}
+	devs = NEW( SyncDeviceRec, finder.n_dirs );
+	threads = NEW( LCUI_Thread, finder.n_dirs );
 	s->tasks = NEW( SyncTask, finder.n_dirs );
+	s->n_tasks = finder.n_dirs;
+	sync_status = s;
+	n_devs = LCFinder_CreateSyncTasks( s, scope, online, n_online, devs );
+	LCUIMutex_Unlock( &sync_status_mutex );
+	free( online );
+	/* 变更的文件在扫描时就交给写入线程保存，不用等到全部扫描完 */
+	packs = NEW( DirStatusDataPackRec, finder.n_dirs );
 	for( i = 0; i < finder.n_dirs; ++i ) {
-		dir = finder.dirs[i];
-		if( !dir ) {
+		if( !s->tasks[i] ) {
 			continue;
 		}
-		len = strlen( dir->path ) + 1;
-		path = malloc( sizeof( wchar_t )*len );
-		len = LCUI_DecodeString( path, dir->path, len, ENCODING_UTF8 );
-		path[len] = 0;
-		s->task = SyncTask_NewW( finder.fileset_dir, path );
-		SyncTask_Start( s->task );
-		s->added_files += s->task->added_files;
-		s->scaned_files += s->task->total_files;
-		s->deleted_files += s->task->deleted_files;
-		s->tasks[i] = s->task;
-		free( path );
+		packs[i].dir = finder.dirs[i];
+		packs[i].status = s;
+		SyncTask_SetHandlers( s->tasks[i], QueueAddedFile,
+				      QueueDeletedFile, QueueModifiedFile,
+				      &packs[i] );
 	}
-	DB_Begin();
+	SyncQueue_Open( s );
+	/* 不同设备上的源文件夹同时扫描，同一设备上的最多同时扫描
+	 * sync_per_device 个，每个线程扫描完一个再接着扫描下一个 */
+	for( i = 0; i < n_devs; ++i ) {
+		for( j = 0; j < devs[i].n_tasks; ++j ) {
+			if( j >= finder.sync_per_device ) {
+				break;
+			}
+			LCUIThread_Create( &threads[n_threads++],
+					   SyncDevice_Thread, &devs[i] );
+		}
+	}
+	for( i = 0; i < n_threads; ++i ) {
+		LCUIThread_Join( threads[i], NULL );
+	}
+	SyncQueue_Close();
+	free( packs );
+	for( i = 0; i < n_devs; ++i ) {
+		free( devs[i].tasks );
+	}
+	free( threads );
+	free( devs );
+	/**
+	 * 同步被终止，已扫描的进度都保存在检查点中，不提交文件列表缓存。已写入
+	 * 数据库的变更会在下次同步时再次出现，重复添加的文件会被忽略掉。
+	 */
+	if( s->state != STATE_STARTED ) {
+		LCUIMutex_Lock( &sync_status_mutex );
+		for( i = 0; i < s->n_tasks; ++i ) {
+			if( s->tasks[i] ) {
+				SyncTask_Delete( &s->tasks[i] );
+			}
+		}
+		free( s->tasks );
+		s->tasks = NULL;
+		s->n_tasks = 0;
+		sync_status = NULL;
+		LCUIMutex_Unlock( &sync_status_mutex );
+		LCUIMutex_Unlock( &sync_mutex );
+		return s->synced_files;
+	}
+	/* 变更都已写入数据库，剩下的只是替换文件列表缓存 */
 	s->state = STATE_SAVING;
-	wprintf(L"\n\nstart sync\n");
 	for( i = 0; i < finder.n_dirs; ++i ) {
-		DirStatusDataPackRec pack;
-		pack.dir = finder.dirs[i];
-		if( !pack.dir ) {
+		if( !s->tasks[i] ) {
 			continue;
 		}
-		pack.status = s;
 		s->task = s->tasks[i];
-		SyncTask_InAddedFiles( s->task, SyncAddedFile, &pack );
-		SyncTask_InDeletedFiles( s->task, SyncDeletedFile, &pack );
 		SyncTask_Commit( s->task );
+		LCUIMutex_Lock( &sync_status_mutex );
 		SyncTask_Delete( &s->task );
+		s->tasks[i] = NULL;
+		LCUIMutex_Unlock( &sync_status_mutex );
 	}
-	DB_Commit();
-	wprintf(L"\n\nend sync\n");
 	s->state = STATE_FINISHED;
+	LCUIMutex_Lock( &sync_status_mutex );
 	s->task = NULL;
 	free( s->tasks );
 	s->tasks = NULL;
+	s->n_tasks = 0;
+	sync_status = NULL;
+	LCUIMutex_Unlock( &sync_status_mutex );
+	LCUIMutex_Unlock( &sync_mutex );
+	/* 只同步了部分源文件夹时，不推迟下一次定期同步 */
+	if( SyncScope_IsFull( scope ) ) {
+		LCUIMutex_Lock( &sync_scheduler.mutex );
+		sync_scheduler.sync_time = LCUI_GetTickCount();
+		LCUIMutex_Unlock( &sync_scheduler.mutex );
+	}
 	return s->synced_files;
 }
 
@@ -352,6 +1438,28 @@ static void LCFInder_InitFileDB( void )
 	finder.n_tags = DB_GetTags( &finder.tags );
 }
 
+static void OnFlushFileDB( void *arg )
+{
+	DB_Flush();
+}
+
+/** 开始定期写入评分和标签的变更，需要在 LCUI 初始化之后调用 */
+static void LCFinder_InitFileDBFlush( void )
+{
+	db_flush_timer = LCUITimer_Set( DB_FLUSH_INTERVAL, 
+					OnFlushFileDB, NULL, TRUE );
+}
+
+/** 停止定期写入，并写入剩余的变更 */
+static void LCFinder_ExitFileDBFlush( void )
+{
+	if( db_flush_timer ) {
+		LCUITimer_Free( db_flush_timer );
+		db_flush_timer = 0;
+	}
+	DB_Flush();
+}
+
 static void ThumbDBDict_ValDel( void *privdata, void *val )
 {
 	ThumbDB_Close( val );
@@ -431,14 +1539,350 @@ void LCFinder_ClearThumbDB( void )
 	LCFinder_TriggerEvent( EVENT_THUMBDB_DEL_DONE, NULL );
 }
 
+/** 初始化文件监视器 */
+static void LCFinder_InitWatcher( void )
+{
+	int i;
+	char *str;
+	LCUIMutex_Init( &sync_mutex );
+	LCUIMutex_Init( &sync_status_mutex );
+	LCUIMutex_Init( &sync_queue.mutex );
+	LCUICond_Init( &sync_queue.not_empty );
+	LCUICond_Init( &sync_queue.not_full );
+	finder.dir_reader = DirReader_GetTypeByName( getenv( DIR_READER_ENV ) );
+	finder.sync_per_device = SYNC_PER_DEVICE;
+	str = getenv( SYNC_PER_DEVICE_ENV );
+	if( str && atoi( str ) > 0 ) {
+		finder.sync_per_device = atoi( str );
+	}
+	LCFinder_InitRemoteScan();
+	finder.watcher = FileWatcher_New( WATCHER_DELAY, OnFilesChanged, NULL );
+	for( i = 0; i < finder.n_dirs; ++i ) {
+		LCFinder_WatchDir( finder.dirs[i], TRUE );
+	}
+}
+
+/** 判断文件所在的源文件夹是否在线，离线的源文件夹中的文件留到下一轮再读取 */
+static LCUI_BOOL LCFinder_IsFileReadable( void *data, const char *path )
+{
+	DB_Dir dir = LCFinder_GetSourceDir( path );
+	return dir && LCFinder_IsSourceOnline( dir );
+}
+
+/** 在文件同步完成后检查是否有新的文件需要计算哈希值 */
+static void OnSyncDone( void *privdata, void *data )
+{
+	FileHashService_Notify( finder.hash_service );
+}
+
+/** 初始化文件哈希服务 */
+static void LCFinder_InitFileHasher( void )
+{
+	finder.hash_service = FileHashService_New( FILE_HASHER_WORKERS,
+						   LCFinder_IsFileReadable,
+						   NULL );
+	LCFinder_BindEvent( EVENT_SYNC_DONE, OnSyncDone, NULL );
+}
+
+/** 停止文件哈希服务，正在计算的文件会计算完 */
+static void LCFinder_ExitFileHasher( void )
+{
+	FileHashService_Delete( &finder.hash_service );
+}
+
+/** 有缩略图等待载入时，后台校验暂停读取 */
+static LCUI_BOOL LCFinder_HasPendingThumbs( void *data )
+{
+	int pending_thumbs;
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	pending_thumbs = sync_scheduler.pending_thumbs;
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+	return pending_thumbs > 0;
+}
+
+/**
+ * 初始化文件校验服务
+ * 速度上限为 0 时不校验，但仍需创建服务，同步时会用它来调度设备读取
+ */
+static void LCFinder_InitScrubService( void )
+{
+	char *str;
+	int64_t rate = SCRUB_RATE, interval = SCRUB_INTERVAL;
+	str = getenv( SCRUB_RATE_ENV );
+	if( str && atoi( str ) >= 0 ) {
+		rate = atoi( str );
+	}
+	str = getenv( SCRUB_INTERVAL_ENV );
+	if( str && atoi( str ) >= 0 ) {
+		interval = atoi( str );
+	}
+	finder.scrub_service = ScrubService_New( rate * 1024 * 1024,
+						 interval * 24 * 60 * 60,
+						 LCFinder_IsFileReadable,
+						 LCFinder_HasPendingThumbs,
+						 NULL );
+}
+
+/** 停止文件校验服务，正在校验的文件会中止，进度停留在上一批 */
+static void LCFinder_ExitScrubService( void )
+{
+	ScrubService_Delete( &finder.scrub_service );
+}
+
+void LCFinder_AddPendingThumbs( int n )
+{
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	sync_scheduler.pending_thumbs += n;
+	if( sync_scheduler.pending_thumbs < 0 ) {
+		sync_scheduler.pending_thumbs = 0;
+	}
+	sync_scheduler.active_time = LCUI_GetTickCount();
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+}
+
+/**
+ * 获取用户已空闲的时间（毫秒）
+ * 在 Windows 中取整个系统最后一次输入的时间，其它平台只能取本程序最后一次
+ * 收到输入的时间
+ */
+static int64_t SyncScheduler_GetIdleTime( void )
+{
+#ifdef _WIN32
+	LASTINPUTINFO info;
+	info.cbSize = sizeof( info );
+	if( GetLastInputInfo( &info ) ) {
+		return (int64_t)(GetTickCount() - info.dwTime);
+	}
+#endif
+	return LCUI_GetTimeDelta( sync_scheduler.active_time );
+}
+
+/** 判断是否需要发起后台同步 */
+static LCUI_BOOL SyncScheduler_IsDue( void )
+{
+	int64_t elapsed;
+	LCUI_BOOL is_syncing;
+	LCUIMutex_Lock( &sync_status_mutex );
+	is_syncing = sync_status != NULL;
+	LCUIMutex_Unlock( &sync_status_mutex );
+	if( is_syncing ) {
+		return FALSE;
+	}
+	elapsed = LCUI_GetTimeDelta( sync_scheduler.sync_time );
+	if( sync_scheduler.interval > 0 && 
+	    elapsed >= sync_scheduler.interval ) {
+		return TRUE;
+	}
+	return elapsed >= SYNC_IDLE_INTERVAL &&
+		SyncScheduler_GetIdleTime() >= SYNC_IDLE_TIME;
+}
+
+static void SyncScheduler_Thread( void *arg )
+{
+	SyncScopeRec scope = { SYNC_BACKGROUND, NULL, 0, NULL };
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	while( sync_scheduler.is_running ) {
+		LCUICond_TimedWait( &sync_scheduler.cond, &sync_scheduler.mutex,
+				    SYNC_CHECK_INTERVAL );
+		if( !sync_scheduler.is_running || !SyncScheduler_IsDue() ) {
+			continue;
+		}
+		/* 同步正式开始前不再重复发起 */
+		sync_scheduler.sync_time = LCUI_GetTickCount();
+		LCUIMutex_Unlock( &sync_scheduler.mutex );
+		LCFinder_TriggerEvent( EVENT_SYNC, &scope );
+		LCUIMutex_Lock( &sync_scheduler.mutex );
+	}
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+	LCUIThread_Exit( NULL );
+}
+
+/** 记录用户的操作时间，用于判断用户是否空闲 */
+static void OnUserInput( LCUI_SysEvent e, void *arg )
+{
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	sync_scheduler.active_time = LCUI_GetTickCount();
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+}
+
+/**
+ * 初始化同步调度器
+ * 上次同步的时间记为 0，启动后的第一次检查就会在后台同步一次，以便发现程序
+ * 关闭期间的变更
+ */
+static void LCFinder_InitSyncScheduler( void )
+{
+	char *str;
+	LCUIMutex_Init( &sync_scheduler.mutex );
+	LCUICond_Init( &sync_scheduler.cond );
+	sync_scheduler.interval = SYNC_INTERVAL * 60 * 1000;
+	str = getenv( SYNC_INTERVAL_ENV );
+	if( str && atoi( str ) >= 0 ) {
+		sync_scheduler.interval = atoi( str ) * 60 * 1000;
+	}
+	sync_scheduler.sync_time = 0;
+	sync_scheduler.active_time = LCUI_GetTickCount();
+	sync_scheduler.pending_thumbs = 0;
+	sync_scheduler.rate = SYNC_MAX_RATE;
+	sync_scheduler.rate_time = 0;
+	sync_scheduler.next_time = 0;
+	sync_scheduler.is_running = TRUE;
+	LCUI_BindEvent( LCUI_KEYDOWN, OnUserInput, NULL, NULL );
+	LCUI_BindEvent( LCUI_MOUSEDOWN, OnUserInput, NULL, NULL );
+	LCUI_BindEvent( LCUI_MOUSEMOVE, OnUserInput, NULL, NULL );
+	LCUI_BindEvent( LCUI_MOUSEWHEEL, OnUserInput, NULL, NULL );
+	LCUIThread_Create( &sync_scheduler.thread, SyncScheduler_Thread, NULL );
+}
+
+/** 停止同步调度器，已发起的同步不受影响 */
+static void LCFinder_ExitSyncScheduler( void )
+{
+	LCUIMutex_Lock( &sync_scheduler.mutex );
+	sync_scheduler.is_running = FALSE;
+	LCUICond_Signal( &sync_scheduler.cond );
+	LCUIMutex_Unlock( &sync_scheduler.mutex );
+	LCUIThread_Join( sync_scheduler.thread, NULL );
+}
+
+/** 禁止再开始新的同步，并终止正在扫描的文件同步 */
+static void LCFinder_StopSyncFiles( void )
+{
+	int i;
+	FileSyncStatus s;
+	LCUIMutex_Lock( &sync_status_mutex );
+	sync_closed = TRUE;
+	s = sync_status;
+	if( s && s->state == STATE_STARTED ) {
+		s->state = STATE_NONE;
+		for( i = 0; i < s->n_tasks; ++i ) {
+			if( s->tasks[i] ) {
+				LCFinder_StopSync( s->tasks[i] );
+			}
+		}
+	}
+	LCUIMutex_Unlock( &sync_status_mutex );
+}
+
 static void LCFinder_Exit( LCUI_SysEvent e, void *arg )
 {
+	/**
+	 * 先禁止新的同步并终止正在进行的扫描，否则文件监视器可能要等到手动同步
+	 * 结束才能退出。之后停止所有会发起同步的线程，丢弃还在排队的同步，并等
+	 * 待正在进行的同步保存检查点，然后才能释放同步用到的资源。
+	 */
+	LCFinder_StopSyncFiles();
+	FileWatcher_Delete( &finder.watcher );
+	LCFinder_ExitSyncScheduler();
+	UI_ExitFileSyncTip();
+	LCUIMutex_Lock( &sync_mutex );
+	LCUIMutex_Unlock( &sync_mutex );
+	LCFinder_ExitFileDBFlush();
+	LCFinder_ExitScrubService();
+	LCFinder_ExitFileHasher();
+	SourceMonitor_Delete( &finder.sources );
+	RemoteMount_Exit();
 	UI_Exit();
 	LCFinder_ExitThumbDB();
 }
 
+/**
+ * 获取 UTF-8 编码的命令行参数
+ * Windows 下 main() 得到的参数是 ANSI 编码的，无法表示所有路径，因此需要
+ * 重新从宽字符的命令行中解析
+ */
+static char **LCFinder_GetArgs( int *argc, char **argv )
+{
+	int i, len;
+	char **args;
+#ifdef _WIN32
+	wchar_t **wargv;
+	wargv = CommandLineToArgvW( GetCommandLineW(), argc );
+	if( !wargv ) {
+		return NULL;
+	}
+#endif
+	args = NEW( char*, *argc + 1 );
+	for( i = 0; i < *argc; ++i ) {
+#ifdef _WIN32
+		len = wcslen( wargv[i] ) * 3 + 1;
+		args[i] = malloc( len );
+		len = EncodeUTF8( args[i], wargv[i], len );
+		args[i][len] = 0;
+#else
+		len = strlen( argv[i] ) + 1;
+		args[i] = malloc( len );
+		strcpy( args[i], argv[i] );
+#endif
+	}
+	args[*argc] = NULL;
+#ifdef _WIN32
+	LocalFree( wargv );
+#endif
+	return args;
+}
+
+/**
+ * 作为分片索引的工作进程运行
+ * 参数格式：--index-shard <分片序号> <分片数量> <源文件夹> [排除规则]
+ */
+static int LCFinder_RunShardWorker( int argc, char **args )
+{
+	int n;
+	if( argc < 5 ) {
+		return -1;
+	}
+	LCFinder_InitWorkDir();
+	n = ShardIndex_RunWorker( finder.data_dir, args[4], 
+				  argc > 5 ? args[5] : NULL, 
+				  atoi( args[2] ), atoi( args[3] ) );
+	return n < 0 ? 1 : 0;
+}
+
+/**
+ * 用多个工作进程为源文件夹建立索引，然后合并到文件数据库中
+ * 参数格式：--index <源文件夹> [分片数量]，适用于文件数量非常多的源文件夹
+ */
+static int LCFinder_RunShardIndex( int argc, char **args )
+{
+	int n, count = SHARD_INDEX_DEFAULT;
+	DB_Dir dir;
+	if( argc < 3 ) {
+		return -1;
+	}
+	if( argc > 3 ) {
+		count = atoi( args[3] );
+	}
+#ifdef _WIN32
+	InitConsoleWindow();
+#endif
+	LCFinder_InitWorkDir();
+	LCFInder_InitFileDB();
+	LCFinder_InitThumbDB();
+	dir = LCFinder_GetDir( args[2] );
+	if( !dir ) {
+		dir = LCFinder_AddDir( args[2] );
+	}
+	if( !dir ) {
+		printf( "[shard] cannot add source dir: %s\n", args[2] );
+		return 1;
+	}
+	n = ShardIndex_Run( args[0], finder.data_dir, dir, count );
+	LCFinder_ExitThumbDB();
+	return n < 0 ? 1 : 0;
+}
+
 int main( int argc, char **argv )
 {
+	char **args = LCFinder_GetArgs( &argc, argv );
+	/* 带有索引参数时不启动界面，只建立索引 */
+	if( args && argc > 1 ) {
+		if( strcmp( args[1], SHARD_INDEX_WORKER_ARG ) == 0 ) {
+			return LCFinder_RunShardWorker( argc, args );
+		}
+		if( strcmp( args[1], SHARD_INDEX_ARG ) == 0 ) {
+			return LCFinder_RunShardIndex( argc, args );
+		}
+	}
 //#define DEBUG
 #if defined (LCUI_BUILD_IN_WIN32) && defined (DEBUG)
 	InitConsoleWindow();
@@ -447,7 +1891,13 @@ int main( int argc, char **argv )
 	LCFInder_InitFileDB();
 	LCFinder_InitThumbDB();
 	finder.trigger = EventTrigger();
+	LCFinder_InitSourceMonitor();
+	LCFinder_InitWatcher();
+	LCFinder_InitFileHasher();
+	LCFinder_InitScrubService();
 	UI_Init();
+	LCFinder_InitFileDBFlush();
+	LCFinder_InitSyncScheduler();
 	LCUI_BindEvent( LCUI_QUIT, LCFinder_Exit, NULL, NULL );
 	return UI_Run();
 }
@@ -33,17 +33,32 @@
 * 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
 * 没有，请查看：<http://www.gnu.org/licenses/>.
 * ****************************************************************************/
+/* syscall() 需要 _GNU_SOURCE */
+#define _GNU_SOURCE
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <direct.h>
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
 #endif
 #include <wchar.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
 #include "sha1.h"
 #include "common.h"
 
@@ -139,9 +154,10 @@ Dict *StrDict_Create( void *(*val_dup)(void*, const void*),
 
 void StrDict_Release( Dict *d )
 {
-	free( d->privdata );
-	d->privdata = NULL;
+	/* 释放字典时还要用到类型里的析构函数，所以要最后再释放类型 */
+	void *dtype = d->privdata;
 	Dict_Release( d );
+	free( dtype );
 }
 
 const char *getdirname( const char *path )
@@ -180,6 +196,78 @@ int wgetfilectime( const wchar_t *path )
 	return ctime;
 }
 
+int64_t wgetfilemtime( const wchar_t *path )
+{
+#ifdef _WIN32
+	struct _stat64 buf;
+	if( _wstat64( path, &buf ) == 0 ) {
+		return buf.st_mtime;
+	}
+#else
+	struct stat buf;
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	if( stat( apath, &buf ) == 0 ) {
+		return buf.st_mtime;
+	}
+#endif
+	return 0;
+}
+
+void *wmapfile( const wchar_t *path, size_t *size )
+{
+	void *data = NULL;
+#ifdef _WIN32
+	HANDLE file, mapping;
+	LARGE_INTEGER file_size;
+	file = CreateFileW( path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( file == INVALID_HANDLE_VALUE ) {
+		return NULL;
+	}
+	if( !GetFileSizeEx( file, &file_size ) || file_size.QuadPart == 0 ||
+	    (uint64_t)file_size.QuadPart > (size_t)-1 ) {
+		CloseHandle( file );
+		return NULL;
+	}
+	mapping = CreateFileMappingW( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( mapping ) {
+		data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+		/* 映射视图会保持对文件的引用，句柄可以先关闭 */
+		CloseHandle( mapping );
+	}
+	CloseHandle( file );
+	*size = (size_t)file_size.QuadPart;
+#else
+	int fd;
+	struct stat buf;
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	fd = open( apath, O_RDONLY );
+	if( fd < 0 ) {
+		return NULL;
+	}
+	if( fstat( fd, &buf ) == 0 && buf.st_size > 0 ) {
+		data = mmap( NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+		if( data == MAP_FAILED ) {
+			data = NULL;
+		}
+		*size = buf.st_size;
+	}
+	close( fd );
+#endif
+	return data;
+}
+
+void wunmapfile( void *data, size_t size )
+{
+#ifdef _WIN32
+	UnmapViewOfFile( data );
+#else
+	munmap( data, size );
+#endif
+}
+
 int64_t wgetfilesize( const wchar_t *path )
 {
 	int fd;
@@ -195,6 +283,127 @@ int64_t wgetfilesize( const wchar_t *path )
 	return size;
 }
 
+int wgetfilestat( const wchar_t *path, FileStat st )
+{
+#ifdef _WIN32
+	struct _stat64 buf;
+	if( _wstat64( path, &buf ) != 0 ) {
+		return -1;
+	}
+	st->inode = 0;
+#else
+	struct stat buf;
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	if( stat( apath, &buf ) != 0 ) {
+		return -1;
+	}
+	st->inode = buf.st_ino;
+#endif
+	st->size = buf.st_size;
+	st->mtime = buf.st_mtime;
+	st->ctime = buf.st_ctime;
+	return 0;
+}
+
+int wgetfiledev( const wchar_t *path, uint64_t *dev )
+{
+#ifdef _WIN32
+	struct _stat64 buf;
+	if( _wstat64( path, &buf ) != 0 ) {
+		return -1;
+	}
+#else
+	struct stat buf;
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	if( stat( apath, &buf ) != 0 ) {
+		return -1;
+	}
+#endif
+	*dev = buf.st_dev;
+	return 0;
+}
+
+#ifdef LCUI_BUILD_IN_LINUX
+/** 网络文件系统的类型编号，取自 linux/magic.h 和各文件系统的源码 */
+static const unsigned long remote_fs_types[] = {
+	0x6969,		/* NFS */
+	0x517B,		/* SMB */
+	0xFF534D42,	/* CIFS */
+	0xFE534D42,	/* SMB2 */
+	0x01021997,	/* 9P */
+	0x00C36400,	/* Ceph */
+	0x5346414F,	/* AFS */
+	0x65735546	/* FUSE，例如 sshfs */
+};
+#endif
+
+LCUI_BOOL wisremotepath( const wchar_t *path )
+{
+#ifdef _WIN32
+	wchar_t root[4];
+	/* UNC 路径，例如：\\server\share\ */
+	if( path[0] == L'\\' && path[1] == L'\\' ) {
+		return TRUE;
+	}
+	if( !path[0] || path[1] != L':' ) {
+		return FALSE;
+	}
+	root[0] = path[0];
+	root[1] = L':';
+	root[2] = L'\\';
+	root[3] = 0;
+	return GetDriveTypeW( root ) == DRIVE_REMOTE;
+#else
+	size_t i;
+	struct statfs buf;
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	if( statfs( apath, &buf ) != 0 ) {
+		return FALSE;
+	}
+	for( i = 0; i < sizeof( remote_fs_types ) / 
+	     sizeof( remote_fs_types[0] ); ++i ) {
+		if( (unsigned long)(uint32_t)buf.f_type == 
+		    remote_fs_types[i] ) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+#endif
+}
+
+#ifdef LCUI_BUILD_IN_LINUX
+/* glibc 没有提供 ioprio_set() 的定义，这些常量取自 linux/ioprio.h */
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#endif
+
+int setthreadbackground( void )
+{
+#ifdef _WIN32
+	/* 后台模式会同时降低线程的 CPU、I/O 和内存优先级 */
+	if( !SetThreadPriority( GetCurrentThread(), 
+				THREAD_MODE_BACKGROUND_BEGIN ) ) {
+		return -1;
+	}
+	return 0;
+#elif defined(LCUI_BUILD_IN_LINUX)
+	/* 在 Linux 中 nice 值和 I/O 优先级都是线程级别的 */
+	pid_t tid = (pid_t)syscall( SYS_gettid );
+	int ret = setpriority( PRIO_PROCESS, tid, 19 );
+	if( syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+		     IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT ) != 0 ) {
+		ret = -1;
+	}
+	return ret;
+#else
+	return -1;
+#endif
+}
+
 int pathjoin( char *path, const char *path1, const char *path2 )
 {
 	int len = strlen( path1 );
@@ -205,7 +414,7 @@ int pathjoin( char *path, const char *path1, const char *path2 )
 	}
 	strcpy( path + len, path2 );
 	len = strlen( path );
-	if( path1[len-1] == PATH_SEP ) {
+	if( path[len-1] == PATH_SEP ) {
 		--len;
 		path[len] = 0;
 	}
@@ -222,13 +431,29 @@ int wpathjoin( wchar_t *path, const wchar_t *path1, const wchar_t *path2 )
 	}
 	wcscpy( path + len, path2 );
 	len = wcslen( path );
-	if( path1[len-1] == PATH_SEP ) {
+	if( path[len-1] == PATH_SEP ) {
 		--len;
 		path[len] = 0;
 	}
 	return len;
 }
 
+int wmkdir( const wchar_t *path )
+{
+#ifdef _WIN32
+	if( _wmkdir( path ) == 0 || errno == EEXIST ) {
+		return 0;
+	}
+#else
+	char apath[PATH_LEN];
+	LCUI_EncodeString( apath, path, PATH_LEN, ENCODING_UTF8 );
+	if( mkdir( apath, 0755 ) == 0 || errno == EEXIST ) {
+		return 0;
+	}
+#endif
+	return -1;
+}
+
 void wgetcurdir( wchar_t *path, int max_len )
 {
 #ifdef _WIN32
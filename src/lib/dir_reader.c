@@ -0,0 +1,640 @@
+﻿/* ***************************************************************************
+* dir_reader.c -- batched directory reader.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* dir_reader.c -- 批量目录读取器。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* statx() 需要 _GNU_SOURCE */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "dir_reader.h"
+
+#ifdef LCUI_BUILD_IN_LINUX
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/** getdents64 的缓冲区大小，越大需要的系统调用次数越少 */
+#define DENTS_BUF_SIZE	(256 * 1024)
+/** io_uring 的队列长度，也是每批提交的 statx 请求数量 */
+#define RING_ENTRIES	256
+#define STATX_FLAGS	AT_SYMLINK_NOFOLLOW
+#define STATX_FIELDS	(STATX_TYPE | STATX_SIZE | STATX_MTIME | \
+			 STATX_CTIME | STATX_INO)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/** io_uring 实例，只用于批量提交 statx 请求 */
+typedef struct IORingRec_ {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+} IORingRec, *IORing;
+#endif
+
+/** 读取中的目录项，名称以偏移量记录，因为名称缓冲区可能会重新分配 */
+typedef struct EntryRec_ {
+	size_t name;			/**< 名称在 names 中的位置 */
+	size_t raw_name;		/**< 原始名称在 raw_names 中的位置 */
+	DirReaderEntryRec entry;
+} EntryRec, *Entry;
+
+typedef struct DirReaderRec_ {
+	DirReaderType type;		/**< 读取方式 */
+	EntryRec *entries;		/**< 目录项列表 */
+	int n_entries;			/**< 目录项数量 */
+	int max_entries;		/**< 目录项列表的容量 */
+	wchar_t *names;			/**< 名称缓冲区 */
+	size_t names_len, names_size;
+	char *raw_names;		/**< 原始的 UTF-8 名称缓冲区 */
+	size_t raw_len, raw_size;
+#ifdef LCUI_BUILD_IN_LINUX
+	char *buf;			/**< getdents64 的缓冲区 */
+	int *pending;			/**< 需要获取属性的目录项 */
+	struct statx *stats;		/**< statx 的结果 */
+	int max_pending;
+	IORing ring;			/**< 不使用 io_uring 时为 NULL */
+#endif
+} DirReaderRec;
+
+/** 在缓冲区末尾追加数据，返回数据在缓冲区中的位置，失败时返回 -1 */
+static long AppendBytes( void **buf, size_t *len, size_t *size,
+			 const void *data, size_t n )
+{
+	void *newbuf;
+	size_t newsize;
+	long pos = (long)*len;
+	if( *len + n > *size ) {
+		newsize = *size > 0 ? *size * 2 : 4096;
+		while( newsize < *len + n ) {
+			newsize *= 2;
+		}
+		newbuf = realloc( *buf, newsize );
+		if( !newbuf ) {
+			return -1;
+		}
+		*buf = newbuf;
+		*size = newsize;
+	}
+	memcpy( (char*)*buf + *len, data, n );
+	*len += n;
+	return pos;
+}
+
+/** 新增一个目录项，name 和 raw_name 可以只提供一个 */
+static Entry DirReader_AddEntry( DirReader r, const wchar_t *name,
+				 const char *raw_name, int type )
+{
+	long pos;
+	Entry e;
+	EntryRec *entries;
+	if( r->n_entries >= r->max_entries ) {
+		int n = r->max_entries > 0 ? r->max_entries * 2 : 256;
+		entries = realloc( r->entries, sizeof( EntryRec ) * n );
+		if( !entries ) {
+			return NULL;
+		}
+		r->entries = entries;
+		r->max_entries = n;
+	}
+	e = &r->entries[r->n_entries];
+	memset( e, 0, sizeof( EntryRec ) );
+	if( raw_name ) {
+		pos = AppendBytes( (void**)&r->raw_names, &r->raw_len, 
+				   &r->raw_size, raw_name, 
+				   strlen( raw_name ) + 1 );
+		if( pos < 0 ) {
+			return NULL;
+		}
+		e->raw_name = pos;
+	}
+	if( name ) {
+		pos = AppendBytes( (void**)&r->names, &r->names_len,
+				   &r->names_size, name,
+				   (wcslen( name ) + 1) * sizeof( wchar_t ) );
+		if( pos < 0 ) {
+			return NULL;
+		}
+		e->name = pos / sizeof( wchar_t );
+	}
+	e->entry.type = type;
+	r->n_entries += 1;
+	return e;
+}
+
+static void DirReader_Reset( DirReader r )
+{
+	r->n_entries = 0;
+	r->names_len = 0;
+	r->raw_len = 0;
+}
+
+/** 用 LCUI 的目录接口读取目录 */
+static int DirReader_ReadPortable( DirReader r, const wchar_t *dirpath,
+				   DirReaderFilter filter )
+{
+	int i, type;
+	Entry e;
+	LCUI_Dir dir;
+	LCUI_DirEntry *entry;
+	wchar_t *name, path[PATH_LEN];
+	size_t len = wcslen( dirpath );
+	if( len + 2 > PATH_LEN ) {
+		return -1;
+	}
+	wcscpy( path, dirpath );
+	if( len > 0 && path[len - 1] != PATH_SEP ) {
+		path[len++] = PATH_SEP;
+		path[len] = 0;
+	}
+	if( LCUI_OpenDir( path, &dir ) != 0 ) {
+		return -1;
+	}
+	while( (entry = LCUI_ReadDir( &dir )) ) {
+		name = LCUI_GetFileName( entry );
+		if( name[0] == '.' ) {
+			if( name[1] == 0 || (name[1] == '.' && name[2] == 0) ) {
+				continue;
+			}
+		}
+		if( LCUI_FileIsDirectory( entry ) ) {
+			type = DIR_ENTRY_DIR;
+		} else if( LCUI_FileIsArchive( entry ) ) {
+			type = DIR_ENTRY_FILE;
+		} else {
+			type = DIR_ENTRY_OTHER;
+		}
+		if( !DirReader_AddEntry( r, name, NULL, type ) ) {
+			break;
+		}
+	}
+	LCUI_CloseDir( &dir );
+	for( i = 0; i < r->n_entries; ++i ) {
+		e = &r->entries[i];
+		if( e->entry.type != DIR_ENTRY_FILE || !filter ||
+		    !filter( r->names + e->name ) ) {
+			continue;
+		}
+		if( len + wcslen( r->names + e->name ) + 1 > PATH_LEN ) {
+			continue;
+		}
+		wcscpy( path + len, r->names + e->name );
+		if( wgetfilestat( path, &e->entry.stat ) == 0 ) {
+			e->entry.has_stat = TRUE;
+		}
+	}
+	return r->n_entries;
+}
+
+#ifdef LCUI_BUILD_IN_LINUX
+
+static void IORing_Delete( IORing ring )
+{
+	if( ring->sqes ) {
+		munmap( ring->sqes, ring->sqes_size );
+	}
+	if( ring->cq_ptr && ring->cq_ptr != ring->sq_ptr ) {
+		munmap( ring->cq_ptr, ring->cq_size );
+	}
+	if( ring->sq_ptr ) {
+		munmap( ring->sq_ptr, ring->sq_size );
+	}
+	if( ring->fd >= 0 ) {
+		close( ring->fd );
+	}
+	free( ring );
+}
+
+/** 新建 io_uring 实例，系统不支持时返回 NULL */
+static IORing IORing_New( unsigned entries )
+{
+	IORing ring;
+	struct io_uring_params p;
+	memset( &p, 0, sizeof( p ) );
+	ring = NEW( IORingRec, 1 );
+	memset( ring, 0, sizeof( IORingRec ) );
+	ring->fd = (int)syscall( __NR_io_uring_setup, entries, &p );
+	if( ring->fd < 0 ) {
+		free( ring );
+		return NULL;
+	}
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+	ring->cq_size = p.cq_off.cqes + 
+			p.cq_entries * sizeof( struct io_uring_cqe );
+	if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if( ring->cq_size > ring->sq_size ) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap( NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING );
+	if( ring->sq_ptr == MAP_FAILED ) {
+		ring->sq_ptr = NULL;
+		IORing_Delete( ring );
+		return NULL;
+	}
+	if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap( NULL, ring->cq_size, 
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING );
+		if( ring->cq_ptr == MAP_FAILED ) {
+			ring->cq_ptr = NULL;
+			IORing_Delete( ring );
+			return NULL;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+	ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_SQES );
+	if( ring->sqes == MAP_FAILED ) {
+		ring->sqes = NULL;
+		IORing_Delete( ring );
+		return NULL;
+	}
+	ring->sq_head = (unsigned*)((char*)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + 
+					    p.cq_off.cqes);
+	return ring;
+}
+
+/** 将 statx 的结果转换为文件属性 */
+static void ConvertStatx( const struct statx *stx, FileStat st )
+{
+	st->size = (int64_t)stx->stx_size;
+	st->mtime = stx->stx_mtime.tv_sec;
+	st->ctime = stx->stx_ctime.tv_sec;
+	st->inode = stx->stx_ino;
+}
+
+/**
+ * 通过 io_uring 批量获取 pending 中的目录项的属性
+ * 每批最多提交 RING_ENTRIES 个请求，提交后等待这一批全部完成，返回 -1 时
+ * 表示 io_uring 不可用，未完成的部分需要改用 statx 获取
+ */
+static int DirReader_StatRing( DirReader r, int dirfd, int n_pending, 
+			       int *n_done )
+{
+	Entry e;
+	int i, k, n, ret;
+	unsigned tail, head, index;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	IORing ring = r->ring;
+	for( i = *n_done; i < n_pending; i += n ) {
+		n = n_pending - i;
+		if( n > RING_ENTRIES ) {
+			n = RING_ENTRIES;
+		}
+		tail = *ring->sq_tail;
+		for( index = 0; index < (unsigned)n; ++index, ++tail ) {
+			e = &r->entries[r->pending[i + index]];
+			sqe = &ring->sqes[tail & *ring->sq_mask];
+			memset( sqe, 0, sizeof( *sqe ) );
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (uint64_t)(uintptr_t)
+				    (r->raw_names + e->raw_name);
+			sqe->len = STATX_FIELDS;
+			sqe->off = (uint64_t)(uintptr_t)&r->stats[i + index];
+			sqe->statx_flags = STATX_FLAGS;
+			sqe->user_data = i + index;
+			ring->sq_array[tail & *ring->sq_mask] = 
+				tail & *ring->sq_mask;
+		}
+		__atomic_store_n( ring->sq_tail, tail, __ATOMIC_RELEASE );
+		ret = (int)syscall( __NR_io_uring_enter, ring->fd, n, n, 
+				    IORING_ENTER_GETEVENTS, NULL, 0 );
+		if( ret < 0 ) {
+			return -1;
+		}
+		/* 等待这一批请求全部完成 */
+		for( index = 0; index < (unsigned)n; ) {
+			head = *ring->cq_head;
+			tail = __atomic_load_n( ring->cq_tail, 
+						__ATOMIC_ACQUIRE );
+			if( head == tail ) {
+				ret = (int)syscall( __NR_io_uring_enter, 
+						    ring->fd, 0, 1,
+						    IORING_ENTER_GETEVENTS,
+						    NULL, 0 );
+				if( ret < 0 && errno != EINTR ) {
+					return -1;
+				}
+				continue;
+			}
+			for( ; head != tail; ++head, ++index ) {
+				cqe = &ring->cqes[head & *ring->cq_mask];
+				k = (int)cqe->user_data;
+				ret = cqe->res;
+				/* 内核不支持 IORING_OP_STATX 时用 statx 重试 */
+				if( ret == -EINVAL ) {
+					e = &r->entries[r->pending[k]];
+					ret = statx( dirfd, r->raw_names + 
+						     e->raw_name, STATX_FLAGS,
+						     STATX_FIELDS, 
+						     &r->stats[k] );
+				}
+				if( ret < 0 ) {
+					r->stats[k].stx_mask = 0;
+				}
+			}
+			__atomic_store_n( ring->cq_head, head, 
+					  __ATOMIC_RELEASE );
+		}
+		*n_done = i + n;
+	}
+	return 0;
+}
+
+/** 确保 pending 和 stats 至少能存下 n 项 */
+static int DirReader_ReservePending( DirReader r, int n )
+{
+	int *pending;
+	struct statx *stats;
+	if( n <= r->max_pending ) {
+		return 0;
+	}
+	pending = realloc( r->pending, sizeof( int ) * n );
+	if( !pending ) {
+		return -1;
+	}
+	r->pending = pending;
+	stats = realloc( r->stats, sizeof( struct statx ) * n );
+	if( !stats ) {
+		return -1;
+	}
+	r->stats = stats;
+	r->max_pending = n;
+	return 0;
+}
+
+/**
+ * 用 getdents64 读取目录
+ * 目录项类型直接取自 d_type，只有类型未知或需要获取属性的文件才调用
+ * statx，而且这些调用都集中在读完目录项之后，可以通过 io_uring 批量提交。
+ */
+static int DirReader_ReadDents( DirReader r, const wchar_t *dirpath,
+				DirReaderFilter filter )
+{
+	long n;
+	Entry e;
+	int fd, i, type, n_pending = 0, n_done = 0;
+	struct linux_dirent64 *d;
+	char path[PATH_LEN * 4];
+	LCUI_EncodeString( path, dirpath, sizeof( path ), ENCODING_UTF8 );
+	fd = open( path, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	if( fd < 0 ) {
+		return -1;
+	}
+	while( (n = syscall( SYS_getdents64, fd, r->buf, 
+			     DENTS_BUF_SIZE )) > 0 ) {
+		for( i = 0; i < n; i += d->d_reclen ) {
+			d = (struct linux_dirent64*)(r->buf + i);
+			if( d->d_name[0] == '.' && (d->d_name[1] == 0 || 
+			    (d->d_name[1] == '.' && d->d_name[2] == 0)) ) {
+				continue;
+			}
+			switch( d->d_type ) {
+			case DT_DIR: type = DIR_ENTRY_DIR; break;
+			case DT_REG: type = DIR_ENTRY_FILE; break;
+			case DT_UNKNOWN: type = -1; break;
+			default: type = DIR_ENTRY_OTHER; break;
+			}
+			e = DirReader_AddEntry( r, NULL, d->d_name, type );
+			if( !e ) {
+				break;
+			}
+			e->entry.stat.inode = d->d_ino;
+		}
+		if( i < n ) {
+			close( fd );
+			return -1;
+		}
+	}
+	/* 解码名称，并找出需要获取属性的目录项 */
+	for( i = 0; i < r->n_entries; ++i ) {
+		wchar_t name[PATH_LEN];
+		e = &r->entries[i];
+		LCUI_DecodeString( name, r->raw_names + e->raw_name,
+				   PATH_LEN, ENCODING_UTF8 );
+		n = AppendBytes( (void**)&r->names, &r->names_len,
+				 &r->names_size, name,
+				 (wcslen( name ) + 1) * sizeof( wchar_t ) );
+		if( n < 0 ) {
+			break;
+		}
+		e->name = n / sizeof( wchar_t );
+		if( e->entry.type == -1 || (e->entry.type == DIR_ENTRY_FILE &&
+		    filter && filter( name )) ) {
+			if( DirReader_ReservePending( r, n_pending + 1 ) != 0 ) {
+				break;
+			}
+			r->pending[n_pending++] = i;
+		}
+	}
+	if( i < r->n_entries ) {
+		close( fd );
+		return -1;
+	}
+	if( r->ring && DirReader_StatRing( r, fd, n_pending, 
+					   &n_done ) != 0 ) {
+		IORing_Delete( r->ring );
+		r->ring = NULL;
+		r->type = DIR_READER_GETDENTS;
+	}
+	for( i = n_done; i < n_pending; ++i ) {
+		e = &r->entries[r->pending[i]];
+		if( statx( fd, r->raw_names + e->raw_name, STATX_FLAGS,
+			   STATX_FIELDS, &r->stats[i] ) != 0 ) {
+			r->stats[i].stx_mask = 0;
+		}
+	}
+	for( i = 0; i < n_pending; ++i ) {
+		struct statx *stx = &r->stats[i];
+		e = &r->entries[r->pending[i]];
+		if( !(stx->stx_mask & STATX_TYPE) ) {
+			if( e->entry.type == -1 ) {
+				e->entry.type = DIR_ENTRY_OTHER;
+			}
+			continue;
+		}
+		if( e->entry.type == -1 ) {
+			if( S_ISDIR( stx->stx_mode ) ) {
+				e->entry.type = DIR_ENTRY_DIR;
+			} else if( S_ISREG( stx->stx_mode ) ) {
+				e->entry.type = DIR_ENTRY_FILE;
+			} else {
+				e->entry.type = DIR_ENTRY_OTHER;
+			}
+			if( e->entry.type != DIR_ENTRY_FILE || !filter ||
+			    !filter( r->names + e->name ) ) {
+				continue;
+			}
+		}
+		ConvertStatx( stx, &e->entry.stat );
+		e->entry.has_stat = TRUE;
+	}
+	close( fd );
+	return r->n_entries;
+}
+
+#endif
+
+DirReader DirReader_New( DirReaderType type )
+{
+	DirReader r = NEW( DirReaderRec, 1 );
+	memset( r, 0, sizeof( DirReaderRec ) );
+#ifdef LCUI_BUILD_IN_LINUX
+	if( type == DIR_READER_IO_URING ) {
+		r->ring = IORing_New( RING_ENTRIES );
+		if( !r->ring ) {
+			type = DIR_READER_GETDENTS;
+		}
+	}
+	if( type != DIR_READER_PORTABLE ) {
+		r->buf = malloc( DENTS_BUF_SIZE );
+		if( !r->buf ) {
+			type = DIR_READER_PORTABLE;
+		}
+	}
+#else
+	type = DIR_READER_PORTABLE;
+#endif
+	r->type = type;
+	return r;
+}
+
+void DirReader_Delete( DirReader *rptr )
+{
+	DirReader r = *rptr;
+#ifdef LCUI_BUILD_IN_LINUX
+	if( r->ring ) {
+		IORing_Delete( r->ring );
+	}
+	free( r->buf );
+	free( r->pending );
+	free( r->stats );
+#endif
+	free( r->entries );
+	free( r->names );
+	free( r->raw_names );
+	free( r );
+	*rptr = NULL;
+}
+
+DirReaderType DirReader_GetType( DirReader r )
+{
+	return r->type;
+}
+
+DirReaderType DirReader_GetTypeByName( const char *name )
+{
+	if( !name ) {
+		return DIR_READER_DEFAULT;
+	}
+	if( strcmp( name, "portable" ) == 0 ) {
+		return DIR_READER_PORTABLE;
+	} else if( strcmp( name, "getdents" ) == 0 ) {
+		return DIR_READER_GETDENTS;
+	} else if( strcmp( name, "io_uring" ) == 0 ) {
+		return DIR_READER_IO_URING;
+	}
+	return DIR_READER_DEFAULT;
+}
+
+int DirReader_Read( DirReader r, const wchar_t *dirpath, 
+		    DirReaderFilter filter )
+{
+	int i, n;
+	DirReader_Reset( r );
+#ifdef LCUI_BUILD_IN_LINUX
+	if( r->type != DIR_READER_PORTABLE ) {
+		n = DirReader_ReadDents( r, dirpath, filter );
+	} else {
+		n = DirReader_ReadPortable( r, dirpath, filter );
+	}
+#else
+	n = DirReader_ReadPortable( r, dirpath, filter );
+#endif
+	if( n < 0 ) {
+		DirReader_Reset( r );
+		return -1;
+	}
+	/* 名称缓冲区不再变化，可以将偏移量换成指针了 */
+	for( i = 0; i < r->n_entries; ++i ) {
+		r->entries[i].entry.name = r->names + r->entries[i].name;
+	}
+	return n;
+}
+
+DirReaderEntry DirReader_GetEntry( DirReader r, int i )
+{
+	if( i < 0 || i >= r->n_entries ) {
+		return NULL;
+	}
+	return &r->entries[i].entry;
+}
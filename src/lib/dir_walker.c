@@ -0,0 +1,307 @@
+﻿/* ***************************************************************************
+* dir_walker.c -- multi-threaded directory walker.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* dir_walker.c -- 多线程目录遍历器。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdio.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "dir_walker.h"
+
+#define DEQUE_INIT_SIZE	64
+#define IDLE_WAIT_TIME	50
+
+/** 目录队列，队列的拥有者从尾部存取，其它工作线程从头部窃取 */
+typedef struct DirDequeRec_ {
+	wchar_t **paths;	/**< 目录路径列表 */
+	int head;		/**< 头部位置 */
+	int tail;		/**< 尾部位置 */
+	int size;		/**< 列表的容量 */
+	LCUI_Mutex mutex;	/**< 互斥锁 */
+} DirDequeRec, *DirDeque;
+
+/** 工作线程 */
+typedef struct DirWorkerRec_ {
+	int id;			/**< 编号 */
+	LCUI_Thread thread;	/**< 线程 */
+	DirWalker walker;	/**< 所属的遍历器 */
+} DirWorkerRec, *DirWorker;
+
+typedef struct DirWalkerRec_ {
+	int n_workers;		/**< 工作线程数量 */
+	int pending;		/**< 已加入队列但还未处理完的目录数量 */
+	int count;		/**< 已处理的目录数量 */
+	LCUI_BOOL is_running;	/**< 是否正在运行 */
+	LCUI_BOOL background;	/**< 工作线程是否以后台优先级运行 */
+	DirDeque deques;	/**< 各个工作线程的目录队列 */
+	DirWorker workers;	/**< 工作线程列表 */
+	LCUI_Mutex mutex;	/**< 用于保护 pending 和 count 的互斥锁 */
+	LCUI_Cond cond;		/**< 用于唤醒空闲工作线程的条件变量 */
+	DirWalkerHandler handler;
+	void *data;
+} DirWalkerRec;
+
+static void DirDeque_Init( DirDeque q )
+{
+	q->head = 0;
+	q->tail = 0;
+	q->size = 0;
+	q->paths = NULL;
+	LCUIMutex_Init( &q->mutex );
+}
+
+static void DirDeque_Destroy( DirDeque q )
+{
+	LCUIMutex_Lock( &q->mutex );
+	for( ; q->head < q->tail; ++q->head ) {
+		free( q->paths[q->head] );
+	}
+	free( q->paths );
+	q->paths = NULL;
+	q->size = 0;
+	q->head = q->tail = 0;
+	LCUIMutex_Unlock( &q->mutex );
+	LCUIMutex_Destroy( &q->mutex );
+}
+
+static int DirDeque_PushTail( DirDeque q, wchar_t *path )
+{
+	int size;
+	wchar_t **paths;
+	LCUIMutex_Lock( &q->mutex );
+	if( q->tail >= q->size ) {
+		/* 如果头部有空位，则先把数据挪到前面 */
+		if( q->head > 0 ) {
+			q->tail -= q->head;
+			memmove( q->paths, q->paths + q->head,
+				 sizeof( wchar_t* ) * q->tail );
+			q->head = 0;
+		} else {
+			size = q->size > 0 ? q->size * 2 : DEQUE_INIT_SIZE;
+			paths = realloc( q->paths, sizeof( wchar_t* ) * size );
+			if( !paths ) {
+				LCUIMutex_Unlock( &q->mutex );
+				return -1;
+			}
+			q->paths = paths;
+			q->size = size;
+		}
+	}
+	q->paths[q->tail++] = path;
+	LCUIMutex_Unlock( &q->mutex );
+	return 0;
+}
+
+static wchar_t *DirDeque_PopTail( DirDeque q )
+{
+	wchar_t *path = NULL;
+	LCUIMutex_Lock( &q->mutex );
+	if( q->tail > q->head ) {
+		path = q->paths[--q->tail];
+		if( q->tail == q->head ) {
+			q->head = q->tail = 0;
+		}
+	}
+	LCUIMutex_Unlock( &q->mutex );
+	return path;
+}
+
+static wchar_t *DirDeque_PopHead( DirDeque q )
+{
+	wchar_t *path = NULL;
+	LCUIMutex_Lock( &q->mutex );
+	if( q->tail > q->head ) {
+		path = q->paths[q->head++];
+		if( q->tail == q->head ) {
+			q->head = q->tail = 0;
+		}
+	}
+	LCUIMutex_Unlock( &q->mutex );
+	return path;
+}
+
+DirWalker DirWalker_New( int n_workers, DirWalkerHandler handler, void *data )
+{
+	int i;
+	DirWalker w;
+	if( n_workers < 1 ) {
+		n_workers = 1;
+	}
+	w = NEW( DirWalkerRec, 1 );
+	w->deques = NEW( DirDequeRec, n_workers );
+	w->workers = NEW( DirWorkerRec, n_workers );
+	for( i = 0; i < n_workers; ++i ) {
+		DirDeque_Init( &w->deques[i] );
+		w->workers[i].id = i;
+		w->workers[i].walker = w;
+	}
+	w->count = 0;
+	w->pending = 0;
+	w->data = data;
+	w->handler = handler;
+	w->n_workers = n_workers;
+	w->is_running = FALSE;
+	w->background = FALSE;
+	LCUIMutex_Init( &w->mutex );
+	LCUICond_Init( &w->cond );
+	return w;
+}
+
+void DirWalker_Delete( DirWalker *wptr )
+{
+	int i;
+	DirWalker w = *wptr;
+	for( i = 0; i < w->n_workers; ++i ) {
+		DirDeque_Destroy( &w->deques[i] );
+	}
+	LCUICond_Destroy( &w->cond );
+	LCUIMutex_Destroy( &w->mutex );
+	free( w->deques );
+	free( w->workers );
+	free( w );
+	*wptr = NULL;
+}
+
+void DirWalker_Push( DirWalker w, int worker, const wchar_t *dirpath )
+{
+	wchar_t *path;
+	size_t len = wcslen( dirpath ) + 1;
+	path = malloc( sizeof( wchar_t ) * len );
+	if( !path ) {
+		return;
+	}
+	wcscpy( path, dirpath );
+	/* 先增加计数，以免其它线程在目录入队后误以为任务已经全部完成 */
+	LCUIMutex_Lock( &w->mutex );
+	w->pending += 1;
+	LCUIMutex_Unlock( &w->mutex );
+	if( DirDeque_PushTail( &w->deques[worker], path ) != 0 ) {
+		free( path );
+		LCUIMutex_Lock( &w->mutex );
+		w->pending -= 1;
+		LCUIMutex_Unlock( &w->mutex );
+		return;
+	}
+	LCUICond_Signal( &w->cond );
+}
+
+/** 从其它工作线程的队列中窃取一个目录 */
+static wchar_t *DirWalker_Steal( DirWalker w, int worker )
+{
+	int i, id;
+	wchar_t *path;
+	for( i = 1; i < w->n_workers; ++i ) {
+		id = (worker + i) % w->n_workers;
+		path = DirDeque_PopHead( &w->deques[id] );
+		if( path ) {
+			return path;
+		}
+	}
+	return NULL;
+}
+
+static void DirWalker_Work( DirWalker w, int worker )
+{
+	wchar_t *path;
+	while( 1 ) {
+		path = DirDeque_PopTail( &w->deques[worker] );
+		if( !path ) {
+			path = DirWalker_Steal( w, worker );
+		}
+		if( path ) {
+			if( w->is_running ) {
+				w->handler( w, worker, path, w->data );
+			}
+			free( path );
+			LCUIMutex_Lock( &w->mutex );
+			w->count += 1;
+			w->pending -= 1;
+			if( w->pending == 0 ) {
+				LCUICond_Broadcast( &w->cond );
+			}
+			LCUIMutex_Unlock( &w->mutex );
+			continue;
+		}
+		LCUIMutex_Lock( &w->mutex );
+		if( w->pending == 0 ) {
+			LCUIMutex_Unlock( &w->mutex );
+			break;
+		}
+		/* 其它线程仍在处理目录，等待它们产生新的目录 */
+		LCUICond_TimedWait( &w->cond, &w->mutex, IDLE_WAIT_TIME );
+		LCUIMutex_Unlock( &w->mutex );
+	}
+}
+
+static void DirWalker_Thread( void *arg )
+{
+	DirWorker worker = arg;
+	if( worker->walker->background ) {
+		setthreadbackground();
+	}
+	DirWalker_Work( worker->walker, worker->id );
+	LCUIThread_Exit( NULL );
+}
+
+int DirWalker_Run( DirWalker w, const wchar_t *dirpath )
+{
+	int i;
+	w->count = 0;
+	w->is_running = TRUE;
+	if( dirpath ) {
+		DirWalker_Push( w, 0, dirpath );
+	}
+	for( i = 1; i < w->n_workers; ++i ) {
+		LCUIThread_Create( &w->workers[i].thread,
+				   DirWalker_Thread, &w->workers[i] );
+	}
+	/* 当前线程作为 0 号工作线程 */
+	DirWalker_Work( w, 0 );
+	for( i = 1; i < w->n_workers; ++i ) {
+		LCUIThread_Join( w->workers[i].thread, NULL );
+	}
+	w->is_running = FALSE;
+	return w->count;
+}
+
+void DirWalker_SetBackground( DirWalker w, LCUI_BOOL background )
+{
+	w->background = background;
+}
+
+void DirWalker_Stop( DirWalker w )
+{
+	w->is_running = FALSE;
+}
@@ -34,23 +34,191 @@
 * 没有，请查看：<http://www.gnu.org/licenses/>.
 * ****************************************************************************/
 
+#include <time.h>
 #include <stdio.h>
 #include <LCUI_Build.h>
 #include <LCUI/LCUI.h>
 #include <LCUI/font/charset.h>
 #include "common.h"
+#include "path_filter.h"
 #include "file_cache.h"
+#include "dir_walker.h"
+#include "dir_reader.h"
+#include "path_trie.h"
+#include "remote_mount.h"
 
 #define MAX_PATH_LEN	2048
+#define MAX_NAME_BYTES	(MAX_PATH_LEN * 4)
+#define SCAN_WORKERS	4
 #define FILE_HEAD_TAG	"[LC-Finder Files Cache]"
+#define CACHE_MAGIC	"LCFCACHE"
+#define CACHE_VERSION	3
+/** 仍可读取的最早的格式版本，第 2 版的分区中没有文件属性 */
+#define CACHE_MIN_VERSION	2
+#define DIR_BLOCK_SIZE	16
+#define NAME_BLOCK_SIZE	16
+/** 分区中的文件名称后面带有文件属性 */
+#define DIR_FLAG_STATS	0x01
+/** 修改时间与扫描开始时间过于接近的目录，下次仍需重新读取 */
+#define DIR_MTIME_GUARD	2
+#define CHECKPOINT_MAGIC	"LCFCKPT"
+/** 保存检查点的时间间隔（秒） */
+#define CHECKPOINT_INTERVAL	10
 #define WCSLEN(STR)	(sizeof( STR ) / sizeof( wchar_t ))
 #define GetDirStats(T)	(DirStats)(((char*)(T)) + sizeof(SyncTaskRec))
 
+/**
+ * 缓存文件格式（第 3 版）
+ * 文件头		CacheHeaderRec
+ * 目录分区		每个目录一个分区，分区之间没有先后顺序
+ * 目录索引		按路径排序的目录列表，每 DIR_BLOCK_SIZE 个目录为一块，
+ *			块内的路径采用前缀压缩：共享前缀长度 + 后缀长度 + 后缀
+ *			+ 分区位置，每块的第一个路径不压缩
+ * 分块索引		每个块相对于目录索引起始处的偏移量
+ *
+ * 目录分区的格式如下，字符串都采用 UTF-8 编码，数值采用变长编码：
+ * 分区大小（不含本字段）
+ * 修改时间、目录项总数、摘要（4 字节）、子目录数量、文件数量、标志
+ * 子目录名称列表		与文件名称的格式相同，但不压缩
+ * 文件名称列表		按名称排序，采用与目录索引相同的分块前缀压缩，
+ *			标志中有 DIR_FLAG_STATS 时，每个名称后面还跟着文件的
+ *			大小、修改时间、创建时间和索引节点号
+ * 分块位置列表		每个文件名称块相对于文件名称列表起始处的偏移量，4 字节
+ */
+/**
+ * 检查点文件格式
+ * 扫描整个目录树时，会定期记录新缓存文件中已写完的目录分区，扫描中断后，
+ * 下次同步可以从新缓存文件中恢复这些分区，无需重新读取对应的目录。
+ * 文件头		CheckpointHeaderRec
+ * 目录列表		每项为：路径长度 + UTF-8 编码的路径 + 分区位置，数值都
+ *			采用变长编码
+ */
+typedef struct CheckpointHeaderRec_ {
+	char magic[8];			/**< 文件标识 */
+	uint32_t version;		/**< 缓存文件的格式版本 */
+	uint32_t n_dirs;		/**< 已写完的目录数量 */
+	uint64_t offset;		/**< 新缓存文件中有效数据的长度 */
+	uint32_t checksum;		/**< 有效数据的校验和 */
+	uint32_t list_checksum;		/**< 目录列表的校验和 */
+	uint32_t filter_digest;		/**< 扫描时使用的过滤规则的摘要 */
+} CheckpointHeaderRec, *CheckpointHeader;
+
+typedef struct CacheHeaderRec_ {
+	char magic[8];			/**< 文件标识 */
+	uint32_t version;		/**< 格式版本 */
+	uint32_t n_dirs;		/**< 目录总数 */
+	uint32_t n_files;		/**< 文件总数 */
+	uint32_t n_blocks;		/**< 目录索引的块数量 */
+	uint64_t index_offset;		/**< 目录索引的位置 */
+	uint64_t block_index_offset;	/**< 分块索引的位置 */
+	uint32_t checksum;		/**< 文件头之后所有数据的校验和 */
+	uint32_t filter_digest;		/**< 扫描时使用的过滤规则的摘要 */
+} CacheHeaderRec, *CacheHeader;
+
+enum DiffType {
+	DIFF_ADDED,
+	DIFF_DELETED,
+	DIFF_MODIFIED
+};
+
+/** 目录摘要，用于判断目录在两次扫描之间是否有变化 */
+typedef struct DirSummaryRec_ {
+	int64_t mtime;		/**< 目录的修改时间，为 0 时表示未知 */
+	unsigned int n_entries;	/**< 目录项总数 */
+	unsigned int digest;	/**< 由各个目录项名称计算出的摘要 */
+	unsigned int n_dirs;	/**< 子目录数量 */
+	unsigned int n_files;	/**< 图片文件数量 */
+} DirSummaryRec, *DirSummary;
+
+/** 目录缓存，对应缓存文件中的一个分区，数据直接引用映射到内存中的文件 */
+typedef struct DirCacheRec_ {
+	DirSummaryRec summary;		/**< 目录摘要 */
+	const uchar_t *data;		/**< 分区数据 */
+	size_t size;			/**< 分区的总字节数 */
+	const uchar_t *dirs;		/**< 子目录名称列表 */
+	const uchar_t *files;		/**< 文件名称列表 */
+	const uchar_t *end;		/**< 文件名称列表的结束位置 */
+	unsigned int flags;		/**< 分区的标志 */
+	LCUI_BOOL visited;		/**< 本次扫描是否访问过该目录 */
+	LCUI_BOOL changed;		/**< 该目录的分区是否已经重写 */
+} DirCacheRec, *DirCache;
+
+/** 扫描到的文件 */
+typedef struct FileEntryRec_ {
+	wchar_t *name;			/**< 文件名称 */
+	FileStatRec stat;		/**< 文件属性 */
+} FileEntryRec, *FileEntry;
+
+/** 新写入的目录分区 */
+typedef struct DirIndexRec_ {
+	char *path;			/**< 目录路径 */
+	uint64_t offset;		/**< 分区在缓存文件中的位置 */
+} DirIndexRec, *DirIndex;
+
+/** 字节缓冲区 */
+typedef struct ByteBufRec_ {
+	uchar_t *data;
+	size_t length;
+	size_t size;
+} ByteBufRec, *ByteBuf;
+
+/** 前缀压缩的名称列表的读取器 */
+typedef struct NameReaderRec_ {
+	const uchar_t *cur;		/**< 当前读取位置 */
+	const uchar_t *end;		/**< 结束位置 */
+	char name[MAX_NAME_BYTES];	/**< 当前名称 */
+	size_t len;			/**< 当前名称的长度 */
+	unsigned int index;		/**< 下一个名称的序号 */
+	unsigned int count;		/**< 名称总数 */
+	unsigned int block_size;	/**< 每块的名称数量 */
+} NameReaderRec, *NameReader;
+
+/** 有变化的目录，用于在同步时对比出新增和删除的文件 */
+typedef struct DirChangeRec_ {
+	wchar_t *path;			/**< 目录路径 */
+	DirCache cache;			/**< 之前的目录分区，为 NULL 时表示新目录 */
+	uint64_t offset;		/**< 新分区的位置，为 0 时表示目录已删除 */
+} DirChangeRec, *DirChange;
+
 /** 文件夹内的文件变更状态统计 */
 typedef struct DirStatsRec_ {
-	Dict *files;		/**< 之前已缓存的文件列表 */
-	Dict *added_files;	/**< 新增的文件 */
-	Dict *deleted_files;	/**< 删除的文件 */
+	PathTrie dirs;		/**< 之前已缓存的目录 */
+	DirCache *caches;	/**< 目录缓存，以目录在 dirs 中的编号作为下标 */
+	uint32_t n_caches;	/**< 目录缓存列表的长度 */
+	LinkedList new_dirs;	/**< 新写入的目录分区 */
+	LinkedList changes;	/**< 有变化的目录 */
+	LinkedList dirty_dirs;	/**< 只需重新读取的目录，为空时扫描整个目录树 */
+	LinkedList dirty_trees;	/**< 需要重新读取所有子目录的目录 */
+	Dict *scanned_dirs;	/**< 只读取部分目录时，记录已读取过的目录 */
+	DirReader *readers;	/**< 目录读取器，每个工作线程一个 */
+	RemoteMount mount;	/**< 远程扫描模式下扫描目录所在的挂载点 */
+	Dict *resumed_dirs;	/**< 从检查点恢复的、尚未沿用的目录分区 */
+	uchar_t *resume;	/**< 从检查点恢复的新缓存文件的数据 */
+	size_t resume_size;	/**< 恢复的数据的长度 */
+	time_t checkpoint_time;	/**< 上次保存检查点的时间 */
+	FileHanlder on_added;	/**< 新增文件的处理函数 */
+	FileHanlder on_deleted;	/**< 已删除文件的处理函数 */
+	FileHanlder on_modified;	/**< 修改过的文件的处理函数 */
+	void *handler_data;	/**< 传给处理函数的附加数据 */
+	ScanThrottle throttle;	/**< 扫描限速函数 */
+	void *throttle_data;	/**< 传给限速函数的附加数据 */
+	PathFilter filter;	/**< 路径过滤器，没有过滤规则时为 NULL */
+	int shard_index;	/**< 需要扫描的分片 */
+	int shard_count;	/**< 分片数量，不分片时为 1 */
+	size_t root_len;	/**< 扫描目录的路径长度，包括末尾的路径分隔符 */
+	uint32_t cache_digest;	/**< 之前缓存的过滤规则的摘要 */
+	LCUI_BOOL rescan;	/**< 过滤规则有变化，所有目录都需要重新读取 */
+	const uchar_t *cache;	/**< 映射到内存中的缓存文件 */
+	size_t cache_size;	/**< 缓存文件的大小 */
+	LCUI_BOOL cache_mapped;	/**< 缓存数据是否为文件映射，否则为转换后的旧缓存 */
+	const uchar_t *tmp;	/**< 映射到内存中的新缓存文件 */
+	size_t tmp_size;	/**< 新缓存文件的大小 */
+	FILE *fp;		/**< 新的缓存文件 */
+	uint64_t offset;	/**< 新的缓存文件的当前写入位置 */
+	uint32_t checksum;	/**< 新的缓存文件的校验和 */
+	time_t start_time;	/**< 扫描开始时间 */
+	LCUI_BOOL is_dirty;	/**< 新的缓存文件是否需要替换掉之前的缓存文件 */
+	LCUI_Mutex mutex;	/**< 扫描线程共用的互斥锁 */
 } DirStatsRec, *DirStats;
 
 /** 忽略大小写对比宽字符串 */
@@ -128,7 +296,7 @@ static void Dict_KeyDestructor( void *privdata, void *key )
 	free( key );
 }
 
-static DictType DictType_Files = {
+static DictType DictType_DirSet = {
 	Dict_KeyHash,
 	Dict_KeyDup,
 	NULL,
@@ -137,6 +305,84 @@ static DictType DictType_Files = {
 	NULL
 };
 
+static wchar_t *DupPath( const wchar_t *path )
+{
+	wchar_t *newpath = malloc( (wcslen( path ) + 1)*sizeof( wchar_t ) );
+	wcscpy( newpath, path );
+	return newpath;
+}
+
+static void DirIndex_Delete( void *arg )
+{
+	DirIndex index = arg;
+	free( index->path );
+	free( index );
+}
+
+static void FileEntry_Delete( void *arg )
+{
+	FileEntry entry = arg;
+	free( entry->name );
+	free( entry );
+}
+
+static void DirChange_Delete( void *arg )
+{
+	DirChange change = arg;
+	free( change->path );
+	free( change );
+}
+
+/** 记录目录的缓存 */
+static int SyncTask_SetDirCache( SyncTask t, const wchar_t *dirpath,
+				 DirCache cache )
+{
+	uint32_t id, n;
+	DirCache *caches;
+	DirStats ds = GetDirStats( t );
+	id = PathTrie_AddDir( ds->dirs, dirpath );
+	if( id == PATH_TRIE_NONE ) {
+		return -1;
+	}
+	if( id >= ds->n_caches ) {
+		n = PathTrie_GetDirCount( ds->dirs ) * 2;
+		caches = realloc( ds->caches, sizeof( DirCache ) * n );
+		if( !caches ) {
+			return -1;
+		}
+		memset( caches + ds->n_caches, 0, 
+			sizeof( DirCache ) * (n - ds->n_caches) );
+		ds->caches = caches;
+		ds->n_caches = n;
+	}
+	ds->caches[id] = cache;
+	return 0;
+}
+
+/** 获取目录的缓存，没有时返回 NULL */
+static DirCache SyncTask_GetDirCache( SyncTask t, const wchar_t *dirpath )
+{
+	uint32_t id;
+	DirStats ds = GetDirStats( t );
+	id = PathTrie_FindDir( ds->dirs, dirpath );
+	if( id == PATH_TRIE_NONE || id >= ds->n_caches ) {
+		return NULL;
+	}
+	return ds->caches[id];
+}
+
+static void SyncTask_ClearDirCaches( SyncTask t )
+{
+	uint32_t i;
+	DirStats ds = GetDirStats( t );
+	for( i = 0; i < ds->n_caches; ++i ) {
+		free( ds->caches[i] );
+	}
+	free( ds->caches );
+	ds->caches = NULL;
+	ds->n_caches = 0;
+}
+
 SyncTask SyncTask_New( const char *data_dir, const char *scan_dir )
 {
 	SyncTask t;
@@ -158,17 +404,51 @@ SyncTask SyncTask_NewW( const wchar_t *data_dir, const wchar_t *scan_dir )
 	int n, len;
 	wchar_t name[44];
 	const wchar_t suffix[] = L".tmp";
+	const wchar_t ckpt_suffix[] = L".ckpt";
 	size_t len1 = wcslen( data_dir ) + 1;
 	size_t len2 = wcslen( scan_dir ) + 1;
 	SyncTask t = malloc( sizeof(SyncTaskRec) + sizeof(DirStatsRec) );
 	DirStats ds = GetDirStats( t );
-	ds->deleted_files = Dict_Create( &DictType_Files, NULL );
-	ds->added_files = Dict_Create( &DictType_Files, NULL );
-	ds->files = Dict_Create( &DictType_Files, NULL );
+	ds->dirs = PathTrie_New();
+	ds->caches = NULL;
+	ds->n_caches = 0;
+	LinkedList_Init( &ds->new_dirs );
+	LinkedList_Init( &ds->changes );
+	LinkedList_Init( &ds->dirty_dirs );
+	LinkedList_Init( &ds->dirty_trees );
+	ds->scanned_dirs = NULL;
+	ds->readers = NULL;
+	ds->resumed_dirs = NULL;
+	ds->resume = NULL;
+	ds->resume_size = 0;
+	ds->on_added = NULL;
+	ds->on_deleted = NULL;
+	ds->on_modified = NULL;
+	ds->handler_data = NULL;
+	ds->throttle = NULL;
+	ds->throttle_data = NULL;
+	ds->filter = NULL;
+	ds->mount = NULL;
+	ds->shard_index = 0;
+	ds->shard_count = 1;
+	ds->cache_digest = 0;
+	ds->rescan = FALSE;
+	ds->is_dirty = FALSE;
+	ds->cache_mapped = FALSE;
+	ds->cache_size = 0;
+	ds->cache = NULL;
+	ds->tmp_size = 0;
+	ds->tmp = NULL;
+	ds->fp = NULL;
+	LCUIMutex_Init( &ds->mutex );
 	t->data_dir = malloc( sizeof( wchar_t ) * len1 );
 	t->scan_dir = malloc( sizeof( wchar_t ) * len2 );
 	wcscpy( t->data_dir, data_dir );
 	wcscpy( t->scan_dir, scan_dir );
+	ds->root_len = len2 - 1;
+	if( ds->root_len > 0 && scan_dir[ds->root_len - 1] != PATH_SEP ) {
+		ds->root_len += 1;
+	}
 	WEncodeSHA1( name, t->scan_dir, len2 );
 	n = wcslen( t->data_dir );
 	len = n + WCSLEN(name) + WCSLEN( suffix );
@@ -181,179 +461,1769 @@ SyncTask SyncTask_NewW( const wchar_t *data_dir, const wchar_t *scan_dir )
 	}
 	wsprintf( t->file, L"%s%s", t->tmpfile, name );
 	wsprintf( t->tmpfile, L"%s%s", t->file, suffix );
+	t->ckptfile = malloc( (wcslen( t->file ) + WCSLEN( ckpt_suffix )) * 
+			      sizeof( wchar_t ) );
+	wsprintf( t->ckptfile, L"%s%s", t->file, ckpt_suffix );
 	t->state = STATE_NONE;
+	t->workers = SCAN_WORKERS;
+	t->reader = DIR_READER_DEFAULT;
+	t->background = FALSE;
+	t->skip_unchanged = FALSE;
+	t->remote = FALSE;
 	t->deleted_files = 0;
+	t->modified_files = 0;
 	t->total_files = 0;
 	t->added_files = 0;
 	return t;
 }
 
+/** 复制目录路径，并确保以路径分隔符结尾 */
+static wchar_t *DupDirPath( const wchar_t *dirpath )
+{
+	int len;
+	wchar_t *path;
+	len = wcslen( dirpath );
+	path = malloc( sizeof( wchar_t ) * (len + 2) );
+	wcscpy( path, dirpath );
+	if( len > 0 && path[len - 1] != PATH_SEP ) {
+		path[len++] = PATH_SEP;
+		path[len] = 0;
+	}
+	return path;
+}
+
+void SyncTask_AddDirtyDir( SyncTask t, const wchar_t *dirpath )
+{
+	DirStats ds = GetDirStats( t );
+	LinkedList_Append( &ds->dirty_dirs, DupDirPath( dirpath ) );
+}
+
+void SyncTask_AddDirtyTree( SyncTask t, const wchar_t *dirpath )
+{
+	DirStats ds = GetDirStats( t );
+	LinkedList_Append( &ds->dirty_dirs, DupDirPath( dirpath ) );
+	LinkedList_Append( &ds->dirty_trees, DupDirPath( dirpath ) );
+}
+
 void SyncTask_ClearCache( SyncTask t )
 {
 	_wremove( t->file );
 	_wremove( t->tmpfile );
+	_wremove( t->ckptfile );
 }
 
-void SyncTask_Delete( SyncTask *tptr )
+static void ByteBuf_Init( ByteBuf buf )
 {
-	SyncTask t = *tptr;
-	DirStats ds = GetDirStats( t );
-	free( t->scan_dir );
-	free( t->data_dir );
-	free( t->file );
-	free( t->tmpfile );
-	t->file = NULL;
-	t->tmpfile = NULL;
-	t->scan_dir = NULL;
-	t->data_dir = NULL;
-	Dict_Release( ds->files );
-	Dict_Release( ds->added_files );
-	Dict_Release( ds->deleted_files );
-	free( t );
-	*tptr = NULL;
+	buf->data = NULL;
+	buf->length = 0;
+	buf->size = 0;
 }
 
-static int FileDict_ForEach( Dict *d, FileHanlder func, void *data )
+static void ByteBuf_Free( ByteBuf buf )
 {
-	int count = 0;
-	DictEntry *entry;
-	DictIterator *iter = Dict_GetIterator( d );
-	while( (entry = Dict_Next( iter )) ) {
-		func( data, DictEntry_GetKey( entry ) );
-		++count;
+	free( buf->data );
+	ByteBuf_Init( buf );
+}
+
+static void ByteBuf_Append( ByteBuf buf, const void *data, size_t len )
+{
+	size_t size;
+	uchar_t *newdata;
+	if( len == 0 ) {
+		return;
 	}
-	Dict_ReleaseIterator( iter );
-	return count;
+	if( buf->length + len > buf->size ) {
+		size = buf->size > 0 ? buf->size * 2 : 256;
+		while( size < buf->length + len ) {
+			size *= 2;
+		}
+		newdata = realloc( buf->data, size );
+		if( !newdata ) {
+			return;
+		}
+		buf->data = newdata;
+		buf->size = size;
+	}
+	memcpy( buf->data + buf->length, data, len );
+	buf->length += len;
 }
 
-int SyncTask_InAddedFiles( SyncTask t, FileHanlder func, void *func_data )
+/** 以变长编码写入整数，每个字节存 7 位，最高位表示后面是否还有字节 */
+static void ByteBuf_AppendVarInt( ByteBuf buf, uint64_t val )
 {
-	DirStats ds = GetDirStats( t );
-	return FileDict_ForEach( ds->added_files, func, func_data );
+	int n = 0;
+	uchar_t bytes[10];
+	while( val >= 0x80 ) {
+		bytes[n++] = (uchar_t)(val | 0x80);
+		val >>= 7;
+	}
+	bytes[n++] = (uchar_t)val;
+	ByteBuf_Append( buf, bytes, n );
 }
 
-int SyncTask_InDeletedFiles( SyncTask t, FileHanlder func, void *func_data )
+static void ByteBuf_AppendUInt32( ByteBuf buf, uint32_t val )
+{
+	uchar_t bytes[4];
+	bytes[0] = (uchar_t)val;
+	bytes[1] = (uchar_t)(val >> 8);
+	bytes[2] = (uchar_t)(val >> 16);
+	bytes[3] = (uchar_t)(val >> 24);
+	ByteBuf_Append( buf, bytes, 4 );
+}
+
+/** 读取变长编码的整数，数据不完整时返回 -1 */
+static int ReadVarInt( const uchar_t **pptr, const uchar_t *end, 
+		       uint64_t *val )
+{
+	int shift = 0;
+	const uchar_t *p = *pptr;
+	*val = 0;
+	while( p < end && shift < 64 ) {
+		*val |= (uint64_t)(*p & 0x7f) << shift;
+		if( !(*p++ & 0x80) ) {
+			*pptr = p;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+static uint32_t ReadUInt32( const uchar_t *p )
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/** 计算 Adler-32 校验和 */
+static uint32_t Adler32( uint32_t adler, const uchar_t *data, size_t len )
+{
+	size_t n;
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	while( len > 0 ) {
+		/* 每处理 5552 个字节取一次模，保证不会溢出 */
+		n = len > 5552 ? 5552 : len;
+		len -= n;
+		while( n-- > 0 ) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+/** 求两个名称的共同前缀长度 */
+static size_t GetSharedLength( const char *s1, size_t len1,
+			       const char *s2, size_t len2 )
+{
+	size_t i, n = len1 < len2 ? len1 : len2;
+	for( i = 0; i < n && s1[i] == s2[i]; ++i );
+	return i;
+}
+
+/** 以前缀压缩的方式写入名称 */
+static void ByteBuf_AppendName( ByteBuf buf, const char *prev, size_t prev_len,
+				const char *name, size_t len )
+{
+	size_t shared = 0;
+	if( prev ) {
+		shared = GetSharedLength( prev, prev_len, name, len );
+	}
+	ByteBuf_AppendVarInt( buf, shared );
+	ByteBuf_AppendVarInt( buf, len - shared );
+	ByteBuf_Append( buf, name + shared, len - shared );
+}
+
+static void NameReader_Init( NameReader reader, const uchar_t *data,
+			     const uchar_t *end, unsigned int count,
+			     unsigned int block_size )
+{
+	reader->cur = data;
+	reader->end = end;
+	reader->name[0] = 0;
+	reader->len = 0;
+	reader->index = 0;
+	reader->count = count;
+	reader->block_size = block_size;
+}
+
+/** 读取下一个名称，返回名称的长度，已读完或失败时返回 -1 */
+static int NameReader_Next( NameReader reader )
+{
+	uint64_t shared, len;
+	if( reader->index >= reader->count ) {
+		return -1;
+	}
+	/* 每块的第一个名称没有压缩 */
+	if( reader->index++ % reader->block_size == 0 ) {
+		reader->len = 0;
+	}
+	if( ReadVarInt( &reader->cur, reader->end, &shared ) != 0 ||
+	    ReadVarInt( &reader->cur, reader->end, &len ) != 0 ) {
+		return -1;
+	}
+	if( shared > reader->len || shared + len >= MAX_NAME_BYTES ||
+	    len > (uint64_t)(reader->end - reader->cur) ) {
+		return -1;
+	}
+	memcpy( reader->name + shared, reader->cur, (size_t)len );
+	reader->cur += len;
+	reader->len = (size_t)(shared + len);
+	reader->name[reader->len] = 0;
+	return (int)reader->len;
+}
+
+/** 在 dirpath 末尾拼接 UTF-8 编码的名称，返回拼接后的路径长度 */
+static int JoinName( wchar_t *path, int dir_len, const char *name )
+{
+	int len;
+	len = LCUI_DecodeString( path + dir_len, name, 
+				 MAX_PATH_LEN - dir_len, ENCODING_UTF8 );
+	path[dir_len + len] = 0;
+	return dir_len + len;
+}
+
+/** 写入新的缓存文件，并更新校验和 */
+static void SyncTask_Write( SyncTask t, const void *data, size_t len )
 {
 	DirStats ds = GetDirStats( t );
-	return FileDict_ForEach( ds->deleted_files, func, func_data );
+	fwrite( data, 1, len, ds->fp );
+	ds->checksum = Adler32( ds->checksum, data, len );
+	ds->offset += len;
 }
 
-/** 从缓存记录中载入文件列表 */
-static int SyncTask_LoadCache( SyncTask t, FILE *fp )
+/** 解析目录分区的摘要，version 为分区所在的缓存文件的格式版本 */
+static int DirCache_Init( DirCache cache, const uchar_t *data, 
+			  const uchar_t *end, uint32_t version )
 {
-	wchar_t *path;
-	char buf[MAX_PATH_LEN];
-	int count = 0, len, size;
+	uint64_t size, val[6];
+	unsigned int i;
+	const uchar_t *p = data;
+	if( ReadVarInt( &p, end, &size ) != 0 ) {
+		return -1;
+	}
+	if( size > (uint64_t)(end - p) ) {
+		return -1;
+	}
+	end = p + size;
+	cache->data = data;
+	cache->size = (size_t)(end - data);
+	for( i = 0; i < 2; ++i ) {
+		if( ReadVarInt( &p, end, &val[i] ) != 0 ) {
+			return -1;
+		}
+	}
+	if( end - p < 4 ) {
+		return -1;
+	}
+	val[2] = ReadUInt32( p );
+	p += 4;
+	val[5] = 0;
+	for( i = 3; i < (version > 2 ? 6U : 5U); ++i ) {
+		if( ReadVarInt( &p, end, &val[i] ) != 0 ) {
+			return -1;
+		}
+	}
+	cache->summary.mtime = (int64_t)val[0];
+	cache->summary.n_entries = (unsigned int)val[1];
+	cache->summary.digest = (uint32_t)val[2];
+	cache->summary.n_dirs = (unsigned int)val[3];
+	cache->summary.n_files = (unsigned int)val[4];
+	cache->flags = (unsigned int)val[5];
+	cache->dirs = p;
+	/* 跳过子目录名称列表，子目录名称没有前缀压缩 */
+	for( i = 0; i < cache->summary.n_dirs; ++i ) {
+		if( ReadVarInt( &p, end, &size ) != 0 ||
+		    ReadVarInt( &p, end, &size ) != 0 ||
+		    size > (uint64_t)(end - p) ) {
+			return -1;
+		}
+		p += size;
+	}
+	cache->files = p;
+	/* 文件名称列表后面是分块位置列表 */
+	size = (cache->summary.n_files + NAME_BLOCK_SIZE - 1) / NAME_BLOCK_SIZE;
+	if( size * 4 > (uint64_t)(end - p) ) {
+		return -1;
+	}
+	cache->end = end - size * 4;
+	cache->visited = FALSE;
+	cache->changed = FALSE;
+	return 0;
+}
+
+/** 载入缓存文件中的目录索引，目录分区在用到时才会读取 */
+static int SyncTask_LoadCache( SyncTask t )
+{
+	uint64_t offset;
+	unsigned int i;
+	DirCache cache;
+	NameReaderRec reader;
+	CacheHeaderRec header;
+	wchar_t path[MAX_PATH_LEN];
 	DirStats ds = GetDirStats( t );
-	if( !fgets( buf, MAX_PATH_LEN, fp ) ) {
-		return 0;
+	if( ds->cache_size < sizeof( header ) ) {
+		return -1;
 	}
-	if( !strstr( buf, FILE_HEAD_TAG ) ) {
-		return 0;
+	memcpy( &header, ds->cache, sizeof( header ) );
+	if( memcmp( header.magic, CACHE_MAGIC, 8 ) != 0 ||
+	    header.version < CACHE_MIN_VERSION ||
+	    header.version > CACHE_VERSION ||
+	    header.index_offset > header.block_index_offset ||
+	    header.block_index_offset > ds->cache_size ) {
+		return -1;
+	}
+	if( Adler32( 1, ds->cache + sizeof( header ),
+		     ds->cache_size - sizeof( header ) ) != header.checksum ) {
+		return -1;
 	}
-	while( !feof( fp ) ) {
-		size = fread( &len, sizeof( int ), 1, fp );
-		if( size < 1 || len < 1 ) {
+	NameReader_Init( &reader, ds->cache + header.index_offset,
+			 ds->cache + header.block_index_offset,
+			 header.n_dirs, DIR_BLOCK_SIZE );
+	for( i = 0; i < header.n_dirs; ++i ) {
+		if( NameReader_Next( &reader ) < 0 ||
+		    ReadVarInt( &reader.cur, reader.end, &offset ) != 0 ||
+		    offset >= header.index_offset ) {
 			break;
 		}
-		size = fread( buf, sizeof( wchar_t ), len, fp );
-		if( size < len || size > MAX_PATH_LEN ) {
-			((wchar_t*)buf)[size] = 0;
+		cache = NEW( DirCacheRec, 1 );
+		if( DirCache_Init( cache, ds->cache + offset, 
+				   ds->cache + header.index_offset,
+				   header.version ) != 0 ) {
+			free( cache );
 			break;
 		}
-		path = (wchar_t*)buf;
-		path[len] = 0;
-		Dict_Add( ds->files, path, (void*)1 );
-		Dict_Add( ds->deleted_files, path, (void*)1 );
-		++count;
+		/* 旧版本的分区没有文件属性，需要重新读取目录来补全 */
+		if( header.version < CACHE_VERSION ) {
+			cache->summary.mtime = 0;
+		}
+		JoinName( path, 0, reader.name );
+		if( SyncTask_SetDirCache( t, path, cache ) != 0 ) {
+			free( cache );
+			break;
+		}
+	}
+	ds->cache_digest = header.filter_digest;
+	if( i < header.n_dirs ) {
+		SyncTask_ClearDirCaches( t );
+		PathTrie_Delete( &ds->dirs );
+		ds->dirs = PathTrie_New();
+		return -1;
+	}
+	/**
+	 * 只读取部分目录时，未读取的分区会原样复制到新的缓存文件中，而旧版本的
+	 * 分区格式与新版本不同，所以这次需要扫描整个目录树
+	 */
+	if( header.version < CACHE_VERSION ) {
+		LinkedList_Clear( &ds->dirty_dirs, free );
+		LinkedList_Clear( &ds->dirty_trees, free );
+		ds->is_dirty = TRUE;
+	}
+	return header.n_files;
+}
+
+/** 读取目录分区中的下一个文件的名称和属性，已读完或失败时返回 -1 */
+static int DirCache_NextFile( DirCache cache, NameReader reader, 
+			      FileStat st )
+{
+	uint64_t val[4];
+	unsigned int i;
+	if( NameReader_Next( reader ) < 0 ) {
+		return -1;
+	}
+	if( !(cache->flags & DIR_FLAG_STATS) ) {
+		memset( st, 0, sizeof( FileStatRec ) );
+		return 0;
+	}
+	for( i = 0; i < 4; ++i ) {
+		if( ReadVarInt( &reader->cur, reader->end, &val[i] ) != 0 ) {
+			return -1;
+		}
+	}
+	st->size = (int64_t)val[0];
+	st->mtime = (int64_t)val[1];
+	st->ctime = (int64_t)val[2];
+	st->inode = val[3];
+	return 0;
+}
+
+/** 判断文件是否修改过，索引节点号为 0 时表示未知，不参与对比 */
+static LCUI_BOOL IsFileModified( FileStat old_st, FileStat new_st )
+{
+	if( old_st->size != new_st->size || old_st->mtime != new_st->mtime ) {
+		return TRUE;
+	}
+	if( old_st->inode != 0 && new_st->inode != 0 && 
+	    old_st->inode != new_st->inode ) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * 对比新旧两个目录分区中的文件列表
+ * 两个列表都是按名称排序的，只需同时遍历一次即可找出差异，无需载入整个列表。
+ * @param[in] old_cache 之前的分区，为 NULL 时所有文件都是新增的
+ * @param[in] new_cache 新的分区，为 NULL 时所有文件都是删除的
+ * @param[in] type 需要找出的差异类型，DIFF_ADDED、DIFF_DELETED 或
+ *  DIFF_MODIFIED，其中一个分区没有文件属性时，不会找出修改过的文件
+ * @param[in] func 差异文件的处理函数，为 NULL 时只统计数量
+ * @returns 差异文件的数量
+ */
+static int DirCache_Diff( DirCache old_cache, DirCache new_cache,
+			  const wchar_t *dirpath, int type,
+			  FileHanlder func, void *func_data )
+{
+	int ret, count = 0;
+	LCUI_BOOL has_old = FALSE, has_new = FALSE, has_stats;
+	NameReaderRec old_reader, new_reader;
+	FileStatRec old_st, new_st;
+	wchar_t path[MAX_PATH_LEN];
+	int dir_len = wcslen( dirpath );
+	wcscpy( path, dirpath );
+	if( old_cache ) {
+		NameReader_Init( &old_reader, old_cache->files, old_cache->end,
+				 old_cache->summary.n_files, NAME_BLOCK_SIZE );
+		has_old = DirCache_NextFile( old_cache, &old_reader, 
+					     &old_st ) >= 0;
+	}
+	if( new_cache ) {
+		NameReader_Init( &new_reader, new_cache->files, new_cache->end,
+				 new_cache->summary.n_files, NAME_BLOCK_SIZE );
+		has_new = DirCache_NextFile( new_cache, &new_reader, 
+					     &new_st ) >= 0;
+	}
+	has_stats = old_cache && new_cache && 
+		    (old_cache->flags & DIR_FLAG_STATS) &&
+		    (new_cache->flags & DIR_FLAG_STATS);
+	if( type == DIFF_MODIFIED && !has_stats ) {
+		return 0;
+	}
+	while( has_old || has_new ) {
+		if( !has_old ) {
+			ret = 1;
+		} else if( !has_new ) {
+			ret = -1;
+		} else {
+			ret = strcmp( old_reader.name, new_reader.name );
+		}
+		if( (ret < 0 && type == DIFF_DELETED) || 
+		    (ret > 0 && type == DIFF_ADDED) ||
+		    (ret == 0 && type == DIFF_MODIFIED &&
+		     IsFileModified( &old_st, &new_st )) ) {
+			if( func ) {
+				JoinName( path, dir_len, ret < 0 ?
+					  old_reader.name : new_reader.name );
+				func( func_data, path, 
+				      ret < 0 ? &old_st : &new_st );
+			}
+			++count;
+		}
+		if( ret <= 0 ) {
+			has_old = DirCache_NextFile( old_cache, &old_reader,
+						     &old_st ) >= 0;
+		}
+		if( ret >= 0 ) {
+			has_new = DirCache_NextFile( new_cache, &new_reader,
+						     &new_st ) >= 0;
+		}
 	}
-	t->deleted_files = count;
 	return count;
 }
 
-/** 扫描文件 */
-static int SyncTask_ScanFilesW( SyncTask t, const wchar_t *dirpath, FILE *fp )
+/** 编码后的文件名称，用于按 UTF-8 编码的名称排序 */
+typedef struct EncodedFileRec_ {
+	char *name;
+	FileEntry entry;
+} EncodedFileRec, *EncodedFile;
+
+static int CompareEncodedFile( const void *a, const void *b )
+{
+	return strcmp( ((const EncodedFileRec*)a)->name, 
+		       ((const EncodedFileRec*)b)->name );
+}
+
+/** 将 wchar_t 字符串转换成 UTF-8 编码的字符串 */
+static char *EncodeName( const wchar_t *wstr )
+{
+	char *str;
+	int len = LCUI_EncodeString( NULL, wstr, 0, ENCODING_UTF8 ) + 1;
+	str = malloc( sizeof( char ) * len );
+	LCUI_EncodeString( str, wstr, len, ENCODING_UTF8 );
+	return str;
+}
+
+/**
+ * 生成目录分区的数据
+ * @param[in] dirs 子目录的名称列表
+ * @param[in] files 文件列表，每一项都是 FileEntry
+ * @param[in] flags 分区的标志，有 DIR_FLAG_STATS 时才写入文件属性
+ */
+static void EncodeDir( ByteBuf buf, DirSummary summary, LinkedList *dirs,
+		       LinkedList *files, unsigned int flags )
+{
+	int i, n;
+	FileStat st;
+	EncodedFile names;
+	size_t len, prev_len = 0;
+	ByteBufRec body, restarts;
+	LinkedListNode *node;
+	ByteBuf_Init( &body );
+	ByteBuf_Init( &restarts );
+	ByteBuf_AppendVarInt( &body, summary->mtime );
+	ByteBuf_AppendVarInt( &body, summary->n_entries );
+	ByteBuf_AppendUInt32( &body, summary->digest );
+	ByteBuf_AppendVarInt( &body, summary->n_dirs );
+	ByteBuf_AppendVarInt( &body, summary->n_files );
+	ByteBuf_AppendVarInt( &body, flags );
+	LinkedList_ForEach( node, dirs ) {
+		char *name = EncodeName( node->data );
+		ByteBuf_AppendName( &body, NULL, 0, name, strlen( name ) );
+		free( name );
+	}
+	n = files->length;
+	names = malloc( sizeof( EncodedFileRec ) * (n + 1) );
+	i = 0;
+	LinkedList_ForEach( node, files ) {
+		names[i].entry = node->data;
+		names[i].name = EncodeName( names[i].entry->name );
+		++i;
+	}
+	qsort( names, n, sizeof( EncodedFileRec ), CompareEncodedFile );
+	len = body.length;
+	for( i = 0; i < n; ++i ) {
+		if( i % NAME_BLOCK_SIZE == 0 ) {
+			ByteBuf_AppendUInt32( &restarts, 
+					      (uint32_t)(body.length - len) );
+			prev_len = 0;
+		}
+		ByteBuf_AppendName( &body, i % NAME_BLOCK_SIZE ? 
+				    names[i - 1].name : NULL, prev_len, 
+				    names[i].name, strlen( names[i].name ) );
+		prev_len = strlen( names[i].name );
+		if( flags & DIR_FLAG_STATS ) {
+			st = &names[i].entry->stat;
+			ByteBuf_AppendVarInt( &body, st->size );
+			ByteBuf_AppendVarInt( &body, st->mtime );
+			ByteBuf_AppendVarInt( &body, st->ctime );
+			ByteBuf_AppendVarInt( &body, st->inode );
+		}
+	}
+	ByteBuf_Append( &body, restarts.data, restarts.length );
+	ByteBuf_AppendVarInt( buf, body.length );
+	ByteBuf_Append( buf, body.data, body.length );
+	for( i = 0; i < n; ++i ) {
+		free( names[i].name );
+	}
+	free( names );
+	ByteBuf_Free( &restarts );
+	ByteBuf_Free( &body );
+}
+
+/**
+ * 载入旧格式的缓存
+ * 旧格式中的文件按所在目录分组后转换成新格式的分区，这些分区的修改时间都
+ * 记为 0，因此本次扫描时都会重新读取，之后就能按新格式进行对比。
+ */
+static int SyncTask_LoadLegacyCache( SyncTask t, FILE *fp )
 {
-	LCUI_Dir dir;
-	LCUI_DirEntry *entry;
-	wchar_t filepath[2048], *name;
-	int i, len, dir_len = wcslen( dirpath );
+	int count = 0, len;
+	unsigned int i, n;
+	PathTrie trie;
+	ByteBufRec buf;
+	DirCache cache;
+	FileEntry entry;
+	uint64_t *offsets;
+	uint32_t dir, file, n_dirs;
+	LinkedList dirs, files;
+	DirSummaryRec summary;
+	char head[MAX_PATH_LEN];
+	wchar_t path[MAX_PATH_LEN], *name;
 	DirStats ds = GetDirStats( t );
-	wcscpy( filepath, dirpath );
-	if( filepath[dir_len - 1] != PATH_SEP ) {
-		filepath[dir_len++] = PATH_SEP;
-		filepath[dir_len] = 0;
+	if( !fgets( head, MAX_PATH_LEN, fp ) ) {
+		return 0;
+	}
+	if( !strstr( head, FILE_HEAD_TAG ) ) {
+		return 0;
 	}
-	LCUI_OpenDir( filepath, &dir );
-	while( (entry = LCUI_ReadDir( &dir )) && t->state == STATE_STARTED ) {
-		name = LCUI_GetFileName( entry );
-		/* 忽略 . 和 .. 文件夹 */
-		if( name[0] == '.' ) {
-			if( name[1] == 0 || (name[1] == '.' && name[2] == 0) ) {
+	/* 用路径树按目录归类文件，目录路径只需存一份 */
+	trie = PathTrie_New();
+	while( 1 ) {
+		if( fread( &len, sizeof( int ), 1, fp ) < 1 || len == 0 ) {
+			break;
+		}
+		n = 1;
+		/* 带有目录摘要的分区，只需要其中的文件记录 */
+		if( len < 0 ) {
+			len = -len;
+			if( len >= MAX_PATH_LEN ||
+			    fread( path, sizeof( wchar_t ), len, fp ) < 
+			    (size_t)len ) {
+				break;
+			}
+			/* 之前的分区格式的摘要中还有个 64 位的大小字段 */
+			if( fseek( fp, sizeof( int64_t ), SEEK_CUR ) != 0 ||
+			    fread( &summary, sizeof( summary ), 1, fp ) < 1 ) {
+				break;
+			}
+			for( i = 0; i < summary.n_dirs; ++i ) {
+				if( fread( &len, sizeof( int ), 1, fp ) < 1 ||
+				    len < 1 || len >= MAX_PATH_LEN ) {
+					break;
+				}
+				fseek( fp, len * sizeof( wchar_t ), SEEK_CUR );
+			}
+			if( i < summary.n_dirs ) {
+				break;
+			}
+			n = summary.n_files;
+			if( n > 0 && fread( &len, sizeof( int ), 1, fp ) < 1 ) {
+				break;
+			}
+		}
+		for( i = 0; i < n; ++i ) {
+			if( i > 0 && fread( &len, sizeof( int ), 1, fp ) < 1 ) {
+				break;
+			}
+			if( len < 1 || len >= MAX_PATH_LEN ) {
+				break;
+			}
+			if( fread( path, sizeof( wchar_t ), len, fp ) <
+			    (size_t)len ) {
+				break;
+			}
+			path[len] = 0;
+			name = wcsrchr( path, PATH_SEP );
+			if( !name ) {
 				continue;
 			}
+			*name++ = 0;
+			dir = PathTrie_AddDir( trie, path );
+			PathTrie_AddFile( trie, dir, name );
+			++count;
 		}
-		wcscpy( filepath + dir_len, name );
-		len = wcslen( filepath );
-		if( LCUI_FileIsDirectory( entry ) ) {
-			SyncTask_ScanFilesW( t, filepath, fp );
-			continue;
+		if( i < n ) {
+			break;
 		}
-		if( !LCUI_FileIsArchive( entry ) ) {
+	}
+	ByteBuf_Init( &buf );
+	LinkedList_Init( &dirs );
+	n_dirs = PathTrie_GetDirCount( trie );
+	offsets = malloc( sizeof( uint64_t ) * (n_dirs + 1) );
+	for( dir = 0; dir < n_dirs; ++dir ) {
+		offsets[dir] = buf.length;
+		file = PathTrie_GetFirstFile( trie, dir );
+		if( file == PATH_TRIE_NONE ) {
 			continue;
 		}
-		if( !IsImageFile( name ) ) {
+		/* 名称直接引用路径树中的字符串，无需复制 */
+		LinkedList_Init( &files );
+		for( ; file != PATH_TRIE_NONE; 
+		     file = PathTrie_GetNextFile( trie, file ) ) {
+			entry = NEW( FileEntryRec, 1 );
+			entry->name = (wchar_t*)
+				PathTrie_GetFileName( trie, file );
+			LinkedList_Append( &files, entry );
+		}
+		memset( &summary, 0, sizeof( summary ) );
+		summary.n_files = files.length;
+		/* 旧格式中没有文件属性 */
+		EncodeDir( &buf, &summary, &dirs, &files, 0 );
+		LinkedList_Clear( &files, free );
+	}
+	ds->cache = buf.data;
+	ds->cache_size = buf.length;
+	ds->cache_mapped = FALSE;
+	for( dir = 0; dir < n_dirs; ++dir ) {
+		if( PathTrie_GetFirstFile( trie, dir ) == PATH_TRIE_NONE ) {
 			continue;
 		}
-		/* 若该文件路径存在于之前的缓存中，说明未被删除，否则将之
-		 * 视为新增的文件。
-		 */
-		if( Dict_FetchValue( ds->files, filepath ) ) {
-			Dict_Delete( ds->deleted_files, filepath );
-			--t->deleted_files;
-			//wprintf(L"unchange: %s\n", filepath);
-		} else {
-			//wprintf(L"added: %s\n", filepath);
-			Dict_Add( ds->added_files, filepath, (void*)1 );
-			++t->added_files;
+		cache = NEW( DirCacheRec, 1 );
+		DirCache_Init( cache, ds->cache + offsets[dir],
+			       ds->cache + ds->cache_size, CACHE_VERSION );
+		PathTrie_GetDirPath( trie, dir, path, MAX_PATH_LEN );
+		if( SyncTask_SetDirCache( t, path, cache ) != 0 ) {
+			free( cache );
 		}
-		fwrite( &len, sizeof( int ), 1, fp );
-		i = fwrite( filepath, sizeof( wchar_t ), len, fp );
-		//wprintf(L"scan file: %s, len: %d, writed: %d\n", filepath, len, i);
-		++t->total_files;
 	}
-	LCUI_CloseDir( &dir );
-	return t->total_files;
+	free( offsets );
+	PathTrie_Delete( &trie );
+	/* 旧格式的缓存需要在这次同步后转换成新格式 */
+	ds->is_dirty = TRUE;
+	return count;
 }
 
-int SyncTask_Start( SyncTask t )
+/** 记录新缓存文件中的目录分区 */
+static void SyncTask_AddDirIndex( SyncTask t, const wchar_t *dirpath,
+				  uint64_t offset )
+{
+	DirIndex index;
+	DirStats ds = GetDirStats( t );
+	index = NEW( DirIndexRec, 1 );
+	index->path = EncodeName( dirpath );
+	index->offset = offset;
+	LinkedList_Append( &ds->new_dirs, index );
+}
+
+/** 将目录分区写入新的缓存文件中，返回分区的位置 */
+static uint64_t SyncTask_WriteDir( SyncTask t, const wchar_t *dirpath, 
+				   const uchar_t *data, size_t len )
+{
+	uint64_t offset;
+	DirStats ds = GetDirStats( t );
+	offset = ds->offset;
+	SyncTask_AddDirIndex( t, dirpath, offset );
+	SyncTask_Write( t, data, len );
+	return offset;
+}
+
+/** 获取过滤规则和分片设置的摘要，没有过滤规则且不分片时为 0 */
+static uint32_t SyncTask_GetFilterDigest( SyncTask t )
+{
+	uint32_t digest;
+	DirStats ds = GetDirStats( t );
+	digest = ds->filter ? PathFilter_GetDigest( ds->filter ) : 0;
+	if( ds->shard_count > 1 ) {
+		digest = digest * 31 + (ds->shard_count << 16) + 
+			 ds->shard_index + 1;
+	}
+	return digest;
+}
+
+static void ByteBuf_AppendPath( ByteBuf buf, const char *path, 
+				uint64_t offset )
+{
+	size_t len = strlen( path );
+	ByteBuf_AppendVarInt( buf, len );
+	ByteBuf_Append( buf, path, len );
+	ByteBuf_AppendVarInt( buf, offset );
+}
+
+/**
+ * 保存检查点
+ * 记录的目录包括本次已写完的目录，以及从上个检查点恢复但还未访问到的目录，
+ * 它们的分区都在新缓存文件的有效数据范围内。
+ */
+static void SyncTask_SaveCheckpoint( SyncTask t )
 {
-	int n;
 	FILE *fp;
-	//wprintf( L"\n\nscan dir: %s\n", t->scan_dir );
-	fp = _wfopen( t->file, L"rb" );
+	char *path;
+	ByteBufRec buf;
+	DirIndex index;
+	DictEntry *entry;
+	DictIterator *iter;
+	LinkedListNode *node;
+	CheckpointHeaderRec header;
+	DirStats ds = GetDirStats( t );
+	ByteBuf_Init( &buf );
+	memset( &header, 0, sizeof( header ) );
+	LinkedList_ForEach( node, &ds->new_dirs ) {
+		index = node->data;
+		ByteBuf_AppendPath( &buf, index->path, index->offset );
+		header.n_dirs += 1;
+	}
+	if( ds->resumed_dirs ) {
+		iter = Dict_GetIterator( ds->resumed_dirs );
+		while( (entry = Dict_Next( iter )) ) {
+			path = EncodeName( DictEntry_GetKey( entry ) );
+			ByteBuf_AppendPath( &buf, path, (uint64_t)(size_t)
+					    DictEntry_GetVal( entry ) );
+			header.n_dirs += 1;
+			free( path );
+		}
+		Dict_ReleaseIterator( iter );
+	}
+	/* 检查点记录的数据必须已经写入到新缓存文件中 */
+	fflush( ds->fp );
+	memcpy( header.magic, CHECKPOINT_MAGIC, 8 );
+	header.version = CACHE_VERSION;
+	header.offset = ds->offset;
+	header.checksum = ds->checksum;
+	header.list_checksum = Adler32( 1, buf.data, buf.length );
+	header.filter_digest = SyncTask_GetFilterDigest( t );
+	fp = _wfopen( t->ckptfile, L"wb" );
 	if( fp ) {
-		SyncTask_LoadCache( t, fp );
+		fwrite( &header, sizeof( header ), 1, fp );
+		fwrite( buf.data, 1, buf.length, fp );
 		fclose( fp );
 	}
-	fp = _wfopen( t->tmpfile, L"wb" );
+	ByteBuf_Free( &buf );
+	ds->checkpoint_time = time( NULL );
+}
+
+/** 读取整个文件，失败时返回 NULL */
+static uchar_t *ReadFileData( const wchar_t *path, size_t max_size, 
+			      size_t *size )
+{
+	FILE *fp;
+	uchar_t *data;
+	fp = _wfopen( path, L"rb" );
 	if( !fp ) {
-		return -1;
+		return NULL;
+	}
+	data = malloc( max_size > 0 ? max_size : 1 );
+	if( !data ) {
+		fclose( fp );
+		return NULL;
+	}
+	*size = fread( data, 1, max_size, fp );
+	fclose( fp );
+	return data;
+}
+
+/**
+ * 载入检查点
+ * 检查点记录的数据需要与新缓存文件中的一致，载入后，ds->resume 中存放的是
+ * 新缓存文件中的有效数据，ds->resumed_dirs 中记录的是可以沿用的目录分区。
+ */
+static int SyncTask_LoadCheckpoint( SyncTask t )
+{
+	FILE *fp;
+	uchar_t *list;
+	uint64_t len, offset;
+	unsigned int i;
+	const uchar_t *p, *end;
+	wchar_t path[MAX_PATH_LEN];
+	char name[MAX_NAME_BYTES];
+	size_t size = 0;
+	CheckpointHeaderRec header;
+	DirStats ds = GetDirStats( t );
+	fp = _wfopen( t->ckptfile, L"rb" );
+	if( !fp ) {
+		return -1;
+	}
+	if( fread( &header, sizeof( header ), 1, fp ) < 1 ||
+	    memcmp( header.magic, CHECKPOINT_MAGIC, 8 ) != 0 ||
+	    header.version != CACHE_VERSION ||
+	    header.filter_digest != SyncTask_GetFilterDigest( t ) ||
+	    header.offset < sizeof( CacheHeaderRec ) ||
+	    header.offset > (size_t)-1 ) {
+		fclose( fp );
+		return -1;
+	}
+	fseek( fp, 0, SEEK_END );
+	len = ftell( fp ) - sizeof( header );
+	fseek( fp, sizeof( header ), SEEK_SET );
+	list = malloc( (size_t)len + 1 );
+	if( !list || fread( list, 1, (size_t)len, fp ) < len ||
+	    Adler32( 1, list, (size_t)len ) != header.list_checksum ) {
+		free( list );
+		fclose( fp );
+		return -1;
+	}
+	fclose( fp );
+	ds->resume = ReadFileData( t->tmpfile, (size_t)header.offset, &size );
+	if( !ds->resume || size != header.offset ||
+	    Adler32( 1, ds->resume + sizeof( CacheHeaderRec ), 
+		     size - sizeof( CacheHeaderRec ) ) != header.checksum ) {
+		free( ds->resume );
+		free( list );
+		ds->resume = NULL;
+		return -1;
+	}
+	ds->resume_size = size;
+	ds->resumed_dirs = Dict_Create( &DictType_DirSet, NULL );
+	p = list;
+	end = list + len;
+	for( i = 0; i < header.n_dirs; ++i ) {
+		if( ReadVarInt( &p, end, &len ) != 0 || 
+		    len >= MAX_NAME_BYTES || len > (uint64_t)(end - p) ) {
+			break;
+		}
+		memcpy( name, p, (size_t)len );
+		name[len] = 0;
+		p += len;
+		if( ReadVarInt( &p, end, &offset ) != 0 ||
+		    offset < sizeof( CacheHeaderRec ) || offset >= size ) {
+			break;
+		}
+		JoinName( path, 0, name );
+		Dict_Add( ds->resumed_dirs, path, (void*)(size_t)offset );
+	}
+	free( list );
+	return 0;
+}
+
+/** 清除从检查点恢复的数据 */
+static void SyncTask_ClearResume( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->resumed_dirs ) {
+		Dict_Release( ds->resumed_dirs );
+		ds->resumed_dirs = NULL;
+	}
+	free( ds->resume );
+	ds->resume = NULL;
+	ds->resume_size = 0;
+}
+
+/** 记录有变化的目录 */
+static DirChange SyncTask_AddChange( SyncTask t, const wchar_t *dirpath,
+				     DirCache cache, uint64_t offset )
+{
+	DirChange change;
+	DirStats ds = GetDirStats( t );
+	change = NEW( DirChangeRec, 1 );
+	change->path = DupPath( dirpath );
+	change->cache = cache;
+	change->offset = offset;
+	LinkedList_Append( &ds->changes, change );
+	if( cache ) {
+		cache->changed = TRUE;
+	}
+	ds->is_dirty = TRUE;
+	return change;
+}
+
+/**
+ * 将已删除的目录中的文件交给处理函数
+ * 目录已删除，它之前的文件都可以立即处理掉。处理函数可能会阻塞，所以不能在
+ * 加锁后调用。
+ */
+static void SyncTask_HandleDeletedDir( SyncTask t, DirChange change )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->on_deleted ) {
+		DirCache_Diff( change->cache, NULL, change->path, DIFF_DELETED,
+			       ds->on_deleted, ds->handler_data );
+	}
+}
+
+/** 获取目录的修改时间，dirpath 末尾带有路径分隔符 */
+static int64_t SyncTask_GetDirMTime( SyncTask t, wchar_t *dirpath, int len )
+{
+	int64_t mtime;
+	FileStatRec st;
+	DirStats ds = GetDirStats( t );
+	/* 某些平台上无法获取末尾带路径分隔符的目录的信息 */
+	LCUI_BOOL trimmed = len > 1 && dirpath[len - 2] != L':';
+	if( trimmed ) {
+		dirpath[len - 1] = 0;
+	}
+	/* 只读取部分目录时，这些目录是已知有变化的，不能使用缓存的属性 */
+	if( ds->mount ) {
+		RemoteMount_GetStat( ds->mount, dirpath, &st, 
+				     !ds->scanned_dirs );
+		mtime = st.mtime;
+	} else {
+		mtime = wgetfilemtime( dirpath );
+	}
+	if( trimmed ) {
+		dirpath[len - 1] = PATH_SEP;
+	}
+	return mtime;
+}
+
+/**
+ * 读取目录
+ * 远程扫描模式下，目录项由读取器读取，图片文件的属性则交给挂载点同时查询，
+ * 而不是由读取器逐个查询。
+ */
+static int SyncTask_ReadDir( SyncTask t, int worker, const wchar_t *dirpath )
+{
+	int i, n, n_files = 0;
+	DirReaderEntry entry, *files;
+	DirStats ds = GetDirStats( t );
+	DirReader reader = ds->readers[worker];
+	if( !ds->mount ) {
+		return DirReader_Read( reader, dirpath, IsImageFile );
+	}
+	RemoteMount_Enter( ds->mount );
+	n = DirReader_Read( reader, dirpath, NULL );
+	RemoteMount_Leave( ds->mount );
+	if( n < 1 ) {
+		return n;
+	}
+	files = malloc( sizeof( DirReaderEntry ) * n );
+	if( !files ) {
+		return n;
+	}
+	for( i = 0; i < n; ++i ) {
+		entry = DirReader_GetEntry( reader, i );
+		if( entry->type == DIR_ENTRY_FILE && !entry->has_stat &&
+		    IsImageFile( entry->name ) ) {
+			files[n_files++] = entry;
+		}
+	}
+	RemoteMount_StatEntries( ds->mount, dirpath, files, n_files,
+				 !ds->scanned_dirs );
+	free( files );
+	return n;
+}
+
+/**
+ * 判断是否需要扫描子目录
+ * 只读取部分目录时，已缓存的子目录如果有变化会单独标记出来，无需在此处扫描
+ */
+static LCUI_BOOL SyncTask_NeedScanDir( SyncTask t, const wchar_t *dirpath )
+{
+	int len;
+	DirCache cache;
+	LinkedListNode *node;
+	wchar_t path[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+	if( !ds->scanned_dirs ) {
+		return TRUE;
+	}
+	LinkedList_ForEach( node, &ds->dirty_trees ) {
+		const wchar_t *tree = node->data;
+		if( wcsncmp( dirpath, tree, wcslen( tree ) ) == 0 ) {
+			return TRUE;
+		}
+	}
+	len = wcslen( dirpath );
+	if( len + 2 > MAX_PATH_LEN ) {
+		return FALSE;
+	}
+	wcscpy( path, dirpath );
+	path[len] = PATH_SEP;
+	path[len + 1] = 0;
+	cache = SyncTask_GetDirCache( t, path );
+	return cache == NULL;
+}
+
+/** 将目录及其所有子目录记为已删除，并将它们的变更记录追加到列表中 */
+static void SyncTask_DeleteTree( SyncTask t, const wchar_t *dirpath,
+				 LinkedList *changes )
+{
+	uint32_t id;
+	DirCache cache;
+	wchar_t path[MAX_PATH_LEN];
+	size_t len = wcslen( dirpath );
+	DirStats ds = GetDirStats( t );
+	for( id = 0; id < ds->n_caches; ++id ) {
+		cache = ds->caches[id];
+		if( !cache || cache->changed ) {
+			continue;
+		}
+		PathTrie_GetDirPath( ds->dirs, id, path, MAX_PATH_LEN );
+		if( wcsncmp( path, dirpath, len ) != 0 ) {
+			continue;
+		}
+		cache->visited = TRUE;
+		t->deleted_files += cache->summary.n_files;
+		LinkedList_Append( changes, 
+				   SyncTask_AddChange( t, path, cache, 0 ) );
+	}
+}
+
+/** 找出之前缓存的子目录中已经不存在的目录，并将它们记为已删除 */
+static void SyncTask_DeleteMissingDirs( SyncTask t, DirCache cache,
+					const wchar_t *dirpath,
+					LinkedList *dirs )
+{
+	int len;
+	NameReaderRec reader;
+	LinkedListNode *node;
+	LinkedList changes;
+	wchar_t path[MAX_PATH_LEN];
+	int dir_len = wcslen( dirpath );
+	DirStats ds = GetDirStats( t );
+	LinkedList_Init( &changes );
+	wcscpy( path, dirpath );
+	NameReader_Init( &reader, cache->dirs, cache->files,
+			 cache->summary.n_dirs, 1 );
+	while( NameReader_Next( &reader ) >= 0 ) {
+		len = JoinName( path, dir_len, reader.name );
+		LinkedList_ForEach( node, dirs ) {
+			if( wcscmp( node->data, path + dir_len ) == 0 ) {
+				break;
+			}
+		}
+		if( node || len + 2 > MAX_PATH_LEN ) {
+			continue;
+		}
+		path[len] = PATH_SEP;
+		path[len + 1] = 0;
+		LCUIMutex_Lock( &ds->mutex );
+		SyncTask_DeleteTree( t, path, &changes );
+		LCUIMutex_Unlock( &ds->mutex );
+	}
+	/* 变更记录在提交前不会被释放，解锁后仍然可以使用 */
+	LinkedList_ForEach( node, &changes ) {
+		SyncTask_HandleDeletedDir( t, node->data );
+	}
+	LinkedList_Clear( &changes, NULL );
+}
+
+/** 将目录分区中记录的子目录添加到遍历器中 */
+static void PushSubDirs( DirWalker w, int worker, DirCache cache,
+			 wchar_t *dirpath, int dir_len )
+{
+	NameReaderRec reader;
+	/* 子目录名称没有压缩，相当于每块只有一个名称 */
+	NameReader_Init( &reader, cache->dirs, cache->files,
+			 cache->summary.n_dirs, 1 );
+	while( NameReader_Next( &reader ) >= 0 ) {
+		JoinName( dirpath, dir_len, reader.name );
+		DirWalker_Push( w, worker, dirpath );
+	}
+	dirpath[dir_len] = 0;
+}
+
+/**
+ * 对比目录的新旧分区，统计变更的文件数量
+ * 设置了处理函数时，变更的文件会在对比的同时交给处理函数，处理函数可能会
+ * 阻塞，所以不能在加锁后调用。
+ */
+static void SyncTask_DiffDir( SyncTask t, DirCache cache,
+			      DirCache new_cache, const wchar_t *dirpath )
+{
+	int n_added, n_deleted, n_modified;
+	DirStats ds = GetDirStats( t );
+	n_added = DirCache_Diff( cache, new_cache, dirpath, DIFF_ADDED,
+				 ds->on_added, ds->handler_data );
+	n_deleted = DirCache_Diff( cache, new_cache, dirpath, DIFF_DELETED,
+				   ds->on_deleted, ds->handler_data );
+	n_modified = DirCache_Diff( cache, new_cache, dirpath, DIFF_MODIFIED,
+				    ds->on_modified, ds->handler_data );
+	LCUIMutex_Lock( &ds->mutex );
+	t->added_files += n_added;
+	t->deleted_files += n_deleted;
+	t->modified_files += n_modified;
+	LCUIMutex_Unlock( &ds->mutex );
+}
+
+/**
+ * 沿用从检查点恢复的目录分区，需在加锁后调用
+ * 分区记录的修改时间与目录当前的修改时间一致时才能沿用，否则需要重新读取
+ * 目录，恢复的分区会成为新缓存文件中无用的数据。沿用后还需调用
+ * SyncTask_DiffDir() 统计变更的文件。
+ * @param[in] cache 之前缓存的目录分区
+ * @param[out] new_cache 沿用的目录分区
+ */
+static LCUI_BOOL SyncTask_ResumeDir( SyncTask t, const wchar_t *dirpath,
+				     int64_t mtime, DirCache cache,
+				     DirCache new_cache )
+{
+	void *val;
+	uint64_t offset;
+	DirStats ds = GetDirStats( t );
+	val = Dict_FetchValue( ds->resumed_dirs, dirpath );
+	if( !val ) {
+		return FALSE;
+	}
+	offset = (uint64_t)(size_t)val;
+	Dict_Delete( ds->resumed_dirs, dirpath );
+	if( DirCache_Init( new_cache, ds->resume + offset, 
+			   ds->resume + ds->resume_size, 
+			   CACHE_VERSION ) != 0 ) {
+		return FALSE;
+	}
+	if( mtime == 0 || new_cache->summary.mtime != mtime ) {
+		return FALSE;
+	}
+	t->total_files += new_cache->summary.n_files;
+	SyncTask_AddDirIndex( t, dirpath, offset );
+	SyncTask_AddChange( t, dirpath, cache, offset );
+	return TRUE;
+}
+
+/** 扫描目录，由目录遍历器的工作线程调用 */
+static void SyncTask_ScanDirW( DirWalker w, int worker,
+			       const wchar_t *dirpath, void *data )
+{
+	int i, n;
+	int64_t mtime;
+	SyncTask t = data;
+	DirCache cache;
+	ByteBufRec buf;
+	uint64_t offset;
+	DirCacheRec new_cache;
+	DirSummaryRec summary;
+	LinkedList dirs, files;
+	FileEntry file;
+	DirReaderEntry entry;
+	wchar_t filepath[MAX_PATH_LEN];
+	const wchar_t *name;
+	int dir_len = wcslen( dirpath );
+	DirStats ds = GetDirStats( t );
+	/* 同步已被终止，剩下的目录都不用再处理了 */
+	if( t->state != STATE_STARTED ) {
+		DirWalker_Stop( w );
+		return;
+	}
+	wcscpy( filepath, dirpath );
+	if( filepath[dir_len - 1] != PATH_SEP ) {
+		filepath[dir_len++] = PATH_SEP;
+		filepath[dir_len] = 0;
+	}
+	mtime = SyncTask_GetDirMTime( t, filepath, dir_len );
+	LCUIMutex_Lock( &ds->mutex );
+	if( ds->scanned_dirs ) {
+		/* 已不存在的目录由它的上级目录处理，已读取过的目录不再读取 */
+		if( mtime == 0 || Dict_FetchValue( ds->scanned_dirs, filepath ) ) {
+			LCUIMutex_Unlock( &ds->mutex );
+			return;
+		}
+		Dict_Add( ds->scanned_dirs, filepath, (void*)1 );
+	}
+	cache = SyncTask_GetDirCache( t, filepath );
+	if( cache ) {
+		cache->visited = TRUE;
+	}
+	/**
+	 * 目录的修改时间未变，说明它的目录项未变，直接沿用缓存中的记录。
+	 * 原地修改文件内容不会改变目录的修改时间，这类修改需要由文件监视器
+	 * 标记出目录后才能检测到，而不支持文件监视器的平台上检测不到，所以只有
+	 * 允许跳过的任务（例如后台同步）才这样做，手动同步时总是重新读取目录。
+	 */
+	if( t->skip_unchanged && cache && mtime != 0 && 
+	    cache->summary.mtime == mtime && 
+	    !ds->scanned_dirs && !ds->rescan ) {
+		t->total_files += cache->summary.n_files;
+		LCUIMutex_Unlock( &ds->mutex );
+		/* 只查询了目录的修改时间，按一个目录项计算 */
+		if( ds->throttle ) {
+			ds->throttle( ds->throttle_data, 1 );
+		}
+		PushSubDirs( w, worker, cache, filepath, dir_len );
+		return;
+	}
+	if( ds->resumed_dirs && SyncTask_ResumeDir( t, filepath, mtime, 
+						    cache, &new_cache ) ) {
+		LCUIMutex_Unlock( &ds->mutex );
+		if( ds->throttle ) {
+			ds->throttle( ds->throttle_data, 1 );
+		}
+		SyncTask_DiffDir( t, cache, &new_cache, filepath );
+		PushSubDirs( w, worker, &new_cache, filepath, dir_len );
+		return;
+	}
+	LCUIMutex_Unlock( &ds->mutex );
+	LinkedList_Init( &dirs );
+	LinkedList_Init( &files );
+	memset( &summary, 0, sizeof( summary ) );
+	/* 读取器会一并获取图片文件的属性，无需再逐个查询 */
+	n = SyncTask_ReadDir( t, worker, filepath );
+	/* 读取不了扫描目录本身（例如设备已断开）时终止扫描，保留缓存的记录 */
+	if( n < 0 && (size_t)dir_len == ds->root_len ) {
+		/* 什么都还没扫描，也就不用保存检查点 */
+		LCUIMutex_Lock( &ds->mutex );
+		ds->checkpoint_time = 0;
+		LCUIMutex_Unlock( &ds->mutex );
+		LCFinder_StopSync( t );
+		DirWalker_Stop( w );
+		return;
+	}
+	/**
+	 * 读取不了子目录（例如没有权限、读取时出错）时不能当作空目录对比，否则
+	 * 它的文件都会被当成已删除，所以原样保留它的分区，并继续扫描它之前记录
+	 * 的子目录，以免这些子目录因未访问到而被当成已删除。
+	 */
+	if( n < 0 ) {
+		if( ds->throttle ) {
+			ds->throttle( ds->throttle_data, 1 );
+		}
+		if( !cache ) {
+			return;
+		}
+		LCUIMutex_Lock( &ds->mutex );
+		t->total_files += cache->summary.n_files;
+		LCUIMutex_Unlock( &ds->mutex );
+		/* 只读取部分目录时，未访问的目录本来就会沿用之前的记录 */
+		if( !ds->scanned_dirs ) {
+			PushSubDirs( w, worker, cache, filepath, dir_len );
+		}
+		return;
+	}
+	if( ds->throttle ) {
+		ds->throttle( ds->throttle_data, n > 0 ? n : 1 );
+	}
+	for( i = 0; i < n && t->state == STATE_STARTED; ++i ) {
+		entry = DirReader_GetEntry( ds->readers[worker], i );
+		name = entry->name;
+		summary.n_entries += 1;
+		summary.digest += Dict_KeyHash( name );
+		/* 子目录交给遍历器处理，空闲的工作线程会来分担 */
+		if( entry->type == DIR_ENTRY_DIR ) {
+			wcscpy( filepath + dir_len, name );
+			/* 被排除的目录不会被读取，也不记录到分区中 */
+			if( ds->filter && PathFilter_IsExcluded( 
+				ds->filter, filepath + ds->root_len, TRUE ) ) {
+				continue;
+			}
+			/* 其它分片的目录同样视为被排除 */
+			if( ds->shard_count > 1 && dir_len == ds->root_len &&
+			    SyncTask_GetShard( name, ds->shard_count ) != 
+			    ds->shard_index ) {
+				continue;
+			}
+			LinkedList_Append( &dirs, DupPath( name ) );
+			if( SyncTask_NeedScanDir( t, filepath ) ) {
+				DirWalker_Push( w, worker, filepath );
+			}
+			continue;
+		}
+		if( entry->type != DIR_ENTRY_FILE || !IsImageFile( name ) ) {
+			continue;
+		}
+		if( ds->shard_count > 1 && dir_len == ds->root_len &&
+		    ds->shard_index != 0 ) {
+			continue;
+		}
+		if( ds->filter ) {
+			wcscpy( filepath + dir_len, name );
+			if( PathFilter_IsExcluded( ds->filter, 
+						   filepath + ds->root_len,
+						   FALSE ) ) {
+				continue;
+			}
+		}
+		file = NEW( FileEntryRec, 1 );
+		file->name = DupPath( name );
+		if( entry->has_stat ) {
+			file->stat = entry->stat;
+		} else {
+			memset( &file->stat, 0, sizeof( FileStatRec ) );
+		}
+		LinkedList_Append( &files, file );
+	}
+	filepath[dir_len] = 0;
+	/* 目录没有读完，保留它之前的缓存记录 */
+	if( t->state != STATE_STARTED ) {
+		LinkedList_Clear( &dirs, free );
+		LinkedList_Clear( &files, FileEntry_Delete );
+		return;
+	}
+	if( cache && ds->scanned_dirs ) {
+		SyncTask_DeleteMissingDirs( t, cache, filepath, &dirs );
+	}
+	summary.n_dirs = dirs.length;
+	summary.n_files = files.length;
+	if( mtime < (int64_t)ds->start_time - DIR_MTIME_GUARD ) {
+		summary.mtime = mtime;
+	}
+	ByteBuf_Init( &buf );
+	EncodeDir( &buf, &summary, &dirs, &files, DIR_FLAG_STATS );
+	LinkedList_Clear( &dirs, free );
+	LinkedList_Clear( &files, FileEntry_Delete );
+	/* 新分区中的文件名称已经排好序，可以直接和之前的分区对比 */
+	DirCache_Init( &new_cache, buf.data, buf.data + buf.length, 
+		       CACHE_VERSION );
+	SyncTask_DiffDir( t, cache, &new_cache, filepath );
+	LCUIMutex_Lock( &ds->mutex );
+	t->total_files += summary.n_files;
+	offset = SyncTask_WriteDir( t, filepath, buf.data, buf.length );
+	SyncTask_AddChange( t, filepath, cache, offset );
+	if( ds->checkpoint_time > 0 && 
+	    time( NULL ) - ds->checkpoint_time >= CHECKPOINT_INTERVAL ) {
+		SyncTask_SaveCheckpoint( t );
+	}
+	LCUIMutex_Unlock( &ds->mutex );
+	ByteBuf_Free( &buf );
+}
+
+/** 判断直接标记出来的目录是否位于被排除的目录中 */
+static LCUI_BOOL SyncTask_IsExcludedDir( SyncTask t, const wchar_t *dirpath )
+{
+	DirStats ds = GetDirStats( t );
+	if( !ds->filter || wcslen( dirpath ) <= ds->root_len ||
+	    wcsncmp( dirpath, t->scan_dir, ds->root_len - 1 ) != 0 ) {
+		return FALSE;
+	}
+	return PathFilter_IsExcludedTree( ds->filter, dirpath + ds->root_len );
+}
+
+/** 扫描文件 */
+static int SyncTask_ScanFilesW( SyncTask t, const wchar_t *dirpath )
+{
+	int i, n;
+	DirWalker w;
+	LinkedListNode *node;
+	DirStats ds = GetDirStats( t );
+	if( t->workers < 1 ) {
+		t->workers = 1;
+	}
+	/* 网络文件系统上同时读取多个目录，以掩盖每次读取的往返延迟 */
+	if( t->remote ) {
+		ds->mount = RemoteMount_Open( t->scan_dir );
+		n = RemoteMount_GetWindow( ds->mount ) / 2;
+		if( t->workers < n ) {
+			t->workers = n;
+		}
+	}
+	w = DirWalker_New( t->workers, SyncTask_ScanDirW, t );
+	DirWalker_SetBackground( w, t->background );
+	ds->readers = malloc( sizeof( DirReader ) * t->workers );
+	for( i = 0; i < t->workers; ++i ) {
+		ds->readers[i] = DirReader_New( t->reader );
+	}
+	if( ds->dirty_dirs.length > 0 ) {
+		ds->scanned_dirs = Dict_Create( &DictType_DirSet, NULL );
+		LinkedList_ForEach( node, &ds->dirty_dirs ) {
+			if( SyncTask_IsExcludedDir( t, node->data ) ) {
+				continue;
+			}
+			DirWalker_Push( w, 0, node->data );
+		}
+		dirpath = NULL;
+	}
+	DirWalker_Run( w, dirpath );
+	DirWalker_Delete( &w );
+	for( i = 0; i < t->workers; ++i ) {
+		DirReader_Delete( &ds->readers[i] );
+	}
+	free( ds->readers );
+	ds->readers = NULL;
+	if( ds->mount ) {
+		RemoteMount_Close( &ds->mount );
+	}
+	return t->total_files;
+}
+
+static int CompareDirIndex( const void *a, const void *b )
+{
+	const DirIndexRec *index1 = *(const DirIndexRec**)a;
+	const DirIndexRec *index2 = *(const DirIndexRec**)b;
+	return strcmp( index1->path, index2->path );
+}
+
+/** 写入按路径排序的目录索引和分块索引 */
+static void SyncTask_WriteIndex( SyncTask t, CacheHeader header )
+{
+	int i, n;
+	DirIndex *list;
+	ByteBufRec buf, blocks;
+	LinkedListNode *node;
+	size_t prev_len = 0, len;
+	DirStats ds = GetDirStats( t );
+	n = ds->new_dirs.length;
+	list = malloc( sizeof( DirIndex ) * (n + 1) );
+	i = 0;
+	LinkedList_ForEach( node, &ds->new_dirs ) {
+		list[i++] = node->data;
+	}
+	qsort( list, n, sizeof( DirIndex ), CompareDirIndex );
+	ByteBuf_Init( &buf );
+	ByteBuf_Init( &blocks );
+	for( i = 0; i < n; ++i ) {
+		if( i % DIR_BLOCK_SIZE == 0 ) {
+			ByteBuf_AppendUInt32( &blocks, (uint32_t)buf.length );
+			prev_len = 0;
+		}
+		len = strlen( list[i]->path );
+		ByteBuf_AppendName( &buf, i % DIR_BLOCK_SIZE ? 
+				    list[i - 1]->path : NULL, prev_len,
+				    list[i]->path, len );
+		ByteBuf_AppendVarInt( &buf, list[i]->offset );
+		prev_len = len;
+	}
+	header->n_dirs = n;
+	header->n_blocks = (n + DIR_BLOCK_SIZE - 1) / DIR_BLOCK_SIZE;
+	header->index_offset = ds->offset;
+	SyncTask_Write( t, buf.data, buf.length );
+	header->block_index_offset = ds->offset;
+	SyncTask_Write( t, blocks.data, blocks.length );
+	ByteBuf_Free( &blocks );
+	ByteBuf_Free( &buf );
+	free( list );
+}
+
+/** 处理扫描中未访问到的目录，并补全新的缓存文件 */
+static void SyncTask_Finish( SyncTask t )
+{
+	uint32_t id;
+	DirCache cache;
+	CacheHeaderRec header;
+	wchar_t dirpath[MAX_PATH_LEN];
+	DirStats ds = GetDirStats( t );
+	for( id = 0; id < ds->n_caches; ++id ) {
+		cache = ds->caches[id];
+		if( !cache || cache->visited || t->state != STATE_STARTED ) {
+			continue;
+		}
+		/* 只读取了部分目录，未读取的目录都沿用之前的记录 */
+		if( ds->scanned_dirs ) {
+			t->total_files += cache->summary.n_files;
+			continue;
+		}
+		/* 扫描完整结束后仍未访问到的目录，说明已被删除 */
+		PathTrie_GetDirPath( ds->dirs, id, dirpath, MAX_PATH_LEN );
+		t->deleted_files += cache->summary.n_files;
+		SyncTask_HandleDeletedDir( t, SyncTask_AddChange( t, dirpath,
+								  cache, 0 ) );
+	}
+	if( !ds->is_dirty ) {
+		return;
+	}
+	/* 未变化的目录分区原样复制到新的缓存文件中 */
+	for( id = 0; id < ds->n_caches; ++id ) {
+		cache = ds->caches[id];
+		if( cache && !cache->changed ) {
+			PathTrie_GetDirPath( ds->dirs, id, dirpath, 
+					     MAX_PATH_LEN );
+			SyncTask_WriteDir( t, dirpath, cache->data, 
+					   cache->size );
+		}
+	}
+	memset( &header, 0, sizeof( header ) );
+	SyncTask_WriteIndex( t, &header );
+	memcpy( header.magic, CACHE_MAGIC, 8 );
+	header.version = CACHE_VERSION;
+	header.n_files = t->total_files;
+	header.checksum = ds->checksum;
+	/**
+	 * 过滤规则变化后只读取了部分目录时，其余分区仍是按之前的规则扫描的，
+	 * 保留之前的摘要，下次完整扫描时仍需重新读取所有目录
+	 */
+	if( ds->rescan && ds->scanned_dirs ) {
+		header.filter_digest = ds->cache_digest;
+	} else {
+		header.filter_digest = SyncTask_GetFilterDigest( t );
+	}
+	fseek( ds->fp, 0, SEEK_SET );
+	fwrite( &header, sizeof( header ), 1, ds->fp );
+}
+
+/** 释放映射到内存中的缓存数据，之前的目录分区也将无法再访问 */
+static void SyncTask_ReleaseCache( SyncTask t )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->tmp ) {
+		wunmapfile( (void*)ds->tmp, ds->tmp_size );
+		ds->tmp = NULL;
+	}
+	if( !ds->cache ) {
+		return;
+	}
+	if( ds->cache_mapped ) {
+		wunmapfile( (void*)ds->cache, ds->cache_size );
+	} else {
+		free( (void*)ds->cache );
+	}
+	ds->cache = NULL;
+}
+
+/**
+ * 遍历有变化的目录，找出新增或删除的文件
+ * 新旧分区都直接从映射到内存中的缓存文件里读取，边对比边交给 func 处理，
+ * 不需要把文件列表都载入到内存中。
+ */
+static int SyncTask_ForEachChange( SyncTask t, int type,
+				   FileHanlder func, void *func_data )
+{
+	int count = 0;
+	DirChange change;
+	DirCacheRec new_cache;
+	LinkedListNode *node;
+	DirStats ds = GetDirStats( t );
+	if( !ds->tmp && t->state == STATE_FINISHED ) {
+		ds->tmp = wmapfile( t->tmpfile, &ds->tmp_size );
+	}
+	LinkedList_ForEach( node, &ds->changes ) {
+		change = node->data;
+		if( change->offset == 0 ) {
+			count += DirCache_Diff( change->cache, NULL, change->path,
+						type, func, func_data );
+			continue;
+		}
+		if( !ds->tmp || change->offset >= ds->tmp_size ) {
+			continue;
+		}
+		if( DirCache_Init( &new_cache, ds->tmp + change->offset,
+				   ds->tmp + ds->tmp_size, 
+				   CACHE_VERSION ) != 0 ) {
+			continue;
+		}
+		count += DirCache_Diff( change->cache, &new_cache, change->path,
+					type, func, func_data );
+	}
+	return count;
+}
+
+void SyncTask_SetHandlers( SyncTask t, FileHanlder on_added,
+			   FileHanlder on_deleted, FileHanlder on_modified,
+			   void *func_data )
+{
+	DirStats ds = GetDirStats( t );
+	ds->on_added = on_added;
+	ds->on_deleted = on_deleted;
+	ds->on_modified = on_modified;
+	ds->handler_data = func_data;
+}
+
+void SyncTask_SetShard( SyncTask t, int index, int count )
+{
+	DirStats ds = GetDirStats( t );
+	if( count < 1 || index < 0 || index >= count ) {
+		index = 0;
+		count = 1;
+	}
+	ds->shard_index = index;
+	ds->shard_count = count;
+}
+
+int SyncTask_GetShard( const wchar_t *name, int count )
+{
+	/* FNV-1a 哈希，各个进程算出的结果一致 */
+	uint32_t hash = 2166136261U;
+	for( ; *name; ++name ) {
+		hash = (hash ^ (uint32_t)*name) * 16777619U;
+	}
+	return count > 1 ? (int)(hash % (uint32_t)count) : 0;
+}
+
+void SyncTask_SetThrottle( SyncTask t, ScanThrottle func, void *func_data )
+{
+	DirStats ds = GetDirStats( t );
+	ds->throttle = func;
+	ds->throttle_data = func_data;
+}
+
+int SyncTask_InAddedFiles( SyncTask t, FileHanlder func, void *func_data )
+{
+	return SyncTask_ForEachChange( t, DIFF_ADDED, func, func_data );
+}
+
+int SyncTask_InDeletedFiles( SyncTask t, FileHanlder func, void *func_data )
+{
+	return SyncTask_ForEachChange( t, DIFF_DELETED, func, func_data );
+}
+
+int SyncTask_InModifiedFiles( SyncTask t, FileHanlder func, void *func_data )
+{
+	return SyncTask_ForEachChange( t, DIFF_MODIFIED, func, func_data );
+}
+
+int SyncTask_Start( SyncTask t )
+{
+	int n;
+	FILE *fp;
+	CacheHeaderRec header;
+	DirStats ds = GetDirStats( t );
+	ds->cache = wmapfile( t->file, &ds->cache_size );
+	ds->cache_mapped = TRUE;
+	if( ds->cache && SyncTask_LoadCache( t ) < 0 ) {
+		SyncTask_ReleaseCache( t );
+		fp = _wfopen( t->file, L"rb" );
+		if( fp ) {
+			SyncTask_LoadLegacyCache( t, fp );
+			fclose( fp );
+		}
+	}
+	/* 过滤规则有变化时，之前缓存的目录都可能包含现在被排除的文件 */
+	if( ds->cache && SyncTask_GetFilterDigest( t ) != ds->cache_digest ) {
+		ds->rescan = TRUE;
+		ds->is_dirty = TRUE;
+	}
+	/**
+	 * 只有扫描整个目录树时才使用检查点，过滤规则与检查点记录的不同时，
+	 * 已写完的目录分区中可能包含现在被排除的文件，载入时会被拒绝
+	 */
+	if( ds->dirty_dirs.length == 0 && !ds->rescan ) {
+		SyncTask_LoadCheckpoint( t );
+	}
+	ds->fp = _wfopen( t->tmpfile, L"wb" );
+	if( !ds->fp ) {
+		SyncTask_ClearResume( t );
+		SyncTask_ReleaseCache( t );
+		return -1;
+	}
+	/* 先占住文件头的位置，等扫描完后再写入 */
+	memset( &header, 0, sizeof( header ) );
+	fwrite( &header, sizeof( header ), 1, ds->fp );
+	ds->offset = sizeof( header );
+	ds->checksum = 1;
+	/* 恢复的数据原样写回，分区的位置和校验和都与之前一致 */
+	if( ds->resume ) {
+		SyncTask_Write( t, ds->resume + sizeof( header ),
+				ds->resume_size - sizeof( header ) );
+	}
+	ds->start_time = time( NULL );
+	ds->checkpoint_time = 0;
+	if( ds->dirty_dirs.length == 0 ) {
+		ds->checkpoint_time = ds->start_time;
 	}
 	t->state = STATE_STARTED;
-	fputs( FILE_HEAD_TAG"\n", fp );
-	n = SyncTask_ScanFilesW( t, t->scan_dir, fp );
+	SyncTask_ScanFilesW( t, t->scan_dir );
+	/* 扫描被终止，保存检查点，下次同步时从这里继续 */
+	if( t->state != STATE_STARTED ) {
+		if( ds->checkpoint_time > 0 ) {
+			SyncTask_SaveCheckpoint( t );
+		}
+		fclose( ds->fp );
+		ds->fp = NULL;
+		SyncTask_ClearResume( t );
+		return -1;
+	}
+	SyncTask_Finish( t );
+	n = t->total_files;
 	t->state = STATE_FINISHED;
-	fclose( fp );
+	fclose( ds->fp );
+	ds->fp = NULL;
+	SyncTask_ClearResume( t );
 	return n;
 }
 
+void SyncTask_SetFilter( SyncTask t, PathFilter filter )
+{
+	DirStats ds = GetDirStats( t );
+	if( ds->filter ) {
+		PathFilter_Delete( &ds->filter );
+	}
+	if( filter && PathFilter_GetRuleCount( filter ) == 0 ) {
+		PathFilter_Delete( &filter );
+	}
+	ds->filter = filter;
+	if( filter ) {
+		PathFilter_Compile( filter );
+	}
+}
+
 void SyncTask_Commit( SyncTask t )
 {
+	DirStats ds = GetDirStats( t );
+	/* 映射中的文件无法被删除和重命名，需要先解除映射 */
+	SyncTask_ReleaseCache( t );
+	/* 扫描未完成，保留新的缓存文件和检查点 */
+	if( t->state != STATE_FINISHED ) {
+		return;
+	}
+	_wremove( t->ckptfile );
+	/* 所有目录都没有变化，继续使用之前的缓存文件 */
+	if( !ds->is_dirty ) {
+		_wremove( t->tmpfile );
+		return;
+	}
 	_wremove( t->file );
 	_wrename( t->tmpfile, t->file );
 }
 
+void SyncTask_Delete( SyncTask *tptr )
+{
+	SyncTask t = *tptr;
+	DirStats ds = GetDirStats( t );
+	SyncTask_ReleaseCache( t );
+	free( t->scan_dir );
+	free( t->data_dir );
+	free( t->file );
+	free( t->tmpfile );
+	free( t->ckptfile );
+	t->ckptfile = NULL;
+	t->file = NULL;
+	t->tmpfile = NULL;
+	t->scan_dir = NULL;
+	t->data_dir = NULL;
+	SyncTask_ClearDirCaches( t );
+	PathTrie_Delete( &ds->dirs );
+	LinkedList_Clear( &ds->new_dirs, DirIndex_Delete );
+	LinkedList_Clear( &ds->changes, DirChange_Delete );
+	LinkedList_Clear( &ds->dirty_dirs, free );
+	LinkedList_Clear( &ds->dirty_trees, free );
+	if( ds->scanned_dirs ) {
+		Dict_Release( ds->scanned_dirs );
+	}
+	SyncTask_ClearResume( t );
+	if( ds->filter ) {
+		PathFilter_Delete( &ds->filter );
+	}
+	LCUIMutex_Destroy( &ds->mutex );
+	free( t );
+	*tptr = NULL;
+}
+
 void LCFinder_StopSync( SyncTask t )
 {
 	t->state = STATE_NONE;
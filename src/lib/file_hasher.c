@@ -0,0 +1,241 @@
+﻿/* ***************************************************************************
+* file_hasher.c -- file content hashing in background threads.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* file_hasher.c -- 在后台线程中计算文件内容的哈希值。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "murmur3.h"
+#include "file_hasher.h"
+
+/** 等待计算的文件队列的容量 */
+#define QUEUE_SIZE	256
+/** 每次读取的数据量 */
+#define READ_BUF_SIZE	(256 * 1024)
+
+/** 等待计算的文件 */
+typedef struct FileHashTaskRec_ {
+	int id;			/**< 文件标识号 */
+	wchar_t *path;		/**< 文件路径 */
+} FileHashTaskRec, *FileHashTask;
+
+typedef struct FileHasherRec_ {
+	int n_workers;		/**< 工作线程数量 */
+	LCUI_Thread *threads;	/**< 工作线程列表 */
+	FileHashTaskRec *tasks;	/**< 循环队列 */
+	int head;		/**< 队首位置 */
+	int length;		/**< 队列长度 */
+	int pending;		/**< 已加入但还未计算完的文件数量 */
+	LCUI_BOOL is_running;	/**< 是否正在运行 */
+	LCUI_Mutex mutex;
+	LCUI_Cond not_empty;	/**< 队列中有文件时通知工作线程 */
+	LCUI_Cond not_full;	/**< 队列有空位时通知添加者 */
+	LCUI_Cond idle;		/**< 所有文件都计算完时通知等待者 */
+	FileHashHandler handler;
+	void *data;
+} FileHasherRec;
+
+int FileHasher_HashFile( const wchar_t *path, FileStat st,
+			 unsigned char *hash )
+{
+	return FileHasher_HashFileEx( path, st, hash, NULL, NULL );
+}
+
+int FileHasher_HashFileEx( const wchar_t *path, FileStat st,
+			   unsigned char *hash, FileReadThrottle throttle,
+			   void *throttle_data )
+{
+	FILE *fp;
+	size_t n;
+	MURMUR3_CTX ctx;
+	FileStatRec end_st;
+	unsigned char *buf;
+	if( wgetfilestat( path, st ) != 0 ) {
+		return -1;
+	}
+	fp = _wfopen( path, L"rb" );
+	if( !fp ) {
+		return -1;
+	}
+	buf = malloc( READ_BUF_SIZE );
+	if( !buf ) {
+		fclose( fp );
+		return -1;
+	}
+	Murmur3Init( &ctx, 0 );
+	while( (n = fread( buf, 1, READ_BUF_SIZE, fp )) > 0 ) {
+		Murmur3Update( &ctx, buf, n );
+		if( throttle && throttle( throttle_data, n ) != 0 ) {
+			break;
+		}
+	}
+	Murmur3Final( hash, &ctx );
+	fclose( fp );
+	free( buf );
+	if( n > 0 || wgetfilestat( path, &end_st ) != 0 ||
+	    end_st.size != st->size || end_st.mtime != st->mtime ) {
+		return -1;
+	}
+	return 0;
+}
+
+static void FileHasher_Thread( void *arg )
+{
+	FileHashTaskRec task;
+	FileStatRec st;
+	FileHasher h = arg;
+	unsigned char hash[FILE_HASH_SIZE];
+	/* 以空闲 I/O 优先级读取文件，不和前台程序争抢磁盘 */
+	setthreadbackground();
+	LCUIMutex_Lock( &h->mutex );
+	while( 1 ) {
+		while( h->length == 0 && h->is_running ) {
+			LCUICond_Wait( &h->not_empty, &h->mutex );
+		}
+		if( !h->is_running ) {
+			break;
+		}
+		task = h->tasks[h->head];
+		h->head = (h->head + 1) % QUEUE_SIZE;
+		h->length -= 1;
+		LCUICond_Signal( &h->not_full );
+		LCUIMutex_Unlock( &h->mutex );
+		if( FileHasher_HashFile( task.path, &st, hash ) == 0 ) {
+			h->handler( h->data, task.id, &st, hash );
+		}
+		free( task.path );
+		LCUIMutex_Lock( &h->mutex );
+		h->pending -= 1;
+		if( h->pending == 0 ) {
+			LCUICond_Broadcast( &h->idle );
+		}
+	}
+	LCUIMutex_Unlock( &h->mutex );
+	LCUIThread_Exit( NULL );
+}
+
+FileHasher FileHasher_New( int workers, FileHashHandler func, void *data )
+{
+	int i;
+	FileHasher h = NEW( FileHasherRec, 1 );
+	if( workers < 1 ) {
+		workers = 1;
+	}
+	h->head = 0;
+	h->length = 0;
+	h->pending = 0;
+	h->data = data;
+	h->handler = func;
+	h->is_running = TRUE;
+	h->n_workers = workers;
+	h->tasks = NEW( FileHashTaskRec, QUEUE_SIZE );
+	h->threads = NEW( LCUI_Thread, workers );
+	LCUIMutex_Init( &h->mutex );
+	LCUICond_Init( &h->not_empty );
+	LCUICond_Init( &h->not_full );
+	LCUICond_Init( &h->idle );
+	for( i = 0; i < workers; ++i ) {
+		LCUIThread_Create( &h->threads[i], FileHasher_Thread, h );
+	}
+	return h;
+}
+
+int FileHasher_Add( FileHasher h, int id, const wchar_t *path )
+{
+	FileHashTask task;
+	LCUIMutex_Lock( &h->mutex );
+	while( h->length >= QUEUE_SIZE && h->is_running ) {
+		LCUICond_Wait( &h->not_full, &h->mutex );
+	}
+	if( !h->is_running ) {
+		LCUIMutex_Unlock( &h->mutex );
+		return -1;
+	}
+	task = &h->tasks[(h->head + h->length) % QUEUE_SIZE];
+	task->id = id;
+	task->path = malloc( (wcslen( path ) + 1) * sizeof( wchar_t ) );
+	wcscpy( task->path, path );
+	h->length += 1;
+	h->pending += 1;
+	LCUICond_Signal( &h->not_empty );
+	LCUIMutex_Unlock( &h->mutex );
+	return 0;
+}
+
+void FileHasher_Wait( FileHasher h )
+{
+	LCUIMutex_Lock( &h->mutex );
+	while( h->pending > 0 && h->is_running ) {
+		LCUICond_Wait( &h->idle, &h->mutex );
+	}
+	LCUIMutex_Unlock( &h->mutex );
+}
+
+void FileHasher_Stop( FileHasher h )
+{
+	LCUIMutex_Lock( &h->mutex );
+	h->is_running = FALSE;
+	while( h->length > 0 ) {
+		free( h->tasks[h->head].path );
+		h->head = (h->head + 1) % QUEUE_SIZE;
+		h->length -= 1;
+		h->pending -= 1;
+	}
+	LCUICond_Broadcast( &h->not_empty );
+	LCUICond_Broadcast( &h->not_full );
+	LCUICond_Broadcast( &h->idle );
+	LCUIMutex_Unlock( &h->mutex );
+}
+
+void FileHasher_Delete( FileHasher *hptr )
+{
+	int i;
+	FileHasher h = *hptr;
+	FileHasher_Stop( h );
+	for( i = 0; i < h->n_workers; ++i ) {
+		LCUIThread_Join( h->threads[i], NULL );
+	}
+	LCUICond_Destroy( &h->not_empty );
+	LCUICond_Destroy( &h->not_full );
+	LCUICond_Destroy( &h->idle );
+	LCUIMutex_Destroy( &h->mutex );
+	free( h->threads );
+	free( h->tasks );
+	free( h );
+	*hptr = NULL;
+}
@@ -37,12 +37,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "sqlite3.h"
 #define __FILE_SEARCH_C__
 #include "file_search.h"
 
 #define STORAGE_PATH "data/storage.db"
 #define SQL_BUF_SIZE 1024
+#define SQL_PARAM_SIZE 16
+#define STMT_CACHE_SIZE 32
 
 #ifdef WIN32
 #define strdup _strdup
@@ -51,20 +54,88 @@
 enum SQLCodeList {
 	SQL_ADD_FILE,
 	SQL_DEL_FILE,
+	SQL_MOVE_FILE,
+	SQL_GET_FILE_ID,
+	SQL_GET_UNHASHED_FILES,
+	SQL_SET_FILE_HASH,
+	SQL_DEL_FILE_HASH,
+	SQL_GET_HASHED_FILES,
+	SQL_SET_FILE_CORRUPT,
+	SQL_DEL_FILE_CORRUPT,
+	SQL_GET_SCRUB_STATE,
+	SQL_SET_SCRUB_STATE,
 	SQL_GET_DIR_TOTAL,
 	SQL_GET_DIR_LIST,
 	SQL_ADD_TAG,
 	SQL_ADD_DIR,
 	SQL_DEL_DIR,
+	SQL_SET_DIR_RULES,
+	SQL_GET_FOLDER,
+	SQL_ADD_FOLDER,
+	SQL_SET_FILE_SCORE,
+	SQL_ADD_FILE_TAG,
+	SQL_DEL_FILE_TAG,
+	SQL_DEL_TAG,
 	SQL_TOTAL
 };
 
+/** 延迟写入的操作类型，写入时按这个顺序执行 */
+enum DB_WriteOpType {
+	OP_SET_SCORE,		/**< 设置文件的评分 */
+	OP_SET_TAG,		/**< 为文件添加或移除标签 */
+	OP_DEL_TAG		/**< 删除标签 */
+};
+
+/** 延迟写入的操作，同一文件或标签上的同类操作只需执行最后一个 */
+typedef struct DB_WriteOpRec_ {
+	int type;		/**< 操作类型 */
+	int fid;		/**< 文件标识号 */
+	int tid;		/**< 标签标识号 */
+	int value;		/**< 评分，或者是否添加标签 */
+	int seq;		/**< 操作的先后顺序 */
+} DB_WriteOpRec, *DB_WriteOp;
+
 static struct DB_Module {
 	sqlite3 *db;
 	const char *sqls[SQL_TOTAL];
 	sqlite3_stmt *stmts[SQL_TOTAL];
-	char *sql_buf;
-	int sql_buf_len;
+	/**
+	 * 延迟写入的操作队列
+	 * 评分和标签的变更先记录在队列中，由 DB_Flush() 或 DB_Commit() 在一个
+	 * 事务中一次性写入。DB_Begin() 到 DB_Commit() 期间持有事务锁，避免定时
+	 * 写入插进其它线程正在进行的事务中。
+	 */
+	struct {
+		sqlite3_mutex *mutex;
+		sqlite3_mutex *txn_mutex;
+		int n_txns;
+		int length;
+		int size;
+		DB_WriteOp ops;
+	} writes;
+	/** 上次查找的文件夹，同步时相邻的文件通常位于同一个文件夹中 */
+	struct {
+		int did;
+		int id;
+		int len;
+		char *path;
+	} folder;
+	/**
+	 * 查询语句的缓存
+	 * 查询条件中的值都通过参数绑定，同一种形式的查询条件生成的 SQL 代码相同，
+	 * 直接用 SQL 代码查找预编译好的语句。缓存满了之后淘汰最久没用过的语句，
+	 * 正在被使用的语句不会被淘汰，也不会同时借给另一个查询。
+	 */
+	struct {
+		sqlite3_mutex *mutex;
+		unsigned int clock;
+		struct {
+			char *sql;
+			sqlite3_stmt *stmt;
+			int in_use;
+			unsigned int last_used;
+		} items[STMT_CACHE_SIZE];
+	} cache;
 } self;
 
 #define STATIC_STR static const char*
@@ -74,7 +145,8 @@ PRAGMA foreign_keys=ON;\
 CREATE TABLE IF NOT EXISTS dir (\
 	visible INTEGER DEFAULT 1,\
 	id INTEGER PRIMARY KEY AUTOINCREMENT,\
-	path TEXT NOT NULL\
+	path TEXT NOT NULL,\
+	rules TEXT DEFAULT NULL\
 );\
 CREATE TABLE IF NOT EXISTS file (\
 	id INTEGER PRIMARY KEY AUTOINCREMENT,\
@@ -84,6 +156,7 @@ CREATE TABLE IF NOT EXISTS file (\
 	create_time INTEGER NOT NULL,\
 	FOREIGN KEY(did) REFERENCES dir(id) ON DELETE CASCADE\
 );\
+CREATE INDEX IF NOT EXISTS file_path_index ON file(did, path);\
 CREATE TABLE IF NOT EXISTS tag_group (\
 	id INTEGER PRIMARY KEY AUTOINCREMENT,\
 	name TEXT NOT NULL\
@@ -100,9 +173,110 @@ CREATE TABLE IF NOT EXISTS file_tag_relation (\
 	tid INTEGER NOT NULL,\
 	FOREIGN KEY (fid) REFERENCES file(id) ON DELETE CASCADE,\
 	FOREIGN KEY (tid) REFERENCES tag(id) ON DELETE CASCADE\
+);\
+CREATE TABLE IF NOT EXISTS file_hash (\
+	fid INTEGER PRIMARY KEY,\
+	size INTEGER NOT NULL,\
+	mtime INTEGER NOT NULL,\
+	hash BLOB NOT NULL,\
+	FOREIGN KEY(fid) REFERENCES file(id) ON DELETE CASCADE\
+);\
+CREATE INDEX IF NOT EXISTS file_hash_index ON file_hash(hash, size);\
+CREATE TABLE IF NOT EXISTS file_corrupt (\
+	fid INTEGER PRIMARY KEY,\
+	hash BLOB NOT NULL,\
+	check_time INTEGER NOT NULL,\
+	FOREIGN KEY(fid) REFERENCES file_hash(fid) ON DELETE CASCADE\
+);\
+CREATE TABLE IF NOT EXISTS scrub_state (\
+	id INTEGER PRIMARY KEY,\
+	last_fid INTEGER NOT NULL,\
+	finish_time INTEGER NOT NULL\
 );";
+/** 数据库结构的升级步骤 */
+typedef struct DB_MigrationRec_ {
+	const char *sql;	/**< 升级用的 SQL 代码 */
+	int (*func)(void);	/**< 需要逐行转换数据时，在 SQL 代码之后调用 */
+	int vacuum;		/**< 升级后是否需要整理数据库文件以释放空间 */
+} DB_MigrationRec;
+
+static int DB_MigrateFolders( void );
+
+/**
+ * 数据库结构的升级步骤
+ * 数据库的 user_version 记录已完成的步骤数量，打开数据库时依次执行还未完成的
+ * 步骤。新的结构变更只能追加到末尾，不能修改已有的步骤。
+ */
+static const DB_MigrationRec sql_migrations[] = {
+	{
+	/**
+	 * 1: 为界面的查询添加索引
+	 * 按创建时间和评分排序、按标签筛选时都不再需要扫描整个表，索引中隐含了
+	 * 文件标识号，按标签筛选时只读索引就能找到文件。删除文件时级联删除标签
+	 * 关系也需要按文件标识号查找。
+	 */
+	"CREATE INDEX IF NOT EXISTS file_create_time_index ON file(create_time);\
+CREATE INDEX IF NOT EXISTS file_score_index ON file(score);\
+CREATE INDEX IF NOT EXISTS file_tag_relation_index \
+ON file_tag_relation(tid, fid);\
+CREATE INDEX IF NOT EXISTS file_tag_relation_fid_index \
+ON file_tag_relation(fid);", NULL, 0
+	}, {
+	/**
+	 * 2: 将文件路径拆分成文件夹和文件名
+	 * 文件夹记录在 folder 表中，文件表只记录所在文件夹的标识号和文件名，不再
+	 * 重复存储完整路径。文件夹的 path 字段保存以分隔符结尾的完整路径，用于
+	 * 拼接出文件的完整路径。文件表需要重建，由 DB_MigrateFolders() 复制数据。
+	 */
+	"CREATE TABLE IF NOT EXISTS folder (\
+	id INTEGER PRIMARY KEY AUTOINCREMENT,\
+	did INTEGER NOT NULL,\
+	parent_id INTEGER DEFAULT NULL,\
+	name TEXT NOT NULL,\
+	path TEXT NOT NULL,\
+	FOREIGN KEY(did) REFERENCES dir(id) ON DELETE CASCADE,\
+	FOREIGN KEY(parent_id) REFERENCES folder(id) ON DELETE CASCADE\
+);\
+CREATE UNIQUE INDEX IF NOT EXISTS folder_path_index ON folder(did, path);\
+CREATE INDEX IF NOT EXISTS folder_parent_index ON folder(parent_id);\
+CREATE TABLE file_new (\
+	id INTEGER PRIMARY KEY AUTOINCREMENT,\
+	did INTEGER NOT NULL,\
+	folder_id INTEGER NOT NULL,\
+	name TEXT NOT NULL,\
+	score INTEGER DEFAULT 0,\
+	create_time INTEGER NOT NULL,\
+	FOREIGN KEY(did) REFERENCES dir(id) ON DELETE CASCADE,\
+	FOREIGN KEY(folder_id) REFERENCES folder(id) ON DELETE CASCADE\
+);", DB_MigrateFolders, 1
+	}
+};
+STATIC_STR sql_migrate_get_files = "\
+SELECT f.id, f.did, f.path, f.score, f.create_time, d.path \
+FROM file f, dir d WHERE d.id = f.did ORDER BY f.did, f.path;";
+STATIC_STR sql_migrate_add_file = "\
+INSERT INTO file_new(id, did, folder_id, name, score, create_time) \
+VALUES(?, ?, ?, ?, ?, ?);";
+/**
+ * 用新的文件表替换旧的文件表
+ * 旧的 file_path_index 随旧表一起删除，新表上同名的索引改为按文件夹和文件名
+ * 查找，初始化时创建旧索引的语句就会被跳过。
+ */
+STATIC_STR sql_migrate_replace_file = "\
+DROP TABLE file;\
+ALTER TABLE file_new RENAME TO file;\
+CREATE INDEX file_path_index ON file(folder_id, name);\
+CREATE INDEX file_did_index ON file(did);\
+CREATE INDEX file_create_time_index ON file(create_time);\
+CREATE INDEX file_score_index ON file(score);";
+STATIC_STR sql_get_user_version = "PRAGMA user_version;";
+STATIC_STR sql_set_user_version = "PRAGMA user_version = %d;";
+/* 之前版本创建的 dir 表没有 rules 字段 */
+STATIC_STR sql_add_dir_rules = "\
+ALTER TABLE dir ADD COLUMN rules TEXT DEFAULT NULL;";
 STATIC_STR sql_get_dir_list = "\
-SELECT id, path FROM dir ORDER BY PATH ASC;";
+SELECT id, path, rules FROM dir ORDER BY PATH ASC;";
+STATIC_STR sql_set_dir_rules = "UPDATE dir SET rules = ? WHERE id = ?;";
 STATIC_STR sql_get_tag_list = "\
 SELECT t.id, t.name, COUNT(ftr.tid) FROM tag t, file_tag_relation ftr \
 WHERE ftr.tid = t.id GROUP BY ftr.tid ORDER BY NAME ASC;\
@@ -112,98 +286,480 @@ STATIC_STR sql_get_tag_total = "SELECT COUNT(*) FROM tag;";
 STATIC_STR sql_add_dir = "INSERT INTO dir(path) VALUES(?);";
 STATIC_STR sql_del_dir = "DELETE FROM dir WHERE id = ?;";
 STATIC_STR sql_add_tag = "INSERT INTO tag(name) VALUES(?);";
-STATIC_STR sql_remove_tag = "DELETE FROM tag WHERE id = %d;";
-STATIC_STR sql_file_set_score = "UPDATE file SET score = %d WHERE id = %d;";
+STATIC_STR sql_remove_tag = "DELETE FROM tag WHERE id = ?;";
+STATIC_STR sql_file_set_score = "UPDATE file SET score = ? WHERE id = ?;";
 STATIC_STR sql_file_add_tag = "\
-REPLACE INTO file_tag_relation(fid, did, tid) VALUES(%d, %d, %d);";
+INSERT INTO file_tag_relation(fid, tid) SELECT ?1, ?2 WHERE NOT EXISTS \
+(SELECT fid FROM file_tag_relation WHERE fid = ?1 AND tid = ?2);";
 STATIC_STR sql_file_remove_tag = "\
-DELETE FROM file_tag_relation WHERE fid = %d AND tid = %d;";
+DELETE FROM file_tag_relation WHERE fid = ? AND tid = ?;";
+STATIC_STR sql_get_folder = "\
+SELECT id FROM folder WHERE did = ? AND path = ?;";
+STATIC_STR sql_add_folder = "\
+INSERT INTO folder(did, parent_id, name, path) VALUES(?, ?, ?, ?);";
 STATIC_STR sql_add_file = "\
-INSERT INTO file(did, path, create_time) VALUES(?,  ?, ?);";
+INSERT INTO file(did, folder_id, name, create_time) SELECT ?1, ?2, ?3, ?4 \
+WHERE NOT EXISTS (SELECT id FROM file WHERE folder_id = ?2 AND name = ?3);";
 STATIC_STR sql_del_file = "\
-DELETE FROM file WHERE did = ? AND path = ?;";
+DELETE FROM file WHERE folder_id = ? AND name = ?;";
+STATIC_STR sql_move_file = "\
+UPDATE file SET did = ?, folder_id = ?, name = ? WHERE id = ?;";
+STATIC_STR sql_get_file_id = "\
+SELECT id FROM file WHERE folder_id = ? AND name = ?;";
+STATIC_STR sql_get_unhashed_files = "\
+SELECT f.id, f.did, f.score, fo.path || f.name, f.create_time FROM file f \
+JOIN folder fo ON fo.id = f.folder_id LEFT JOIN file_hash h ON h.fid = f.id \
+WHERE h.fid IS NULL AND f.id > ? ORDER BY f.id LIMIT ?;";
+STATIC_STR sql_set_file_hash = "\
+REPLACE INTO file_hash(fid, size, mtime, hash) VALUES(?, ?, ?, ?);";
+STATIC_STR sql_del_file_hash = "\
+DELETE FROM file_hash WHERE fid IN \
+(SELECT id FROM file WHERE folder_id = ? AND name = ?);";
+STATIC_STR sql_get_hashed_files = "\
+SELECT f.id, f.did, f.score, fo.path || f.name, f.create_time, \
+h.size, h.mtime, h.hash FROM file_hash h, file f, folder fo \
+WHERE f.id = h.fid AND fo.id = f.folder_id AND h.fid > ? \
+ORDER BY h.fid LIMIT ?;";
+STATIC_STR sql_set_file_corrupt = "\
+REPLACE INTO file_corrupt(fid, hash, check_time) VALUES(?, ?, ?);";
+STATIC_STR sql_del_file_corrupt = "DELETE FROM file_corrupt WHERE fid = ?;";
+STATIC_STR sql_get_corrupt_files = "\
+SELECT f.id, f.did, f.score, fo.path || f.name, f.create_time \
+FROM file_corrupt c, file f, folder fo \
+WHERE f.id = c.fid AND fo.id = f.folder_id ORDER BY c.check_time DESC;";
+STATIC_STR sql_get_scrub_state = "\
+SELECT last_fid, finish_time FROM scrub_state WHERE id = 0;";
+STATIC_STR sql_set_scrub_state = "\
+REPLACE INTO scrub_state(id, last_fid, finish_time) VALUES(0, ?, ?);";
+STATIC_STR sql_get_duplicate_files = "\
+SELECT f.id, f.did, f.score, fo.path || f.name, f.create_time, h.size, h.hash \
+FROM file_hash h, file f, folder fo, (SELECT hash, size FROM file_hash \
+GROUP BY hash, size HAVING COUNT(*) > 1) d \
+WHERE h.hash = d.hash AND h.size = d.size AND f.id = h.fid \
+AND fo.id = f.folder_id \
+ORDER BY h.size DESC, h.hash, f.id;";
 STATIC_STR sql_get_tag_id = "SELECT id FROM tag WHERE name = \"%s\";";
 STATIC_STR sql_get_dir_id = "SELECT id FROM dir WHERE path = \"%s\";";
+/** 文件的完整路径由所在文件夹的路径和文件名拼接而成，文件名用于按名称分页 */
 STATIC_STR sql_search_files = "\
-SELECT f.id, f.did, f.score, f.path, f.create_time FROM file f";
+SELECT f.id, f.did, f.score, fo.path || f.name, f.create_time, f.name \
+FROM file f JOIN folder fo ON fo.id = f.folder_id";
 STATIC_STR sql_count_files = "SELECT COUNT(f.id) FROM file f";
+STATIC_STR sql_get_dir_paths = "SELECT id, path FROM dir;";
+STATIC_STR sql_find_folder = "\
+SELECT id FROM folder WHERE did = ? AND path = ?;";
+/**
+ * 查询语句中的参数编号
+ * ?1 ~ ?3 为游标的排序字段，之后依次是每页数量、文件名下限、目录的标识号、
+ * LIMIT 和 OFFSET 的值，源文件夹和标签的标识号排在最后。
+ */
+enum DB_QueryParam {
+	PARAM_PAGE_SIZE = 4,
+	PARAM_LAST_NAME,
+	PARAM_FOLDER,
+	PARAM_LIMIT,
+	PARAM_OFFSET,
+	PARAM_IDS
+};
+/**
+ * 按目录筛选文件的条件
+ * ?6 为目录的标识号，?5 为文件名的下限，通常是空字符串，按文件名分页时则是
+ * 上一个文件的文件名。
+ */
+STATIC_STR sql_dirpath_terms = " f.folder_id = ?6 AND f.name > ?5";
+/** 分页游标的排序字段，下标加 1 即为绑定参数的编号 */
+STATIC_STR sql_cursor_keys[3] = { "f.create_time", "f.score", "f.id" };
+STATIC_STR sql_attach_catalog = "ATTACH DATABASE ? AS catalog;";
+STATIC_STR sql_detach_catalog = "DETACH DATABASE catalog;";
+/**
+ * 合并分片目录
+ * 先按路径建立源文件夹和文件夹标识号的映射表，再按文件夹和文件名建立文件
+ * 标识号的映射表，上级文件夹、标签关系和内容哈希值都通过映射表转换成当前
+ * 数据库中的标识号。
+ */
+STATIC_STR sql_merge_catalog = "\
+INSERT INTO main.dir(path, rules) SELECT c.path, c.rules FROM catalog.dir c \
+WHERE NOT EXISTS (SELECT id FROM main.dir WHERE path = c.path);\
+CREATE TEMP TABLE dir_map AS SELECT c.id AS old_id, d.id AS new_id \
+FROM catalog.dir c, main.dir d WHERE d.path = c.path;\
+INSERT INTO main.folder(did, name, path) SELECT m.new_id, c.name, c.path \
+FROM catalog.folder c, temp.dir_map m WHERE c.did = m.old_id AND NOT EXISTS \
+(SELECT id FROM main.folder WHERE did = m.new_id AND path = c.path);\
+CREATE TEMP TABLE folder_map AS SELECT c.id AS old_id, f.id AS new_id \
+FROM catalog.folder c, temp.dir_map m, main.folder f \
+WHERE c.did = m.old_id AND f.did = m.new_id AND f.path = c.path;\
+UPDATE main.folder SET parent_id = (SELECT p.new_id \
+FROM temp.folder_map m, catalog.folder c, temp.folder_map p \
+WHERE m.new_id = main.folder.id AND c.id = m.old_id AND p.old_id = c.parent_id) \
+WHERE parent_id IS NULL AND id IN (SELECT new_id FROM temp.folder_map);\
+INSERT INTO main.file(did, folder_id, name, score, create_time) \
+SELECT m.new_id, fm.new_id, c.name, c.score, c.create_time \
+FROM catalog.file c, temp.dir_map m, temp.folder_map fm \
+WHERE c.did = m.old_id AND c.folder_id = fm.old_id AND NOT EXISTS \
+(SELECT id FROM main.file WHERE folder_id = fm.new_id AND name = c.name);\
+CREATE TEMP TABLE file_map AS SELECT c.id AS old_id, f.id AS new_id \
+FROM catalog.file c, temp.folder_map fm, main.file f \
+WHERE c.folder_id = fm.old_id AND f.folder_id = fm.new_id AND f.name = c.name;\
+INSERT OR IGNORE INTO temp.merged_file(id) SELECT new_id FROM temp.file_map;\
+INSERT INTO main.tag(name, alias, visible) \
+SELECT c.name, c.alias, c.visible FROM catalog.tag c \
+WHERE NOT EXISTS (SELECT id FROM main.tag WHERE name = c.name);\
+INSERT INTO main.file_tag_relation(fid, tid) SELECT DISTINCT fm.new_id, t.id \
+FROM catalog.file_tag_relation r, temp.file_map fm, catalog.tag c, main.tag t \
+WHERE r.fid = fm.old_id AND r.tid = c.id AND t.name = c.name AND NOT EXISTS \
+(SELECT fid FROM main.file_tag_relation WHERE fid = fm.new_id AND tid = t.id);\
+REPLACE INTO main.file_hash(fid, size, mtime, hash) \
+SELECT fm.new_id, h.size, h.mtime, h.hash \
+FROM catalog.file_hash h, temp.file_map fm WHERE h.fid = fm.old_id;";
+/** 记录已合并的文件，用于找出没有出现在任何一个分片中的文件 */
+STATIC_STR sql_merged_file_table = "\
+CREATE TEMP TABLE IF NOT EXISTS merged_file(id INTEGER PRIMARY KEY);";
+STATIC_STR sql_count_merged_files = "SELECT COUNT(*) FROM temp.file_map;";
+STATIC_STR sql_drop_merge_maps = "\
+DROP TABLE IF EXISTS temp.dir_map;\
+DROP TABLE IF EXISTS temp.folder_map;\
+DROP TABLE IF EXISTS temp.file_map;";
+STATIC_STR sql_prune_merged_dir = "\
+DELETE FROM file WHERE did = ? AND id NOT IN (SELECT id FROM temp.merged_file);";
+STATIC_STR sql_end_merge = "DROP TABLE IF EXISTS temp.merged_file;";
 
-/** 缓存 SQL 代码，等到调用 DB_Commit() 时再一次性处理掉 */
-static int DB_CacheSQL( const char *sql )
+/** 将操作追加到延迟写入队列，与队尾相同对象的同类操作直接合并 */
+static int DB_AddWriteOp( int type, int fid, int tid, int value )
 {
-	int len;
-	char *buf, *tail;
-	len = strlen( sql ) + 2;
-	if( self.sql_buf ) {
-		len += self.sql_buf_len;
-		buf = realloc( self.sql_buf, sizeof( char )*(len + 1) );
-		tail = buf + self.sql_buf_len;
-	} else {
-		buf = malloc( sizeof( char )*(len + 1) );
-		tail = buf;
+	DB_WriteOp op, ops;
+	sqlite3_mutex_enter( self.writes.mutex );
+	op = self.writes.length > 0 ? 
+		&self.writes.ops[self.writes.length - 1] : NULL;
+	if( op && op->type == type && op->fid == fid && op->tid == tid ) {
+		op->value = value;
+		sqlite3_mutex_leave( self.writes.mutex );
+		return 0;
 	}
-	if( !buf ) {
-		return -1;
+	if( self.writes.length >= self.writes.size ) {
+		int size = self.writes.size > 0 ? self.writes.size * 2 : 64;
+		ops = realloc( self.writes.ops, sizeof( DB_WriteOpRec )*size );
+		if( !ops ) {
+			sqlite3_mutex_leave( self.writes.mutex );
+			return -1;
+		}
+		self.writes.ops = ops;
+		self.writes.size = size;
 	}
-	sprintf( tail, "%s;\n", sql );
-	self.sql_buf = buf;
-	self.sql_buf_len = len;
+	op = &self.writes.ops[self.writes.length];
+	op->type = type;
+	op->fid = fid;
+	op->tid = tid;
+	op->value = value;
+	op->seq = self.writes.length++;
+	sqlite3_mutex_leave( self.writes.mutex );
 	return 0;
 }
 
-/** 检测目录的下一级文件列表中是否有指定文件 */
-static int DirHasFile( const char *dirpath, const char *filepath )
+static int DB_CompareWriteOp( const void *a, const void *b )
 {
-	const char *p1, *p2;
-	for( p1 = dirpath, p2 = filepath; *p1 && *p2; ++p1, ++p2 ) {
-		if( *p1 != *p2 ) {
-			break;
-		}
+	const DB_WriteOpRec *op1 = a, *op2 = b;
+	if( op1->type != op2->type ) {
+		return op1->type - op2->type;
+	}
+	if( op1->fid != op2->fid ) {
+		return op1->fid < op2->fid ? -1 : 1;
 	}
-	/* 目录路径必须比文件路径短 */
-	if( *p1 || !*p2 ) {
+	if( op1->tid != op2->tid ) {
+		return op1->tid < op2->tid ? -1 : 1;
+	}
+	return op1->seq - op2->seq;
+}
+
+/**
+ * 执行队列中的操作
+ * 按类型、文件和标签排序后，同一对象的同类操作排在一起，只执行最后一个。
+ * 标签关系的变更在删除标签之前执行，被删除的标签的关系会被级联删除，与依次
+ * 执行的结果相同。调用者需要持有事务锁。
+ * @returns 实际执行的操作数量
+ */
+static int DB_ExecWriteOps( void )
+{
+	int i, n, count = 0;
+	DB_WriteOp ops, op;
+	sqlite3_stmt *stmt;
+	sqlite3_mutex_enter( self.writes.mutex );
+	ops = self.writes.ops;
+	n = self.writes.length;
+	self.writes.ops = NULL;
+	self.writes.length = 0;
+	self.writes.size = 0;
+	sqlite3_mutex_leave( self.writes.mutex );
+	if( n == 0 ) {
+		free( ops );
 		return 0;
 	}
-	if( p1 != dirpath ) {
-		/* 如果目录路径最后一个字符不是路径分隔符 */
-		if( p1[-1] != '\\' && p1[-1] != '/' ) {
-			if( *p2 != '\\' && *p2 != '/' ) {
-				return 0;
+	qsort( ops, n, sizeof( DB_WriteOpRec ), DB_CompareWriteOp );
+	for( i = 0; i < n; ++i ) {
+		op = &ops[i];
+		if( i + 1 < n && op[1].type == op->type && 
+		    op[1].fid == op->fid && op[1].tid == op->tid ) {
+			continue;
+		}
+		switch( op->type ) {
+		case OP_SET_SCORE:
+			stmt = self.stmts[SQL_SET_FILE_SCORE];
+			sqlite3_reset( stmt );
+			sqlite3_bind_int( stmt, 1, op->value );
+			sqlite3_bind_int( stmt, 2, op->fid );
+			break;
+		case OP_SET_TAG:
+			if( op->value ) {
+				stmt = self.stmts[SQL_ADD_FILE_TAG];
+			} else {
+				stmt = self.stmts[SQL_DEL_FILE_TAG];
 			}
+			sqlite3_reset( stmt );
+			sqlite3_bind_int( stmt, 1, op->fid );
+			sqlite3_bind_int( stmt, 2, op->tid );
+			break;
+		case OP_DEL_TAG:
+			stmt = self.stmts[SQL_DEL_TAG];
+			sqlite3_reset( stmt );
+			sqlite3_bind_int( stmt, 1, op->tid );
+			break;
+		default: continue;
 		}
+		sqlite3_step( stmt );
+		sqlite3_reset( stmt );
+		++count;
 	}
-	/* 检测剩余这段文件路径是否包含路径分隔符 */
-	while( *p2++ ) {
-		if( *p2 == '\\' || *p2 == '/' ) {
-			return 0;
+	free( ops );
+	return count;
+}
+
+#define IS_PATH_SEP(C) ((C) == '\\' || (C) == '/')
+
+/** 获取文件名在路径中的位置，前面的部分就是以分隔符结尾的文件夹路径 */
+static const char *DB_GetFileName( const char *filepath )
+{
+	const char *p, *name = filepath;
+	for( p = filepath; *p; ++p ) {
+		if( IS_PATH_SEP( *p ) ) {
+			name = p + 1;
 		}
 	}
-	return 1;
+	return name;
 }
 
-static void sqlite3_hasfile( sqlite3_context *ctx, int argc, sqlite3_value **argv )
+/**
+ * 获取文件夹的标识号
+ * @param[in] did 文件夹所属的源文件夹的标识号
+ * @param[in] root 源文件夹的路径，创建文件夹时用于确定从哪一级开始记录
+ * @param[in] path 以分隔符结尾的文件夹路径
+ * @param[in] len 文件夹路径的长度
+ * @param[in] create 文件夹不存在时是否创建，它的上级文件夹也会一并创建
+ * @returns 找不到时返回 0
+ */
+static int DB_GetFolderId( int did, const char *root, const char *path,
+			   int len, int create )
 {
-	const char *dirpath, *filepath;
-	if( argc != 2 ) {
-		return;
+	char *buf;
+	const char *name;
+	int i, id = 0, parent_id = 0, root_len, name_len;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_FOLDER];
+	if( self.folder.path && self.folder.did == did &&
+	    self.folder.len == len &&
+	    strncmp( self.folder.path, path, len ) == 0 ) {
+		return self.folder.id;
 	}
-	if( sqlite3_value_type( argv[0] ) != SQLITE_TEXT ) {
-		return;
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, did );
+	sqlite3_bind_text( stmt, 2, path, len, NULL );
+	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		id = sqlite3_column_int( stmt, 0 );
 	}
-	if( sqlite3_value_type( argv[1] ) != SQLITE_TEXT ) {
-		return;
+	sqlite3_reset( stmt );
+	if( id == 0 && create ) {
+		root_len = strlen( root );
+		if( root_len > 0 && !IS_PATH_SEP( root[root_len - 1] ) ) {
+			++root_len;
+		}
+		for( i = len - 2; i >= 0 && !IS_PATH_SEP( path[i] ); --i );
+		/* 源文件夹本身没有上级文件夹，名称就是它的完整路径 */
+		if( len > root_len && i >= 0 ) {
+			parent_id = DB_GetFolderId( did, root, path, 
+						    i + 1, 1 );
+			name = path + i + 1;
+			name_len = len - i - 2;
+		} else {
+			name = path;
+			name_len = len > 1 ? len - 1 : len;
+		}
+		stmt = self.stmts[SQL_ADD_FOLDER];
+		sqlite3_reset( stmt );
+		sqlite3_bind_int( stmt, 1, did );
+		if( parent_id > 0 ) {
+			sqlite3_bind_int( stmt, 2, parent_id );
+		} else {
+			sqlite3_bind_null( stmt, 2 );
+		}
+		sqlite3_bind_text( stmt, 3, name, name_len, NULL );
+		sqlite3_bind_text( stmt, 4, path, len, NULL );
+		sqlite3_step( stmt );
+		sqlite3_reset( stmt );
+		return DB_GetFolderId( did, root, path, len, 0 );
+	}
+	if( id > 0 ) {
+		buf = realloc( self.folder.path, sizeof( char )*(len + 1) );
+		if( buf ) {
+			strncpy( buf, path, len );
+			buf[len] = 0;
+			self.folder.path = buf;
+			self.folder.did = did;
+			self.folder.len = len;
+			self.folder.id = id;
+		}
+	}
+	return id;
+}
+
+/** 获取文件所在文件夹的标识号 */
+static int DB_GetFileFolderId( DB_Dir dir, const char *filepath,
+			       int create )
+{
+	int len = DB_GetFileName( filepath ) - filepath;
+	return DB_GetFolderId( dir->id, dir->path, filepath, len, create );
+}
+
+/** 清除文件夹标识号的缓存，文件夹被删除后需要调用 */
+static void DB_ClearFolderCache( void )
+{
+	self.folder.did = 0;
+	self.folder.id = 0;
+	self.folder.len = 0;
+}
+
+/** 将旧文件表中的记录复制到新文件表，并记录各个文件所在的文件夹 */
+static int DB_MigrateFolders( void )
+{
+	DB_DirRec dir;
+	const char *path;
+	int ret = 0, folder_id;
+	sqlite3_stmt *stmt, *stmt_add;
+	if( sqlite3_prepare_v2( self.db, sql_migrate_get_files, -1,
+				&stmt, NULL ) != SQLITE_OK ) {
+		return -1;
+	}
+	if( sqlite3_prepare_v2( self.db, sql_migrate_add_file, -1,
+				&stmt_add, NULL ) != SQLITE_OK ) {
+		sqlite3_finalize( stmt );
+		return -1;
+	}
+	/* 文件夹相关的语句在升级完成后才会和其它语句一起预编译，这里先准备好 */
+	sqlite3_prepare_v2( self.db, sql_get_folder, -1,
+			    &self.stmts[SQL_GET_FOLDER], NULL );
+	sqlite3_prepare_v2( self.db, sql_add_folder, -1,
+			    &self.stmts[SQL_ADD_FOLDER], NULL );
+	while( ret == 0 && sqlite3_step( stmt ) == SQLITE_ROW ) {
+		dir.id = sqlite3_column_int( stmt, 1 );
+		dir.path = (char*)sqlite3_column_text( stmt, 5 );
+		path = (const char*)sqlite3_column_text( stmt, 2 );
+		folder_id = DB_GetFileFolderId( &dir, path, 1 );
+		if( folder_id == 0 ) {
+			ret = -1;
+			break;
+		}
+		sqlite3_reset( stmt_add );
+		sqlite3_bind_int( stmt_add, 1, sqlite3_column_int( stmt, 0 ) );
+		sqlite3_bind_int( stmt_add, 2, dir.id );
+		sqlite3_bind_int( stmt_add, 3, folder_id );
+		sqlite3_bind_text( stmt_add, 4, DB_GetFileName( path ), 
+				   -1, NULL );
+		sqlite3_bind_int( stmt_add, 5, sqlite3_column_int( stmt, 3 ) );
+		sqlite3_bind_int( stmt_add, 6, sqlite3_column_int( stmt, 4 ) );
+		if( sqlite3_step( stmt_add ) != SQLITE_DONE ) {
+			ret = -1;
+		}
 	}
-	dirpath = sqlite3_value_text( argv[0] );
-	filepath = sqlite3_value_text( argv[1] );
-	sqlite3_result_int( ctx, DirHasFile( dirpath, filepath ) );
+	sqlite3_finalize( stmt );
+	sqlite3_finalize( stmt_add );
+	sqlite3_finalize( self.stmts[SQL_GET_FOLDER] );
+	sqlite3_finalize( self.stmts[SQL_ADD_FOLDER] );
+	self.stmts[SQL_GET_FOLDER] = NULL;
+	self.stmts[SQL_ADD_FOLDER] = NULL;
+	/* 升级失败时会回滚，缓存的文件夹标识号可能已经无效 */
+	DB_ClearFolderCache();
+	if( ret != 0 ) {
+		return ret;
+	}
+	if( sqlite3_exec( self.db, sql_migrate_replace_file, 
+			  NULL, NULL, NULL ) != SQLITE_OK ) {
+		return -1;
+	}
+	return 0;
+}
+
+/** 执行还未完成的数据库结构升级步骤，每一步都在单独的事务中执行 */
+static int DB_Migrate( void )
+{
+	int vacuum = 0;
+	int ret, i, version = 0;
+	int n = sizeof( sql_migrations ) / sizeof( sql_migrations[0] );
+	char sql[64], *errmsg = NULL;
+	sqlite3_stmt *stmt;
+	ret = sqlite3_prepare_v2( self.db, sql_get_user_version, -1,
+				  &stmt, NULL );
+	if( ret != SQLITE_OK ) {
+		return -1;
+	}
+	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		version = sqlite3_column_int( stmt, 0 );
+	}
+	sqlite3_finalize( stmt );
+	if( version >= n ) {
+		return 0;
+	}
+	/* 重建数据表时不能让外键约束级联删除其它表中的记录，事务中不能切换 */
+	sqlite3_exec( self.db, "PRAGMA foreign_keys=OFF;", NULL, NULL, NULL );
+	for( i = version; i < n; ++i ) {
+		printf( "[database] migrate to version %d\n", i + 1 );
+		sqlite3_exec( self.db, "begin;", NULL, NULL, NULL );
+		ret = sqlite3_exec( self.db, sql_migrations[i].sql, NULL, NULL, 
+				    &errmsg );
+		if( ret == SQLITE_OK && sql_migrations[i].func &&
+		    sql_migrations[i].func() != 0 ) {
+			errmsg = sqlite3_mprintf( "%s", sqlite3_errmsg( self.db ) );
+			ret = SQLITE_ERROR;
+		}
+		if( ret == SQLITE_OK ) {
+			sprintf( sql, sql_set_user_version, i + 1 );
+			ret = sqlite3_exec( self.db, sql, NULL, NULL, &errmsg );
+		}
+		if( ret != SQLITE_OK ) {
+			printf( "[database] error: %s\n", errmsg );
+			sqlite3_free( errmsg );
+			sqlite3_exec( self.db, "rollback;", NULL, NULL, NULL );
+			sqlite3_exec( self.db, "PRAGMA foreign_keys=ON;", 
+				      NULL, NULL, NULL );
+			return -1;
+		}
+		sqlite3_exec( self.db, "commit;", NULL, NULL, NULL );
+		vacuum = vacuum || sql_migrations[i].vacuum;
+	}
+	sqlite3_exec( self.db, "PRAGMA foreign_keys=ON;", NULL, NULL, NULL );
+	if( vacuum ) {
+		printf( "[database] vacuum ...\n" );
+		sqlite3_exec( self.db, "VACUUM;", NULL, NULL, NULL );
+	}
+	return 0;
 }
 
 int DB_Init( void )
+{
+	return DB_InitFile( STORAGE_PATH );
+}
+
+int DB_InitFile( const char *path )
 {
 	int i, ret;
 	char *errmsg;
 	printf( "[database] init ...\n" );
-	ret = sqlite3_open( STORAGE_PATH, &self.db );
+	ret = sqlite3_open( path, &self.db );
 	if( ret != SQLITE_OK ) {
 		printf("[database] open failed\n");
 		return -1;
@@ -213,15 +769,35 @@ int DB_Init( void )
 		printf( "[database] error: %s\n", errmsg );
 		return -2;
 	}
-	sqlite3_create_function( self.db, "hasfile", 2, SQLITE_UTF8, NULL, 
-				 sqlite3_hasfile, NULL, NULL );
+	/* 字段已存在时会出错，忽略即可 */
+	sqlite3_exec( self.db, sql_add_dir_rules, NULL, NULL, NULL );
+	if( DB_Migrate() != 0 ) {
+		return -3;
+	}
 	self.sqls[SQL_ADD_FILE] = sql_add_file;
 	self.sqls[SQL_DEL_FILE] = sql_del_file;
+	self.sqls[SQL_MOVE_FILE] = sql_move_file;
+	self.sqls[SQL_GET_FILE_ID] = sql_get_file_id;
+	self.sqls[SQL_GET_UNHASHED_FILES] = sql_get_unhashed_files;
+	self.sqls[SQL_SET_FILE_HASH] = sql_set_file_hash;
+	self.sqls[SQL_DEL_FILE_HASH] = sql_del_file_hash;
+	self.sqls[SQL_GET_HASHED_FILES] = sql_get_hashed_files;
+	self.sqls[SQL_SET_FILE_CORRUPT] = sql_set_file_corrupt;
+	self.sqls[SQL_DEL_FILE_CORRUPT] = sql_del_file_corrupt;
+	self.sqls[SQL_GET_SCRUB_STATE] = sql_get_scrub_state;
+	self.sqls[SQL_SET_SCRUB_STATE] = sql_set_scrub_state;
 	self.sqls[SQL_ADD_DIR] = sql_add_dir;
 	self.sqls[SQL_DEL_DIR] = sql_del_dir;
+	self.sqls[SQL_SET_DIR_RULES] = sql_set_dir_rules;
 	self.sqls[SQL_ADD_TAG] = sql_add_tag;
 	self.sqls[SQL_GET_DIR_LIST] = sql_get_dir_list;
 	self.sqls[SQL_GET_DIR_TOTAL] = sql_get_dir_total;
+	self.sqls[SQL_GET_FOLDER] = sql_get_folder;
+	self.sqls[SQL_ADD_FOLDER] = sql_add_folder;
+	self.sqls[SQL_SET_FILE_SCORE] = sql_file_set_score;
+	self.sqls[SQL_ADD_FILE_TAG] = sql_file_add_tag;
+	self.sqls[SQL_DEL_FILE_TAG] = sql_file_remove_tag;
+	self.sqls[SQL_DEL_TAG] = sql_remove_tag;
 	for( i = 0; i < SQL_TOTAL; ++i ) {
 		sqlite3_stmt *stmt;
 		const char *sql = self.sqls[i];
@@ -233,8 +809,9 @@ int DB_Init( void )
 		}
 		stmt = NULL;
 	}
-	self.sql_buf = NULL;
-	self.sql_buf_len = 0;
+	self.writes.mutex = sqlite3_mutex_alloc( SQLITE_MUTEX_FAST );
+	self.writes.txn_mutex = sqlite3_mutex_alloc( SQLITE_MUTEX_RECURSIVE );
+	self.cache.mutex = sqlite3_mutex_alloc( SQLITE_MUTEX_FAST );
 	printf( "[database] init done\n" );
 	return 0;
 }
@@ -263,6 +840,7 @@ DB_Dir DB_AddDir( const char *dirpath )
 	dir = malloc( sizeof( DB_DirRec ) );
 	dir->id = sqlite3_column_int( stmt, 0 );
 	dir->path = strdup( dirpath );
+	dir->rules = NULL;
 	sqlite3_finalize( stmt );
 	return dir;
 }
@@ -273,6 +851,29 @@ void DB_DeleteDir( DB_Dir dir )
 	sqlite3_reset( stmt );
 	sqlite3_bind_int( stmt, 1, dir->id );
 	sqlite3_step( stmt );
+	/* 源文件夹中的文件夹记录已被级联删除 */
+	DB_ClearFolderCache();
+}
+
+void DB_SetDirRules( DB_Dir dir, const char *rules )
+{
+	char *str = NULL;
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_DIR_RULES];
+	if( rules && rules[0] ) {
+		str = strdup( rules );
+	}
+	sqlite3_reset( stmt );
+	if( str ) {
+		sqlite3_bind_text( stmt, 1, str, strlen( str ), NULL );
+	} else {
+		sqlite3_bind_null( stmt, 1 );
+	}
+	sqlite3_bind_int( stmt, 2, dir->id );
+	sqlite3_step( stmt );
+	if( dir->rules ) {
+		free( dir->rules );
+	}
+	dir->rules = str;
 }
 
 int DB_GetDirs( DB_Dir **outlist )
@@ -310,6 +911,10 @@ int DB_GetDirs( DB_Dir **outlist )
 		}
 		dir->id = sqlite3_column_int( stmt, 0 );
 		dir->path = strdup( sqlite3_column_text( stmt, 1 ) );
+		dir->rules = NULL;
+		if( sqlite3_column_type( stmt, 2 ) == SQLITE_TEXT ) {
+			dir->rules = strdup( sqlite3_column_text( stmt, 2 ) );
+		}
 		list[i] = dir;
 	}
 	*outlist = list;
@@ -344,24 +949,292 @@ DB_Tag DB_AddTag( const char *tagname )
 
 void DB_AddFile( DB_Dir dir, const char *filepath, int create_time )
 {
-	int ret;
+	int ret, folder_id;
 	sqlite3_stmt *stmt = self.stmts[SQL_ADD_FILE];
+	folder_id = DB_GetFileFolderId( dir, filepath, 1 );
+	if( folder_id == 0 ) {
+		return;
+	}
 	sqlite3_reset( stmt );
 	ret = sqlite3_bind_int( stmt, 1, dir->id );
-	ret = sqlite3_bind_text( stmt, 2, filepath, strlen( filepath ), NULL );
-	ret = sqlite3_bind_int( stmt, 3, create_time );
+	ret = sqlite3_bind_int( stmt, 2, folder_id );
+	ret = sqlite3_bind_text( stmt, 3, DB_GetFileName( filepath ), 
+				 -1, NULL );
+	ret = sqlite3_bind_int( stmt, 4, create_time );
 	ret = sqlite3_step( stmt );
 }
 
 void DB_DeleteFile( DB_Dir dir, const char *filepath )
 {
 	sqlite3_stmt *stmt = self.stmts[SQL_DEL_FILE];
+	int folder_id = DB_GetFileFolderId( dir, filepath, 0 );
+	if( folder_id == 0 ) {
+		return;
+	}
 	sqlite3_reset( stmt );
-	sqlite3_bind_int( stmt, 1, dir->id );
-	sqlite3_bind_text( stmt, 2, filepath, strlen( filepath ), NULL );
+	sqlite3_bind_int( stmt, 1, folder_id );
+	sqlite3_bind_text( stmt, 2, DB_GetFileName( filepath ), -1, NULL );
 	sqlite3_step( stmt );
 }
 
+void DB_MoveFile( DB_Dir dir, const char *filepath,
+		  DB_Dir new_dir, const char *new_filepath )
+{
+	int fid = 0, folder_id, new_folder_id;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_FILE_ID];
+	/**
+	 * 恢复中断的同步时，已经写入过的移动会被再次报告，这时旧位置已经没有
+	 * 记录，新位置的记录就是移动过去的文件，不能删除它，重复的移动不做处理。
+	 */
+	folder_id = DB_GetFileFolderId( dir, filepath, 0 );
+	if( folder_id == 0 ) {
+		return;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, folder_id );
+	sqlite3_bind_text( stmt, 2, DB_GetFileName( filepath ), -1, NULL );
+	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		fid = sqlite3_column_int( stmt, 0 );
+	}
+	sqlite3_reset( stmt );
+	if( fid == 0 || (dir->id == new_dir->id && 
+			 strcmp( filepath, new_filepath ) == 0) ) {
+		return;
+	}
+	/* 上次同步中断时可能已经添加过新位置的记录，先删除它 */
+	DB_DeleteFile( new_dir, new_filepath );
+	new_folder_id = DB_GetFileFolderId( new_dir, new_filepath, 1 );
+	if( new_folder_id == 0 ) {
+		return;
+	}
+	stmt = self.stmts[SQL_MOVE_FILE];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, new_dir->id );
+	sqlite3_bind_int( stmt, 2, new_folder_id );
+	sqlite3_bind_text( stmt, 3, DB_GetFileName( new_filepath ), 
+			   -1, NULL );
+	sqlite3_bind_int( stmt, 4, fid );
+	sqlite3_step( stmt );
+}
+
+/** 从查询结果的当前行中读取文件记录 */
+static DB_File DB_ReadFile( sqlite3_stmt *stmt )
+{
+	DB_File file = malloc( sizeof( DB_FileRec ) );
+	file->id = sqlite3_column_int( stmt, 0 );
+	file->did = sqlite3_column_int( stmt, 1 );
+	file->score = sqlite3_column_int( stmt, 2 );
+	file->path = strdup( sqlite3_column_text( stmt, 3 ) );
+	file->create_time = sqlite3_column_int( stmt, 4 );
+	return file;
+}
+
+int DB_GetUnhashedFiles( int min_id, int limit, DB_File **outlist )
+{
+	int n = 0;
+	DB_File *list;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_UNHASHED_FILES];
+	list = malloc( sizeof( DB_File ) * (limit + 1) );
+	if( !list ) {
+		return -1;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, min_id );
+	sqlite3_bind_int( stmt, 2, limit );
+	while( n < limit && sqlite3_step( stmt ) == SQLITE_ROW ) {
+		list[n++] = DB_ReadFile( stmt );
+	}
+	list[n] = NULL;
+	*outlist = list;
+	return n;
+}
+
+void DB_SetFileHash( int fid, int64_t size, int64_t mtime,
+		     const unsigned char *hash, int hash_len )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_FILE_HASH];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, fid );
+	sqlite3_bind_int64( stmt, 2, size );
+	sqlite3_bind_int64( stmt, 3, mtime );
+	sqlite3_bind_blob( stmt, 4, hash, hash_len, SQLITE_TRANSIENT );
+	sqlite3_step( stmt );
+}
+
+void DB_DeleteFileHash( DB_Dir dir, const char *filepath )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_DEL_FILE_HASH];
+	int folder_id = DB_GetFileFolderId( dir, filepath, 0 );
+	if( folder_id == 0 ) {
+		return;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, folder_id );
+	sqlite3_bind_text( stmt, 2, DB_GetFileName( filepath ), -1, NULL );
+	sqlite3_step( stmt );
+}
+
+int DB_GetHashedFiles( int min_id, int limit, DB_FileHash **outlist )
+{
+	int n = 0, len;
+	DB_FileHash item, *list;
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_HASHED_FILES];
+	list = malloc( sizeof( DB_FileHash ) * (limit + 1) );
+	if( !list ) {
+		return -1;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, min_id );
+	sqlite3_bind_int( stmt, 2, limit );
+	while( n < limit && sqlite3_step( stmt ) == SQLITE_ROW ) {
+		item = malloc( sizeof( DB_FileHashRec ) );
+		item->file = DB_ReadFile( stmt );
+		item->size = sqlite3_column_int64( stmt, 5 );
+		item->mtime = sqlite3_column_int64( stmt, 6 );
+		len = sqlite3_column_bytes( stmt, 7 );
+		if( len > DB_HASH_MAX_LEN ) {
+			len = DB_HASH_MAX_LEN;
+		}
+		item->hash_len = len;
+		memcpy( item->hash, sqlite3_column_blob( stmt, 7 ), len );
+		list[n++] = item;
+	}
+	list[n] = NULL;
+	sqlite3_reset( stmt );
+	*outlist = list;
+	return n;
+}
+
+void DB_SetFileCorrupt( int fid, const unsigned char *hash, int hash_len,
+			int64_t check_time )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_FILE_CORRUPT];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, fid );
+	sqlite3_bind_blob( stmt, 2, hash, hash_len, SQLITE_TRANSIENT );
+	sqlite3_bind_int64( stmt, 3, check_time );
+	sqlite3_step( stmt );
+}
+
+void DB_ClearFileCorrupt( int fid )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_DEL_FILE_CORRUPT];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, fid );
+	sqlite3_step( stmt );
+}
+
+int DB_GetCorruptFiles( DB_File **outlist )
+{
+	int ret, n = 0, max = 0;
+	DB_File *list = NULL, *files;
+	sqlite3_stmt *stmt;
+	ret = sqlite3_prepare_v2( self.db, sql_get_corrupt_files, -1,
+				  &stmt, NULL );
+	if( ret != SQLITE_OK ) {
+		return -1;
+	}
+	while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		if( n + 1 >= max ) {
+			max = max > 0 ? max * 2 : 16;
+			files = realloc( list, sizeof( DB_File ) * max );
+			if( !files ) {
+				break;
+			}
+			list = files;
+		}
+		list[n++] = DB_ReadFile( stmt );
+	}
+	sqlite3_finalize( stmt );
+	if( list ) {
+		list[n] = NULL;
+	}
+	*outlist = list;
+	return n;
+}
+
+void DB_GetScrubState( int *last_fid, int64_t *finish_time )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_GET_SCRUB_STATE];
+	*last_fid = 0;
+	*finish_time = 0;
+	sqlite3_reset( stmt );
+	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		*last_fid = sqlite3_column_int( stmt, 0 );
+		*finish_time = sqlite3_column_int64( stmt, 1 );
+	}
+	sqlite3_reset( stmt );
+}
+
+void DB_SetScrubState( int last_fid, int64_t finish_time )
+{
+	sqlite3_stmt *stmt = self.stmts[SQL_SET_SCRUB_STATE];
+	sqlite3_reset( stmt );
+	sqlite3_bind_int( stmt, 1, last_fid );
+	sqlite3_bind_int64( stmt, 2, finish_time );
+	sqlite3_step( stmt );
+}
+
+int DB_GetDuplicateFiles( DB_FileGroup **outlist )
+{
+	int ret, len, hash_len = 0;
+	int64_t size, group_size = -1;
+	const void *hash;
+	unsigned char group_hash[DB_HASH_MAX_LEN];
+	DB_FileGroup *list = NULL, group = NULL, *groups;
+	DB_File *files;
+	sqlite3_stmt *stmt;
+	int n_groups = 0, max_groups = 0;
+	ret = sqlite3_prepare_v2( self.db, sql_get_duplicate_files, -1,
+				  &stmt, NULL );
+	if( ret != SQLITE_OK ) {
+		return -1;
+	}
+	while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		size = sqlite3_column_int64( stmt, 5 );
+		hash = sqlite3_column_blob( stmt, 6 );
+		len = sqlite3_column_bytes( stmt, 6 );
+		if( len > DB_HASH_MAX_LEN ) {
+			len = DB_HASH_MAX_LEN;
+		}
+		/* 结果已按大小和哈希值排序，与上一行不同则是新的一组 */
+		if( !group || size != group_size || len != hash_len ||
+		    memcmp( hash, group_hash, len ) != 0 ) {
+			if( n_groups + 1 >= max_groups ) {
+				max_groups = max_groups > 0 ? max_groups * 2 : 16;
+				groups = realloc( list, sizeof( DB_FileGroup ) *
+						  max_groups );
+				if( !groups ) {
+					break;
+				}
+				list = groups;
+			}
+			group = malloc( sizeof( DB_FileGroupRec ) );
+			group->files = NULL;
+			group->n_files = 0;
+			group->size = size;
+			list[n_groups++] = group;
+			group_size = size;
+			hash_len = len;
+			memcpy( group_hash, hash, len );
+		}
+		files = realloc( group->files, sizeof( DB_File ) *
+				 (group->n_files + 2) );
+		if( !files ) {
+			break;
+		}
+		group->files = files;
+		files[group->n_files++] = DB_ReadFile( stmt );
+		files[group->n_files] = NULL;
+	}
+	sqlite3_finalize( stmt );
+	if( list ) {
+		list[n_groups] = NULL;
+	}
+	*outlist = list;
+	return n_groups;
+}
+
 int DB_GetTags( DB_Tag **outlist )
 {
 	DB_Tag *list, tag;
@@ -406,48 +1279,180 @@ int DB_GetTags( DB_Tag **outlist )
 
 void DBTag_Remove( DB_Tag tag )
 {
-	char sql[SQL_BUF_SIZE];
-	sprintf( sql, sql_remove_tag, tag->id );
-	DB_CacheSQL( sql );
+	DB_AddWriteOp( OP_DEL_TAG, 0, tag->id, 0 );
 }
 
 void DBFile_RemoveTag( DB_File file, DB_Tag tag )
 {
-	char sql[SQL_BUF_SIZE];
-	sprintf( sql, sql_file_remove_tag, file->id, tag->id );
-	DB_CacheSQL( sql );
+	DB_AddWriteOp( OP_SET_TAG, file->id, tag->id, 0 );
 }
 
 void DBFile_AddTag( DB_File file, DB_Tag tag )
 {
-	char sql[SQL_BUF_SIZE];
-	sprintf( sql, sql_file_add_tag, file->id, file->did, tag->id );
-	DB_CacheSQL( sql );
+	DB_AddWriteOp( OP_SET_TAG, file->id, tag->id, 1 );
 }
 
 void DBFile_SetScore( DB_File file, int score )
 {
-	char sql[SQL_BUF_SIZE];
-	sprintf( sql, sql_file_set_score, score, file->id );
-	DB_CacheSQL( sql );
+	file->score = score;
+	DB_AddWriteOp( OP_SET_SCORE, file->id, 0, score );
+}
+
+#ifdef DEBUG
+/**
+ * 检查查询语句的执行计划
+ * 有筛选条件或排序时，文件和标签关系表都应该能通过索引查找或按索引顺序读取，
+ * 出现不使用索引的全表扫描说明缺少索引。
+ */
+static void DBQuery_CheckPlan( const char *sql )
+{
+	int ret;
+	char *plan_sql;
+	const char *detail;
+	sqlite3_stmt *stmt;
+	if( !strstr( sql, " WHERE" ) && !strstr( sql, " ORDER BY" ) ) {
+		return;
+	}
+	plan_sql = sqlite3_mprintf( "EXPLAIN QUERY PLAN %s", sql );
+	if( !plan_sql ) {
+		return;
+	}
+	ret = sqlite3_prepare_v2( self.db, plan_sql, -1, &stmt, NULL );
+	sqlite3_free( plan_sql );
+	if( ret != SQLITE_OK ) {
+		return;
+	}
+	while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		detail = (const char*)sqlite3_column_text( stmt, 3 );
+		if( detail && strncmp( detail, "SCAN", 4 ) == 0 &&
+		    !strstr( detail, "INDEX" ) ) {
+			printf( "[database] full scan: %s\n  in: %s\n", 
+				detail, sql );
+		}
+	}
+	sqlite3_finalize( stmt );
+}
+#endif
+
+/** 从缓存中取出查询语句，缓存中没有空闲的同一语句时预编译一个新的 */
+static sqlite3_stmt *DB_AcquireStmt( const char *sql )
+{
+	int i, slot = -1;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_mutex_enter( self.cache.mutex );
+	for( i = 0; i < STMT_CACHE_SIZE; ++i ) {
+		if( self.cache.items[i].sql && !self.cache.items[i].in_use &&
+		    strcmp( self.cache.items[i].sql, sql ) == 0 ) {
+			self.cache.items[i].in_use = 1;
+			self.cache.items[i].last_used = ++self.cache.clock;
+			stmt = self.cache.items[i].stmt;
+			break;
+		}
+	}
+	sqlite3_mutex_leave( self.cache.mutex );
+	if( stmt ) {
+		return stmt;
+	}
+	if( sqlite3_prepare_v2( self.db, sql, -1, &stmt, NULL ) != SQLITE_OK ) {
+		sqlite3_finalize( stmt );
+		return NULL;
+	}
+#ifdef DEBUG
+	DBQuery_CheckPlan( sql );
+#endif
+	sqlite3_mutex_enter( self.cache.mutex );
+	/* 优先使用空位，否则替换最久没用过的空闲语句 */
+	for( i = 0; i < STMT_CACHE_SIZE; ++i ) {
+		if( !self.cache.items[i].sql ) {
+			slot = i;
+			break;
+		}
+		if( self.cache.items[i].in_use ) {
+			continue;
+		}
+		if( slot < 0 || self.cache.items[i].last_used < 
+		    self.cache.items[slot].last_used ) {
+			slot = i;
+		}
+	}
+	/* 缓存中的语句都正在被使用时不缓存，用完后直接销毁 */
+	if( slot >= 0 ) {
+		if( self.cache.items[slot].sql ) {
+			sqlite3_finalize( self.cache.items[slot].stmt );
+			free( self.cache.items[slot].sql );
+		}
+		self.cache.items[slot].sql = strdup( sql );
+		self.cache.items[slot].stmt = stmt;
+		self.cache.items[slot].in_use = 1;
+		self.cache.items[slot].last_used = ++self.cache.clock;
+	}
+	sqlite3_mutex_leave( self.cache.mutex );
+	return stmt;
+}
+
+/** 归还查询语句，语句会被重置并清除已绑定的参数 */
+static void DB_ReleaseStmt( sqlite3_stmt *stmt )
+{
+	int i;
+	if( !stmt ) {
+		return;
+	}
+	sqlite3_reset( stmt );
+	sqlite3_clear_bindings( stmt );
+	sqlite3_mutex_enter( self.cache.mutex );
+	for( i = 0; i < STMT_CACHE_SIZE; ++i ) {
+		if( self.cache.items[i].stmt == stmt && 
+		    self.cache.items[i].in_use ) {
+			self.cache.items[i].in_use = 0;
+			break;
+		}
+	}
+	sqlite3_mutex_leave( self.cache.mutex );
+	if( i == STMT_CACHE_SIZE ) {
+		sqlite3_finalize( stmt );
+	}
+}
+
+/** 绑定查询条件中的目录、源文件夹和标签的标识号 */
+static void DBQuery_BindTerms( DB_Query query, sqlite3_stmt *stmt )
+{
+	int i;
+	for( i = 0; i < query->n_ids; ++i ) {
+		sqlite3_bind_int( stmt, PARAM_IDS + i, query->ids[i] );
+	}
+	if( query->dirpath ) {
+		sqlite3_bind_int( stmt, PARAM_FOLDER, query->folder_id );
+		sqlite3_bind_text( stmt, PARAM_LAST_NAME, "", -1, NULL );
+	}
 }
 
 int DBQuery_GetTotalFiles( DB_Query query )
 {
 	int total = 0;
+	char *sql;
 	sqlite3_stmt *stmt;
-	char sql[SQL_BUF_SIZE];
 	if( !query ) {
 		return 0;
 	}
+	sql = malloc( sizeof( char )*(strlen( sql_count_files ) + 
+		      strlen( query->sql_tables ) + 
+		      strlen( query->sql_terms ) + 1) );
+	if( !sql ) {
+		return 0;
+	}
 	strcpy( sql, sql_count_files );
 	strcat( sql, query->sql_tables );
 	strcat( sql, query->sql_terms );
-	sqlite3_prepare_v2( self.db, sql, -1, &stmt, NULL );
+	stmt = DB_AcquireStmt( sql );
+	free( sql );
+	if( !stmt ) {
+		return 0;
+	}
+	DBQuery_BindTerms( query, stmt );
 	if( sqlite3_step( stmt ) == SQLITE_ROW ) {
 		total = sqlite3_column_int( stmt, 0 );
 	}
-	sqlite3_finalize( stmt );
+	DB_ReleaseStmt( stmt );
 	return total;
 }
 
@@ -472,12 +1477,34 @@ static int escape( char *buf, const char *str )
 	return outptr - buf;
 }
 
+/** 绑定游标的起始位置和每页数量 */
+static void DBQuery_BindPage( DB_Query query )
+{
+	int i;
+	sqlite3_reset( query->stmt );
+	for( i = 0; i < 3; ++i ) {
+		sqlite3_bind_int64( query->stmt, i + 1, query->keys[i] );
+	}
+	sqlite3_bind_int( query->stmt, PARAM_PAGE_SIZE, query->page_size );
+	if( query->last_name ) {
+		sqlite3_bind_text( query->stmt, PARAM_LAST_NAME, 
+				   query->last_name, -1, SQLITE_TRANSIENT );
+	}
+	query->page_count = 0;
+}
+
 DB_File DBQuery_FetchFile( DB_Query query )
 {
 	int ret;
 	DB_File file;
 	const char *path;
 	ret = sqlite3_step( query->stmt );
+	/* 当前页已取满，可能还有下一页 */
+	if( ret != SQLITE_ROW && query->page_size > 0 &&
+	    query->page_count == query->page_size ) {
+		DBQuery_BindPage( query );
+		ret = sqlite3_step( query->stmt );
+	}
 	if( ret != SQLITE_ROW ) {
 		return NULL;
 	}
@@ -489,102 +1516,426 @@ DB_File DBQuery_FetchFile( DB_Query query )
 	file->create_time = sqlite3_column_int( query->stmt, 4 );
 	file->path = malloc( (strlen( path ) + 1)*sizeof( char ) );
 	strcpy( file->path, path );
+	if( query->page_size > 0 ) {
+		query->keys[0] = sqlite3_column_int64( query->stmt, 4 );
+		query->keys[1] = sqlite3_column_int64( query->stmt, 2 );
+		query->keys[2] = sqlite3_column_int64( query->stmt, 0 );
+		query->page_count += 1;
+	}
+	if( query->last_name ) {
+		free( query->last_name );
+		query->last_name = strdup( sqlite3_column_text( query->stmt, 5 ) );
+	}
 	return file;
 }
 
-DB_Query DB_NewQuery( const DB_QueryTerms terms )
+/** 获取目录所属的源文件夹的标识号，找不到时返回 0 */
+static int DB_GetSourceDirId( const char *dirpath )
 {
-	int i;
-	char buf[256] = " WHERE", sql[SQL_BUF_SIZE];
+	size_t len, max_len = 0;
+	int id = 0;
+	const char *path;
+	sqlite3_stmt *stmt = DB_AcquireStmt( sql_get_dir_paths );
+	if( !stmt ) {
+		return 0;
+	}
+	while( sqlite3_step( stmt ) == SQLITE_ROW ) {
+		path = (const char*)sqlite3_column_text( stmt, 1 );
+		len = path ? strlen( path ) : 0;
+		if( len < max_len || strncmp( path, dirpath, len ) != 0 ) {
+			continue;
+		}
+		/* 源文件夹路径必须在分隔符处结束，避免 C:\a 匹配到 C:\ab */
+		if( dirpath[len] && dirpath[len] != '\\' && 
+		    dirpath[len] != '/' && len > 0 && 
+		    path[len - 1] != '\\' && path[len - 1] != '/' ) {
+			continue;
+		}
+		id = sqlite3_column_int( stmt, 0 );
+		max_len = len;
+	}
+	DB_ReleaseStmt( stmt );
+	return id;
+}
+
+/** 获取目录在文件夹表中的标识号，找不到时返回 0 */
+static int DB_FindFolder( const char *dirpath )
+{
+	int id = 0, len;
+	char *path;
+	sqlite3_stmt *stmt;
+	len = strlen( dirpath );
+	path = malloc( sizeof( char )*(len + 2) );
+	if( !path ) {
+		return 0;
+	}
+	strcpy( path, dirpath );
+	/* 文件夹路径以分隔符结尾，沿用目录路径中的分隔符 */
+	if( len == 0 || !IS_PATH_SEP( path[len - 1] ) ) {
+		path[len] = strchr( dirpath, '/' ) ? '/' : '\\';
+		path[++len] = 0;
+	}
+	stmt = DB_AcquireStmt( sql_find_folder );
+	if( stmt ) {
+		sqlite3_bind_int( stmt, 1, DB_GetSourceDirId( path ) );
+		sqlite3_bind_text( stmt, 2, path, len, NULL );
+		if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+			id = sqlite3_column_int( stmt, 0 );
+		}
+		DB_ReleaseStmt( stmt );
+	}
+	free( path );
+	return id;
+}
+
+/**
+ * 获取标识号列表的参数数量
+ * 参数数量向上取整到 2 的幂，不同数量的源文件夹和标签就只会生成少数几种
+ * 查询语句，多出的参数重复最后一个标识号，不影响查询结果。
+ */
+static int DB_GetParamCount( int n )
+{
+	int count = 1;
+	while( count < n ) {
+		count *= 2;
+	}
+	return count;
+}
+
+/** 根据查询条件生成数据表和筛选条件 */
+static DB_Query DB_CreateQuery( const DB_QueryTerms terms )
+{
+	int i, n_dirs = 0, n_tags = 0;
+	char buf[256] = " WHERE";
 	DB_Query q = malloc( sizeof(DB_QueryRec) );
-	q->sql_terms = malloc( sizeof( char )*SQL_BUF_SIZE );
+	if( terms->n_dirs > 0 && terms->dirs ) {
+		n_dirs = DB_GetParamCount( terms->n_dirs );
+	}
+	if( terms->n_tags > 0 && terms->tags ) {
+		n_tags = DB_GetParamCount( terms->n_tags );
+	}
+	q->n_ids = n_dirs + n_tags;
+	q->ids = malloc( sizeof( int )*(q->n_ids + 1) );
+	q->sql_terms = malloc( sizeof( char )*(SQL_BUF_SIZE + 
+			       q->n_ids * SQL_PARAM_SIZE) );
 	q->sql_tables = malloc( sizeof( char )*SQL_BUF_SIZE );
+	q->sql_options = malloc( sizeof( char )*SQL_BUF_SIZE );
 	q->sql_terms[0] = 0;
 	q->sql_tables[0] = 0;
-	if( terms->n_dirs > 0 && terms->dirs ) {
+	q->sql_options[0] = 0;
+	q->stmt = NULL;
+	q->page_size = 0;
+	q->page_count = 0;
+	q->dirpath = NULL;
+	q->last_name = NULL;
+	q->folder_id = 0;
+	q->limit = terms->limit;
+	q->offset = terms->offset;
+	if( n_dirs > 0 ) {
 		strcpy( q->sql_terms, buf );
-		strcat( q->sql_tables, ", dir d" );
-		strcat( q->sql_terms, " f.did = d.did" );
-		strcat( q->sql_terms, " AND f.did IN (" );
-		for( i = 0; i < terms->n_dirs; ++i ) {
-			sprintf( buf, "%d", terms->dirs[i]->id );
-			if( i > 0 ) {
-				strcat( q->sql_terms, ", " );
+		strcat( q->sql_terms, " f.did IN (" );
+		for( i = 0; i < n_dirs; ++i ) {
+			if( i < terms->n_dirs ) {
+				q->ids[i] = terms->dirs[i]->id;
+			} else {
+				q->ids[i] = q->ids[i - 1];
 			}
+			sprintf( buf, "%s?%d", i > 0 ? ", " : "", PARAM_IDS + i );
 			strcat( q->sql_terms, buf );
 		}
+		strcat( q->sql_terms, ")" );
 		strcpy( buf, " AND" );
 	}
-	if( terms->n_tags > 0 && terms->tags ) {
+	if( n_tags > 0 ) {
 		strcat( q->sql_tables, ", file_tag_relation ftr" );
 		strcat( q->sql_terms, buf );
 		strcat( q->sql_terms, " ftr.tid IN (" );
-		for( i = 0; i < terms->n_dirs; ++i ) {
-			sprintf( buf, "%d", terms->tags[i]->id );
-			if( i > 0 ) {
-				strcat( q->sql_terms, ", " );
+		for( i = 0; i < n_tags; ++i ) {
+			if( i < terms->n_tags ) {
+				q->ids[n_dirs + i] = terms->tags[i]->id;
+			} else {
+				q->ids[n_dirs + i] = q->ids[n_dirs + i - 1];
 			}
+			sprintf( buf, "%s?%d", i > 0 ? ", " : "", 
+				 PARAM_IDS + n_dirs + i );
 			strcat( q->sql_terms, buf );
 		}
 		strcat( q->sql_terms, ") AND ftr.fid = f.id" );
 		strcpy( buf, " AND" );
 	}
 	if( terms->dirpath ) {
-		char *path;
-		i = 2 * strlen( terms->dirpath );
-		path = malloc( i * sizeof( char ) );
 		strcat( q->sql_terms, buf );
-		strcat( q->sql_terms, " HASFILE('" );
-		strcat( q->sql_terms, terms->dirpath );
-		strcat( q->sql_terms, "', f.path)" );
+		strcat( q->sql_terms, sql_dirpath_terms );
+		q->folder_id = DB_FindFolder( terms->dirpath );
+		q->dirpath = strdup( terms->dirpath );
+	}
+	return q;
+}
+
+/** 按生成好的数据表、筛选条件和附加选项取出预编译的查询语句 */
+static DB_Query DB_PrepareQuery( DB_Query q )
+{
+	char *sql;
+	sql = malloc( sizeof( char )*(strlen( sql_search_files ) + 
+		      strlen( q->sql_tables ) + strlen( q->sql_terms ) + 
+		      strlen( q->sql_options ) + 1) );
+	if( sql ) {
+		strcpy( sql, sql_search_files );
+		strcat( sql, q->sql_tables );
+		strcat( sql, q->sql_terms );
+		strcat( sql, q->sql_options );
+		//printf("sql: %s\n", sql);
+		q->stmt = DB_AcquireStmt( sql );
+		free( sql );
 	}
+	if( q->stmt ) {
+		DBQuery_BindTerms( q, q->stmt );
+		sqlite3_bind_int( q->stmt, PARAM_LIMIT, q->limit );
+		sqlite3_bind_int( q->stmt, PARAM_OFFSET, q->offset );
+		return q;
+	}
+	DB_DeleteQuery( q );
+	return NULL;
+}
+
+DB_Query DB_NewQuery( const DB_QueryTerms terms )
+{
+	DB_Query q = DB_CreateQuery( terms );
 	if( terms->create_time == DESC ) {
-		strcat( q->sql_terms, " ORDER BY f.create_time DESC" );
+		strcat( q->sql_options, " ORDER BY f.create_time DESC" );
 	} else if( terms->create_time == ASC ) {
-		strcat( q->sql_terms, " ORDER BY f.create_time ASC" );
+		strcat( q->sql_options, " ORDER BY f.create_time ASC" );
 	}
 	if( terms->score != NONE ) {
 		if( terms->create_time != NONE ) {
-			strcat( q->sql_terms, ", " );
+			strcat( q->sql_options, ", " );
 		} else {
-			strcat( q->sql_terms, " ORDER BY " );
+			strcat( q->sql_options, " ORDER BY " );
 		}
 		if( terms->score == DESC ) {
-			strcat( q->sql_terms, "f.score DESC" );
+			strcat( q->sql_options, "f.score DESC" );
 		} else {
-			strcat( q->sql_terms, "f.score ASC" );
+			strcat( q->sql_options, "f.score ASC" );
 		}
 	}
-	sprintf( buf, " LIMIT %d OFFSET %d", terms->limit, terms->offset );
-	strcpy( sql, sql_search_files );
-	strcat( sql, q->sql_tables );
-	strcat( q->sql_terms, buf );
-	strcat( sql, q->sql_terms );
-	//printf("sql: %s\n", sql);
-	i = sqlite3_prepare_v2( self.db, sql, -1, &q->stmt, NULL );
-	if( i == SQLITE_OK ) {
+	strcat( q->sql_options, " LIMIT ?7 OFFSET ?8" );
+	return DB_PrepareQuery( q );
+}
+
+/**
+ * 分页游标的查询语句中，每个排序字段 k 与上一个文件的值 v 的比较条件写成
+ * k >= v AND (k > v OR 后面字段的条件) 的形式，第一个字段的范围条件可以直接
+ * 用上索引，而不是拆成多个 OR 分支后再重新排序。
+ */
+DB_Query DB_NewQueryCursor( const DB_QueryTerms terms )
+{
+	char buf[128];
+	int i, n = 0, keys[3], desc[3];
+	const char *name, *op;
+	DB_Query q = DB_CreateQuery( terms );
+	if( terms->create_time != NONE ) {
+		keys[n] = 0;
+		desc[n++] = terms->create_time == DESC;
+	}
+	if( terms->score != NONE ) {
+		keys[n] = 1;
+		desc[n++] = terms->score == DESC;
+	}
+	/**
+	 * 只按目录筛选时按文件名分页，同一文件夹中的文件名是唯一的。文件名下限
+	 * 换成上一个文件的文件名，就能按索引的顺序接着读取，不用每一页都重新
+	 * 排序目录中的所有文件。
+	 */
+	if( n == 0 && q->dirpath ) {
+		q->last_name = strdup( "" );
+		strcat( q->sql_options, " ORDER BY f.name ASC LIMIT ?4" );
+		q->page_size = terms->limit > 0 ? terms->limit : 100;
+		if( !DB_PrepareQuery( q ) ) {
+			return NULL;
+		}
+		DBQuery_BindPage( q );
 		return q;
 	}
-	free( q->sql_terms );
-	free( q );
-	return NULL;
+	/* 以标识号作为最后一个排序字段，保证每个文件的位置都是唯一的 */
+	keys[n] = 2;
+	desc[n] = n > 0 ? desc[n - 1] : 0;
+	++n;
+	/* 第一页从最前面开始，排序字段都取各自方向上的极限值 */
+	for( i = 0; i < 3; ++i ) {
+		q->keys[i] = INT64_MIN;
+	}
+	for( i = 0; i < n; ++i ) {
+		q->keys[keys[i]] = desc[i] ? INT64_MAX : INT64_MIN;
+	}
+	strcat( q->sql_options, q->sql_terms[0] ? " AND" : " WHERE" );
+	for( i = 0; i < n; ++i ) {
+		name = sql_cursor_keys[keys[i]];
+		op = desc[i] ? "<" : ">";
+		if( i == n - 1 ) {
+			sprintf( buf, " %s %s ?%d", name, op, keys[i] + 1 );
+		} else {
+			sprintf( buf, " %s %s= ?%d AND (%s %s ?%d OR", name, op,
+				 keys[i] + 1, name, op, keys[i] + 1 );
+		}
+		strcat( q->sql_options, buf );
+	}
+	for( i = 0; i < n - 1; ++i ) {
+		strcat( q->sql_options, ")" );
+	}
+	strcat( q->sql_options, " ORDER BY" );
+	for( i = 0; i < n; ++i ) {
+		sprintf( buf, "%s %s %s", i > 0 ? "," : "", 
+			 sql_cursor_keys[keys[i]], desc[i] ? "DESC" : "ASC" );
+		strcat( q->sql_options, buf );
+	}
+	strcat( q->sql_options, " LIMIT ?4" );
+	q->page_size = terms->limit > 0 ? terms->limit : 100;
+	if( !DB_PrepareQuery( q ) ) {
+		return NULL;
+	}
+	DBQuery_BindPage( q );
+	return q;
 }
 
 void DB_DeleteQuery( DB_Query query )
 {
 	free( query->sql_terms );
-	sqlite3_finalize( query->stmt );
+	free( query->sql_tables );
+	free( query->sql_options );
+	free( query->dirpath );
+	free( query->last_name );
+	free( query->ids );
+	DB_ReleaseStmt( query->stmt );
 	query->sql_terms = NULL;
+	query->sql_tables = NULL;
+	query->sql_options = NULL;
 	query->stmt = NULL;
 	free( query );
 }
 
+int DB_MergeCatalog( const char *path )
+{
+	int i, ret, count = -1;
+	char *errmsg = NULL;
+	sqlite3_stmt *stmt;
+	/**
+	 * 预编译的语句在读完结果前一直处于执行状态，会导致临时表无法删除、
+	 * 分片目录无法分离，需要先重置
+	 */
+	for( i = 0; i < SQL_TOTAL; ++i ) {
+		if( self.stmts[i] ) {
+			sqlite3_reset( self.stmts[i] );
+		}
+	}
+	/* ATTACH 不能在事务中执行 */
+	ret = sqlite3_prepare_v2( self.db, sql_attach_catalog, -1, &stmt, NULL );
+	if( ret != SQLITE_OK ) {
+		return -1;
+	}
+	sqlite3_bind_text( stmt, 1, path, strlen( path ), NULL );
+	ret = sqlite3_step( stmt );
+	sqlite3_finalize( stmt );
+	if( ret != SQLITE_DONE ) {
+		printf( "[database] cannot attach catalog: %s\n", path );
+		return -1;
+	}
+	sqlite3_exec( self.db, sql_merged_file_table, NULL, NULL, NULL );
+	sqlite3_exec( self.db, "begin;", NULL, NULL, NULL );
+	ret = sqlite3_exec( self.db, sql_merge_catalog, NULL, NULL, &errmsg );
+	if( ret == SQLITE_OK ) {
+		sqlite3_prepare_v2( self.db, sql_count_merged_files, 
+				    -1, &stmt, NULL );
+		if( sqlite3_step( stmt ) == SQLITE_ROW ) {
+			count = sqlite3_column_int( stmt, 0 );
+		}
+		sqlite3_finalize( stmt );
+	} else {
+		printf( "[database] error: %s\n", errmsg );
+		sqlite3_free( errmsg );
+	}
+	sqlite3_exec( self.db, sql_drop_merge_maps, NULL, NULL, NULL );
+	if( count >= 0 ) {
+		sqlite3_exec( self.db, "commit;", NULL, NULL, NULL );
+	} else {
+		sqlite3_exec( self.db, "rollback;", NULL, NULL, NULL );
+	}
+	sqlite3_exec( self.db, sql_detach_catalog, NULL, NULL, NULL );
+	return count;
+}
+
+int DB_EndMerge( DB_Dir dir )
+{
+	int count = 0;
+	sqlite3_stmt *stmt;
+	if( dir ) {
+		sqlite3_exec( self.db, sql_merged_file_table, 
+			      NULL, NULL, NULL );
+		sqlite3_prepare_v2( self.db, sql_prune_merged_dir, 
+				    -1, &stmt, NULL );
+		sqlite3_bind_int( stmt, 1, dir->id );
+		if( sqlite3_step( stmt ) == SQLITE_DONE ) {
+			count = sqlite3_changes( self.db );
+		}
+		sqlite3_finalize( stmt );
+	}
+	sqlite3_exec( self.db, sql_end_merge, NULL, NULL, NULL );
+	return count;
+}
+
 int DB_Begin( void )
 {
+	sqlite3_mutex_enter( self.writes.mutex );
+	self.writes.n_txns += 1;
+	sqlite3_mutex_leave( self.writes.mutex );
+	sqlite3_mutex_enter( self.writes.txn_mutex );
 	return sqlite3_exec( self.db, "begin;", NULL, NULL, NULL );
 }
 
 int DB_Commit( void )
 {
-	return sqlite3_exec( self.db, "commit;", NULL, NULL, NULL );
+	int ret;
+	DB_ExecWriteOps();
+	ret = sqlite3_exec( self.db, "commit;", NULL, NULL, NULL );
+	sqlite3_mutex_leave( self.writes.txn_mutex );
+	sqlite3_mutex_enter( self.writes.mutex );
+	self.writes.n_txns -= 1;
+	sqlite3_mutex_leave( self.writes.mutex );
+	return ret;
+}
+
+/** 检查是否有线程正在进行事务 */
+static int DB_InTransaction( void )
+{
+	int n;
+	sqlite3_mutex_enter( self.writes.mutex );
+	n = self.writes.n_txns;
+	sqlite3_mutex_leave( self.writes.mutex );
+	return n > 0;
+}
+
+int DB_Flush( void )
+{
+	int count;
+	sqlite3_mutex_enter( self.writes.mutex );
+	count = self.writes.length;
+	sqlite3_mutex_leave( self.writes.mutex );
+	/* 其它线程正在进行事务时不等待，它提交时会一并写入 */
+	if( count == 0 || DB_InTransaction() ) {
+		return 0;
+	}
+	/**
+	 * DB_Begin() 在持有事务锁之前就已计入事务数量，尝试失败时如果仍然没有
+	 * 事务，说明当前平台不支持 sqlite3_mutex_try()，事务锁是空闲的。
+	 */
+	if( sqlite3_mutex_try( self.writes.txn_mutex ) != SQLITE_OK ) {
+		if( DB_InTransaction() ) {
+			return 0;
+		}
+		sqlite3_mutex_enter( self.writes.txn_mutex );
+	}
+	sqlite3_exec( self.db, "begin;", NULL, NULL, NULL );
+	count = DB_ExecWriteOps();
+	sqlite3_exec( self.db, "commit;", NULL, NULL, NULL );
+	sqlite3_mutex_leave( self.writes.txn_mutex );
+	return count;
 }
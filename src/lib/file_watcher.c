@@ -0,0 +1,523 @@
+﻿/* ***************************************************************************
+* file_watcher.c -- file watcher
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* file_watcher.c -- 文件监视器
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/timer.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "file_watcher.h"
+
+#ifdef LCUI_BUILD_IN_LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define MAX_PATH_LEN	2048
+/** 等待事件的超时时间，监视线程每隔这么久检查一次是否需要退出 */
+#define POLL_TIMEOUT	500
+/** 持续有事件时，最多等待 delay 的这么多倍就得处理一次 */
+#define MAX_DELAY_TIMES	5
+#define EVENT_BUF_SIZE	(64 * 1024)
+/** 文件写入后关闭时也要标记目录，以便检测出修改过的文件 */
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |\
+			 IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR |\
+			 IN_EXCL_UNLINK)
+
+/** 被监视的根目录 */
+typedef struct WatchRootRec_ {
+	wchar_t *path;			/**< 根目录路径 */
+	Dict *dirty_dirs;		/**< 有变更的目录 */
+	LCUI_BOOL overflow;		/**< 是否丢失了事件 */
+	LCUI_BOOL is_ready;		/**< 是否已开始监视它的子目录 */
+} WatchRootRec, *WatchRoot;
+
+/** 被监视的目录 */
+typedef struct WatchRec_ {
+	wchar_t *path;			/**< 目录路径，末尾带路径分隔符 */
+	WatchRoot root;			/**< 所属的根目录 */
+} WatchRec, *Watch;
+
+typedef struct FileWatcherRec_ {
+	int fd;				/**< inotify 实例 */
+	int delay;			/**< 合并事件的等待时间 */
+	Watch *watches;			/**< 以监视描述符作为下标的目录列表 */
+	int n_watches;			/**< 目录列表的容量 */
+	LinkedList roots;		/**< 根目录列表 */
+	LCUI_BOOL is_running;		/**< 监视线程是否在运行 */
+	LCUI_Thread thread;		/**< 监视线程 */
+	LCUI_Mutex mutex;		/**< 互斥锁 */
+	FileWatcherHandler handler;	/**< 文件变更处理函数 */
+	void *data;			/**< 传给处理函数的附加数据 */
+} FileWatcherRec;
+
+static unsigned int Dict_KeyHash( const void *key )
+{
+	const wchar_t *buf = key;
+	unsigned int hash = 5381;
+	while( *buf ) {
+		hash = ((hash << 5) + hash) + (*buf++);
+	}
+	return hash;
+}
+
+static int Dict_KeyCompare( void *privdata, const void *key1, 
+			    const void *key2 )
+{
+	return wcscmp( key1, key2 ) == 0;
+}
+
+static void *Dict_KeyDup( void *privdata, const void *key )
+{
+	size_t len = wcslen( key ) + 1;
+	wchar_t *newkey = malloc( len * sizeof( wchar_t ) );
+	wcscpy( newkey, key );
+	return newkey;
+}
+
+static void Dict_KeyDestructor( void *privdata, void *key )
+{
+	free( key );
+}
+
+static DictType DictType_Dirs = {
+	Dict_KeyHash,
+	Dict_KeyDup,
+	NULL,
+	Dict_KeyCompare,
+	Dict_KeyDestructor,
+	NULL
+};
+
+static wchar_t *DupPath( const wchar_t *path, LCUI_BOOL add_sep )
+{
+	wchar_t *newpath;
+	size_t len = wcslen( path );
+	newpath = malloc( (len + 2) * sizeof( wchar_t ) );
+	wcscpy( newpath, path );
+	if( add_sep && len > 0 && newpath[len - 1] != PATH_SEP ) {
+		newpath[len++] = PATH_SEP;
+		newpath[len] = 0;
+	}
+	return newpath;
+}
+
+static void WatchRoot_Delete( void *arg )
+{
+	WatchRoot root = arg;
+	Dict_Release( root->dirty_dirs );
+	free( root->path );
+	free( root );
+}
+
+static void FileWatcher_RemoveWatch( FileWatcher w, int wd )
+{
+	Watch watch;
+	if( wd < 0 || wd >= w->n_watches || !w->watches[wd] ) {
+		return;
+	}
+	watch = w->watches[wd];
+	w->watches[wd] = NULL;
+	inotify_rm_watch( w->fd, wd );
+	free( watch->path );
+	free( watch );
+}
+
+/** 取消监视 dirpath 及其所有子目录 */
+static void FileWatcher_RemoveTree( FileWatcher w, const wchar_t *dirpath )
+{
+	int wd;
+	size_t len = wcslen( dirpath );
+	for( wd = 0; wd < w->n_watches; ++wd ) {
+		if( w->watches[wd] &&
+		    wcsncmp( w->watches[wd]->path, dirpath, len ) == 0 ) {
+			FileWatcher_RemoveWatch( w, wd );
+		}
+	}
+}
+
+/** 监视单个目录，返回监视描述符 */
+static int FileWatcher_AddWatch( FileWatcher w, WatchRoot root,
+				 const wchar_t *dirpath )
+{
+	int wd, n;
+	Watch watch, *watches;
+	char path[MAX_PATH_LEN];
+	LCUI_EncodeString( path, dirpath, MAX_PATH_LEN, ENCODING_UTF8 );
+	wd = inotify_add_watch( w->fd, path, WATCH_MASK );
+	if( wd < 0 ) {
+		return -1;
+	}
+	if( wd >= w->n_watches ) {
+		n = w->n_watches > 0 ? w->n_watches * 2 : 256;
+		while( n <= wd ) {
+			n *= 2;
+		}
+		watches = realloc( w->watches, sizeof( Watch ) * n );
+		if( !watches ) {
+			inotify_rm_watch( w->fd, wd );
+			return -1;
+		}
+		memset( watches + w->n_watches, 0, 
+			sizeof( Watch ) * (n - w->n_watches) );
+		w->watches = watches;
+		w->n_watches = n;
+	}
+	/* 同一个目录会得到相同的描述符，更新它的路径即可 */
+	watch = w->watches[wd];
+	if( watch ) {
+		free( watch->path );
+	} else {
+		watch = NEW( WatchRec, 1 );
+		w->watches[wd] = watch;
+	}
+	watch->path = DupPath( dirpath, TRUE );
+	watch->root = root;
+	return wd;
+}
+
+/** 监视目录及其所有子目录 */
+static void FileWatcher_AddTree( FileWatcher w, WatchRoot root,
+				 const wchar_t *dirpath )
+{
+	int len;
+	LCUI_Dir dir;
+	LinkedList dirs;
+	LCUI_DirEntry *entry;
+	LinkedListNode *node;
+	wchar_t path[MAX_PATH_LEN], *name;
+	LinkedList_Init( &dirs );
+	LinkedList_Append( &dirs, DupPath( dirpath, TRUE ) );
+	/* 逐层展开目录，新增的子目录追加到列表末尾 */
+	for( node = dirs.head.next; node && w->is_running; 
+	     node = node->next ) {
+		if( FileWatcher_AddWatch( w, root, node->data ) < 0 ) {
+			/**
+			 * 目录已被删除时不用处理，上级目录会有相应的事件。监视数量
+			 * 达到上限等原因导致无法监视时，这个目录中的变更都会被漏掉，
+			 * 只能当作丢失了事件，重新同步整个根目录。
+			 */
+			if( errno != ENOENT && errno != ENOTDIR ) {
+				root->overflow = TRUE;
+			}
+			continue;
+		}
+		len = wcslen( node->data );
+		wcscpy( path, node->data );
+		if( LCUI_OpenDir( path, &dir ) != 0 ) {
+			continue;
+		}
+		while( (entry = LCUI_ReadDir( &dir )) ) {
+			name = LCUI_GetFileName( entry );
+			if( name[0] == '.' ) {
+				if( name[1] == 0 || 
+				    (name[1] == '.' && name[2] == 0) ) {
+					continue;
+				}
+			}
+			if( !LCUI_FileIsDirectory( entry ) ||
+			    len + wcslen( name ) + 2 > MAX_PATH_LEN ) {
+				continue;
+			}
+			wcscpy( path + len, name );
+			LinkedList_Append( &dirs, DupPath( path, TRUE ) );
+		}
+		LCUI_CloseDir( &dir );
+	}
+	LinkedList_Clear( &dirs, free );
+}
+
+/** 处理一个 inotify 事件 */
+static void FileWatcher_HandleEvent( FileWatcher w, 
+				     struct inotify_event *e )
+{
+	int len;
+	Watch watch;
+	WatchRoot root;
+	LinkedListNode *node;
+	wchar_t path[MAX_PATH_LEN];
+	if( e->mask & IN_Q_OVERFLOW ) {
+		LinkedList_ForEach( node, &w->roots ) {
+			root = node->data;
+			root->overflow = TRUE;
+		}
+		return;
+	}
+	if( e->wd < 0 || e->wd >= w->n_watches || !w->watches[e->wd] ) {
+		return;
+	}
+	watch = w->watches[e->wd];
+	root = watch->root;
+	/* 目录自身被删除时，由它的上级目录的事件来处理 */
+	if( e->mask & (IN_IGNORED | IN_DELETE_SELF) ) {
+		FileWatcher_RemoveWatch( w, e->wd );
+		return;
+	}
+	Dict_Add( root->dirty_dirs, watch->path, (void*)1 );
+	if( !(e->mask & IN_ISDIR) || e->len == 0 ) {
+		return;
+	}
+	len = wcslen( watch->path );
+	wcscpy( path, watch->path );
+	len += LCUI_DecodeString( path + len, e->name, 
+				  MAX_PATH_LEN - len - 1, ENCODING_UTF8 );
+	path[len++] = PATH_SEP;
+	path[len] = 0;
+	/* 移走的目录的监视描述符不会失效，但路径已经不对了 */
+	if( e->mask & IN_MOVED_FROM ) {
+		FileWatcher_RemoveTree( w, path );
+	} else if( e->mask & (IN_CREATE | IN_MOVED_TO) ) {
+		FileWatcher_AddTree( w, root, path );
+	}
+}
+
+/** 将有变更的目录交给处理函数 */
+static void FileWatcher_Flush( FileWatcher w )
+{
+	WatchRoot root;
+	LinkedList dirs;
+	DictEntry *entry;
+	DictIterator *iter;
+	LinkedListNode *node;
+	LinkedList_ForEach( node, &w->roots ) {
+		root = node->data;
+		if( root->overflow ) {
+			root->overflow = FALSE;
+			Dict_Release( root->dirty_dirs );
+			root->dirty_dirs = Dict_Create( &DictType_Dirs, NULL );
+			w->handler( w->data, root->path, NULL );
+			continue;
+		}
+		LinkedList_Init( &dirs );
+		iter = Dict_GetIterator( root->dirty_dirs );
+		while( (entry = Dict_Next( iter )) ) {
+			LinkedList_Append( &dirs, DupPath( 
+				DictEntry_GetKey( entry ), FALSE ) );
+		}
+		Dict_ReleaseIterator( iter );
+		if( dirs.length > 0 ) {
+			Dict_Release( root->dirty_dirs );
+			root->dirty_dirs = Dict_Create( &DictType_Dirs, NULL );
+			w->handler( w->data, root->path, &dirs );
+		}
+		LinkedList_Clear( &dirs, free );
+	}
+}
+
+/**
+ * 监视新加入的根目录及其所有子目录
+ * 遍历较大的目录树比较耗时，所以放在监视线程中进行，不阻塞调用者。
+ * @returns 是否有根目录的部分子目录无法监视
+ */
+static LCUI_BOOL FileWatcher_AddRoots( FileWatcher w )
+{
+	WatchRoot root;
+	LinkedListNode *node;
+	LCUI_BOOL overflow = FALSE;
+	LinkedList_ForEach( node, &w->roots ) {
+		root = node->data;
+		if( root->is_ready ) {
+			continue;
+		}
+		root->is_ready = TRUE;
+		FileWatcher_AddTree( w, root, root->path );
+		overflow = overflow || root->overflow;
+	}
+	return overflow;
+}
+
+/** 监视线程 */
+static void FileWatcher_Thread( void *arg )
+{
+	int n;
+	char *buf, *p;
+	FileWatcher w = arg;
+	struct pollfd pfd;
+	struct inotify_event *e;
+	int64_t first_time = 0, last_time = 0;
+	buf = malloc( EVENT_BUF_SIZE );
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+	while( w->is_running ) {
+		pfd.revents = 0;
+		n = poll( &pfd, 1, last_time ? w->delay : POLL_TIMEOUT );
+		LCUIMutex_Lock( &w->mutex );
+		/* 有目录无法监视时，和事件一样等待一段时间后交给处理函数 */
+		if( FileWatcher_AddRoots( w ) && last_time == 0 ) {
+			first_time = last_time = LCUI_GetTickCount();
+		}
+		if( n > 0 && (pfd.revents & POLLIN) ) {
+			n = read( w->fd, buf, EVENT_BUF_SIZE );
+			for( p = buf; n > 0 && p < buf + n; ) {
+				e = (struct inotify_event*)p;
+				FileWatcher_HandleEvent( w, e );
+				p += sizeof( struct inotify_event ) + e->len;
+			}
+			last_time = LCUI_GetTickCount();
+			if( first_time == 0 ) {
+				first_time = last_time;
+			}
+		}
+		/* 等到一段时间内没有新事件时再处理，以便合并连续的操作 */
+		if( last_time && (LCUI_GetTimeDelta( last_time ) >= w->delay ||
+		    LCUI_GetTimeDelta( first_time ) >= 
+		    w->delay * MAX_DELAY_TIMES) ) {
+			FileWatcher_Flush( w );
+			first_time = last_time = 0;
+		}
+		LCUIMutex_Unlock( &w->mutex );
+	}
+	free( buf );
+	LCUIThread_Exit( NULL );
+}
+
+FileWatcher FileWatcher_New( int delay, FileWatcherHandler handler, 
+			     void *data )
+{
+	FileWatcher w;
+	int fd = inotify_init();
+	if( fd < 0 ) {
+		return NULL;
+	}
+	w = NEW( FileWatcherRec, 1 );
+	w->fd = fd;
+	w->data = data;
+	w->delay = delay;
+	w->handler = handler;
+	w->watches = NULL;
+	w->n_watches = 0;
+	w->is_running = TRUE;
+	LinkedList_Init( &w->roots );
+	LCUIMutex_Init( &w->mutex );
+	LCUIThread_Create( &w->thread, FileWatcher_Thread, w );
+	return w;
+}
+
+void FileWatcher_Delete( FileWatcher *wptr )
+{
+	int wd;
+	FileWatcher w = *wptr;
+	if( !w ) {
+		return;
+	}
+	w->is_running = FALSE;
+	LCUIThread_Join( w->thread, NULL );
+	for( wd = 0; wd < w->n_watches; ++wd ) {
+		FileWatcher_RemoveWatch( w, wd );
+	}
+	LinkedList_Clear( &w->roots, WatchRoot_Delete );
+	LCUIMutex_Destroy( &w->mutex );
+	close( w->fd );
+	free( w->watches );
+	free( w );
+	*wptr = NULL;
+}
+
+int FileWatcher_Watch( FileWatcher w, const wchar_t *dirpath )
+{
+	WatchRoot root;
+	if( !w ) {
+		return -1;
+	}
+	root = NEW( WatchRootRec, 1 );
+	root->path = DupPath( dirpath, FALSE );
+	root->dirty_dirs = Dict_Create( &DictType_Dirs, NULL );
+	root->overflow = FALSE;
+	root->is_ready = FALSE;
+	LCUIMutex_Lock( &w->mutex );
+	LinkedList_Append( &w->roots, root );
+	LCUIMutex_Unlock( &w->mutex );
+	return 0;
+}
+
+void FileWatcher_Unwatch( FileWatcher w, const wchar_t *dirpath )
+{
+	int wd;
+	WatchRoot root;
+	wchar_t *path;
+	LinkedListNode *node;
+	if( !w ) {
+		return;
+	}
+	path = DupPath( dirpath, FALSE );
+	LCUIMutex_Lock( &w->mutex );
+	LinkedList_ForEach( node, &w->roots ) {
+		root = node->data;
+		if( wcscmp( root->path, path ) == 0 ) {
+			break;
+		}
+	}
+	if( node ) {
+		for( wd = 0; wd < w->n_watches; ++wd ) {
+			if( w->watches[wd] && w->watches[wd]->root == root ) {
+				FileWatcher_RemoveWatch( w, wd );
+			}
+		}
+		LinkedList_Unlink( &w->roots, node );
+		WatchRoot_Delete( root );
+		free( node );
+	}
+	LCUIMutex_Unlock( &w->mutex );
+	free( path );
+}
+
+#else
+
+FileWatcher FileWatcher_New( int delay, FileWatcherHandler handler, 
+			     void *data )
+{
+	return NULL;
+}
+
+void FileWatcher_Delete( FileWatcher *wptr )
+{
+	*wptr = NULL;
+}
+
+int FileWatcher_Watch( FileWatcher w, const wchar_t *dirpath )
+{
+	return -1;
+}
+
+void FileWatcher_Unwatch( FileWatcher w, const wchar_t *dirpath )
+{
+}
+
+#endif
@@ -0,0 +1,163 @@
+﻿/* ***************************************************************************
+* hash_service.c -- background file hash service
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* hash_service.c -- 后台文件哈希服务
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "file_search.h"
+#include "file_hasher.h"
+#include "hash_service.h"
+
+/** 每次从数据库中取出的未计算哈希值的文件数量 */
+#define FILE_HASHER_BATCH 256
+
+typedef struct FileHashServiceRec_ {
+	LCUI_BOOL is_running;		/**< 是否正在运行 */
+	LCUI_BOOL is_dirty;		/**< 是否可能有新的文件需要计算 */
+	FileHasher hasher;		/**< 文件哈希计算器 */
+	FileReadableFunc readable;	/**< 判断文件能否读取的函数 */
+	void *data;			/**< 传给 readable 的附加数据 */
+	LCUI_Thread thread;		/**< 从数据库中取出文件的线程 */
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;
+} FileHashServiceRec;
+
+/** 保存计算好的文件哈希值，由文件哈希计算器的工作线程调用 */
+static void OnFileHashed( void *data, int id, const FileStatRec *st,
+			  const unsigned char *hash )
+{
+	DB_Begin();
+	DB_SetFileHash( id, st->size, st->mtime, hash, FILE_HASH_SIZE );
+	DB_Commit();
+}
+
+/** 将数据库中还没有哈希值的文件分批交给文件哈希计算器 */
+static void FileHashService_Run( FileHashService s )
+{
+	int i, n, min_id = 0;
+	DB_File *files;
+	wchar_t wpath[PATH_LEN];
+	while( s->is_running ) {
+		DB_Begin();
+		n = DB_GetUnhashedFiles( min_id, FILE_HASHER_BATCH, &files );
+		DB_Commit();
+		if( n <= 0 ) {
+			if( n == 0 ) {
+				free( files );
+			}
+			break;
+		}
+		for( i = 0; i < n; ++i ) {
+			min_id = files[i]->id;
+			LCUI_DecodeString( wpath, files[i]->path, PATH_LEN, 
+					   ENCODING_UTF8 );
+			if( s->is_running && (!s->readable || 
+			    s->readable( s->data, files[i]->path )) ) {
+				FileHasher_Add( s->hasher, min_id, wpath );
+			}
+			free( files[i]->path );
+			free( files[i] );
+		}
+		free( files );
+	}
+	/* 计算失败的文件会在下一轮重新计算 */
+	FileHasher_Wait( s->hasher );
+}
+
+static void FileHashService_Thread( void *arg )
+{
+	FileHashService s = arg;
+	LCUIMutex_Lock( &s->mutex );
+	while( s->is_running ) {
+		if( !s->is_dirty ) {
+			LCUICond_Wait( &s->cond, &s->mutex );
+			continue;
+		}
+		s->is_dirty = FALSE;
+		LCUIMutex_Unlock( &s->mutex );
+		FileHashService_Run( s );
+		LCUIMutex_Lock( &s->mutex );
+	}
+	LCUIMutex_Unlock( &s->mutex );
+	LCUIThread_Exit( NULL );
+}
+
+FileHashService FileHashService_New( int workers, FileReadableFunc readable,
+				     void *data )
+{
+	FileHashService s = NEW( FileHashServiceRec, 1 );
+	LCUIMutex_Init( &s->mutex );
+	LCUICond_Init( &s->cond );
+	s->readable = readable;
+	s->data = data;
+	s->is_dirty = TRUE;
+	s->is_running = TRUE;
+	s->hasher = FileHasher_New( workers, OnFileHashed, s );
+	LCUIThread_Create( &s->thread, FileHashService_Thread, s );
+	return s;
+}
+
+void FileHashService_Notify( FileHashService s )
+{
+	LCUIMutex_Lock( &s->mutex );
+	s->is_dirty = TRUE;
+	LCUICond_Signal( &s->cond );
+	LCUIMutex_Unlock( &s->mutex );
+}
+
+void FileHashService_Delete( FileHashService *sptr )
+{
+	FileHashService s = *sptr;
+	if( !s ) {
+		return;
+	}
+	LCUIMutex_Lock( &s->mutex );
+	s->is_running = FALSE;
+	LCUICond_Signal( &s->cond );
+	LCUIMutex_Unlock( &s->mutex );
+	FileHasher_Stop( s->hasher );
+	LCUIThread_Join( s->thread, NULL );
+	FileHasher_Delete( &s->hasher );
+	LCUICond_Destroy( &s->cond );
+	LCUIMutex_Destroy( &s->mutex );
+	free( s );
+	*sptr = NULL;
+}
@@ -0,0 +1,132 @@
+/*
+MurmurHash3_x64_128
+By Austin Appleby
+100% Public Domain
+
+Test Vectors (seed 0, digest is h1 then h2, both little-endian)
+""
+00000000 00000000 00000000 00000000
+"hello"
+029BBD41 B3A7D8CB 191DAE48 6A901E5B
+"The quick brown fox jumps over the lazy dog"
+6C1B07BC 7BBC4BE3 47939AC4 A93C437A
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "murmur3.h"
+
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Read a little-endian 64-bit word, whatever the host byte order is. */
+static uint64_t getblock64( const unsigned char *p )
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void putblock64( unsigned char *p, uint64_t v )
+{
+	int i;
+	for( i = 0; i < 8; ++i ) {
+		p[i] = (unsigned char)(v >> (i * 8));
+	}
+}
+
+/* Finalization mix - force all bits of a hash block to avalanche */
+static uint64_t fmix64( uint64_t k )
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/* Hash a single 128-bit block. */
+static void Murmur3Transform( MURMUR3_CTX *context, const unsigned char *block )
+{
+	uint64_t k1 = getblock64( block );
+	uint64_t k2 = getblock64( block + 8 );
+	uint64_t h1 = context->h1, h2 = context->h2;
+
+	k1 *= C1; k1 = rotl64( k1, 31 ); k1 *= C2; h1 ^= k1;
+	h1 = rotl64( h1, 27 ); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+	k2 *= C2; k2 = rotl64( k2, 33 ); k2 *= C1; h2 ^= k2;
+	h2 = rotl64( h2, 31 ); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+
+	context->h1 = h1;
+	context->h2 = h2;
+}
+
+void Murmur3Init( MURMUR3_CTX *context, uint32_t seed )
+{
+	context->h1 = seed;
+	context->h2 = seed;
+	context->length = 0;
+}
+
+void Murmur3Update( MURMUR3_CTX *context, const unsigned char *data, size_t len )
+{
+	size_t used = (size_t)(context->length & 15), n;
+
+	context->length += len;
+	if( used > 0 ) {
+		n = 16 - used;
+		if( len < n ) {
+			memcpy( context->buffer + used, data, len );
+			return;
+		}
+		memcpy( context->buffer + used, data, n );
+		Murmur3Transform( context, context->buffer );
+		data += n;
+		len -= n;
+	}
+	for( ; len >= 16; data += 16, len -= 16 ) {
+		Murmur3Transform( context, data );
+	}
+	memcpy( context->buffer, data, len );
+}
+
+void Murmur3Final( unsigned char digest[16], MURMUR3_CTX *context )
+{
+	int i, n = (int)(context->length & 15);
+	const unsigned char *tail = context->buffer;
+	uint64_t h1 = context->h1, h2 = context->h2;
+	uint64_t k1 = 0, k2 = 0;
+
+	/* The tail is mixed in byte by byte, as in the reference switch. */
+	for( i = n - 1; i >= 8; --i ) {
+		k2 ^= (uint64_t)tail[i] << ((i - 8) * 8);
+	}
+	if( n > 8 ) {
+		k2 *= C2; k2 = rotl64( k2, 33 ); k2 *= C1; h2 ^= k2;
+	}
+	for( i = (n < 8 ? n : 8) - 1; i >= 0; --i ) {
+		k1 ^= (uint64_t)tail[i] << (i * 8);
+	}
+	if( n > 0 ) {
+		k1 *= C1; k1 = rotl64( k1, 31 ); k1 *= C2; h1 ^= k1;
+	}
+
+	h1 ^= context->length;
+	h2 ^= context->length;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64( h1 );
+	h2 = fmix64( h2 );
+	h1 += h2;
+	h2 += h1;
+
+	putblock64( digest, h1 );
+	putblock64( digest + 8, h2 );
+	memset( context, 0, sizeof( *context ) );
+}
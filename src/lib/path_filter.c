@@ -0,0 +1,758 @@
+﻿/* ***************************************************************************
+* path_filter.c -- path exclusion rules compiled to a DFA.
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* path_filter.c -- 编译为确定有限状态自动机的路径排除规则。
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "path_filter.h"
+
+/** 自动机的状态数量上限 */
+#define MAX_STATES	4096
+/** 状态哈希表的容量，必须是 2 的幂且大于 MAX_STATES */
+#define STATE_SLOTS	8192
+/** 死状态，任何规则都不可能再匹配 */
+#define STATE_DEAD	0
+/** 初始状态 */
+#define STATE_START	1
+
+#ifdef _WIN32
+#define FoldChar(CH) ((CH) >= L'A' && (CH) <= L'Z' ? (CH) + 32 : (CH))
+#else
+#define FoldChar(CH) (CH)
+#endif
+
+/**
+ * 规则中的元素，每个元素都是非确定有限状态自动机中的一个位置
+ * 匹配到一个元素后进入下一个位置，每条规则最后都有一个 TOKEN_END 元素，
+ * 到达该位置即表示规则匹配成功。
+ */
+enum TokenType {
+	TOKEN_CHAR,	/**< 匹配指定字符 */
+	TOKEN_ANY,	/**< ?，匹配 / 以外的任意字符 */
+	TOKEN_CLASS,	/**< [...]，匹配字符集合中的字符 */
+	TOKEN_STAR,	/**< *，匹配任意个 / 以外的字符 */
+	TOKEN_ANYSTAR,	/**< **，匹配任意个字符 */
+	TOKEN_END
+};
+
+typedef struct CharRangeRec_ {
+	wchar_t first;
+	wchar_t last;
+} CharRangeRec, *CharRange;
+
+typedef struct TokenRec_ {
+	int type;
+	wchar_t ch;		/**< TOKEN_CHAR 匹配的字符 */
+	LCUI_BOOL negate;	/**< TOKEN_CLASS 是否匹配集合以外的字符 */
+	int n_ranges;		/**< TOKEN_CLASS 中的字符范围数量 */
+	CharRange ranges;	/**< TOKEN_CLASS 中的字符范围 */
+	int skip;		/**< 进入该位置时还可直接跳过的元素数量 */
+	int rule;		/**< TOKEN_END 所属的规则 */
+} TokenRec, *Token;
+
+typedef struct RuleRec_ {
+	LCUI_BOOL include;	/**< 是否为重新包含的规则 */
+	LCUI_BOOL dir_only;	/**< 是否只匹配目录 */
+	int start;		/**< 第一个元素的位置 */
+} RuleRec, *Rule;
+
+typedef struct PathFilterRec_ {
+	RuleRec *rules;		/**< 规则列表 */
+	int n_rules;		/**< 规则数量 */
+	TokenRec *tokens;	/**< 所有规则的元素 */
+	int n_tokens;		/**< 元素数量 */
+	int max_tokens;		/**< 元素列表的容量 */
+	uint32_t digest;	/**< 规则的摘要 */
+	LCUI_BOOL compiled;	/**< 是否已编译 */
+	wchar_t *points;	/**< 字符分段的起点，每段字符的匹配结果相同 */
+	int n_symbols;		/**< 字符分段的数量，即自动机的输入符号数量 */
+	int n_states;		/**< 状态数量 */
+	int *trans;		/**< 状态转移表，n_states 行 n_symbols 列 */
+	int *accept_dir;	/**< 目录在各个状态下最后匹配的规则，-1 表示无 */
+	int *accept_file;	/**< 文件在各个状态下最后匹配的规则 */
+	int n_words;		/**< 位置集合占用的字数 */
+	uint32_t *start_set;	/**< 初始的位置集合，只在模拟匹配时使用 */
+	LCUI_BOOL use_nfa;	/**< 自动机过大，改为逐个位置模拟匹配 */
+} PathFilterRec;
+
+/** 编译时使用的数据 */
+typedef struct CompilerRec_ {
+	PathFilter filter;
+	int n_words;		/**< 每个状态的位置集合占用的字数 */
+	uint32_t *sets;		/**< 各个状态的位置集合 */
+	int *slots;		/**< 状态哈希表，存放状态编号加 1 */
+} CompilerRec, *Compiler;
+
+PathFilter PathFilter_New( void )
+{
+	PathFilter f = NEW( PathFilterRec, 1 );
+	f->rules = NULL;
+	f->tokens = NULL;
+	f->points = NULL;
+	f->trans = NULL;
+	f->accept_dir = NULL;
+	f->accept_file = NULL;
+	f->start_set = NULL;
+	f->use_nfa = FALSE;
+	f->n_words = 0;
+	f->digest = 0;
+	f->n_rules = 0;
+	f->n_tokens = 0;
+	f->max_tokens = 0;
+	f->n_states = 0;
+	f->n_symbols = 0;
+	f->compiled = FALSE;
+	return f;
+}
+
+/** 清除编译结果 */
+static void PathFilter_Reset( PathFilter f )
+{
+	free( f->points );
+	free( f->trans );
+	free( f->accept_dir );
+	free( f->accept_file );
+	free( f->start_set );
+	f->points = NULL;
+	f->trans = NULL;
+	f->accept_dir = NULL;
+	f->accept_file = NULL;
+	f->start_set = NULL;
+	f->use_nfa = FALSE;
+	f->n_states = 0;
+	f->n_symbols = 0;
+	f->compiled = FALSE;
+}
+
+void PathFilter_Delete( PathFilter *fptr )
+{
+	int i;
+	PathFilter f = *fptr;
+	PathFilter_Reset( f );
+	for( i = 0; i < f->n_tokens; ++i ) {
+		free( f->tokens[i].ranges );
+	}
+	free( f->tokens );
+	free( f->rules );
+	free( f );
+	*fptr = NULL;
+}
+
+static Token PathFilter_AddToken( PathFilter f, int type )
+{
+	Token t;
+	if( f->n_tokens >= f->max_tokens ) {
+		f->max_tokens = f->max_tokens > 0 ? f->max_tokens * 2 : 32;
+		f->tokens = realloc( f->tokens, 
+				     sizeof( TokenRec ) * f->max_tokens );
+	}
+	t = &f->tokens[f->n_tokens++];
+	memset( t, 0, sizeof( TokenRec ) );
+	t->type = type;
+	return t;
+}
+
+static void Token_AddRange( Token t, wchar_t first, wchar_t last )
+{
+	size_t size = sizeof( CharRangeRec ) * (t->n_ranges + 1);
+	t->ranges = realloc( t->ranges, size );
+	t->ranges[t->n_ranges].first = first;
+	t->ranges[t->n_ranges].last = last;
+	t->n_ranges += 1;
+}
+
+/**
+ * 解析字符集合，p 指向 [ 之后的字符
+ * 集合没有闭合时按普通字符处理，返回 NULL
+ */
+static const wchar_t *PathFilter_AddClass( PathFilter f, const wchar_t *p,
+					   const wchar_t *end )
+{
+	Token t;
+	wchar_t first, last;
+	const wchar_t *q = p;
+	if( q < end && (*q == L'!' || *q == L'^') ) {
+		++q;
+	}
+	/* 紧跟在开头的 ] 是普通字符 */
+	if( q < end && *q == L']' ) {
+		++q;
+	}
+	while( q < end && *q != L']' ) {
+		++q;
+	}
+	if( q >= end ) {
+		return NULL;
+	}
+	t = PathFilter_AddToken( f, TOKEN_CLASS );
+	if( *p == L'!' || *p == L'^' ) {
+		t->negate = TRUE;
+		++p;
+	}
+	while( p < q ) {
+		first = last = *p++;
+		if( p + 1 < q && *p == L'-' ) {
+			last = p[1];
+			p += 2;
+		}
+		if( first > last ) {
+			continue;
+		}
+		Token_AddRange( t, first, last );
+#ifdef _WIN32
+		/* 匹配时路径中的字符已转为小写，集合中的大写字母也需转换 */
+		if( first <= L'Z' && last >= L'A' ) {
+			Token_AddRange( t, FoldChar( first < L'A' ? L'A' : first ),
+					FoldChar( last > L'Z' ? L'Z' : last ) );
+		}
+#endif
+	}
+	return q + 1;
+}
+
+/** 更新规则摘要，采用 FNV-1a 算法 */
+static uint32_t UpdateDigest( uint32_t digest, const wchar_t *str, size_t len )
+{
+	size_t i;
+	if( digest == 0 ) {
+		digest = 2166136261u;
+	}
+	for( i = 0; i < len; ++i ) {
+		digest = (digest ^ (uint32_t)str[i]) * 16777619u;
+	}
+	digest = (digest ^ L'\n') * 16777619u;
+	return digest ? digest : 1;
+}
+
+/** 添加一条规则，rule 的长度为 len，不以 0 结尾 */
+static int PathFilter_AddRuleN( PathFilter f, const wchar_t *rule, size_t len )
+{
+	Rule r;
+	Token t;
+	const wchar_t *p, *begin, *next, *end;
+	LCUI_BOOL include = FALSE, dir_only = FALSE, anchored = FALSE;
+	while( len > 0 && (rule[len - 1] == L' ' || rule[len - 1] == L'\t' ||
+			   rule[len - 1] == L'\r') ) {
+		--len;
+	}
+	if( len == 0 || rule[0] == L'#' ) {
+		return 0;
+	}
+	f->digest = UpdateDigest( f->digest, rule, len );
+	end = rule + len;
+	p = rule;
+	if( *p == L'!' ) {
+		include = TRUE;
+		++p;
+	}
+	while( end > p && (end[-1] == L'/' || end[-1] == L'\\') ) {
+		dir_only = TRUE;
+		--end;
+	}
+	if( p >= end ) {
+		return 0;
+	}
+	for( next = p; next < end; ++next ) {
+		if( *next == L'/' || *next == L'\\' ) {
+			anchored = TRUE;
+			break;
+		}
+	}
+	if( *p == L'/' || *p == L'\\' ) {
+		++p;
+	}
+	begin = p;
+	PathFilter_Reset( f );
+	f->rules = realloc( f->rules, sizeof( RuleRec ) * (f->n_rules + 1) );
+	r = &f->rules[f->n_rules++];
+	r->include = include;
+	r->dir_only = dir_only;
+	r->start = f->n_tokens;
+	/* 不含 / 的规则可以匹配任意层级，相当于在前面加上 ** / */
+	if( !anchored ) {
+		t = PathFilter_AddToken( f, TOKEN_ANYSTAR );
+		t->skip = 1;
+		t = PathFilter_AddToken( f, TOKEN_CHAR );
+		t->ch = L'/';
+	}
+	while( p < end ) {
+		/* 独占一层的 ** */
+		if( p[0] == L'*' && p + 1 < end && p[1] == L'*' &&
+		    (p == begin || p[-1] == L'/' || p[-1] == L'\\') &&
+		    (p + 2 == end || p[2] == L'/' || p[2] == L'\\') ) {
+			t = PathFilter_AddToken( f, TOKEN_ANYSTAR );
+			if( p + 2 < end ) {
+				t->skip = 1;
+				t = PathFilter_AddToken( f, TOKEN_CHAR );
+				t->ch = L'/';
+				p += 3;
+			} else {
+				p += 2;
+			}
+			continue;
+		}
+		switch( *p ) {
+		case L'*':
+			while( p < end && *p == L'*' ) {
+				++p;
+			}
+			PathFilter_AddToken( f, TOKEN_STAR );
+			continue;
+		case L'?':
+			PathFilter_AddToken( f, TOKEN_ANY );
+			break;
+		case L'[':
+			next = PathFilter_AddClass( f, p + 1, end );
+			if( next ) {
+				p = next;
+				continue;
+			}
+			t = PathFilter_AddToken( f, TOKEN_CHAR );
+			t->ch = L'[';
+			break;
+		case L'\\':
+		case L'/':
+			t = PathFilter_AddToken( f, TOKEN_CHAR );
+			t->ch = L'/';
+			break;
+		default:
+			t = PathFilter_AddToken( f, TOKEN_CHAR );
+			t->ch = FoldChar( *p );
+			break;
+		}
+		++p;
+	}
+	t = PathFilter_AddToken( f, TOKEN_END );
+	t->rule = f->n_rules - 1;
+	return 1;
+}
+
+int PathFilter_AddRule( PathFilter f, const wchar_t *rule )
+{
+	return PathFilter_AddRuleN( f, rule, wcslen( rule ) );
+}
+
+int PathFilter_AddRules( PathFilter f, const wchar_t *rules )
+{
+	int n = 0;
+	const wchar_t *p, *line;
+	for( line = p = rules; ; ++p ) {
+		if( *p == L'\n' || *p == 0 ) {
+			n += PathFilter_AddRuleN( f, line, p - line );
+			if( *p == 0 ) {
+				break;
+			}
+			line = p + 1;
+		}
+	}
+	return n;
+}
+
+int PathFilter_GetRuleCount( PathFilter f )
+{
+	return f->n_rules;
+}
+
+uint32_t PathFilter_GetDigest( PathFilter f )
+{
+	return f->digest;
+}
+
+static int CompareChar( const void *a, const void *b )
+{
+	wchar_t ch1 = *(const wchar_t*)a, ch2 = *(const wchar_t*)b;
+	return ch1 < ch2 ? -1 : (ch1 > ch2 ? 1 : 0);
+}
+
+/**
+ * 将字符分段
+ * 以规则中出现的字符和字符范围的边界作为分段的起点，同一段内的字符对所有
+ * 元素的匹配结果都相同，自动机只需为每段建立一列状态转移。
+ */
+static void PathFilter_InitSymbols( PathFilter f )
+{
+	int i, j, n = 0;
+	Token t;
+	wchar_t *points;
+	points = malloc( sizeof( wchar_t ) * (f->n_tokens * 2 + 2) );
+	points[n++] = L'/';
+	points[n++] = L'/' + 1;
+	for( i = 0; i < f->n_tokens; ++i ) {
+		t = &f->tokens[i];
+		if( t->type == TOKEN_CHAR ) {
+			points = realloc( points, sizeof( wchar_t ) * (n + 2) );
+			points[n++] = t->ch;
+			points[n++] = t->ch + 1;
+		} else if( t->type == TOKEN_CLASS ) {
+			points = realloc( points, sizeof( wchar_t ) *
+					  (n + t->n_ranges * 2) );
+			for( j = 0; j < t->n_ranges; ++j ) {
+				points[n++] = t->ranges[j].first;
+				points[n++] = t->ranges[j].last + 1;
+			}
+		}
+	}
+	qsort( points, n, sizeof( wchar_t ), CompareChar );
+	for( i = 1, j = 1; i < n; ++i ) {
+		if( points[i] != points[j - 1] ) {
+			points[j++] = points[i];
+		}
+	}
+	f->points = points;
+	/* 第一个起点之前的字符也是一段 */
+	f->n_symbols = j + 1;
+}
+
+/** 获取字符所在的分段 */
+static int PathFilter_GetSymbol( PathFilter f, wchar_t ch )
+{
+	int low = 0, high = f->n_symbols - 1, mid;
+	/* 找出最后一个不大于 ch 的起点 */
+	while( low < high ) {
+		mid = (low + high + 1) / 2;
+		if( f->points[mid - 1] <= ch ) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+/** 获取分段中的一个字符 */
+static wchar_t PathFilter_GetSymbolChar( PathFilter f, int symbol )
+{
+	return symbol == 0 ? 0 : f->points[symbol - 1];
+}
+
+static LCUI_BOOL Token_MatchChar( Token t, wchar_t ch )
+{
+	int i;
+	switch( t->type ) {
+	case TOKEN_CHAR:
+		return t->ch == ch;
+	case TOKEN_ANY:
+	case TOKEN_STAR:
+		return ch != L'/';
+	case TOKEN_ANYSTAR:
+		return TRUE;
+	case TOKEN_CLASS:
+		if( ch == L'/' ) {
+			return FALSE;
+		}
+		for( i = 0; i < t->n_ranges; ++i ) {
+			if( ch >= t->ranges[i].first && ch <= t->ranges[i].last ) {
+				return !t->negate;
+			}
+		}
+		return t->negate;
+	default: break;
+	}
+	return FALSE;
+}
+
+#define SetBit(SET, I) (SET)[(I) >> 5] |= 1u << ((I) & 31)
+#define HasBit(SET, I) ((SET)[(I) >> 5] & (1u << ((I) & 31)))
+
+/** 进入位置，并将不需要消耗字符就能到达的位置一并加入集合 */
+static void AddPosition( PathFilter f, uint32_t *set, int pos )
+{
+	Token t;
+	while( !HasBit( set, pos ) ) {
+		SetBit( set, pos );
+		t = &f->tokens[pos];
+		if( t->type != TOKEN_STAR && t->type != TOKEN_ANYSTAR ) {
+			break;
+		}
+		/* ** / 可以整个跳过，但 ** 匹配过字符后就必须接着匹配 / */
+		if( t->skip > 0 ) {
+			AddPosition( f, set, pos + 1 + t->skip );
+		}
+		pos += 1;
+	}
+}
+
+/** 计算位置集合匹配一个字符后得到的位置集合 */
+static void StepPositions( PathFilter f, const uint32_t *set,
+			   uint32_t *next, wchar_t ch )
+{
+	int pos, type;
+	memset( next, 0, sizeof( uint32_t ) * f->n_words );
+	for( pos = 0; pos < f->n_tokens; ++pos ) {
+		if( !HasBit( set, pos ) || 
+		    !Token_MatchChar( &f->tokens[pos], ch ) ) {
+			continue;
+		}
+		/* 星号匹配字符后停留在原位置 */
+		type = f->tokens[pos].type;
+		if( type == TOKEN_STAR || type == TOKEN_ANYSTAR ) {
+			SetBit( next, pos );
+		}
+		AddPosition( f, next, pos + 1 );
+	}
+}
+
+/** 找出位置集合中最后匹配的规则，-1 表示无 */
+static void GetAcceptRules( PathFilter f, const uint32_t *set,
+			    int *dir_rule, int *file_rule )
+{
+	int pos, rule;
+	*dir_rule = -1;
+	*file_rule = -1;
+	for( pos = 0; pos < f->n_tokens; ++pos ) {
+		if( !HasBit( set, pos ) || f->tokens[pos].type != TOKEN_END ) {
+			continue;
+		}
+		rule = f->tokens[pos].rule;
+		if( rule > *dir_rule ) {
+			*dir_rule = rule;
+		}
+		if( !f->rules[rule].dir_only && rule > *file_rule ) {
+			*file_rule = rule;
+		}
+	}
+}
+
+static uint32_t HashSet( const uint32_t *set, int n_words )
+{
+	int i;
+	uint32_t hash = 2166136261u;
+	for( i = 0; i < n_words; ++i ) {
+		hash = (hash ^ set[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * 查找位置集合对应的状态，没有时创建新状态
+ * 状态数量超出上限时返回 -1
+ */
+static int Compiler_GetState( Compiler c, const uint32_t *set )
+{
+	int i, state;
+	PathFilter f = c->filter;
+	size_t size = sizeof( uint32_t ) * f->n_words;
+	uint32_t slot = HashSet( set, f->n_words ) & (STATE_SLOTS - 1);
+	while( c->slots[slot] ) {
+		state = c->slots[slot] - 1;
+		if( memcmp( c->sets + state * f->n_words, set, size ) == 0 ) {
+			return state;
+		}
+		slot = (slot + 1) & (STATE_SLOTS - 1);
+	}
+	if( f->n_states >= MAX_STATES ) {
+		return -1;
+	}
+	state = f->n_states++;
+	c->slots[slot] = state + 1;
+	memcpy( c->sets + state * f->n_words, set, size );
+	GetAcceptRules( f, set, &f->accept_dir[state], 
+			&f->accept_file[state] );
+	for( i = 0; i < f->n_symbols; ++i ) {
+		f->trans[state * f->n_symbols + i] = STATE_DEAD;
+	}
+	return state;
+}
+
+/**
+ * 用子集构造法生成确定有限状态自动机
+ * 自动机的每个状态对应一个位置集合，从初始状态开始，为每种输入符号计算出
+ * 下一个位置集合，直到不再出现新的集合。
+ */
+static int PathFilter_BuildDFA( PathFilter f )
+{
+	CompilerRec c;
+	uint32_t *set;
+	int state, symbol, next, ret = 0;
+	c.filter = f;
+	c.sets = malloc( sizeof( uint32_t ) * f->n_words * MAX_STATES );
+	c.slots = NEW( int, STATE_SLOTS );
+	set = malloc( sizeof( uint32_t ) * f->n_words );
+	f->trans = malloc( sizeof( int ) * f->n_symbols * MAX_STATES );
+	f->accept_dir = malloc( sizeof( int ) * MAX_STATES );
+	f->accept_file = malloc( sizeof( int ) * MAX_STATES );
+	/* 0 号状态是空集合，1 号状态是初始的位置集合 */
+	memset( set, 0, sizeof( uint32_t ) * f->n_words );
+	Compiler_GetState( &c, set );
+	Compiler_GetState( &c, f->start_set );
+	/* 按创建顺序处理每个状态，处理过程中新建的状态会排在后面 */
+	for( state = STATE_START; state < f->n_states && ret == 0; ++state ) {
+		for( symbol = 0; symbol < f->n_symbols; ++symbol ) {
+			StepPositions( f, c.sets + state * f->n_words, set,
+				       PathFilter_GetSymbolChar( f, symbol ) );
+			next = Compiler_GetState( &c, set );
+			if( next < 0 ) {
+				ret = -1;
+				break;
+			}
+			f->trans[state * f->n_symbols + symbol] = next;
+		}
+	}
+	free( set );
+	free( c.sets );
+	free( c.slots );
+	return ret;
+}
+
+int PathFilter_Compile( PathFilter f )
+{
+	int rule, ret;
+	if( f->compiled ) {
+		return f->use_nfa ? -1 : 0;
+	}
+	PathFilter_Reset( f );
+	f->compiled = TRUE;
+	if( f->n_rules == 0 ) {
+		return 0;
+	}
+	f->n_words = (f->n_tokens + 31) / 32;
+	f->start_set = NEW( uint32_t, f->n_words );
+	for( rule = 0; rule < f->n_rules; ++rule ) {
+		AddPosition( f, f->start_set, f->rules[rule].start );
+	}
+	PathFilter_InitSymbols( f );
+	ret = PathFilter_BuildDFA( f );
+	if( ret != 0 ) {
+		free( f->trans );
+		free( f->accept_dir );
+		free( f->accept_file );
+		f->trans = NULL;
+		f->accept_dir = NULL;
+		f->accept_file = NULL;
+		f->n_states = 0;
+		f->use_nfa = TRUE;
+	}
+	return ret;
+}
+
+/** 判断最后匹配的规则是否为排除规则 */
+static LCUI_BOOL PathFilter_IsExcludeRule( PathFilter f, int rule )
+{
+	return rule >= 0 && !f->rules[rule].include;
+}
+
+/** 逐个位置模拟匹配，参数同 PathFilter_Match() */
+static LCUI_BOOL PathFilter_MatchNFA( PathFilter f, const wchar_t *path,
+				      LCUI_BOOL is_dir, LCUI_BOOL check_dirs )
+{
+	wchar_t ch;
+	const wchar_t *p;
+	int dir_rule, file_rule;
+	LCUI_BOOL ret = FALSE;
+	uint32_t *buf, *set, *next, *tmp;
+	size_t size = sizeof( uint32_t ) * f->n_words;
+	buf = malloc( size * 2 );
+	set = buf;
+	next = buf + f->n_words;
+	memcpy( set, f->start_set, size );
+	for( p = path; *p; ++p ) {
+		ch = *p == L'\\' ? L'/' : FoldChar( *p );
+		if( ch == L'/' ) {
+			if( !p[1] ) {
+				break;
+			}
+			GetAcceptRules( f, set, &dir_rule, &file_rule );
+			if( check_dirs && p != path &&
+			    PathFilter_IsExcludeRule( f, dir_rule ) ) {
+				free( buf );
+				return TRUE;
+			}
+		}
+		StepPositions( f, set, next, ch );
+		tmp = set;
+		set = next;
+		next = tmp;
+	}
+	GetAcceptRules( f, set, &dir_rule, &file_rule );
+	ret = PathFilter_IsExcludeRule( f, is_dir ? dir_rule : file_rule );
+	free( buf );
+	return ret;
+}
+
+/**
+ * 匹配路径
+ * @param[in] check_dirs 是否检查路径中的每一级目录
+ */
+static LCUI_BOOL PathFilter_Match( PathFilter f, const wchar_t *path,
+				   LCUI_BOOL is_dir, LCUI_BOOL check_dirs )
+{
+	wchar_t ch;
+	const wchar_t *p;
+	int state = STATE_START;
+	if( !f->compiled || f->n_rules == 0 ) {
+		return FALSE;
+	}
+	if( f->use_nfa ) {
+		return PathFilter_MatchNFA( f, path, is_dir, check_dirs );
+	}
+	for( p = path; *p; ++p ) {
+		ch = *p == L'\\' ? L'/' : FoldChar( *p );
+		if( ch == L'/' ) {
+			/* 忽略末尾的路径分隔符 */
+			if( !p[1] ) {
+				break;
+			}
+			if( check_dirs && p != path && PathFilter_IsExcludeRule( 
+				f, f->accept_dir[state] ) ) {
+				return TRUE;
+			}
+		}
+		state = f->trans[state * f->n_symbols +
+				 PathFilter_GetSymbol( f, ch )];
+		/* 任何规则都不可能再匹配 */
+		if( state == STATE_DEAD ) {
+			return FALSE;
+		}
+	}
+	if( is_dir ) {
+		return PathFilter_IsExcludeRule( f, f->accept_dir[state] );
+	}
+	return PathFilter_IsExcludeRule( f, f->accept_file[state] );
+}
+
+LCUI_BOOL PathFilter_IsExcluded( PathFilter f, const wchar_t *path,
+				 LCUI_BOOL is_dir )
+{
+	return PathFilter_Match( f, path, is_dir, FALSE );
+}
+
+LCUI_BOOL PathFilter_IsExcludedTree( PathFilter f, const wchar_t *dirpath )
+{
+	return PathFilter_Match( f, dirpath, TRUE, TRUE );
+}
@@ -0,0 +1,367 @@
+﻿/* ***************************************************************************
+* path_trie.c -- compact path store
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* path_trie.c -- 紧凑的路径存储
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "path_trie.h"
+
+/** 目录记录 */
+typedef struct PathTrieDirRec_ {
+	uint32_t parent;	/**< 上级目录 */
+	uint32_t name;		/**< 名称在名称池中的位置 */
+	uint32_t hash;		/**< 由上级目录编号和名称计算出的哈希值 */
+	uint32_t files;		/**< 最后添加的文件 */
+} PathTrieDirRec, *PathTrieDir;
+
+/** 文件记录 */
+typedef struct PathTrieFileRec_ {
+	uint32_t dir;		/**< 所在目录 */
+	uint32_t name;		/**< 名称在名称池中的位置 */
+	uint32_t next;		/**< 同一目录中的上一个添加的文件 */
+} PathTrieFileRec, *PathTrieFile;
+
+typedef struct PathTrieRec_ {
+	PathTrieDir dirs;	/**< 目录列表 */
+	uint32_t n_dirs;	/**< 目录数量 */
+	uint32_t max_dirs;	/**< 目录列表的容量 */
+	PathTrieFile files;	/**< 文件列表 */
+	uint32_t n_files;	/**< 文件数量 */
+	uint32_t max_files;	/**< 文件列表的容量 */
+	wchar_t *names;		/**< 名称池，名称之间以 0 分隔 */
+	uint32_t names_len;	/**< 名称池已用的长度 */
+	uint32_t names_size;	/**< 名称池的容量 */
+	uint32_t *slots;	/**< 目录哈希表，采用开放寻址，存放目录编号 */
+	uint32_t n_slots;	/**< 哈希表的容量，总是 2 的幂 */
+} PathTrieRec;
+
+static uint32_t HashName( uint32_t parent, const wchar_t *name, size_t len )
+{
+	size_t i;
+	uint32_t hash = 5381 + parent * 31;
+	for( i = 0; i < len; ++i ) {
+		hash = ((hash << 5) + hash) + name[i];
+	}
+	return hash;
+}
+
+/** 确保数组能容纳 n 个元素 */
+static int Reserve( void **array, uint32_t *size, 
+		    uint32_t n, size_t item_size )
+{
+	void *newarray;
+	uint32_t newsize = *size > 0 ? *size : 64;
+	if( n <= *size ) {
+		return 0;
+	}
+	while( newsize < n ) {
+		newsize *= 2;
+	}
+	newarray = realloc( *array, newsize * item_size );
+	if( !newarray ) {
+		return -1;
+	}
+	*array = newarray;
+	*size = newsize;
+	return 0;
+}
+
+static uint32_t PathTrie_AddName( PathTrie trie, const wchar_t *name, 
+				  size_t len )
+{
+	uint32_t pos = trie->names_len;
+	if( Reserve( (void**)&trie->names, &trie->names_size, 
+		     pos + len + 1, sizeof( wchar_t ) ) != 0 ) {
+		return PATH_TRIE_NONE;
+	}
+	wcsncpy( trie->names + pos, name, len );
+	trie->names[pos + len] = 0;
+	trie->names_len += len + 1;
+	return pos;
+}
+
+/** 扩大哈希表，并重新放置所有目录 */
+static int PathTrie_Rehash( PathTrie trie )
+{
+	uint32_t i, j, mask, *slots;
+	uint32_t n = trie->n_slots > 0 ? trie->n_slots * 2 : 256;
+	slots = malloc( n * sizeof( uint32_t ) );
+	if( !slots ) {
+		return -1;
+	}
+	memset( slots, 0xff, n * sizeof( uint32_t ) );
+	mask = n - 1;
+	for( i = 0; i < trie->n_dirs; ++i ) {
+		j = trie->dirs[i].hash & mask;
+		while( slots[j] != PATH_TRIE_NONE ) {
+			j = (j + 1) & mask;
+		}
+		slots[j] = i;
+	}
+	free( trie->slots );
+	trie->slots = slots;
+	trie->n_slots = n;
+	return 0;
+}
+
+/** 在上级目录中查找子目录，找不到时返回对应的空位 */
+static uint32_t *PathTrie_Lookup( PathTrie trie, uint32_t parent, 
+				  const wchar_t *name, size_t len,
+				  uint32_t hash )
+{
+	PathTrieDir dir;
+	uint32_t mask = trie->n_slots - 1;
+	uint32_t i = hash & mask;
+	while( trie->slots[i] != PATH_TRIE_NONE ) {
+		dir = &trie->dirs[trie->slots[i]];
+		if( dir->hash == hash && dir->parent == parent &&
+		    wcsncmp( trie->names + dir->name, name, len ) == 0 &&
+		    trie->names[dir->name + len] == 0 ) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return &trie->slots[i];
+}
+
+/** 获取子目录，不存在时根据 create 参数决定是否创建 */
+static uint32_t PathTrie_GetChild( PathTrie trie, uint32_t parent,
+				   const wchar_t *name, size_t len,
+				   LCUI_BOOL create )
+{
+	uint32_t *slot, id;
+	PathTrieDir dir;
+	uint32_t hash = HashName( parent, name, len );
+	slot = PathTrie_Lookup( trie, parent, name, len, hash );
+	if( *slot != PATH_TRIE_NONE || !create ) {
+		return *slot;
+	}
+	if( Reserve( (void**)&trie->dirs, &trie->max_dirs,
+		     trie->n_dirs + 1, sizeof( PathTrieDirRec ) ) != 0 ) {
+		return PATH_TRIE_NONE;
+	}
+	id = trie->n_dirs;
+	dir = &trie->dirs[id];
+	dir->name = PathTrie_AddName( trie, name, len );
+	if( dir->name == PATH_TRIE_NONE ) {
+		return PATH_TRIE_NONE;
+	}
+	dir->hash = hash;
+	dir->parent = parent;
+	dir->files = PATH_TRIE_NONE;
+	trie->n_dirs += 1;
+	/* 负载超过一半时扩大哈希表 */
+	if( trie->n_dirs * 2 > trie->n_slots ) {
+		PathTrie_Rehash( trie );
+	} else {
+		*slot = id;
+	}
+	return id;
+}
+
+/** 逐级查找目录，0 号目录为根目录 */
+static uint32_t PathTrie_Walk( PathTrie trie, const wchar_t *dirpath,
+			       LCUI_BOOL create )
+{
+	const wchar_t *p, *name;
+	uint32_t id = 0;
+	for( p = name = dirpath; ; ++p ) {
+		if( *p != PATH_SEP && *p != 0 ) {
+			continue;
+		}
+		/* 末尾的路径分隔符之后没有名称 */
+		if( *p == 0 && p == name && p != dirpath ) {
+			break;
+		}
+		id = PathTrie_GetChild( trie, id, name, p - name, create );
+		if( id == PATH_TRIE_NONE || *p == 0 ) {
+			break;
+		}
+		name = p + 1;
+	}
+	return id;
+}
+
+PathTrie PathTrie_New( void )
+{
+	PathTrie trie = NEW( PathTrieRec, 1 );
+	trie->dirs = NULL;
+	trie->files = NULL;
+	trie->names = NULL;
+	trie->slots = NULL;
+	trie->n_dirs = trie->max_dirs = 0;
+	trie->n_files = trie->max_files = 0;
+	trie->names_len = trie->names_size = 0;
+	trie->n_slots = 0;
+	PathTrie_Rehash( trie );
+	/* 根目录没有名称，也没有上级目录 */
+	Reserve( (void**)&trie->dirs, &trie->max_dirs, 1, 
+		 sizeof( PathTrieDirRec ) );
+	trie->dirs[0].name = PathTrie_AddName( trie, L"", 0 );
+	trie->dirs[0].parent = PATH_TRIE_NONE;
+	trie->dirs[0].files = PATH_TRIE_NONE;
+	trie->dirs[0].hash = 0;
+	trie->n_dirs = 1;
+	return trie;
+}
+
+void PathTrie_Delete( PathTrie *trieptr )
+{
+	PathTrie trie = *trieptr;
+	free( trie->dirs );
+	free( trie->files );
+	free( trie->names );
+	free( trie->slots );
+	free( trie );
+	*trieptr = NULL;
+}
+
+uint32_t PathTrie_AddDir( PathTrie trie, const wchar_t *dirpath )
+{
+	return PathTrie_Walk( trie, dirpath, TRUE );
+}
+
+uint32_t PathTrie_FindDir( PathTrie trie, const wchar_t *dirpath )
+{
+	return PathTrie_Walk( trie, dirpath, FALSE );
+}
+
+uint32_t PathTrie_AddFile( PathTrie trie, uint32_t dir, const wchar_t *name )
+{
+	uint32_t id;
+	PathTrieFile file;
+	if( dir >= trie->n_dirs ) {
+		return PATH_TRIE_NONE;
+	}
+	if( Reserve( (void**)&trie->files, &trie->max_files,
+		     trie->n_files + 1, sizeof( PathTrieFileRec ) ) != 0 ) {
+		return PATH_TRIE_NONE;
+	}
+	id = trie->n_files;
+	file = &trie->files[id];
+	file->name = PathTrie_AddName( trie, name, wcslen( name ) );
+	if( file->name == PATH_TRIE_NONE ) {
+		return PATH_TRIE_NONE;
+	}
+	file->dir = dir;
+	file->next = trie->dirs[dir].files;
+	trie->dirs[dir].files = id;
+	trie->n_files += 1;
+	return id;
+}
+
+uint32_t PathTrie_GetDirCount( PathTrie trie )
+{
+	return trie->n_dirs;
+}
+
+uint32_t PathTrie_GetFileCount( PathTrie trie )
+{
+	return trie->n_files;
+}
+
+int PathTrie_GetDirPath( PathTrie trie, uint32_t dir, 
+			 wchar_t *buf, int max_len )
+{
+	int len = 0, name_len;
+	uint32_t id;
+	const wchar_t *name;
+	/* 先算出路径总长度，再从后往前填写各级目录名称 */
+	for( id = dir; id != 0 && id < trie->n_dirs; 
+	     id = trie->dirs[id].parent ) {
+		len += wcslen( trie->names + trie->dirs[id].name ) + 1;
+	}
+	if( len >= max_len ) {
+		buf[0] = 0;
+		return 0;
+	}
+	buf[len] = 0;
+	name_len = len;
+	for( id = dir; id != 0 && id < trie->n_dirs; 
+	     id = trie->dirs[id].parent ) {
+		name = trie->names + trie->dirs[id].name;
+		buf[--name_len] = PATH_SEP;
+		name_len -= wcslen( name );
+		wcsncpy( buf + name_len, name, wcslen( name ) );
+	}
+	return len;
+}
+
+int PathTrie_GetFilePath( PathTrie trie, uint32_t file,
+			  wchar_t *buf, int max_len )
+{
+	int len;
+	const wchar_t *name;
+	if( file >= trie->n_files ) {
+		buf[0] = 0;
+		return 0;
+	}
+	len = PathTrie_GetDirPath( trie, trie->files[file].dir, buf, max_len );
+	name = trie->names + trie->files[file].name;
+	if( len + (int)wcslen( name ) >= max_len ) {
+		buf[0] = 0;
+		return 0;
+	}
+	wcscpy( buf + len, name );
+	return len + wcslen( name );
+}
+
+const wchar_t *PathTrie_GetFileName( PathTrie trie, uint32_t file )
+{
+	if( file >= trie->n_files ) {
+		return NULL;
+	}
+	return trie->names + trie->files[file].name;
+}
+
+uint32_t PathTrie_GetFirstFile( PathTrie trie, uint32_t dir )
+{
+	if( dir >= trie->n_dirs ) {
+		return PATH_TRIE_NONE;
+	}
+	return trie->dirs[dir].files;
+}
+
+uint32_t PathTrie_GetNextFile( PathTrie trie, uint32_t file )
+{
+	if( file >= trie->n_files ) {
+		return PATH_TRIE_NONE;
+	}
+	return trie->files[file].next;
+}
@@ -0,0 +1,402 @@
+﻿/* ***************************************************************************
+* remote_mount.c -- metadata access to network filesystems
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* remote_mount.c -- 网络文件系统的元数据访问
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include "common.h"
+#include "dir_reader.h"
+#include "remote_mount.h"
+
+/** 缓存的属性数量上限，超出后清空缓存 */
+#define STAT_CACHE_MAX	200000
+
+/** 缓存的属性 */
+typedef struct StatCacheRec_ {
+	int ret;		/**< 查询结果，失败的查询也会缓存 */
+	FileStatRec stat;	/**< 文件属性 */
+	int64_t time;		/**< 查询时间 */
+} StatCacheRec, *StatCache;
+
+/** 一个目录中需要获取属性的文件 */
+typedef struct StatJobRec_ {
+	const wchar_t *dirpath;		/**< 目录路径，末尾带有路径分隔符 */
+	size_t dir_len;			/**< 目录路径的长度 */
+	DirReaderEntry *entries;	/**< 目录项列表 */
+	int n_entries;			/**< 目录项数量 */
+	int next;			/**< 下一个尚未开始查询的目录项 */
+	int n_done;			/**< 已查询完的目录项数量 */
+	LCUI_BOOL cached;		/**< 是否可以使用缓存 */
+	LinkedListNode node;		/**< 在查询队列中的结点 */
+} StatJobRec, *StatJob;
+
+typedef struct RemoteMountRec_ {
+	uint64_t dev;			/**< 设备编号 */
+	int refs;			/**< 引用次数 */
+	int active;			/**< 正在进行的查询数量 */
+	LCUI_BOOL is_running;		/**< 查询线程是否正在运行 */
+	LCUI_Thread *threads;		/**< 查询线程 */
+	LinkedList jobs;		/**< 还有目录项未开始查询的任务 */
+	Dict *cache;			/**< 属性缓存，以文件路径为键 */
+	LCUI_Mutex mutex;
+	LCUI_Cond job_cond;		/**< 有新任务或需要退出时通知查询线程 */
+	LCUI_Cond slot_cond;		/**< 并发窗口有空位时通知等待者 */
+	LCUI_Cond done_cond;		/**< 有任务完成时通知任务的发起者 */
+	LinkedListNode node;		/**< 在挂载点列表中的结点 */
+} RemoteMountRec;
+
+static struct RemoteMountModule {
+	int window;		/**< 并发窗口的大小，也是每个挂载点的查询线程数量 */
+	int ttl;		/**< 属性缓存的有效期（毫秒） */
+	LinkedList mounts;	/**< 已打开过的挂载点 */
+	LCUI_Mutex mutex;	/**< 用于保护挂载点列表的互斥锁 */
+} self;
+
+static unsigned int StatCache_KeyHash( const void *key )
+{
+	const wchar_t *p = key;
+	unsigned int hash = 5381;
+	while( *p ) {
+		hash = ((hash << 5) + hash) + (*p++);
+	}
+	return hash;
+}
+
+static int StatCache_KeyCompare( void *privdata, const void *key1, 
+				 const void *key2 )
+{
+	return wcscmp( key1, key2 ) == 0;
+}
+
+static void *StatCache_KeyDup( void *privdata, const void *key )
+{
+	size_t len = wcslen( key ) + 1;
+	wchar_t *newkey = malloc( len * sizeof( wchar_t ) );
+	wcscpy( newkey, key );
+	return newkey;
+}
+
+static void StatCache_KeyDestructor( void *privdata, void *key )
+{
+	free( key );
+}
+
+static void StatCache_ValDestructor( void *privdata, void *val )
+{
+	free( val );
+}
+
+static DictType DictType_StatCache = {
+	StatCache_KeyHash,
+	StatCache_KeyDup,
+	NULL,
+	StatCache_KeyCompare,
+	StatCache_KeyDestructor,
+	StatCache_ValDestructor
+};
+
+void RemoteMount_Enter( RemoteMount m )
+{
+	LCUIMutex_Lock( &m->mutex );
+	while( m->active >= self.window ) {
+		LCUICond_Wait( &m->slot_cond, &m->mutex );
+	}
+	m->active += 1;
+	LCUIMutex_Unlock( &m->mutex );
+}
+
+void RemoteMount_Leave( RemoteMount m )
+{
+	LCUIMutex_Lock( &m->mutex );
+	m->active -= 1;
+	LCUICond_Signal( &m->slot_cond );
+	LCUIMutex_Unlock( &m->mutex );
+}
+
+/** 从缓存中获取尚未过期的属性，需在锁定挂载点后调用 */
+static StatCache RemoteMount_GetCache( RemoteMount m, const wchar_t *path )
+{
+	StatCache sc;
+	if( self.ttl <= 0 ) {
+		return NULL;
+	}
+	sc = Dict_FetchValue( m->cache, path );
+	if( sc && LCUI_GetTimeDelta( sc->time ) >= self.ttl ) {
+		Dict_Delete( m->cache, path );
+		return NULL;
+	}
+	return sc;
+}
+
+/** 将查询结果存入缓存，需在锁定挂载点后调用 */
+static void RemoteMount_SetCache( RemoteMount m, const wchar_t *path,
+				  int ret, const FileStatRec *st )
+{
+	StatCache sc;
+	if( self.ttl <= 0 ) {
+		return;
+	}
+	sc = Dict_FetchValue( m->cache, path );
+	if( !sc ) {
+		/* 缓存只是为了减少短时间内的重复查询，满了就整个清空 */
+		if( Dict_Size( m->cache ) >= STAT_CACHE_MAX ) {
+			Dict_Release( m->cache );
+			m->cache = Dict_Create( &DictType_StatCache, NULL );
+		}
+		sc = NEW( StatCacheRec, 1 );
+		Dict_Add( m->cache, (void*)path, sc );
+	}
+	sc->ret = ret;
+	sc->stat = *st;
+	sc->time = LCUI_GetTickCount();
+}
+
+int RemoteMount_GetStat( RemoteMount m, const wchar_t *path, 
+			 FileStat st, LCUI_BOOL cached )
+{
+	int ret;
+	StatCache sc;
+	if( cached ) {
+		LCUIMutex_Lock( &m->mutex );
+		sc = RemoteMount_GetCache( m, path );
+		if( sc ) {
+			ret = sc->ret;
+			*st = sc->stat;
+			LCUIMutex_Unlock( &m->mutex );
+			return ret;
+		}
+		LCUIMutex_Unlock( &m->mutex );
+	}
+	RemoteMount_Enter( m );
+	ret = wgetfilestat( path, st );
+	if( ret != 0 ) {
+		memset( st, 0, sizeof( FileStatRec ) );
+	}
+	RemoteMount_Leave( m );
+	LCUIMutex_Lock( &m->mutex );
+	RemoteMount_SetCache( m, path, ret, st );
+	LCUIMutex_Unlock( &m->mutex );
+	return ret;
+}
+
+/**
+ * 执行任务中的一个查询
+ * 需在锁定挂载点后调用，查询期间会解锁，任务已没有未开始的查询时返回 FALSE
+ */
+static LCUI_BOOL StatJob_Run( RemoteMount m, StatJob job )
+{
+	int i;
+	DirReaderEntry e;
+	wchar_t path[PATH_LEN];
+	if( job->next >= job->n_entries ) {
+		return FALSE;
+	}
+	i = job->next++;
+	if( job->next >= job->n_entries ) {
+		LinkedList_Unlink( &m->jobs, &job->node );
+	}
+	LCUIMutex_Unlock( &m->mutex );
+	e = job->entries[i];
+	if( job->dir_len + wcslen( e->name ) + 1 <= PATH_LEN ) {
+		wcscpy( path, job->dirpath );
+		wcscpy( path + job->dir_len, e->name );
+		if( RemoteMount_GetStat( m, path, &e->stat, 
+					 job->cached ) == 0 ) {
+			e->has_stat = TRUE;
+		}
+	}
+	LCUIMutex_Lock( &m->mutex );
+	job->n_done += 1;
+	if( job->n_done >= job->n_entries ) {
+		LCUICond_Broadcast( &m->done_cond );
+	}
+	return TRUE;
+}
+
+/** 查询线程，不断地从队列中的任务里取出目录项查询 */
+static void RemoteMount_Thread( void *arg )
+{
+	StatJob job;
+	RemoteMount m = arg;
+	LCUIMutex_Lock( &m->mutex );
+	while( m->is_running ) {
+		if( m->jobs.length < 1 ) {
+			LCUICond_Wait( &m->job_cond, &m->mutex );
+			continue;
+		}
+		job = m->jobs.head.next->data;
+		StatJob_Run( m, job );
+	}
+	LCUIMutex_Unlock( &m->mutex );
+	LCUIThread_Exit( NULL );
+}
+
+void RemoteMount_StatEntries( RemoteMount m, const wchar_t *dirpath,
+			      DirReaderEntry *entries, int n, 
+			      LCUI_BOOL cached )
+{
+	StatJobRec job;
+	wchar_t path[PATH_LEN];
+	size_t len = wcslen( dirpath );
+	if( n < 1 || len + 2 > PATH_LEN ) {
+		return;
+	}
+	wcscpy( path, dirpath );
+	if( path[len - 1] != PATH_SEP ) {
+		path[len++] = PATH_SEP;
+		path[len] = 0;
+	}
+	job.dirpath = path;
+	job.dir_len = len;
+	job.entries = entries;
+	job.n_entries = n;
+	job.next = 0;
+	job.n_done = 0;
+	job.cached = cached;
+	job.node.data = &job;
+	LCUIMutex_Lock( &m->mutex );
+	LinkedList_AppendNode( &m->jobs, &job.node );
+	LCUICond_Broadcast( &m->job_cond );
+	/* 当前线程也参与查询，查询线程都在忙时也不会干等 */
+	while( StatJob_Run( m, &job ) );
+	while( job.n_done < job.n_entries ) {
+		LCUICond_Wait( &m->done_cond, &m->mutex );
+	}
+	LCUIMutex_Unlock( &m->mutex );
+}
+
+int RemoteMount_GetWindow( RemoteMount m )
+{
+	return self.window;
+}
+
+RemoteMount RemoteMount_Open( const wchar_t *path )
+{
+	int i;
+	uint64_t dev = 0;
+	RemoteMount m = NULL;
+	LinkedListNode *node;
+	/* 获取不到设备编号的路径（例如已断开的共享文件夹）共用一个挂载点 */
+	wgetfiledev( path, &dev );
+	LCUIMutex_Lock( &self.mutex );
+	LinkedList_ForEach( node, &self.mounts ) {
+		if( ((RemoteMount)node->data)->dev == dev ) {
+			m = node->data;
+			break;
+		}
+	}
+	if( !m ) {
+		m = NEW( RemoteMountRec, 1 );
+		m->dev = dev;
+		m->cache = Dict_Create( &DictType_StatCache, NULL );
+		m->node.data = m;
+		LinkedList_Init( &m->jobs );
+		LCUIMutex_Init( &m->mutex );
+		LCUICond_Init( &m->job_cond );
+		LCUICond_Init( &m->slot_cond );
+		LCUICond_Init( &m->done_cond );
+		LinkedList_AppendNode( &self.mounts, &m->node );
+	}
+	if( m->refs++ == 0 ) {
+		m->is_running = TRUE;
+		m->threads = NEW( LCUI_Thread, self.window );
+		for( i = 0; i < self.window; ++i ) {
+			LCUIThread_Create( &m->threads[i], 
+					   RemoteMount_Thread, m );
+		}
+	}
+	LCUIMutex_Unlock( &self.mutex );
+	return m;
+}
+
+void RemoteMount_Close( RemoteMount *mptr )
+{
+	int i;
+	RemoteMount m = *mptr;
+	*mptr = NULL;
+	LCUIMutex_Lock( &self.mutex );
+	if( --m->refs > 0 ) {
+		LCUIMutex_Unlock( &self.mutex );
+		return;
+	}
+	LCUIMutex_Lock( &m->mutex );
+	m->is_running = FALSE;
+	LCUICond_Broadcast( &m->job_cond );
+	LCUIMutex_Unlock( &m->mutex );
+	for( i = 0; i < self.window; ++i ) {
+		LCUIThread_Join( m->threads[i], NULL );
+	}
+	free( m->threads );
+	m->threads = NULL;
+	LCUIMutex_Unlock( &self.mutex );
+}
+
+void RemoteMount_Init( int window, int ttl )
+{
+	if( window < 1 ) {
+		window = REMOTE_WINDOW_DEFAULT;
+	} else if( window > REMOTE_WINDOW_MAX ) {
+		window = REMOTE_WINDOW_MAX;
+	}
+	self.window = window;
+	self.ttl = ttl > 0 ? ttl * 1000 : 0;
+	LinkedList_Init( &self.mounts );
+	LCUIMutex_Init( &self.mutex );
+}
+
+void RemoteMount_Exit( void )
+{
+	RemoteMount m;
+	LinkedListNode *node;
+	LCUIMutex_Lock( &self.mutex );
+	while( self.mounts.length > 0 ) {
+		node = self.mounts.head.next;
+		m = node->data;
+		LinkedList_Unlink( &self.mounts, node );
+		Dict_Release( m->cache );
+		LCUICond_Destroy( &m->job_cond );
+		LCUICond_Destroy( &m->slot_cond );
+		LCUICond_Destroy( &m->done_cond );
+		LCUIMutex_Destroy( &m->mutex );
+		free( m );
+	}
+	LCUIMutex_Unlock( &self.mutex );
+	LCUIMutex_Destroy( &self.mutex );
+}
@@ -0,0 +1,390 @@
+﻿/* ***************************************************************************
+* scrub_service.c -- background file scrub service
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* scrub_service.c -- 后台文件校验服务
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "file_search.h"
+#include "file_hasher.h"
+#include "hash_service.h"
+#include "scrub_service.h"
+
+/** 每次从数据库中取出的待校验文件数量，同一批文件按在磁盘上的位置排序后读取 */
+#define SCRUB_BATCH 1024
+/** 校验服务检查是否需要开始新一轮校验的间隔时间（毫秒） */
+#define SCRUB_CHECK_INTERVAL (60 * 1000)
+/** 校验线程等待设备同步结束时，每次检查的间隔时间（毫秒） */
+#define SCRUB_WAIT_INTERVAL 1000
+/** 校验线程需要暂停读取时，每次检查的间隔时间（毫秒） */
+#define SCRUB_BUSY_INTERVAL 200
+
+/**
+ * 设备读取调度
+ * 记录正在同步的设备，后台校验在读取每一块数据前都会检查文件所在的设备，设备
+ * 正在同步时就等同步结束再读取，两者不会同时占用同一个设备。
+ */
+typedef struct DeviceIORec_ {
+	uint64_t *devs;			/**< 正在同步的设备 */
+	int *counts;			/**< 各设备上正在扫描的线程数量 */
+	int n_devs;			/**< 设备数量 */
+	int max_devs;			/**< 列表的容量 */
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;			/**< 有设备结束同步时通知等待者 */
+} DeviceIORec, *DeviceIO;
+
+typedef struct ScrubServiceRec_ {
+	LCUI_BOOL is_running;		/**< 是否正在运行 */
+	int64_t rate;			/**< 每秒最多读取的字节数 */
+	int64_t interval;		/**< 每两轮校验之间的间隔时间（秒） */
+	int64_t next_time;		/**< 下一块数据可以读取的时间（微秒） */
+	FileReadableFunc readable;	/**< 判断文件能否读取的函数 */
+	ScrubBusyFunc busy;		/**< 判断是否需要暂停读取的函数 */
+	void *data;			/**< 传给上面两个函数的附加数据 */
+	DeviceIORec device_io;		/**< 设备读取调度 */
+	LCUI_Thread thread;		/**< 校验线程 */
+	LCUI_Mutex mutex;
+	LCUI_Cond cond;
+} ScrubServiceRec;
+
+/** 等待校验的文件 */
+typedef struct ScrubItemRec_ {
+	DB_FileHash hash;		/**< 文件及其保存的哈希值 */
+	wchar_t *path;			/**< 文件路径 */
+	uint64_t dev;			/**< 所在设备的编号 */
+	uint64_t inode;			/**< 索引节点号，用于按磁盘上的位置排序 */
+	ScrubService service;		/**< 所属的校验服务 */
+} ScrubItemRec, *ScrubItem;
+
+/** 判断设备是否正在同步，调用前需锁定 io->mutex */
+static LCUI_BOOL DeviceIO_IsSyncing( DeviceIO io, uint64_t dev )
+{
+	int i;
+	for( i = 0; i < io->n_devs; ++i ) {
+		if( io->devs[i] == dev ) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void ScrubService_BeginSync( ScrubService s, uint64_t dev )
+{
+	int i;
+	DeviceIO io = &s->device_io;
+	LCUIMutex_Lock( &io->mutex );
+	for( i = 0; i < io->n_devs; ++i ) {
+		if( io->devs[i] == dev ) {
+			break;
+		}
+	}
+	if( i == io->n_devs ) {
+		if( io->n_devs >= io->max_devs ) {
+			io->max_devs = io->max_devs * 2 + 4;
+			io->devs = realloc( io->devs, 
+					    sizeof( uint64_t ) * io->max_devs );
+			io->counts = realloc( io->counts, 
+					      sizeof( int ) * io->max_devs );
+		}
+		io->devs[i] = dev;
+		io->counts[i] = 0;
+		io->n_devs += 1;
+	}
+	io->counts[i] += 1;
+	LCUIMutex_Unlock( &io->mutex );
+}
+
+void ScrubService_EndSync( ScrubService s, uint64_t dev )
+{
+	int i;
+	DeviceIO io = &s->device_io;
+	LCUIMutex_Lock( &io->mutex );
+	for( i = 0; i < io->n_devs; ++i ) {
+		if( io->devs[i] != dev ) {
+			continue;
+		}
+		io->counts[i] -= 1;
+		if( io->counts[i] <= 0 ) {
+			io->n_devs -= 1;
+			io->devs[i] = io->devs[io->n_devs];
+			io->counts[i] = io->counts[io->n_devs];
+			LCUICond_Broadcast( &io->cond );
+		}
+		break;
+	}
+	LCUIMutex_Unlock( &io->mutex );
+}
+
+/**
+ * 文件校验的读取限速函数，由校验线程调用
+ * 需要暂停读取、或者文件所在的设备正在同步时先等待，再按速度上限算出这块
+ * 数据占用的时间，等到时间再返回。
+ */
+static int ScrubService_Throttle( void *data, size_t n )
+{
+	int64_t now, wait;
+	ScrubItem item = data;
+	ScrubService s = item->service;
+	DeviceIO io = &s->device_io;
+	while( s->is_running && s->busy && s->busy( s->data ) ) {
+		LCUI_MSleep( SCRUB_BUSY_INTERVAL );
+	}
+	LCUIMutex_Lock( &io->mutex );
+	while( s->is_running && DeviceIO_IsSyncing( io, item->dev ) ) {
+		LCUICond_TimedWait( &io->cond, &io->mutex,
+				    SCRUB_WAIT_INTERVAL );
+	}
+	LCUIMutex_Unlock( &io->mutex );
+	if( !s->is_running ) {
+		return -1;
+	}
+	LCUIMutex_Lock( &s->mutex );
+	now = LCUI_GetTickCount() * 1000;
+	if( s->next_time < now ) {
+		s->next_time = now;
+	}
+	s->next_time += (int64_t)n * 1000000 / s->rate;
+	wait = (s->next_time - now) / 1000;
+	LCUIMutex_Unlock( &s->mutex );
+	if( wait > 0 ) {
+		LCUI_MSleep( (unsigned int)wait );
+	}
+	return 0;
+}
+
+/**
+ * 按文件在磁盘上的大致位置排序
+ * 先按设备，再按索引节点号，不支持索引节点号的平台上按路径排序，同一目录下的
+ * 文件通常也是相邻存放的。
+ */
+static int ScrubItem_Compare( const void *a, const void *b )
+{
+	const ScrubItemRec *item1 = a, *item2 = b;
+	if( item1->dev != item2->dev ) {
+		return item1->dev < item2->dev ? -1 : 1;
+	}
+	if( item1->inode != item2->inode ) {
+		return item1->inode < item2->inode ? -1 : 1;
+	}
+	return strcmp( item1->hash->file->path, item2->hash->file->path );
+}
+
+/** 校验一个文件，内容与保存的哈希值不一致时记录到数据库中 */
+static void ScrubService_CheckFile( ScrubService s, ScrubItem item )
+{
+	FileStatRec st;
+	DB_FileHash fh = item->hash;
+	unsigned char hash[FILE_HASH_SIZE];
+	/* 不能读取的文件（例如所在的源文件夹已离线）留到下一轮再校验 */
+	if( s->readable && !s->readable( s->data, fh->file->path ) ) {
+		return;
+	}
+	if( FileHasher_HashFileEx( item->path, &st, hash,
+				   ScrubService_Throttle, item ) != 0 ) {
+		return;
+	}
+	/**
+	 * 计算哈希值之后修改过的文件，内容不一致是正常的，同步时会删除它的哈希值
+	 * 并重新计算，不算是损坏
+	 */
+	if( st.size != fh->size || st.mtime != fh->mtime ||
+	    fh->hash_len != FILE_HASH_SIZE ) {
+		return;
+	}
+	DB_Begin();
+	if( memcmp( hash, fh->hash, FILE_HASH_SIZE ) != 0 ) {
+		printf( "[scrub] file corrupted: %s\n", fh->file->path );
+		DB_SetFileCorrupt( fh->file->id, hash, FILE_HASH_SIZE,
+				   time( NULL ) );
+	} else {
+		DB_ClearFileCorrupt( fh->file->id );
+	}
+	DB_Commit();
+}
+
+/**
+ * 从上次中断的位置继续校验，直到校验完所有文件
+ * 每校验完一批文件才保存一次进度，中断时这一批会在下次重新校验
+ */
+static void ScrubService_Run( ScrubService s )
+{
+	int i, n, len, last_fid;
+	int64_t finish_time;
+	DB_FileHash *files;
+	ScrubItemRec *items;
+	FileStatRec st;
+	DB_Begin();
+	DB_GetScrubState( &last_fid, &finish_time );
+	DB_Commit();
+	while( s->is_running ) {
+		DB_Begin();
+		n = DB_GetHashedFiles( last_fid, SCRUB_BATCH, &files );
+		DB_Commit();
+		if( n <= 0 ) {
+			if( n < 0 ) {
+				break;
+			}
+			free( files );
+			DB_Begin();
+			DB_SetScrubState( 0, time( NULL ) );
+			DB_Commit();
+			break;
+		}
+		items = NEW( ScrubItemRec, n );
+		for( i = 0; i < n; ++i ) {
+			len = strlen( files[i]->file->path ) + 1;
+			items[i].hash = files[i];
+			items[i].service = s;
+			items[i].path = malloc( sizeof( wchar_t ) * len );
+			len = LCUI_DecodeString( items[i].path, 
+						 files[i]->file->path, len,
+						 ENCODING_UTF8 );
+			items[i].path[len] = 0;
+			items[i].dev = 0;
+			items[i].inode = 0;
+			wgetfiledev( items[i].path, &items[i].dev );
+			if( wgetfilestat( items[i].path, &st ) == 0 ) {
+				items[i].inode = st.inode;
+			}
+		}
+		qsort( items, n, sizeof( ScrubItemRec ), ScrubItem_Compare );
+		for( i = 0; i < n && s->is_running; ++i ) {
+			ScrubService_CheckFile( s, &items[i] );
+		}
+		last_fid = files[n - 1]->file->id;
+		for( i = 0; i < n; ++i ) {
+			free( items[i].path );
+			free( files[i]->file->path );
+			free( files[i]->file );
+			free( files[i] );
+		}
+		free( items );
+		free( files );
+		if( s->is_running ) {
+			DB_Begin();
+			DB_SetScrubState( last_fid, finish_time );
+			DB_Commit();
+		}
+	}
+}
+
+/** 判断是否需要校验：有未完成的一轮，或者距离上一轮完成已超过间隔时间 */
+static LCUI_BOOL ScrubService_IsDue( ScrubService s )
+{
+	int last_fid;
+	int64_t finish_time;
+	DB_Begin();
+	DB_GetScrubState( &last_fid, &finish_time );
+	DB_Commit();
+	if( last_fid > 0 ) {
+		return TRUE;
+	}
+	return time( NULL ) - finish_time >= s->interval;
+}
+
+static void ScrubService_Thread( void *arg )
+{
+	ScrubService s = arg;
+	/* 以空闲 I/O 优先级读取文件，不和前台程序争抢磁盘 */
+	setthreadbackground();
+	LCUIMutex_Lock( &s->mutex );
+	while( s->is_running ) {
+		if( ScrubService_IsDue( s ) ) {
+			LCUIMutex_Unlock( &s->mutex );
+			ScrubService_Run( s );
+			LCUIMutex_Lock( &s->mutex );
+		}
+		if( s->is_running ) {
+			LCUICond_TimedWait( &s->cond, &s->mutex,
+					    SCRUB_CHECK_INTERVAL );
+		}
+	}
+	LCUIMutex_Unlock( &s->mutex );
+	LCUIThread_Exit( NULL );
+}
+
+ScrubService ScrubService_New( int64_t rate, int64_t interval,
+			       FileReadableFunc readable, ScrubBusyFunc busy,
+			       void *data )
+{
+	ScrubService s = NEW( ScrubServiceRec, 1 );
+	LCUIMutex_Init( &s->device_io.mutex );
+	LCUICond_Init( &s->device_io.cond );
+	LCUIMutex_Init( &s->mutex );
+	LCUICond_Init( &s->cond );
+	s->rate = rate;
+	s->interval = interval;
+	s->next_time = 0;
+	s->readable = readable;
+	s->busy = busy;
+	s->data = data;
+	s->is_running = rate > 0;
+	if( s->is_running ) {
+		LCUIThread_Create( &s->thread, ScrubService_Thread, s );
+	}
+	return s;
+}
+
+void ScrubService_Delete( ScrubService *sptr )
+{
+	ScrubService s = *sptr;
+	if( !s ) {
+		return;
+	}
+	if( s->is_running ) {
+		LCUIMutex_Lock( &s->mutex );
+		s->is_running = FALSE;
+		LCUICond_Signal( &s->cond );
+		LCUIMutex_Unlock( &s->mutex );
+		LCUIMutex_Lock( &s->device_io.mutex );
+		LCUICond_Broadcast( &s->device_io.cond );
+		LCUIMutex_Unlock( &s->device_io.mutex );
+		LCUIThread_Join( s->thread, NULL );
+	}
+	LCUICond_Destroy( &s->device_io.cond );
+	LCUIMutex_Destroy( &s->device_io.mutex );
+	LCUICond_Destroy( &s->cond );
+	LCUIMutex_Destroy( &s->mutex );
+	free( s->device_io.devs );
+	free( s->device_io.counts );
+	free( s );
+	*sptr = NULL;
+}
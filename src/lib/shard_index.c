@@ -0,0 +1,371 @@
+﻿/* ***************************************************************************
+* shard_index.c -- sharded indexing of very large source folders
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* shard_index.c -- 大型源文件夹的分片索引
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "path_filter.h"
+#include "file_cache.h"
+#include "file_search.h"
+#include "shard_index.h"
+#ifdef _WIN32
+#include <Windows.h>
+typedef HANDLE ShardProcess;
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+typedef pid_t ShardProcess;
+#endif
+
+/** 工作进程每写入这么多条记录就提交一次事务 */
+#define SHARD_COMMIT_SIZE 10000
+
+typedef struct ShardWriterRec_ {
+	DB_Dir dir;		/**< 分片目录中的源文件夹记录 */
+	int count;		/**< 当前事务中已写入的记录数量 */
+} ShardWriterRec, *ShardWriter;
+
+/**
+ * 获取分片的数据存放目录
+ * 路径为 <数据文件夹>/shards/<源文件夹路径的 SHA1>/<分片序号>/，不存在时会
+ * 逐级新建
+ */
+static int ShardIndex_GetDir( wchar_t *path, const wchar_t *data_dir,
+			      const char *dirpath, int index )
+{
+	char hash[44];
+	wchar_t name[44];
+	int len = strlen( dirpath );
+	EncodeSHA1( hash, dirpath, len );
+	LCUI_DecodeString( name, hash, 44, ENCODING_UTF8 );
+	wpathjoin( path, data_dir, L"shards" );
+	wmkdir( path );
+	wpathjoin( path, path, name );
+	wmkdir( path );
+	swprintf( name, 44, L"%d", index );
+	len = wpathjoin( path, path, name );
+	if( wmkdir( path ) != 0 ) {
+		return -1;
+	}
+	path[len++] = PATH_SEP;
+	path[len] = 0;
+	return 0;
+}
+
+/** 获取分片目录的文件路径 */
+static void ShardIndex_GetCatalogPath( char *path, const wchar_t *shard_dir )
+{
+	wchar_t wpath[PATH_LEN];
+	wpathjoin( wpath, shard_dir, L"catalog.db" );
+	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
+}
+
+/** 在分片目录中查找源文件夹的记录，没有时添加 */
+static DB_Dir ShardIndex_GetCatalogDir( const char *dirpath )
+{
+	int i, n;
+	DB_Dir dir = NULL, *dirs;
+	n = DB_GetDirs( &dirs );
+	for( i = 0; i < n; ++i ) {
+		if( !dir && strcmp( dirs[i]->path, dirpath ) == 0 ) {
+			dir = dirs[i];
+			continue;
+		}
+		free( dirs[i]->path );
+		free( dirs[i]->rules );
+		free( dirs[i] );
+	}
+	if( n > 0 ) {
+		free( dirs );
+	}
+	return dir ? dir : DB_AddDir( dirpath );
+}
+
+/** 提交写满的事务，让日志文件保持在较小的尺寸 */
+static void ShardWriter_Step( ShardWriter w )
+{
+	if( ++w->count >= SHARD_COMMIT_SIZE ) {
+		DB_Commit();
+		DB_Begin();
+		w->count = 0;
+	}
+}
+
+static void ShardWriter_AddFile( void *data, const wchar_t *wpath,
+				 const FileStatRec *st )
+{
+	char path[PATH_LEN];
+	ShardWriter w = data;
+	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
+	DB_AddFile( w->dir, path, (int)st->ctime );
+	ShardWriter_Step( w );
+}
+
+static void ShardWriter_DeleteFile( void *data, const wchar_t *wpath,
+				    const FileStatRec *st )
+{
+	char path[PATH_LEN];
+	ShardWriter w = data;
+	LCUI_EncodeString( path, wpath, PATH_LEN, ENCODING_UTF8 );
+	DB_DeleteFile( w->dir, path );
+	ShardWriter_Step( w );
+}
+
+int ShardIndex_RunWorker( const wchar_t *data_dir, const char *dirpath,
+			  const char *rules, int index, int count )
+{
+	int n, len;
+	SyncTask t;
+	wchar_t *wstr;
+	PathFilter filter;
+	ShardWriterRec writer;
+	char catalog[PATH_LEN];
+	wchar_t shard_dir[PATH_LEN], wpath[PATH_LEN];
+	if( index < 0 || index >= count || count > SHARD_INDEX_MAX ) {
+		return -1;
+	}
+	if( ShardIndex_GetDir( shard_dir, data_dir, dirpath, index ) != 0 ) {
+		return -1;
+	}
+	ShardIndex_GetCatalogPath( catalog, shard_dir );
+	if( DB_InitFile( catalog ) != 0 ) {
+		return -1;
+	}
+	writer.count = 0;
+	writer.dir = ShardIndex_GetCatalogDir( dirpath );
+	if( !writer.dir ) {
+		return -1;
+	}
+	DB_SetDirRules( writer.dir, rules );
+	LCUI_DecodeString( wpath, dirpath, PATH_LEN, ENCODING_UTF8 );
+	t = SyncTask_NewW( shard_dir, wpath );
+	if( rules && rules[0] ) {
+		len = strlen( rules ) + 1;
+		wstr = malloc( sizeof( wchar_t ) * len );
+		len = LCUI_DecodeString( wstr, rules, len, ENCODING_UTF8 );
+		wstr[len] = 0;
+		filter = PathFilter_New();
+		PathFilter_AddRules( filter, wstr );
+		SyncTask_SetFilter( t, filter );
+		free( wstr );
+	}
+	SyncTask_SetShard( t, index, count );
+	if( SyncTask_Start( t ) < 0 ) {
+		SyncTask_Delete( &t );
+		return -1;
+	}
+	/* 先删除再添加，与文件同步的处理顺序一致 */
+	DB_Begin();
+	SyncTask_InDeletedFiles( t, ShardWriter_DeleteFile, &writer );
+	SyncTask_InAddedFiles( t, ShardWriter_AddFile, &writer );
+	DB_Commit();
+	SyncTask_Commit( t );
+	n = t->total_files;
+	printf( "[shard] %d/%d: %d files, %lu added, %lu deleted\n",
+		index, count, n, t->added_files, t->deleted_files );
+	SyncTask_Delete( &t );
+	return n;
+}
+
+#ifdef _WIN32
+/** 按 CommandLineToArgvW() 的解析规则将参数加上引号后追加到命令行中 */
+static wchar_t *AppendArg( wchar_t *cmd, size_t *len, const char *arg )
+{
+	int i, n = strlen( arg ) + 1;
+	size_t slashes = 0;
+	wchar_t *warg, *p;
+	warg = malloc( sizeof( wchar_t ) * n );
+	n = LCUI_DecodeString( warg, arg, n, ENCODING_UTF8 );
+	warg[n] = 0;
+	/* 最坏情况下每个字符都需要转义，另外还有空格、两个引号和结束符 */
+	p = realloc( cmd, sizeof( wchar_t ) * (*len + n * 2 + 4) );
+	if( !p ) {
+		free( warg );
+		return cmd;
+	}
+	cmd = p;
+	if( *len > 0 ) {
+		cmd[(*len)++] = L' ';
+	}
+	cmd[(*len)++] = L'"';
+	for( i = 0; i < n; ++i ) {
+		if( warg[i] == L'\\' ) {
+			++slashes;
+		} else {
+			/* 引号前面的反斜杠需要加倍，引号本身也需要转义 */
+			if( warg[i] == L'"' ) {
+				for( ; slashes > 0; --slashes ) {
+					cmd[(*len)++] = L'\\';
+				}
+				cmd[(*len)++] = L'\\';
+			}
+			slashes = 0;
+		}
+		cmd[(*len)++] = warg[i];
+	}
+	/* 结尾的反斜杠后面紧跟着引号，同样需要加倍 */
+	for( ; slashes > 0; --slashes ) {
+		cmd[(*len)++] = L'\\';
+	}
+	cmd[(*len)++] = L'"';
+	cmd[*len] = 0;
+	free( warg );
+	return cmd;
+}
+#endif
+
+/** 启动进程，args 以 NULL 结尾，第一个参数为程序路径 */
+static int ShardIndex_Spawn( ShardProcess *proc, char **args )
+{
+#ifdef _WIN32
+	int i;
+	BOOL ok;
+	size_t len = 0;
+	wchar_t *cmd = NULL;
+	STARTUPINFOW si;
+	PROCESS_INFORMATION pi;
+	for( i = 0; args[i]; ++i ) {
+		cmd = AppendArg( cmd, &len, args[i] );
+	}
+	memset( &si, 0, sizeof( si ) );
+	si.cb = sizeof( si );
+	ok = CreateProcessW( NULL, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW,
+			     NULL, NULL, &si, &pi );
+	free( cmd );
+	if( !ok ) {
+		return -1;
+	}
+	CloseHandle( pi.hThread );
+	*proc = pi.hProcess;
+	return 0;
+#else
+	pid_t pid = fork();
+	if( pid < 0 ) {
+		return -1;
+	}
+	if( pid == 0 ) {
+		execv( args[0], args );
+		_exit( 127 );
+	}
+	*proc = pid;
+	return 0;
+#endif
+}
+
+/** 等待进程结束，返回它的退出码，失败时返回 -1 */
+static int ShardIndex_Wait( ShardProcess proc )
+{
+#ifdef _WIN32
+	DWORD code;
+	WaitForSingleObject( proc, INFINITE );
+	if( !GetExitCodeProcess( proc, &code ) ) {
+		code = (DWORD)-1;
+	}
+	CloseHandle( proc );
+	return (int)code;
+#else
+	int status;
+	if( waitpid( proc, &status, 0 ) < 0 || !WIFEXITED( status ) ) {
+		return -1;
+	}
+	return WEXITSTATUS( status );
+#endif
+}
+
+int ShardIndex_Run( const char *exe, const wchar_t *data_dir,
+		    DB_Dir dir, int count )
+{
+	int i, n, total = 0, failed = 0;
+	char index[16], count_str[16], catalog[PATH_LEN];
+	char *args[7];
+	wchar_t shard_dir[PATH_LEN];
+	ShardProcess procs[SHARD_INDEX_MAX];
+	LCUI_BOOL ok[SHARD_INDEX_MAX];
+	if( count < 1 || count > SHARD_INDEX_MAX ) {
+		return -1;
+	}
+	sprintf( count_str, "%d", count );
+	args[0] = (char*)exe;
+	args[1] = SHARD_INDEX_WORKER_ARG;
+	args[2] = index;
+	args[3] = count_str;
+	args[4] = dir->path;
+	args[5] = dir->rules;
+	args[6] = NULL;
+	for( i = 0; i < count; ++i ) {
+		sprintf( index, "%d", i );
+		ok[i] = ShardIndex_Spawn( &procs[i], args ) == 0;
+		if( !ok[i] ) {
+			printf( "[shard] cannot start worker %d\n", i );
+		}
+	}
+	for( i = 0; i < count; ++i ) {
+		ok[i] = ok[i] && ShardIndex_Wait( procs[i] ) == 0;
+		if( !ok[i] ) {
+			printf( "[shard] worker %d failed\n", i );
+			failed += 1;
+		}
+	}
+	/* 失败的分片的分片目录可能是旧的，也可能不完整，不能合并 */
+	for( i = 0; i < count; ++i ) {
+		if( !ok[i] ) {
+			continue;
+		}
+		if( ShardIndex_GetDir( shard_dir, data_dir, 
+				       dir->path, i ) != 0 ) {
+			failed += 1;
+			continue;
+		}
+		ShardIndex_GetCatalogPath( catalog, shard_dir );
+		n = DB_MergeCatalog( catalog );
+		if( n < 0 ) {
+			failed += 1;
+			continue;
+		}
+		total += n;
+	}
+	n = DB_EndMerge( failed > 0 ? NULL : dir );
+	printf( "[shard] merged %d files, removed %d files, %d failed\n",
+		total, n, failed );
+	return failed > 0 ? -1 : total;
+}
@@ -0,0 +1,329 @@
+﻿/* ***************************************************************************
+* source_monitor.c -- source folder health monitor
+*
+* Copyright (C) 2016 by Liu Chao <lc-soft@live.cn>
+*
+* This file is part of the LC-Finder project, and may only be used, modified,
+* and distributed under the terms of the GPLv2.
+*
+* By continuing to use, modify, or distribute this file you indicate that you
+* have read the license and understand and accept it fully.
+*
+* The LC-Finder project is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE. See the GPL v2 for more details.
+*
+* You should have received a copy of the GPLv2 along with this file. It is
+* usually in the LICENSE.TXT file, If not, see <http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+/* ****************************************************************************
+* source_monitor.c -- 源文件夹状态监视器
+*
+* 版权所有 (C) 2016 归属于 刘超 <lc-soft@live.cn>
+*
+* 这个文件是 LC-Finder 项目的一部分，并且只可以根据GPLv2许可协议来使用、更改和
+* 发布。
+*
+* 继续使用、修改或发布本文件，表明您已经阅读并完全理解和接受这个许可协议。
+*
+* LC-Finder 项目是基于使用目的而加以散布的，但不负任何担保责任，甚至没有适销
+* 性或特定用途的隐含担保，详情请参照GPLv2许可协议。
+*
+* 您应已收到附随于本文件的GPLv2许可协议的副本，它通常在 LICENSE 文件中，如果
+* 没有，请查看：<http://www.gnu.org/licenses/>.
+* ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <LCUI_Build.h>
+#include <LCUI/LCUI.h>
+#include <LCUI/font/charset.h>
+#include "common.h"
+#include "source_monitor.h"
+
+/**
+ * 源文件夹记录
+ * 记录由检测线程和正在等待检测结果的线程共同引用，最后一个释放引用的线程
+ * 负责释放它，因为检测线程可能会在监视器删除后才从系统调用中返回
+ */
+typedef struct SourceRec_ {
+	char *path;			/**< 源文件夹路径 */
+	wchar_t *wpath;			/**< 用于检测的路径，末尾不带路径分隔符 */
+	int state;			/**< 当前状态 */
+	int probes;			/**< 已完成的检测次数 */
+	int interval;			/**< 定期检测的间隔时间 */
+	int refs;			/**< 引用次数 */
+	LCUI_BOOL is_probing;		/**< 是否正在检测 */
+	LCUI_BOOL requested;		/**< 是否有立即检测的请求 */
+	LCUI_BOOL deleted;		/**< 是否已被移除 */
+	SourceStateHandler handler;	/**< 状态变更的处理函数 */
+	void *data;			/**< 传给处理函数的附加数据 */
+	LCUI_Thread thread;		/**< 检测线程 */
+	LCUI_Mutex mutex;
+	LCUI_Cond wake_cond;		/**< 用于唤醒检测线程 */
+	LCUI_Cond done_cond;		/**< 检测完成时通知等待者 */
+} SourceRec, *Source;
+
+typedef struct SourceMonitorRec_ {
+	int timeout;			/**< 检测的超时时间 */
+	int interval;			/**< 定期检测的间隔时间 */
+	SourceStateHandler handler;	/**< 状态变更的处理函数 */
+	void *data;			/**< 传给处理函数的附加数据 */
+	LinkedList sources;		/**< 源文件夹列表 */
+	LCUI_Mutex mutex;		/**< 用于保护源文件夹列表的互斥锁 */
+} SourceMonitorRec;
+
+static void Source_Free( Source s )
+{
+	LCUICond_Destroy( &s->wake_cond );
+	LCUICond_Destroy( &s->done_cond );
+	LCUIMutex_Destroy( &s->mutex );
+	free( s->wpath );
+	free( s->path );
+	free( s );
+}
+
+/** 释放引用，需在锁定记录后调用，记录被释放时返回 TRUE */
+static LCUI_BOOL Source_Release( Source s )
+{
+	if( --s->refs > 0 ) {
+		return FALSE;
+	}
+	LCUIMutex_Unlock( &s->mutex );
+	Source_Free( s );
+	return TRUE;
+}
+
+/** 检测源文件夹，这里的系统调用可能会阻塞很久 */
+static int Source_Probe( Source s )
+{
+	FileStatRec st;
+	if( wgetfilestat( s->wpath, &st ) != 0 ) {
+		return SOURCE_OFFLINE;
+	}
+	return SOURCE_ONLINE;
+}
+
+/**
+ * 更新状态，需在锁定记录后调用
+ * 状态有变化且需要通知时返回 TRUE，调用者需在解锁后调用处理函数
+ */
+static LCUI_BOOL Source_SetState( Source s, int state )
+{
+	int old_state = s->state;
+	s->state = state;
+	return old_state != state && old_state != SOURCE_UNKNOWN &&
+		!s->deleted && s->handler;
+}
+
+static void Source_Thread( void *arg )
+{
+	int state;
+	Source s = arg;
+	LCUIMutex_Lock( &s->mutex );
+	while( !s->deleted ) {
+		if( !s->requested ) {
+			LCUICond_TimedWait( &s->wake_cond, &s->mutex, 
+					    s->interval );
+			if( s->deleted ) {
+				break;
+			}
+		}
+		s->requested = FALSE;
+		s->is_probing = TRUE;
+		LCUIMutex_Unlock( &s->mutex );
+		state = Source_Probe( s );
+		LCUIMutex_Lock( &s->mutex );
+		s->is_probing = FALSE;
+		s->probes += 1;
+		LCUICond_Broadcast( &s->done_cond );
+		if( Source_SetState( s, state ) ) {
+			LCUIMutex_Unlock( &s->mutex );
+			s->handler( s->data, s->path, state );
+			LCUIMutex_Lock( &s->mutex );
+		}
+	}
+	if( !Source_Release( s ) ) {
+		LCUIMutex_Unlock( &s->mutex );
+	}
+	LCUIThread_Exit( NULL );
+}
+
+/** 查找源文件夹记录，需在锁定监视器后调用 */
+static Source SourceMonitor_Find( SourceMonitor m, const char *path )
+{
+	Source s;
+	LinkedListNode *node;
+	LinkedList_ForEach( node, &m->sources ) {
+		s = node->data;
+		if( strcmp( s->path, path ) == 0 ) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+SourceMonitor SourceMonitor_New( int timeout, int interval,
+				 SourceStateHandler handler, void *data )
+{
+	SourceMonitor m = NEW( SourceMonitorRec, 1 );
+	m->timeout = timeout;
+	m->interval = interval;
+	m->handler = handler;
+	m->data = data;
+	LinkedList_Init( &m->sources );
+	LCUIMutex_Init( &m->mutex );
+	return m;
+}
+
+void SourceMonitor_Add( SourceMonitor m, const char *path )
+{
+	Source s;
+	size_t len;
+	LCUIMutex_Lock( &m->mutex );
+	if( SourceMonitor_Find( m, path ) ) {
+		LCUIMutex_Unlock( &m->mutex );
+		return;
+	}
+	s = NEW( SourceRec, 1 );
+	len = strlen( path ) + 1;
+	s->path = malloc( len );
+	strcpy( s->path, path );
+	s->wpath = NEW( wchar_t, len + 1 );
+	len = LCUI_DecodeString( s->wpath, path, len, ENCODING_UTF8 );
+	/* 某些平台上无法获取末尾带路径分隔符的目录的属性，根目录除外 */
+	if( len > 1 && s->wpath[len - 1] == PATH_SEP && 
+	    s->wpath[len - 2] != L':' ) {
+		--len;
+	}
+	s->wpath[len] = 0;
+	s->state = SOURCE_UNKNOWN;
+	s->refs = 1;
+	s->requested = TRUE;
+	s->interval = m->interval;
+	s->handler = m->handler;
+	s->data = m->data;
+	LCUIMutex_Init( &s->mutex );
+	LCUICond_Init( &s->wake_cond );
+	LCUICond_Init( &s->done_cond );
+	LinkedList_Append( &m->sources, s );
+	LCUIThread_Create( &s->thread, Source_Thread, s );
+	LCUIMutex_Unlock( &m->mutex );
+}
+
+/** 让检测线程退出，检测线程卡在系统调用中时不等待它 */
+static void Source_Stop( Source s )
+{
+	LCUI_Thread thread;
+	LCUI_BOOL is_probing;
+	LCUIMutex_Lock( &s->mutex );
+	s->deleted = TRUE;
+	thread = s->thread;
+	is_probing = s->is_probing;
+	LCUICond_Signal( &s->wake_cond );
+	LCUIMutex_Unlock( &s->mutex );
+	if( !is_probing ) {
+		LCUIThread_Join( thread, NULL );
+	}
+}
+
+void SourceMonitor_Remove( SourceMonitor m, const char *path )
+{
+	Source s = NULL;
+	LinkedListNode *node;
+	LCUIMutex_Lock( &m->mutex );
+	LinkedList_ForEach( node, &m->sources ) {
+		if( strcmp( ((Source)node->data)->path, path ) == 0 ) {
+			s = node->data;
+			LinkedList_DeleteNode( &m->sources, node );
+			break;
+		}
+	}
+	LCUIMutex_Unlock( &m->mutex );
+	if( s ) {
+		Source_Stop( s );
+	}
+}
+
+void SourceMonitor_Delete( SourceMonitor *mptr )
+{
+	Source s;
+	SourceMonitor m = *mptr;
+	/* 处理函数可能会访问监视器，停止检测线程时不能占用它 */
+	while( 1 ) {
+		LCUIMutex_Lock( &m->mutex );
+		if( m->sources.length < 1 ) {
+			LCUIMutex_Unlock( &m->mutex );
+			break;
+		}
+		s = m->sources.head.next->data;
+		LinkedList_DeleteNode( &m->sources, m->sources.head.next );
+		LCUIMutex_Unlock( &m->mutex );
+		Source_Stop( s );
+	}
+	LCUIMutex_Destroy( &m->mutex );
+	free( m );
+	*mptr = NULL;
+}
+
+int SourceMonitor_GetState( SourceMonitor m, const char *path )
+{
+	Source s;
+	int state = SOURCE_UNKNOWN;
+	LCUIMutex_Lock( &m->mutex );
+	s = SourceMonitor_Find( m, path );
+	if( s ) {
+		state = s->state;
+	}
+	LCUIMutex_Unlock( &m->mutex );
+	return state;
+}
+
+int SourceMonitor_Check( SourceMonitor m, const char *path )
+{
+	Source s;
+	int state, probes;
+	int64_t start, wait;
+	LCUI_BOOL notify = FALSE;
+	LCUIMutex_Lock( &m->mutex );
+	s = SourceMonitor_Find( m, path );
+	if( !s ) {
+		LCUIMutex_Unlock( &m->mutex );
+		return SOURCE_UNKNOWN;
+	}
+	LCUIMutex_Lock( &s->mutex );
+	/* 已知离线而且检测线程仍卡着，说明还没恢复，不用再等一次 */
+	if( s->state == SOURCE_OFFLINE && s->is_probing ) {
+		LCUIMutex_Unlock( &s->mutex );
+		LCUIMutex_Unlock( &m->mutex );
+		return SOURCE_OFFLINE;
+	}
+	/* 等待期间不占用监视器，以免阻塞 SourceMonitor_GetState() */
+	s->refs += 1;
+	LCUIMutex_Unlock( &m->mutex );
+	/* 正在进行的检测可能在请求之前就开始了，需要等下一次检测的结果 */
+	probes = s->probes + (s->is_probing ? 2 : 1);
+	s->requested = TRUE;
+	LCUICond_Signal( &s->wake_cond );
+	start = LCUI_GetTickCount();
+	while( s->probes < probes && !s->deleted ) {
+		wait = m->timeout - LCUI_GetTimeDelta( start );
+		if( wait <= 0 ) {
+			notify = Source_SetState( s, SOURCE_OFFLINE );
+			break;
+		}
+		LCUICond_TimedWait( &s->done_cond, &s->mutex, (unsigned)wait );
+	}
+	state = s->state;
+	if( !Source_Release( s ) ) {
+		LCUIMutex_Unlock( &s->mutex );
+	}
+	if( notify ) {
+		m->handler( m->data, path, state );
+	}
+	return state;
+}
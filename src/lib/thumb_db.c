@@ -118,3 +118,33 @@ int ThumbDB_Save( ThumbDB db, const char *filepath, ThumbData data )
 	free( block );
 	return rc == UNQLITE_OK ? 0 : -2;
 }
+
+int ThumbDB_Delete( ThumbDB db, const char *filepath )
+{
+	int rc;
+	rc = unqlite_kv_delete( db, filepath, -1 );
+	return rc == UNQLITE_OK ? 0 : -1;
+}
+
+int ThumbDB_Move( ThumbDB db, const char *filepath,
+		  ThumbDB new_db, const char *new_filepath )
+{
+	int rc;
+	void *data;
+	unqlite_int64 size;
+	rc = unqlite_kv_fetch( db, filepath, -1, NULL, &size );
+	if( rc != UNQLITE_OK ) {
+		return -1;
+	}
+	data = malloc( (size_t)size );
+	rc = unqlite_kv_fetch( db, filepath, -1, data, &size );
+	if( rc == UNQLITE_OK ) {
+		rc = unqlite_kv_store( new_db, new_filepath, -1, data, size );
+	}
+	free( data );
+	if( rc != UNQLITE_OK ) {
+		return -1;
+	}
+	unqlite_kv_delete( db, filepath, -1 );
+	return 0;
+}
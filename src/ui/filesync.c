@@ -50,28 +50,30 @@
 /** 当前文件同步功能所需的数据 */
 static struct SyncContextRec_ {
 	LCUI_BOOL is_syncing;		/**< 是否正在同步 */
+	LCUI_BOOL is_closed;		/**< 是否已停止接受新的同步 */
 	FileSyncStatusRec status;	/**< 当前状态数据 */
 	LCUI_Widget text;		/**< 提示框中显示的内容 */
 	LCUI_Widget title;		/**< 提示框中显示的标题 */
 	LCUI_Thread thread;		/**< 用于进行文件同步的线程 */
 	int timer;			/**< 用于动态更新提示框内容的定时器 */
+	SyncScope scope;		/**< 正在进行的同步的范围 */
+	SyncScope pending;		/**< 同步期间收到的、超出当前范围的同步 */
+	LCUI_Mutex mutex;		/**< 用于保护同步范围的互斥锁 */
 } self;
 
 static void OnUpdateStats( void *arg )
 {
-	wchar_t wstr[256];
 	int count, total;
+	wchar_t wstr[256];
 	switch( self.status.state ) {
 	case STATE_STARTED:
-		count = self.status.scaned_files;
-		if( self.status.task ) {
-			count += self.status.task->total_files;
-		}
+		count = LCFinder_GetScannedFiles( &self.status );
 		wsprintf( wstr, TEXT_SCANING, count );
 		break;
 	case STATE_SAVING:
 		count = self.status.synced_files;
 		total = self.status.added_files + self.status.deleted_files;
+		total += self.status.modified_files;
 		wsprintf( wstr, TEXT_SAVING, count, total );
 		break;
 	case STATE_FINISHED:
@@ -89,36 +91,101 @@ static void OnHideTip( void *arg )
 	Widget_AddClass( alert, "hide" );
 }
 
-/** 文件同步线程 */
-static void FileSyncThread( void *arg )
+static void OnShowTip( void )
 {
 	LCUI_Widget alert = self.text->parent;
 	TextView_SetTextW( self.title, TEXT_STARED );
 	Widget_RemoveClass( alert, "hide" );
-	LCFinder_SyncFiles( &self.status );
-	OnUpdateStats( NULL );
+}
+
+/** 文件同步线程，依次进行同步期间收到的同步 */
+static void FileSyncThread( void *arg )
+{
+	LCUIMutex_Lock( &self.mutex );
+	while( self.pending ) {
+		self.scope = self.pending;
+		self.pending = NULL;
+		self.status.is_background = self.scope->mode == SYNC_BACKGROUND;
+		LCUIMutex_Unlock( &self.mutex );
+		/* 后台同步不打扰用户，不显示提示框 */
+		if( !self.status.is_background ) {
+			OnShowTip();
+		}
+		LCFinder_SyncFiles( &self.status, self.scope );
+		OnUpdateStats( NULL );
+		if( !self.status.is_background ) {
+			TextView_SetTextW( self.title, TEXT_FINISHED );
+			LCUITimer_Set( 3000, OnHideTip, NULL, FALSE );
+		}
+		LCFinder_TriggerEvent( EVENT_SYNC_DONE, NULL );
+		LCUIMutex_Lock( &self.mutex );
+		SyncScope_Delete( &self.scope );
+	}
 	LCUITimer_Free( self.timer );
-	TextView_SetTextW( self.title, TEXT_FINISHED );
-	LCUITimer_Set( 3000, OnHideTip, NULL, FALSE );
 	self.is_syncing = FALSE;
 	self.timer = 0;
-	LCFinder_TriggerEvent( EVENT_SYNC_DONE, NULL );
+	LCUIMutex_Unlock( &self.mutex );
 }
 
 static void OnStartSyncFiles( void *privdata, void *data )
 {
-	if( self.is_syncing ) {
+	SyncScope scope = data;
+	LCUI_BOOL is_background = scope && scope->mode == SYNC_BACKGROUND;
+	LCUIMutex_Lock( &self.mutex );
+	if( self.is_closed ) {
+		LCUIMutex_Unlock( &self.mutex );
 		return;
 	}
-	self.is_syncing = TRUE;
-	self.timer = LCUITimer_Set( 200, OnUpdateStats, NULL, TRUE );
-	LCUIThread_Create( &self.thread, FileSyncThread, NULL );
+	if( self.is_syncing && self.scope && 
+	    SyncScope_Covers( self.scope, scope ) ) {
+		if( is_background || self.scope->mode != SYNC_BACKGROUND ) {
+			LCUIMutex_Unlock( &self.mutex );
+			return;
+		}
+		/**
+		 * 后台同步会跳过修改时间未变的目录，检测不出原地修改过的文件，所以
+		 * 用户手动同步时仍需在它结束后再同步一次。在此之前让它不再限速，
+		 * 并显示提示框。
+		 */
+		if( self.status.is_background ) {
+			self.status.is_background = FALSE;
+			OnShowTip();
+		}
+	}
+	/* 超出当前范围的同步等当前的同步结束后再进行 */
+	if( self.pending ) {
+		SyncScope_Merge( self.pending, scope );
+	} else {
+		self.pending = SyncScope_Duplicate( scope );
+	}
+	if( !self.is_syncing ) {
+		self.is_syncing = TRUE;
+		self.timer = LCUITimer_Set( 200, OnUpdateStats, NULL, TRUE );
+		LCUIThread_Create( &self.thread, FileSyncThread, NULL );
+	}
+	LCUIMutex_Unlock( &self.mutex );
 }
 
 void UI_InitFileSyncTip( void )
 {
 	memset( &self, 0, sizeof( self ) );
+	LCUIMutex_Init( &self.mutex );
 	self.text = LCUIWidget_GetById( "file-sync-tip-stats" );
 	self.title = LCUIWidget_GetById( "file-sync-tip-title" );
 	LCFinder_BindEvent( EVENT_SYNC, OnStartSyncFiles, NULL );
 }
+
+void UI_ExitFileSyncTip( void )
+{
+	LCUI_BOOL is_syncing;
+	LCUIMutex_Lock( &self.mutex );
+	self.is_closed = TRUE;
+	is_syncing = self.is_syncing;
+	if( self.pending ) {
+		SyncScope_Delete( &self.pending );
+	}
+	LCUIMutex_Unlock( &self.mutex );
+	if( is_syncing ) {
+		LCUIThread_Join( self.thread, NULL );
+	}
+}
@@ -321,6 +321,7 @@ static LCUI_Graph *LoadThumb( ThumbView view, ThumbFileInfo info,
 	ThumbDB db;
 	ThumbDataRec tdata;
 	LCUI_Graph *thumb;
+	LCUI_BOOL online;
 	const char *filename;
 	wchar_t wpath[PATH_LEN];
 	char apath[PATH_LEN], path[PATH_LEN];
@@ -328,6 +329,11 @@ static LCUI_Graph *LoadThumb( ThumbView view, ThumbFileInfo info,
 	if( !dir ) {
 		return NULL;
 	}
+	/* 离线的源文件夹只能使用缩略图数据库中已有的缩略图，不能访问文件 */
+	online = LCFinder_IsSourceOnline( dir );
+	if( !online && info->is_dir ) {
+		return NULL;
+	}
 	dbs = *view->dbs;
 	db = Dict_FetchValue( dbs, dir->path );
 	if( !db ) {
@@ -354,6 +360,9 @@ static LCUI_Graph *LoadThumb( ThumbView view, ThumbFileInfo info,
 	DEBUG_MSG( "load thumb from: %s\n", filename );
 	if( ThumbDB_Load( db, filename, &tdata ) != 0 ) {
 		LCUI_Graph img;
+		if( !online ) {
+			return NULL;
+		}
 		Graph_Init( &img );
 		Graph_Init( &tdata.graph );
 		if( Graph_LoadImage( apath, &img ) != 0 ) {
@@ -422,7 +431,9 @@ static void ThumbView_UpdateLayoutContext( LCUI_Widget w )
 
 void ThumbView_Empty( LCUI_Widget w )
 {
+	int n = 0;
 	ThumbView view;
+	ThumbViewTask task;
 	LinkedListNode *node;
 	view = w->private_data;
 	view->is_loading = FALSE;
@@ -432,8 +443,15 @@ void ThumbView_Empty( LCUI_Widget w )
 	view->layout.count = 0;
 	view->layout.current = NULL;
 	view->layout.folder_count = 0;
+	LinkedList_ForEach( node, &view->tasks ) {
+		task = node->data;
+		if( task->type == TASK_LOAD_THUMB ) {
+			++n;
+		}
+	}
 	LinkedList_Clear( &view->tasks, free );
 	LinkedList_Clear( &view->layout.row, NULL );
+	LCFinder_AddPendingThumbs( -n );
 	ThumbView_UpdateLayoutContext( w );
 	LinkedList_ForEach( node, &view->files ) {
 		ThumbCache_Delete( view->cache, node->data );
@@ -734,6 +752,8 @@ static void OnScrollLoad( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 	LCUICond_Signal( &data->view->tasks_cond );
 	DEBUG_MSG("on scroll load: %s\n", task->info->path);
 	LCUIMutex_Unlock( &data->view->tasks_mutex );
+	/* 让后台同步给缩略图加载让路 */
+	LCFinder_AddPendingThumbs( 1 );
 }
 
 LCUI_Widget ThumbView_AppendFolder( LCUI_Widget w, const char *filepath, 
@@ -822,6 +842,7 @@ static void ThumbView_ExecTask( LCUI_Widget w, ThumbViewTask t )
 	switch( t->type ) {
 	case TASK_LOAD_THUMB:
 		ThumbView_ExecLoadThumb( w, t );
+		LCFinder_AddPendingThumbs( -1 );
 		break;
 	case TASK_LAYOUT:
 		ThumbView_ExecUpdateLayout( w, t );
@@ -72,6 +72,7 @@ typedef struct FileEntryRec_ {
 
 static struct FoldersViewData {
 	DB_Dir dir;
+	char *dirpath;
 	LCUI_Widget view;
 	LCUI_Widget items;
 	LCUI_Widget info;
@@ -101,6 +102,16 @@ static void OnDelDir( void *privdata, void *data )
 
 static void OnBtnSyncClick( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 {
+	SyncScopeRec scope;
+	/* 打开了某个文件夹时，只同步这个文件夹 */
+	if( this_view.dirpath ) {
+		scope.mode = SYNC_MANUAL;
+		scope.dirs = NULL;
+		scope.n_dirs = 0;
+		scope.path = this_view.dirpath;
+		LCFinder_TriggerEvent( EVENT_SYNC, &scope );
+		return;
+	}
 	LCFinder_TriggerEvent( EVENT_SYNC, NULL );
 }
 
@@ -169,10 +180,10 @@ static int FileScanner_ScanDirs( FileScanner scanner, char *path )
 
 static int FileScanner_ScanFiles( FileScanner scanner, char *path )
 {
+	int total;
 	DB_File file;
 	DB_Query query;
 	FileEntry entry;
-	int i, total, count;
 	DB_QueryTermsRec terms;
 	terms.dirpath = path;
 	terms.n_dirs = 0;
@@ -183,29 +194,25 @@ static int FileScanner_ScanFiles( FileScanner scanner, char *path )
 	terms.tags = NULL;
 	terms.dirs = NULL;
 	terms.create_time = NONE;
-	query = DB_NewQuery( &terms );
-	count = total = DBQuery_GetTotalFiles( query );
-	while( scanner->is_running && count > 0 ) {
-		DB_DeleteQuery( query );
-		query = DB_NewQuery( &terms );
-		i = count < terms.limit ? count : terms.limit;
-		for( ; scanner->is_running && i > 0; --i ) {
-			file = DBQuery_FetchFile( query );
-			if( !file ) {
-				break;
-			}
-			entry = NEW( FileEntryRec, 1 );
-			entry->is_dir = FALSE;
-			entry->file = file;
-			entry->path = file->path;
-			DEBUG_MSG("file: %s\n", file->path);
-			LCUIMutex_Lock( &scanner->mutex );
-			LinkedList_Append( &scanner->files, entry );
-			LCUICond_Signal( &scanner->cond );
-			LCUIMutex_Unlock( &scanner->mutex );
+	query = DB_NewQueryCursor( &terms );
+	total = DBQuery_GetTotalFiles( query );
+	while( query && scanner->is_running ) {
+		file = DBQuery_FetchFile( query );
+		if( !file ) {
+			break;
 		}
-		count -= terms.limit;
-		terms.offset += terms.limit;
+		entry = NEW( FileEntryRec, 1 );
+		entry->is_dir = FALSE;
+		entry->file = file;
+		entry->path = file->path;
+		DEBUG_MSG("file: %s\n", file->path);
+		LCUIMutex_Lock( &scanner->mutex );
+		LinkedList_Append( &scanner->files, entry );
+		LCUICond_Signal( &scanner->cond );
+		LCUIMutex_Unlock( &scanner->mutex );
+	}
+	if( query ) {
+		DB_DeleteQuery( query );
 	}
 	return total;
 }
@@ -407,6 +414,14 @@ static void OpenFolder( const char *dirpath )
 	DEBUG_MSG("clear thumb view items\n");
 	ThumbView_Empty( this_view.items );
 	this_view.dir = dir;
+	if( this_view.dirpath ) {
+		free( this_view.dirpath );
+		this_view.dirpath = NULL;
+	}
+	if( dirpath ) {
+		this_view.dirpath = malloc( strlen( dirpath ) + 1 );
+		strcpy( this_view.dirpath, dirpath );
+	}
 	this_view.viewsync.prev_item_type = -1;
 	LinkedList_ClearData( &this_view.files, OnDeleteFileEntry );
 	FileScanner_Start( &this_view.scanner, path );
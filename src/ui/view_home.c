@@ -107,9 +107,9 @@ static void OnDeleteDBFile( void *arg )
 /** 扫描全部文件 */
 static int FileScanner_ScanAll( FileScanner scanner )
 {
+	int total;
 	DB_File file;
 	DB_Query query;
-	int i, total, count;
 	DB_QueryTermsRec terms;
 	terms.dirpath = NULL;
 	terms.n_dirs = 0;
@@ -120,27 +120,24 @@ static int FileScanner_ScanAll( FileScanner scanner )
 	terms.tags = NULL;
 	terms.dirs = NULL;
 	terms.create_time = DESC;
-	query = DB_NewQuery( &terms );
-	count = total = DBQuery_GetTotalFiles( query );
+	/* 用游标分页读取，每一页都从上一页的末尾接着取 */
+	query = DB_NewQueryCursor( &terms );
+	total = DBQuery_GetTotalFiles( query );
 	scanner->total = total;
 	scanner->count = 0;
-	while( scanner->is_running && count > 0 ) {
-		DB_DeleteQuery( query );
-		query = DB_NewQuery( &terms );
-		i = count < terms.limit ? count : terms.limit;
-		for( ; scanner->is_running && i > 0; --i ) {
-			file = DBQuery_FetchFile( query );
-			if( !file ) {
-				break;
-			}
-			LCUIMutex_Lock( &scanner->mutex );
-			LinkedList_Append( &scanner->files, file );
-			LCUICond_Signal( &scanner->cond );
-			LCUIMutex_Unlock( &scanner->mutex );
-			scanner->count += 1;
+	while( query && scanner->is_running ) {
+		file = DBQuery_FetchFile( query );
+		if( !file ) {
+			break;
 		}
-		count -= terms.limit;
-		terms.offset += terms.limit;
+		LCUIMutex_Lock( &scanner->mutex );
+		LinkedList_Append( &scanner->files, file );
+		LCUICond_Signal( &scanner->cond );
+		LCUIMutex_Unlock( &scanner->mutex );
+		scanner->count += 1;
+	}
+	if( query ) {
+		DB_DeleteQuery( query );
 	}
 	return total;
 }
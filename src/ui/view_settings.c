@@ -124,6 +124,7 @@ static void OnSelectDir( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 	BROWSEINFOW bi;
 	LCUI_Surface s;
 	LPITEMIDLIST iids;
+	SyncScopeRec scope;
 	char dirpath[PATH_LEN] = "";
 	wchar_t wdirpath[PATH_LEN] = L"";
 	s = LCUIDisplay_GetSurfaceOwner( w );
@@ -150,6 +151,12 @@ static void OnSelectDir( LCUI_Widget w, LCUI_WidgetEvent e, void *arg )
 	dir = LCFinder_AddDir( dirpath );
 	if( dir ) {
 		LCFinder_TriggerEvent( EVENT_DIR_ADD, dir );
+		/* 只同步新添加的源文件夹 */
+		scope.mode = SYNC_MANUAL;
+		scope.dirs = &dir;
+		scope.n_dirs = 1;
+		scope.path = NULL;
+		LCFinder_TriggerEvent( EVENT_SYNC, &scope );
 	}
 }
 